@@ -43,6 +43,7 @@ testScripts=(
     'mempool_tx_input_limit.py'
     'mempool_nu_activation.py'
     'mempool_tx_expiry.py'
+    'mempool_persist.py'
     'httpbasics.py'
     'zapwallettxes.py'
     'proxy_test.py'
@@ -69,6 +70,8 @@ testScripts=(
     'p2p_txexpiry_dos.py'
     'p2p_txexpiringsoon.py'
     'p2p_node_bloom.py'
+    'compactblocks.py'
+    'sendheaders.py'
     'regtest_signrawtransaction.py'
     'finalsaplingroot.py'
     'sprout_sapling_migration.py'
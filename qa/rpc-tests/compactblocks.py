@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The zPrime developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test compact block relay between nodes:
+#
+# - node0 and node1 take compact blocks, node2 runs with -compactblocks=0
+# - a block with a transaction node1 never saw is filled in with getblocktxn
+# - blocks of transactions node1 has are filled in from its mempool
+# - once node0 has given node1 a new tip, node1 asks it to announce blocks
+#   as cmpctblock right away
+# - node1 runs with -earlyblockrelay, and hands new blocks on to node3
+#   before it has validated them
+#
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, assert_true, assert_false, \
+    start_node, connect_nodes, sync_blocks, sync_mempools, p2p_port
+
+import time
+
+
+class CompactBlocksTest(BitcoinTestFramework):
+
+    def setup_network(self, split=False):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-debug=cmpctblock"]))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-debug=cmpctblock", "-earlyblockrelay"]))
+        self.nodes.append(start_node(2, self.options.tmpdir, ["-compactblocks=0"]))
+        self.nodes.append(start_node(3, self.options.tmpdir, ["-debug=cmpctblock"]))
+        connect_nodes(self.nodes[0], 1)
+        connect_nodes(self.nodes[0], 2)
+        connect_nodes(self.nodes[1], 3)
+        self.is_network_split = False
+
+    def peer_info(self, node, peer):
+        addr = "127.0.0.1:%d" % p2p_port(peer)
+        for info in node.getpeerinfo():
+            if info['addr'] == addr:
+                return info
+        return None
+
+    def wait_for(self, predicate):
+        for _ in range(100):
+            if predicate():
+                return
+            time.sleep(0.1)
+        assert_true(predicate())
+
+    def run_test(self):
+        # The cached chain is old; a new block takes the nodes out of
+        # initial block download, after which blocks are relayed as they come
+        self.nodes[0].generate(1)
+        sync_blocks(self.nodes)
+
+        # sendcmpct follows the verack
+        self.wait_for(lambda: self.peer_info(self.nodes[0], 1)['cmpctblocks'])
+        assert_false(self.peer_info(self.nodes[0], 2)['cmpctblocks'])
+
+        print "Mining a block with a transaction node1 doesn't have..."
+        self.nodes[0].disconnectnode("127.0.0.1:%d" % p2p_port(1))
+        self.wait_for(lambda: self.peer_info(self.nodes[0], 1) is None)
+        unrelayed = self.nodes[0].sendtoaddress(self.nodes[0].getnewaddress(), 0.1)
+        connect_nodes(self.nodes[0], 1)
+        self.wait_for(lambda: self.peer_info(self.nodes[0], 1)['cmpctblocks'])
+        self.wait_for(lambda: all(info['cmpctblocks'] for info in self.nodes[1].getpeerinfo()))
+        assert_false(unrelayed in self.nodes[1].getrawmempool())
+        assert_false(self.peer_info(self.nodes[0], 1)['cmpctblocks_hb'])
+
+        blockhash = self.nodes[0].generate(1)[0]
+        sync_blocks(self.nodes)
+        for node in self.nodes:
+            assert_equal(node.getbestblockhash(), blockhash)
+        assert_true(unrelayed in self.nodes[1].getblock(blockhash)['tx'])
+
+        # node0 was first with the new tip, so node1 asks it for compact
+        # block announcements; node2 takes no compact blocks at all
+        self.wait_for(lambda: self.peer_info(self.nodes[0], 1)['cmpctblocks_hb'])
+        assert_false(self.peer_info(self.nodes[0], 2)['cmpctblocks_hb'])
+
+        print "Mining blocks with transactions from the mempool..."
+        addr = self.nodes[2].getnewaddress()
+        for i in range(3):
+            txids = [self.nodes[2].sendtoaddress(addr, 0.1) for _ in range(5)]
+            sync_mempools(self.nodes)
+            blockhash = self.nodes[0].generate(1)[0]
+            sync_blocks(self.nodes)
+            for node in self.nodes:
+                assert_equal(node.getbestblockhash(), blockhash)
+                assert_equal(len(node.getrawmempool()), 0)
+            assert_equal(sorted(self.nodes[1].getblock(blockhash)['tx'][1:]), sorted(txids))
+
+        print "Relaying blocks on before validating them..."
+        # node1 has given node3 its new tips first, so node3 asks it for
+        # compact block announcements, which node1 sends as soon as the
+        # header from node0 checks out
+        self.wait_for(lambda: self.peer_info(self.nodes[1], 3)['cmpctblocks_hb'])
+        for i in range(3):
+            txids = [self.nodes[2].sendtoaddress(addr, 0.1) for _ in range(5)]
+            sync_mempools(self.nodes)
+            blockhash = self.nodes[0].generate(1)[0]
+            sync_blocks(self.nodes)
+            for node in self.nodes:
+                assert_equal(node.getbestblockhash(), blockhash)
+            assert_equal(sorted(self.nodes[3].getblock(blockhash)['tx'][1:]), sorted(txids))
+        assert_true(self.peer_info(self.nodes[1], 3)['cmpctblocks_hb'])
+
+
+if __name__ == '__main__':
+    CompactBlocksTest().main()
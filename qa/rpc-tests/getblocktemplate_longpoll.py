@@ -7,7 +7,7 @@ import sys; assert sys.version_info < (3,), ur"This script does not run under Py
 
 from test_framework.test_framework import BitcoinTestFramework
 from test_framework.authproxy import AuthServiceProxy
-from test_framework.util import random_transaction
+from test_framework.util import random_transaction, start_nodes
 
 from decimal import Decimal
 
@@ -52,14 +52,19 @@ class GetBlockTemplateLPTest(BitcoinTestFramework):
     Test longpolling with getblocktemplate.
     '''
 
+    def setup_nodes(self):
+        # Build templates as soon as the mempool changes, not only when asked
+        return start_nodes(4, self.options.tmpdir, [["-blocktemplateservice"]] * 4)
+
     def run_test(self):
-        print "Warning: this test will take about 70 seconds in the best case. Be patient."
         self.nodes[0].generate(10)
         templat = self.nodes[0].getblocktemplate()
         longpollid = templat['longpollid']
         # longpollid should not change between successive invocations if nothing else happens
         templat2 = self.nodes[0].getblocktemplate()
         assert(templat2['longpollid'] == longpollid)
+        # and every caller gets the same template
+        assert(templat2['workid'] == templat['workid'])
 
         # Test 1: test that the longpolling wait if we do nothing
         thr = LongpollThread(self.nodes[0])
@@ -86,9 +91,11 @@ class GetBlockTemplateLPTest(BitcoinTestFramework):
         thr.start()
         # generate a random transaction and submit it
         (txid, txhex, fee) = random_transaction(self.nodes, Decimal("1.1"), Decimal("0.0"), Decimal("0.001"), 20)
-        # after one minute, every 10 seconds the mempool is probed, so in 80 seconds it should have returned
-        thr.join(60 + 20)
+        # a new template is built within -blocktemplateinterval (1 second) of the mempool change
+        thr.join(10)
         assert(not thr.is_alive())
+        templat3 = self.nodes[0].getblocktemplate()
+        assert(templat3['workid'] != templat['workid'])
 
 if __name__ == '__main__':
     GetBlockTemplateLPTest().main()
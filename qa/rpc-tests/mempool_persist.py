@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The zPrime developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that the mempool is saved on shutdown and loaded on restart:
+#
+# - node0 keeps its mempool, with entry times and prioritisation, across a restart
+# - node1, started with -persistmempool=0, does not load it
+# - savemempool writes mempool.dat, which another node can then load
+#
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, assert_true, \
+    start_node, stop_node
+from test_framework.mininode import COIN
+
+import os
+import shutil
+import time
+
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self, split=False):
+        # Unconnected, so each node only has its own transactions
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.nodes.append(start_node(1, self.options.tmpdir))
+        self.is_network_split = True
+
+    def wait_for_load(self, node, size):
+        for _ in range(100):
+            info = node.getmempoolinfo()
+            if info['loaded'] and info['size'] == size:
+                return
+            time.sleep(0.1)
+        assert_equal(node.getmempoolinfo()['size'], size)
+
+    def run_test(self):
+        addr = self.nodes[0].getnewaddress()
+        # Later sends may spend the change of earlier ones, so the dump has to
+        # list parents first for them all to load
+        txids = [self.nodes[0].sendtoaddress(addr, 0.1) for _ in range(5)]
+        assert_equal(self.nodes[0].getmempoolinfo()['size'], 5)
+        assert_true(self.nodes[0].getmempoolinfo()['loaded'])
+
+        prioritised = txids[0]
+        self.nodes[0].prioritisetransaction(prioritised, 0, 1 * COIN)
+        entry_times = dict((txid, self.nodes[0].getrawmempool(True)[txid]['time']) for txid in txids)
+
+        print "Restarting node0 with its mempool..."
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir)
+        self.wait_for_load(self.nodes[0], len(txids))
+        mempool = self.nodes[0].getrawmempool(True)
+        assert_equal(sorted(mempool.keys()), sorted(txids))
+        for txid in txids:
+            assert_equal(mempool[txid]['time'], entry_times[txid])
+
+        # The prioritisation was restored with the transaction
+        block_template = self.nodes[0].getblocktemplate()
+        fees = dict((tx['hash'], tx['fee']) for tx in block_template['transactions'])
+        assert_true(prioritised in fees)
+
+        print "Restarting node0 with -persistmempool=0..."
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-persistmempool=0"])
+        time.sleep(1)
+        assert_equal(self.nodes[0].getmempoolinfo()['size'], 0)
+        # The dump from before is still on disk, as nothing loaded it
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir)
+        self.wait_for_load(self.nodes[0], len(txids))
+
+        print "Copying node0's dump to node1..."
+        mempooldat0 = os.path.join(self.options.tmpdir, 'node0', 'regtest', 'mempool.dat')
+        mempooldat1 = os.path.join(self.options.tmpdir, 'node1', 'regtest', 'mempool.dat')
+        os.remove(mempooldat0)
+        self.nodes[0].savemempool()
+        assert_true(os.path.isfile(mempooldat0))
+
+        stop_node(self.nodes[1], 1)
+        shutil.copyfile(mempooldat0, mempooldat1)
+        self.nodes[1] = start_node(1, self.options.tmpdir)
+        self.wait_for_load(self.nodes[1], len(txids))
+        assert_equal(sorted(self.nodes[1].getrawmempool()), sorted(txids))
+
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
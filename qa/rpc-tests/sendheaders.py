@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The zPrime developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test headers announcements and the block download scheduler:
+#
+# - peers ask for new blocks to be announced with headers after the verack
+# - new blocks, one at a time or a few at once, reach every node
+# - a run of blocks longer than a headers announcement still syncs
+# - the per-peer in-flight limit is reported
+#
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, assert_true, \
+    start_node, connect_nodes, sync_blocks, p2p_port
+
+import time
+
+
+class SendHeadersTest(BitcoinTestFramework):
+
+    def setup_network(self, split=False):
+        self.nodes = []
+        for i in range(3):
+            self.nodes.append(start_node(i, self.options.tmpdir, ["-debug=net"]))
+        connect_nodes(self.nodes[0], 1)
+        connect_nodes(self.nodes[1], 2)
+        self.is_network_split = False
+
+    def peer_info(self, node, peer):
+        addr = "127.0.0.1:%d" % p2p_port(peer)
+        for info in node.getpeerinfo():
+            if info['addr'] == addr:
+                return info
+        return None
+
+    def wait_for(self, predicate):
+        for _ in range(100):
+            if predicate():
+                return
+            time.sleep(0.1)
+        assert_true(predicate())
+
+    def check_tips(self, blockhash):
+        sync_blocks(self.nodes)
+        for node in self.nodes:
+            assert_equal(node.getbestblockhash(), blockhash)
+
+    def run_test(self):
+        # Leave initial block download, so that blocks are announced as they come
+        self.check_tips(self.nodes[0].generate(1)[0])
+
+        # sendheaders follows the verack
+        for node in self.nodes:
+            self.wait_for(lambda: all(info['sendheaders'] for info in node.getpeerinfo()))
+            for info in node.getpeerinfo():
+                assert_true(info['inflight_limit'] >= 2)
+
+        print "Announcing blocks one at a time..."
+        for i in range(3):
+            self.check_tips(self.nodes[0].generate(1)[0])
+
+        print "Announcing a few blocks at once..."
+        self.check_tips(self.nodes[2].generate(4)[-1])
+
+        print "Syncing more blocks than fit in an announcement..."
+        self.nodes[0].disconnectnode("127.0.0.1:%d" % p2p_port(1))
+        self.wait_for(lambda: self.peer_info(self.nodes[0], 1) is None)
+        blockhash = self.nodes[0].generate(20)[-1]
+        connect_nodes(self.nodes[0], 1)
+        self.check_tips(blockhash)
+
+        # node1 has timed the blocks it fetched by now
+        assert_true(any('blockservicetime' in info for info in self.nodes[1].getpeerinfo()))
+
+
+if __name__ == '__main__':
+    SendHeadersTest().main()
@@ -219,6 +219,15 @@ case "$1" in
                 extract_benchmark_data
                 zprime_rpc zcbenchmark connectblockslow 10
                 ;;
+            createnewblock)
+                zprime_rpc zcbenchmark createnewblock 10 "${@:3}"
+                ;;
+            addrmanadd|addrmanselect|addrmanserialize)
+                zprime_rpc zcbenchmark "$2" 10 "${@:3}"
+                ;;
+            netreplay)
+                zprime_rpc zcbenchmark netreplay 10 "${@:3}"
+                ;;
             sendtoaddress)
                 zprime_rpc zcbenchmark sendtoaddress 10 "${@:4}"
                 ;;
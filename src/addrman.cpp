@@ -71,14 +71,42 @@ double CAddrInfo::GetChance(int64_t nNow) const
     return fChance;
 }
 
+void CAddrManSlotIndex::Clear()
+{
+    std::vector<int>().swap(vSlots);
+    std::fill(vIndex.begin(), vIndex.end(), -1);
+}
+
+void CAddrManSlotIndex::Insert(int nBucket, int nBucketPos)
+{
+    int nSlot = nBucket * ADDRMAN_BUCKET_SIZE + nBucketPos;
+    if (vIndex[nSlot] != -1)
+        return;
+    vIndex[nSlot] = vSlots.size();
+    vSlots.push_back(nSlot);
+}
+
+void CAddrManSlotIndex::Erase(int nBucket, int nBucketPos)
+{
+    int nSlot = nBucket * ADDRMAN_BUCKET_SIZE + nBucketPos;
+    int nIndex = vIndex[nSlot];
+    if (nIndex == -1)
+        return;
+    // move the last position into the hole
+    vSlots[nIndex] = vSlots.back();
+    vIndex[vSlots[nIndex]] = nIndex;
+    vSlots.pop_back();
+    vIndex[nSlot] = -1;
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    AddrIdMap::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
+    AddrInfoMap::iterator it2 = mapInfo.find((*it).second);
     if (it2 != mapInfo.end())
         return &(*it2).second;
     return NULL;
@@ -116,6 +144,24 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     vRandom[nRndPos2] = nId1;
 }
 
+void CAddrMan::SetTried(int nKBucket, int nKBucketPos, int nId)
+{
+    vvTried[nKBucket][nKBucketPos] = nId;
+    if (nId == -1)
+        slotsTried.Erase(nKBucket, nKBucketPos);
+    else
+        slotsTried.Insert(nKBucket, nKBucketPos);
+}
+
+void CAddrMan::SetNew(int nUBucket, int nUBucketPos, int nId)
+{
+    vvNew[nUBucket][nUBucketPos] = nId;
+    if (nId == -1)
+        slotsNew.Erase(nUBucket, nUBucketPos);
+    else
+        slotsNew.Insert(nUBucket, nUBucketPos);
+}
+
 void CAddrMan::Delete(int nId)
 {
     assert(mapInfo.count(nId) != 0);
@@ -138,7 +184,7 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
         CAddrInfo& infoDelete = mapInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
+        SetNew(nUBucket, nUBucketPos, -1);
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
         }
@@ -151,7 +197,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
         int pos = info.GetBucketPosition(nKey, true, bucket);
         if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
+            SetNew(bucket, pos, -1);
             info.nRefCount--;
         }
     }
@@ -172,7 +218,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
-        vvTried[nKBucket][nKBucketPos] = -1;
+        SetTried(nKBucket, nKBucketPos, -1);
         nTried--;
 
         // find which new bucket it belongs to
@@ -183,12 +229,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Enter it into the new set again.
         infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        SetNew(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
-    vvTried[nKBucket][nKBucketPos] = nId;
+    SetTried(nKBucket, nKBucketPos, nId);
     nTried++;
     info.fInTried = true;
 }
@@ -212,6 +258,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nLastSuccess = nTime;
     info.nLastTry = nTime;
     info.nAttempts = 0;
+    nChanges++;
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
 
@@ -255,11 +302,16 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         // periodically update nTime
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty)) {
             pinfo->nTime = std::max((int64_t)0, addr.nTime - nTimePenalty);
+            nChanges++;
+        }
 
         // add services
-        pinfo->nServices |= addr.nServices;
+        if ((pinfo->nServices | addr.nServices) != pinfo->nServices) {
+            pinfo->nServices |= addr.nServices;
+            nChanges++;
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -300,7 +352,8 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            SetNew(nUBucket, nUBucketPos, nId);
+            nChanges++;
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -327,6 +380,7 @@ void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+    nChanges++;
 }
 
 CAddrInfo CAddrMan::Select_(bool newOnly)
@@ -334,63 +388,29 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
     if (size() == 0)
         return CAddrInfo();
 
-    // Track number of attempts to find a table entry, before giving up to avoid infinite loop
-    const int kMaxRetries = 200000;         // magic number so unit tests can pass
-    const int kRetriesBetweenSleep = 1000;
-    const int kRetrySleepInterval = 100;    // milliseconds
-
     if (newOnly && nNew == 0)
         return CAddrInfo();
 
     // Use a 50% chance for choosing between tried and new table entries.
-    if (!newOnly &&
-       (nTried > 0 && (nNew == 0 || RandomInt(2) == 0))) { 
-        // use a tried node
-        double fChanceFactor = 1.0;
-        while (1) {
-            int i = 0;
-            int nKBucket = RandomInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvTried[nKBucket][nKBucketPos] == -1) {
-                nKBucket = (nKBucket + insecure_rand()) % ADDRMAN_TRIED_BUCKET_COUNT;
-                nKBucketPos = (nKBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-                if (i++ > kMaxRetries)
-                    return CAddrInfo();
-                if (i % kRetriesBetweenSleep == 0 && !nKey.IsNull())
-                    MilliSleep(kRetrySleepInterval);
-            }
-            int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
-    } else {
-        // use a new node
-        double fChanceFactor = 1.0;
-        while (1) {
-            int i = 0;
-            int nUBucket = RandomInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvNew[nUBucket][nUBucketPos] == -1) {
-                nUBucket = (nUBucket + insecure_rand()) % ADDRMAN_NEW_BUCKET_COUNT;
-                nUBucketPos = (nUBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-                if (i++ > kMaxRetries)
-                    return CAddrInfo();
-                if (i % kRetriesBetweenSleep == 0 && !nKey.IsNull())
-                    MilliSleep(kRetrySleepInterval);
-            }
-            int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
+    bool fTried = !newOnly && (nTried > 0 && (nNew == 0 || RandomInt(2) == 0));
+    const CAddrManSlotIndex& slots = fTried ? slotsTried : slotsNew;
+    if (slots.size() == 0)
+        return CAddrInfo();
+
+    // Pick positions in use at random, with growing odds of taking whatever
+    // is there, so that entries tried recently or failing are less likely
+    double fChanceFactor = 1.0;
+    while (1) {
+        int nBucket, nBucketPos;
+        slots.Get(RandomInt(slots.size()), nBucket, nBucketPos);
+        int nId = fTried ? vvTried[nBucket][nBucketPos] : vvNew[nBucket][nBucketPos];
+        AddrInfoMap::iterator it = mapInfo.find(nId);
+        assert(it != mapInfo.end());
+        CAddrInfo& info = it->second;
+        if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
+            return info;
+        fChanceFactor *= 1.2;
     }
-    
-    return CAddrInfo();
 }
 
 #ifdef DEBUG_ADDRMAN
@@ -402,7 +422,7 @@ int CAddrMan::Check_()
     if (vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+    for (AddrInfoMap::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
         int n = (*it).first;
         CAddrInfo& info = (*it).second;
         if (info.fInTried) {
@@ -460,6 +480,16 @@ int CAddrMan::Check_()
         }
     }
 
+    if (slotsTried.size() != (size_t)nTried)
+        return -20;
+    size_t nNewSlots = 0;
+    for (int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++)
+        for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++)
+            if (vvNew[n][i] != -1)
+                nNewSlots++;
+    if (slotsNew.size() != nNewSlots)
+        return -21;
+
     if (setTried.size())
         return -13;
     if (mapNew.size())
@@ -508,8 +538,10 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
-    if (nTime - info.nTime > nUpdateInterval)
+    if (nTime - info.nTime > nUpdateInterval) {
         info.nTime = nTime;
+        nChanges++;
+    }
 }
 
 int CAddrMan::RandomInt(int nMax){
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_ADDRMAN_H
 #define BITCOIN_ADDRMAN_H
 
+#include "hash.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -12,11 +13,14 @@
 #include "timedata.h"
 #include "util.h"
 
+#include <limits>
 #include <map>
 #include <set>
 #include <stdint.h>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 /**
  * Extended statistics about a CAddress
  */
@@ -166,12 +170,66 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/**
+ * Hashes network addresses with a random key, so that peers can't feed us
+ * addresses that all land in the same place of a hash table.
+ */
+class CNetAddrHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CNetAddrHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+    size_t operator()(const CNetAddr& addr) const
+    {
+        struct in6_addr ip6;
+        addr.GetIn6Addr(&ip6);
+        return CSipHasher(k0, k1).Write((const unsigned char*)&ip6, sizeof(ip6)).Finalize();
+    }
+};
+
+/**
+ * The positions in use in a table of buckets, so that one of them can be
+ * picked at random in constant time however empty the table is.
+ */
+class CAddrManSlotIndex
+{
+private:
+    //! positions in use, as bucket * ADDRMAN_BUCKET_SIZE + position in the bucket
+    std::vector<int> vSlots;
+
+    //! where each position of the table is in vSlots, or -1 if it is free
+    std::vector<int> vIndex;
+
+public:
+    explicit CAddrManSlotIndex(int nBuckets) : vIndex(nBuckets * ADDRMAN_BUCKET_SIZE, -1) {}
+
+    void Clear();
+
+    void Insert(int nBucket, int nBucketPos);
+    void Erase(int nBucket, int nBucketPos);
+
+    size_t size() const { return vSlots.size(); }
+
+    //! Get the n-th position in use
+    void Get(size_t n, int& nBucket, int& nBucketPos) const
+    {
+        nBucket = vSlots[n] / ADDRMAN_BUCKET_SIZE;
+        nBucketPos = vSlots[n] % ADDRMAN_BUCKET_SIZE;
+    }
+};
+
 /** 
  * Stochastical (IP) address manager 
  */
 class CAddrMan
 {
 private:
+    typedef boost::unordered_map<int, CAddrInfo> AddrInfoMap;
+    typedef boost::unordered_map<CNetAddr, int, CNetAddrHasher> AddrIdMap;
+
     //! critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
@@ -179,10 +237,10 @@ private:
     int nIdCount;
 
     //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    AddrInfoMap mapInfo;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    AddrIdMap mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -199,6 +257,13 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! positions in use in vvTried and vvNew, to select from
+    CAddrManSlotIndex slotsTried;
+    CAddrManSlotIndex slotsNew;
+
+    //! number of changes to the serialized data since creation
+    uint64_t nChanges;
+
 protected:
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -213,6 +278,10 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    //! Set a position in the "tried" or "new" table to nId, or free it with -1.
+    void SetTried(int nKBucket, int nKBucketPos, int nId);
+    void SetNew(int nUBucket, int nUBucketPos, int nId);
+
     //! Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
@@ -292,9 +361,9 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        boost::unordered_map<int, int> mapUnkIds;
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+        for (AddrInfoMap::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             mapUnkIds[(*it).first] = nIds;
             const CAddrInfo &info = (*it).second;
             if (info.nRefCount) {
@@ -304,7 +373,7 @@ public:
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+        for (AddrInfoMap::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             const CAddrInfo &info = (*it).second;
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
@@ -370,7 +439,7 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                    SetNew(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
@@ -390,7 +459,7 @@ public:
                 vRandom.push_back(nIdCount);
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
+                SetTried(nKBucket, nKBucketPos, nIdCount);
                 nIdCount++;
             } else {
                 nLost++;
@@ -410,7 +479,7 @@ public:
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNew(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -418,9 +487,9 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
+        for (AddrInfoMap::const_iterator it = mapInfo.begin(); it != mapInfo.end(); ) {
             if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
+                AddrInfoMap::const_iterator itCopy = it++;
                 Delete(itCopy->first);
                 nLostUnk++;
             } else {
@@ -437,6 +506,10 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        mapInfo.clear();
+        mapAddr.clear();
+        slotsTried.Clear();
+        slotsNew.Clear();
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
@@ -454,7 +527,7 @@ public:
         nNew = 0;
     }
 
-    CAddrMan()
+    CAddrMan() : slotsTried(ADDRMAN_TRIED_BUCKET_COUNT), slotsNew(ADDRMAN_NEW_BUCKET_COUNT), nChanges(0)
     {
         Clear();
     }
@@ -470,6 +543,13 @@ public:
         return vRandom.size();
     }
 
+    //! Return a count that moves on whenever what would be serialized changes.
+    uint64_t GetChanges() const
+    {
+        LOCK(cs);
+        return nChanges;
+    }
+
     //! Consistency check
     void Check()
     {
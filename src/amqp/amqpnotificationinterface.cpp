@@ -49,6 +49,7 @@ AMQPNotificationInterface* AMQPNotificationInterface::CreateWithArguments(const
     factories["pubhashtx"] = AMQPAbstractNotifier::Create<AMQPPublishHashTransactionNotifier>;
     factories["pubrawblock"] = AMQPAbstractNotifier::Create<AMQPPublishRawBlockNotifier>;
     factories["pubrawtx"] = AMQPAbstractNotifier::Create<AMQPPublishRawTransactionNotifier>;
+    factories["pubblocktemplate"] = AMQPAbstractNotifier::Create<AMQPPublishBlockTemplateNotifier>;
 
     for (std::map<std::string, AMQPNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i) {
         std::map<std::string, std::string>::const_iterator j = args.find("-amqp" + i->first);
@@ -134,3 +135,16 @@ void AMQPNotificationInterface::SyncTransaction(const CTransaction &tx, const CB
         }
     }
 }
+
+void AMQPNotificationInterface::UpdatedBlockTemplate(const CBlock& block)
+{
+    for (std::list<AMQPAbstractNotifier*>::iterator i = notifiers.begin(); i != notifiers.end(); ) {
+        AMQPAbstractNotifier *notifier = *i;
+        if (notifier->NotifyBlockTemplate(block)) {
+            i++;
+        } else {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
@@ -17,6 +17,7 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_BLOCKTEMPLATE = "blocktemplate";
 
 // Invoke this method from a new thread to run the proton container event loop.
 void AMQPAbstractPublishNotifier::SpawnProtonContainer()
@@ -175,3 +176,11 @@ bool AMQPPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool AMQPPublishBlockTemplateNotifier::NotifyBlockTemplate(const CBlock &block)
+{
+    LogPrint("amqp", "amqp: Publish blocktemplate on %s\n", block.hashPrevBlock.GetHex());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    return SendMessage(MSG_BLOCKTEMPLATE, &(*ss.begin()), ss.size());
+}
@@ -53,4 +53,10 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+class AMQPPublishBlockTemplateNotifier : public AMQPAbstractPublishNotifier
+{
+public:
+    bool NotifyBlockTemplate(const CBlock &block);
+};
+
 #endif // ZPRIME_AMQP_AMQPPUBLISHNOTIFIER_H
@@ -24,6 +24,12 @@ static std::map<OperationStatus, std::string> OperationStatusMap = {
     {OperationStatus::SUCCESS, "success"}
 };
 
+static std::map<OperationPriority, std::string> OperationPriorityMap = {
+    {OperationPriority::HIGH, "high"},
+    {OperationPriority::NORMAL, "normal"},
+    {OperationPriority::LOW, "low"}
+};
+
 /**
  * Every operation instance should have a globally unique id
  */
@@ -32,12 +38,13 @@ AsyncRPCOperation::AsyncRPCOperation() : error_code_(0), error_message_() {
     boost::uuids::uuid uuid = uuidgen();
     id_ = "opid-" + boost::uuids::to_string(uuid);
     creation_time_ = (int64_t)time(NULL);
+    queued_time_ = std::chrono::system_clock::now();
     set_state(OperationStatus::READY);
 }
 
 AsyncRPCOperation::AsyncRPCOperation(const AsyncRPCOperation& o) :
         id_(o.id_), creation_time_(o.creation_time_), state_(o.state_.load()),
-        start_time_(o.start_time_), end_time_(o.end_time_),
+        queued_time_(o.queued_time_), start_time_(o.start_time_), end_time_(o.end_time_),
         error_code_(o.error_code_), error_message_(o.error_message_),
         result_(o.result_)
 {
@@ -47,6 +54,7 @@ AsyncRPCOperation& AsyncRPCOperation::operator=( const AsyncRPCOperation& other
     this->id_ = other.id_;
     this->creation_time_ = other.creation_time_;
     this->state_.store(other.state_.load());
+    this->queued_time_ = other.queued_time_;
     this->start_time_ = other.start_time_;
     this->end_time_ = other.end_time_;
     this->error_code_ = other.error_code_;
@@ -155,6 +163,19 @@ UniValue AsyncRPCOperation::getStatus() const {
     obj.push_back(Pair("id", this->id_));
     obj.push_back(Pair("status", OperationStatusMap[status]));
     obj.push_back(Pair("creation_time", this->creation_time_));
+    obj.push_back(Pair("priority", OperationPriorityMap[this->getPriority()]));
+
+    // Time spent waiting in the queue, so far if the operation has not started yet
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (status == OperationStatus::READY) {
+            std::chrono::duration<double> queued_seconds = std::chrono::system_clock::now() - queued_time_;
+            obj.push_back(Pair("queued_secs", queued_seconds.count()));
+        } else if (start_time_ >= queued_time_) {
+            std::chrono::duration<double> queued_seconds = start_time_ - queued_time_;
+            obj.push_back(Pair("queued_secs", queued_seconds.count()));
+        }
+    }
     // TODO: Issue #1354: There may be other useful metadata to return to the user.
     UniValue err = this->getError();
     if (!err.isNull()) {
@@ -37,6 +37,13 @@ typedef enum class operationStateEnum {
     SUCCESS
 } OperationStatus;
 
+// Operations of a higher priority are started first by the AsyncRPCQueue.
+typedef enum class operationPriorityEnum {
+    HIGH = 0,
+    NORMAL,
+    LOW
+} OperationPriority;
+
 class AsyncRPCOperation {
 public:
     AsyncRPCOperation();
@@ -65,6 +72,22 @@ public:
     // Override this method to add data to the default status object.
     virtual UniValue getStatus() const;
 
+    // Override these methods to control how the queue schedules your subclass.
+    // Operations of the same type share a concurrency limit in the queue.
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::NORMAL;
+    }
+
+    virtual std::string getType() const {
+        return "generic";
+    }
+
+    // Operations that select and spend wallet funds are executed one at a
+    // time, whatever their type, so they never pick the same notes or UTXOs.
+    virtual bool spendsFunds() const {
+        return false;
+    }
+
     UniValue getError() const;
 
     UniValue getResult() const;
@@ -114,7 +137,7 @@ protected:
     int error_code_;
     std::string error_message_;
     std::atomic<OperationStatus> state_;
-    std::chrono::time_point<std::chrono::system_clock> start_time_, end_time_;
+    std::chrono::time_point<std::chrono::system_clock> queued_time_, start_time_, end_time_;
 
     void start_execution_clock();
     void stop_execution_clock();
@@ -28,48 +28,111 @@ AsyncRPCQueue::~AsyncRPCQueue() {
 void AsyncRPCQueue::run(size_t workerId) {
 
     while (true) {
-        AsyncRPCOperationId key;
         std::shared_ptr<AsyncRPCOperation> operation;
+        std::string type;
         {
             std::unique_lock<std::mutex> guard(lock_);
-            while (operation_id_queue_.empty() && !isClosed() && !isFinishing()) {
+            while (true) {
+                // Exit if the queue is closing.
+                if (isClosed()) {
+                    operation_id_queues_.clear();
+                    break;
+                }
+
+                operation = pop_runnable_operation();
+                if (operation) {
+                    break;
+                }
+
+                // Exit if the queue is empty and we are finishing up
+                if (isFinishing() && get_queued_count() == 0) {
+                    break;
+                }
+
+                // Nothing can run yet: the queue is empty, or every waiting
+                // operation is held back by its concurrency limit.
                 this->condition_.wait(guard);
             }
 
-            // Exit if the queue is empty and we are finishing up
-            if (isFinishing() && operation_id_queue_.empty()) {
+            if (!operation) {
                 break;
             }
 
-            // Exit if the queue is closing.
-            if (isClosed()) {
-                while (!operation_id_queue_.empty()) {
-                    operation_id_queue_.pop();
-                }
-                break;
+            type = operation->getType();
+            executing_by_type_[type]++;
+            if (operation->spendsFunds()) {
+                executing_spending_ = true;
             }
+        }
 
-            // Get operation id
-            key = operation_id_queue_.front();
-            operation_id_queue_.pop();
+        operation->main();
 
-            // Search operation map
-            AsyncRPCOperationMap::const_iterator iter = operation_map_.find(key);
-            if (iter != operation_map_.end()) {
-                operation = iter->second;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            executing_by_type_[type]--;
+            if (operation->spendsFunds()) {
+                executing_spending_ = false;
             }
+            // Operations held back by a concurrency limit may now be runnable
+            this->condition_.notify_all();
         }
+    }
+}
+
+/**
+ * Remove and return the next operation to execute: the oldest operation of the
+ * highest priority whose type is below its concurrency limit, and which does not
+ * spend funds while another such operation is executing.  Operations that
+ * were cancelled, or removed from the map by popOperationForId(), are dropped.
+ * Caller must hold lock_.
+ */
+std::shared_ptr<AsyncRPCOperation> AsyncRPCQueue::pop_runnable_operation() {
+    for (auto & entry : operation_id_queues_) {
+        std::deque<AsyncRPCOperationId>& ids = entry.second;
+        for (auto it = ids.begin(); it != ids.end(); ) {
+            AsyncRPCOperationMap::const_iterator iter = operation_map_.find(*it);
+            if (iter == operation_map_.end() || iter->second->isCancelled()) {
+                it = ids.erase(it);
+                continue;
+            }
 
-        if (!operation) {
-            // cannot find operation in map, may have been removed
-        } else if (operation->isCancelled()) {
-            // skip cancelled operation
-        } else {
-            operation->main();
+            std::shared_ptr<AsyncRPCOperation> operation = iter->second;
+            if (operation->spendsFunds() && executing_spending_) {
+                ++it;
+                continue;
+            }
+            size_t limit = get_concurrency_limit(operation->getType());
+            if (limit == 0 || executing_by_type_[operation->getType()] < limit) {
+                ids.erase(it);
+                return operation;
+            }
+            ++it;
         }
     }
+    return nullptr;
 }
 
+/**
+ * Caller must hold lock_.
+ */
+size_t AsyncRPCQueue::get_concurrency_limit(const std::string& type) const {
+    auto it = concurrency_limits_.find(type);
+    if (it != concurrency_limits_.end()) {
+        return it->second;
+    }
+    return default_concurrency_limit_;
+}
+
+/**
+ * Caller must hold lock_.
+ */
+size_t AsyncRPCQueue::get_queued_count() const {
+    size_t count = 0;
+    for (auto & entry : operation_id_queues_) {
+        count += entry.second.size();
+    }
+    return count;
+}
 
 /**
  * Add shared_ptr to operation.
@@ -91,10 +154,40 @@ void AsyncRPCQueue::addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOp
 
     AsyncRPCOperationId id = ptrOperation->getId();
     operation_map_.emplace(id, ptrOperation);
-    operation_id_queue_.push(id);
+    operation_id_queues_[ptrOperation->getPriority()].push_back(id);
     this->condition_.notify_one();
 }
 
+/**
+ * Return the number of operations that will be started before the given one,
+ * or -1 if the operation is not waiting in the queue.
+ */
+int AsyncRPCQueue::getQueuePosition(AsyncRPCOperationId id) const {
+    std::lock_guard<std::mutex> guard(lock_);
+    int position = 0;
+    for (auto & entry : operation_id_queues_) {
+        for (auto & queuedId : entry.second) {
+            if (queuedId == id) {
+                return position;
+            }
+            position++;
+        }
+    }
+    return -1;
+}
+
+void AsyncRPCQueue::setConcurrencyLimit(const std::string& type, size_t limit) {
+    std::lock_guard<std::mutex> guard(lock_);
+    concurrency_limits_[type] = limit;
+    this->condition_.notify_all();
+}
+
+void AsyncRPCQueue::setDefaultConcurrencyLimit(size_t limit) {
+    std::lock_guard<std::mutex> guard(lock_);
+    default_concurrency_limit_ = limit;
+    this->condition_.notify_all();
+}
+
 /**
  * Return the operation for a given operation id.
  */
@@ -168,7 +261,7 @@ void AsyncRPCQueue::cancelAllOperations() {
  */
 size_t AsyncRPCQueue::getOperationCount() const {
     std::lock_guard<std::mutex> guard(lock_);
-    return operation_id_queue_.size();
+    return get_queued_count();
 }
 
 /**
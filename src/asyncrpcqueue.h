@@ -10,7 +10,8 @@
 #include <iostream>
 #include <string>
 #include <chrono>
-#include <queue>
+#include <deque>
+#include <map>
 #include <unordered_map>
 #include <vector>
 #include <future>
@@ -49,11 +50,20 @@ public:
     std::shared_ptr<AsyncRPCOperation> popOperationForId(AsyncRPCOperationId);
     void addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOperation);
     std::vector<AsyncRPCOperationId> getAllOperationIds() const;
+    int getQueuePosition(AsyncRPCOperationId) const; // -1 if not waiting to execute
+
+    // Maximum number of operations of one type executing at the same time (0 = no limit).
+    // Operations that spend funds are further limited to one at a time overall.
+    void setConcurrencyLimit(const std::string& type, size_t limit);
+    void setDefaultConcurrencyLimit(size_t limit);
 
 private:
     // addWorker() will spawn a new thread on run())
     void run(size_t workerId);
     void wait_for_worker_threads();
+    std::shared_ptr<AsyncRPCOperation> pop_runnable_operation();
+    size_t get_concurrency_limit(const std::string& type) const;
+    size_t get_queued_count() const;
 
     // Why this is not a recursive lock: http://www.zaval.org/resources/library/butenhof1.html
     mutable std::mutex lock_;
@@ -61,7 +71,12 @@ private:
     std::atomic<bool> closed_;
     std::atomic<bool> finish_;
     AsyncRPCOperationMap operation_map_;
-    std::queue <AsyncRPCOperationId> operation_id_queue_;
+    // Waiting operations, one FIFO per priority, highest priority first
+    std::map<OperationPriority, std::deque<AsyncRPCOperationId> > operation_id_queues_;
+    std::map<std::string, size_t> concurrency_limits_;
+    size_t default_concurrency_limit_ = 0;
+    std::map<std::string, size_t> executing_by_type_;
+    bool executing_spending_ = false;
     std::vector<std::thread> workers_;
 };
 
@@ -0,0 +1,190 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "consensus/consensus.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <unordered_map>
+
+#include <boost/foreach.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+    shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block.GetBlockHeader())
+{
+    FillShortTxIDSelector();
+    // The coinbase is never in the mempool, so it is always sent in full
+    prefilledtxn[0].index = 0;
+    prefilledtxn[0].tx = block.vtx[0];
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        shorttxids[i - 1] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    unsigned char shorttxidhash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)&stream[0], stream.size()).Finalize(shorttxidhash);
+    shorttxidk0 = ReadLE64(&shorttxidhash[0]);
+    shorttxidk1 = ReadLE64(&shorttxidhash[8]);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids calculation assumes 6-byte shorttxids");
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<const CTransaction*>& extra_txn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    // Every transaction takes more than 64 bytes, so this bounds the allocation below
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / 64)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    txn_available.resize(cmpctblock.BlockTxCount());
+
+    // The prefilled indexes are already absolute and ascending, see DifferenceFormatter
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        if (prefilled.index >= txn_available.size())
+            return READ_STATUS_INVALID;
+        txn_available[prefilled.index] = std::make_shared<const CTransaction>(prefilled.tx);
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Map each short id to its index among the slots not prefilled
+    std::unordered_map<uint64_t, uint16_t> shorttxids(cmpctblock.shorttxids.size());
+    uint16_t index_offset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (txn_available[i + index_offset])
+            index_offset++;
+        shorttxids[cmpctblock.shorttxids[i]] = i + index_offset;
+        // A sender grinding short ids to collide in the same bucket would have
+        // every lookup below walk the bucket. With the ids uniformly spread
+        // a bucket of more than 12 is all but impossible, so give up and ask
+        // for the full block instead.
+        if (shorttxids.bucket_size(shorttxids.bucket(cmpctblock.shorttxids[i])) > 12)
+            return READ_STATUS_FAILED;
+    }
+    // Two transactions of the block sharing a short id can't be told apart
+    if (shorttxids.size() != cmpctblock.shorttxids.size())
+        return READ_STATUS_FAILED;
+
+    // Indexes matched by more than one transaction are left empty for blocktxn
+    std::vector<bool> have_txn(txn_available.size());
+    {
+        LOCK(pool->cs);
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it) {
+            const CTransaction& tx = it->GetTx();
+            std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(cmpctblock.GetShortID(tx.GetHash()));
+            if (idit == shorttxids.end())
+                continue;
+            if (!have_txn[idit->second]) {
+                txn_available[idit->second] = std::make_shared<const CTransaction>(tx);
+                have_txn[idit->second] = true;
+                mempool_count++;
+            } else if (txn_available[idit->second]) {
+                // A short id collision in the mempool; request the transaction
+                txn_available[idit->second].reset();
+                mempool_count--;
+            }
+            // Stop once every short id is matched; a collision with a later
+            // transaction goes unnoticed, and shows up in FillBlock instead
+            if (mempool_count == shorttxids.size())
+                break;
+        }
+    }
+
+    std::vector<bool> from_extra(txn_available.size());
+    for (size_t i = 0; i < extra_txn.size(); i++) {
+        const CTransaction& tx = *extra_txn[i];
+        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(cmpctblock.GetShortID(tx.GetHash()));
+        if (idit == shorttxids.end())
+            continue;
+        if (!have_txn[idit->second]) {
+            txn_available[idit->second] = std::make_shared<const CTransaction>(tx);
+            have_txn[idit->second] = true;
+            from_extra[idit->second] = true;
+            extra_count++;
+        } else if (txn_available[idit->second] && txn_available[idit->second]->GetHash() != tx.GetHash()) {
+            // The same transaction may be in both the mempool and extra_txn,
+            // which is no collision
+            txn_available[idit->second].reset();
+            if (from_extra[idit->second])
+                extra_count--;
+            else
+                mempool_count--;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+             cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < txn_available.size());
+    return txn_available[index] ? true : false;
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    uint256 hash = header.GetHash();
+    block = header;
+    block.vtx.resize(txn_available.size());
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (!txn_available[i]) {
+            if (vtx_missing.size() <= tx_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[tx_missing_offset++];
+        } else {
+            block.vtx[i] = *txn_available[i];
+        }
+    }
+
+    // Make sure FillBlock can only be called once
+    header.SetNull();
+    txn_available.clear();
+
+    if (vtx_missing.size() != tx_missing_offset)
+        return READ_STATUS_INVALID;
+
+    // A short id collision with a transaction we had fills in the wrong
+    // transaction, which shows up as a merkle root mismatch; that is not
+    // the peer's fault, so fall back to the full block
+    bool mutated;
+    if (block.BuildMerkleTree(&mutated) != block.hashMerkleRoot || mutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool, %lu txn from extra pool and %lu txn requested\n",
+             hash.ToString(), prefilled_count, mempool_count, extra_count, vtx_missing.size());
+    if (vtx_missing.size() < 5) {
+        BOOST_FOREACH(const CTransaction& tx, vtx_missing)
+            LogPrint("cmpctblock", "Reconstructed block %s required tx %s\n", hash.ToString(), tx.GetHash().ToString());
+    }
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,234 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+class CTxMemPool;
+
+/** Version of the compact block encoding announced in sendcmpct */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Default for -compactblocks */
+static const bool DEFAULT_COMPACTBLOCKS = true;
+/** Default for -earlyblockrelay */
+static const bool DEFAULT_EARLYBLOCKRELAY = false;
+/** Number of peers asked to announce new blocks as compact blocks right away */
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
+/** Compact blocks are only served for blocks this close to the tip */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Missing transactions are only served for blocks this close to the tip */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+
+/**
+ * Transaction indexes are sent in ascending order, each as the difference
+ * from the previous index minus one.
+ */
+class DifferenceFormatter
+{
+private:
+    uint64_t nShift;
+
+public:
+    DifferenceFormatter() : nShift(0) {}
+
+    uint64_t Encode(uint16_t n)
+    {
+        if (n < nShift)
+            throw std::ios_base::failure("differential index out of order");
+        uint64_t diff = n - nShift;
+        nShift = (uint64_t)n + 1;
+        return diff;
+    }
+
+    uint16_t Decode(uint64_t diff)
+    {
+        uint64_t n = diff + nShift;
+        if (n < diff || n > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("differential index overflowed 16 bits");
+        nShift = n + 1;
+        return (uint16_t)n;
+    }
+};
+
+/** Request for the transactions of a block at the given indexes */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(blockhash);
+        uint64_t nCount = indexes.size();
+        READWRITE(COMPACTSIZE(nCount));
+        // Grow as the indexes are read rather than trusting the count
+        if (ser_action.ForRead())
+            indexes.clear();
+        DifferenceFormatter formatter;
+        for (uint64_t i = 0; i < nCount; i++) {
+            uint64_t diff = ser_action.ForRead() ? 0 : formatter.Encode(indexes[i]);
+            READWRITE(COMPACTSIZE(diff));
+            if (ser_action.ForRead())
+                indexes.push_back(formatter.Decode(diff));
+        }
+    }
+};
+
+/** The transactions of a block answering a BlockTransactionsRequest, in the requested order */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    explicit BlockTransactions(const BlockTransactionsRequest& req) :
+        blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full with a compact block, at its index in the block */
+struct PrefilledTransaction
+{
+    uint16_t index;
+    CTransaction tx;
+};
+
+typedef enum ReadStatus_t
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! The peer sent something invalid
+    READ_STATUS_FAILED,  //! Failed to process object, fall back to requesting the full block
+} ReadStatus;
+
+/**
+ * A block announced as its header and the 6-byte short ids of its
+ * transactions, with the coinbase sent in full. The short ids are SipHash-2-4
+ * of the txid, keyed from the header and a sender-chosen nonce so that
+ * collisions cannot be precomputed against every peer at once.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64_t nShortTxIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortTxIDs));
+        if (ser_action.ForRead())
+            shorttxids.clear();
+        for (uint64_t i = 0; i < nShortTxIDs; i++) {
+            uint32_t lsb = 0;
+            uint16_t msb = 0;
+            if (!ser_action.ForRead()) {
+                lsb = shorttxids[i] & 0xffffffff;
+                msb = (shorttxids[i] >> 32) & 0xffff;
+            }
+            READWRITE(lsb);
+            READWRITE(msb);
+            if (ser_action.ForRead())
+                shorttxids.push_back(((uint64_t)msb << 32) | (uint64_t)lsb);
+        }
+
+        // Indexes are differential on the wire and absolute in memory
+        uint64_t nPrefilled = prefilledtxn.size();
+        READWRITE(COMPACTSIZE(nPrefilled));
+        if (ser_action.ForRead())
+            prefilledtxn.clear();
+        DifferenceFormatter formatter;
+        for (uint64_t i = 0; i < nPrefilled; i++) {
+            uint64_t diff = ser_action.ForRead() ? 0 : formatter.Encode(prefilledtxn[i].index);
+            READWRITE(COMPACTSIZE(diff));
+            if (ser_action.ForRead()) {
+                prefilledtxn.push_back(PrefilledTransaction());
+                prefilledtxn.back().index = formatter.Decode(diff);
+            }
+            READWRITE(prefilledtxn[i].tx);
+        }
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/**
+ * A compact block being filled in: from the mempool and orphans by InitData,
+ * then with the transactions the peer sends in blocktxn by FillBlock.
+ */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<std::shared_ptr<const CTransaction> > txn_available;
+    size_t prefilled_count, mempool_count, extra_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+
+    explicit PartiallyDownloadedBlock(CTxMemPool* poolIn) :
+        prefilled_count(0), mempool_count(0), extra_count(0), pool(poolIn) {}
+
+    /**
+     * Match the short ids of cmpctblock against the mempool, and then against
+     * extra_txn (e.g. orphans), which must stay valid for the duration of the
+     * call. Locks pool->cs.
+     */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<const CTransaction*>& extra_txn);
+    bool IsTxAvailable(size_t index) const;
+    /** Fill block in with vtx_missing, in the order of the indexes that were not available */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+
+    size_t GetPrefilledCount() const { return prefilled_count; }
+    size_t GetMempoolCount() const { return mempool_count; }
+    size_t GetExtraCount() const { return extra_count; }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
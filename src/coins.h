@@ -260,6 +260,20 @@ public:
     }
 };
 
+/** Salted hasher for outpoints, spreading the outputs of one transaction over the table */
+class COutPointHasher
+{
+private:
+    uint256 salt;
+
+public:
+    COutPointHasher();
+
+    size_t operator()(const COutPoint& key) const {
+        return key.hash.GetHash(salt) ^ ((size_t)key.n * 0x9E3779B9);
+    }
+};
+
 struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -20,9 +21,13 @@
 #include "merkleblock.h"
 #include "metrics.h"
 #include "net.h"
+#include "orphanpool.h"
 #include "pow.h"
+#include "scheduler.h"
 #include "txdb.h"
+#include "txadmission.h"
 #include "txmempool.h"
+#include "txreconciliation.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -36,6 +41,7 @@
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
@@ -80,6 +86,9 @@ bool fCoinbaseEnforcedProtectionEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
+bool fCompactBlocks = DEFAULT_COMPACTBLOCKS;
+bool fEarlyBlockRelay = DEFAULT_EARLYBLOCKRELAY;
+bool fTxReconciliation = DEFAULT_TXRECONCILIATION;
 /* If the tip is older than this (in seconds), the node is considered to be in initial block download.
  */
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
@@ -91,13 +100,11 @@ CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+COrphanPool orphanPool GUARDED_BY(cs_main);
+/** Set once orphans can be reprocessed on the scheduler thread */
+static CScheduler* pOrphanScheduler GUARDED_BY(cs_main) = NULL;
+static bool fOrphanWorkScheduled GUARDED_BY(cs_main) = false;
+static void ScheduleOrphanWork() EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -204,6 +211,7 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Set while a cmpctblock is being filled in
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -213,6 +221,25 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /**
+     * Peers asked to announce new blocks to us as compact blocks, without
+     * waiting for a getdata: those that most recently gave us a new tip,
+     * oldest first. Protected by cs_main.
+     */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+    /**
+     * The latest tip as block and cmpctblock messages, serialized once for
+     * every peer it goes to. A block relayed before it is validated is kept
+     * here too, whole, so that the transactions peers are missing from it
+     * can be served while it is. Protected by cs_mostRecentBlock.
+     */
+    CCriticalSection cs_mostRecentBlock;
+    uint256 hashMostRecentBlock;
+    CSharedNetMsg msgMostRecentBlock;
+    CSharedNetMsg msgMostRecentCmpctBlock;
+    std::shared_ptr<const CBlock> pblockMostRecent;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -267,6 +294,26 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer sent sendcmpct, so can send and take compact blocks.
+    bool fProvidesCmpctBlocks;
+    //! Whether this peer wants new blocks announced as cmpctblock right away.
+    bool fPreferHeaderAndIDs;
+    //! Whether we want this peer to announce new blocks to us as cmpctblock.
+    bool fWantHeaderAndIDs;
+    //! What we last asked of this peer in sendcmpct.
+    bool fSentWantHeaderAndIDs;
+    //! Whether this peer wants new blocks announced with headers rather than inv.
+    bool fPreferHeaders;
+    //! The last header we sent this peer, in headers or in an announcement.
+    CBlockIndex *pindexBestHeaderSent;
+    //! Moving average of the time this peer takes per block we request from it, in microseconds, or 0.
+    int64_t nBlockServiceTime;
+    //! When the last block we requested from this peer arrived, in microseconds.
+    int64_t nLastBlockReceived;
+    //! Round trip time to this peer as of its last pong, in microseconds, or 0.
+    int64_t nRTT;
+    //! Number of headers messages in a row from this peer that didn't connect.
+    int nUnconnectingHeaders;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -280,6 +327,16 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fProvidesCmpctBlocks = false;
+        fPreferHeaderAndIDs = false;
+        fWantHeaderAndIDs = false;
+        fSentWantHeaderAndIDs = false;
+        fPreferHeaders = false;
+        pindexBestHeaderSent = NULL;
+        nBlockServiceTime = 0;
+        nLastBlockReceived = 0;
+        nRTT = 0;
+        nUnconnectingHeaders = 0;
     }
 };
 
@@ -336,18 +393,48 @@ void FinalizeNode(NodeId nodeid) {
 
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
-    EraseOrphansFor(nodeid);
+    orphanPool.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
+/** Fold a sample of how long a peer took to deliver a block into its average, in microseconds. */
+void UpdateBlockServiceTime(CNodeState* state, int64_t nSample) {
+    if (state->nBlockServiceTime == 0)
+        state->nBlockServiceTime = nSample;
+    else
+        state->nBlockServiceTime = (state->nBlockServiceTime * 7 + nSample) / 8;
+}
+
+/**
+ * How many blocks to keep in flight from a peer: enough to keep it busy
+ * for a round trip, given how quickly it has been delivering them. Slow
+ * peers are given few, so that the blocks they hold up the download
+ * window with are few too.
+ */
+int GetBlocksInTransitLimit(const CNodeState* state) {
+    if (state->nBlockServiceTime == 0 || state->nRTT == 0)
+        return DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nLimit = state->nRTT / state->nBlockServiceTime + 2;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nLimit));
+}
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// nodeFrom is the peer the block came from, if any, for its throughput.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (nodeFrom == itInFlight->second.first) {
+            // Blocks are sent one after another, so this one took from the
+            // later of its request and the previous block's arrival
+            int64_t nNow = GetTimeMicros();
+            UpdateBlockServiceTime(state, nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived));
+            state->nLastBlockReceived = nNow;
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -376,6 +463,31 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+/**
+ * Ask nodeid, which just gave us a new tip, to announce its next blocks as
+ * cmpctblock; the peer that least recently did is asked to stop in its stead.
+ * The sendcmpct messages go out from SendMessages.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(NodeId nodeid) {
+    AssertLockHeld(cs_main);
+    CNodeState* nodestate = State(nodeid);
+    if (!fCompactBlocks || nodestate == NULL || !nodestate->fProvidesCmpctBlocks)
+        return;
+    std::list<NodeId>::iterator it = std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), nodeid);
+    if (it != lNodesAnnouncingHeaderAndIDs.end()) {
+        lNodesAnnouncingHeaderAndIDs.splice(lNodesAnnouncingHeaderAndIDs.end(), lNodesAnnouncingHeaderAndIDs, it);
+        return;
+    }
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        CNodeState* evicted = State(lNodesAnnouncingHeaderAndIDs.front());
+        if (evicted)
+            evicted->fWantHeaderAndIDs = false;
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    nodestate->fWantHeaderAndIDs = true;
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -409,6 +521,16 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+/** Whether the peer is known to have the header of pindex, from what it announced or what we sent it. */
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -429,8 +551,8 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. pindexWaiting is set to the first missing block that is already in flight. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexWaiting) {
     if (count == 0)
         return;
 
@@ -507,6 +629,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaiting = pindex;
             }
         }
     }
@@ -526,6 +649,11 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.fProvidesCmpctBlocks = state->fProvidesCmpctBlocks;
+    stats.fPreferHeaderAndIDs = state->fPreferHeaderAndIDs;
+    stats.fPreferHeaders = state->fPreferHeaders;
+    stats.nBlocksInTransitLimit = GetBlocksInTransitLimit(state);
+    stats.nBlockServiceTime = state->nBlockServiceTime;
     return true;
 }
 
@@ -568,92 +696,6 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
-
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = GetSerializeSize(tx, SER_NETWORK, tx.nVersion);
-    if (sz > 5000)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
-
-
 bool IsStandardTx(const CTransaction& tx, string& reason, const int nHeight)
 {
     bool overwinterActive = NetworkUpgradeActive(nHeight, Params().GetConsensus(), Consensus::UPGRADE_OVERWINTER);
@@ -1352,8 +1394,22 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit)
+{
+    size_t nSizeBefore = pool.size();
+    pool.TrimToSize(limit);
+    if (pool.size() != nSizeBefore)
+        LogPrint("mempool", "Mempool size limit evicted %u transactions\n", nSizeBefore - pool.size());
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectAbsurdFee, fOverrideMempoolLimit);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1376,14 +1432,25 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
     }
 
-    auto verifier = libzprime::ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
-        return error("AcceptToMemoryPool: CheckTransaction failed");
+    // The admission queue may already have run the stateless checks off
+    // cs_main. The result stands if it used the same consensus rules; the
+    // only height-dependent part, expiry, is covered by the check below.
+    CValidationState stateStateless;
+    if (txAdmissionQueue.GetStatelessResult(tx.GetHash(), consensusBranchId, stateStateless)) {
+        if (!stateStateless.IsValid()) {
+            state = stateStateless;
+            return error("AcceptToMemoryPool: stateless checks failed");
+        }
+    } else {
+        auto verifier = libzprime::ProofVerifier::Strict();
+        if (!CheckTransaction(tx, state, verifier))
+            return error("AcceptToMemoryPool: CheckTransaction failed");
 
-    // DoS level set to 10 to be more forgiving.
-    // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
-    if (!ContextualCheckTransaction(tx, state, nextBlockHeight, 10)) {
-        return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
+        // DoS level set to 10 to be more forgiving.
+        // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
+        if (!ContextualCheckTransaction(tx, state, nextBlockHeight, 10)) {
+            return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
+        }
     }
 
     // DoS mitigation: reject transactions expiring soon
@@ -1523,7 +1590,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // it has passed ContextualCheckInputs and therefore this is correct.
         auto consensusBranchId = CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
         unsigned int nSize = entry.GetTxSize();
 
         // Accept a tx if it contains joinsplits and has at least the default fee specified by z_sendmany.
@@ -1538,6 +1605,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // Once the pool has filled up and evicted packages, anything new has
+        // to outbid them; see CTxMemPool::GetMinFee.
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (fLimitFree && mempoolRejectFee > 0 && nFees < mempoolRejectFee) {
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                    hash.ToString(), nFees, mempoolRejectFee),
+                            REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1597,8 +1673,27 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: too-long-mempool-chain %s, %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // Trim the pool and check whether the tx is still in it
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1874,6 +1969,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -2142,6 +2238,8 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
@@ -2169,6 +2267,8 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -3046,13 +3146,23 @@ bool static DisconnectTip(CValidationState &state, bool fBare = false) {
 
     if (!fBare) {
         // Resurrect mempool transactions from the disconnected block.
+        std::vector<uint256> vHashUpdate;
         BOOST_FOREACH(const CTransaction &tx, block.vtx) {
             // ignore validation errors in resurrected transactions
             list<CTransaction> removed;
             CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
                 mempool.remove(tx, removed, true);
-        }
+            else if (mempool.exists(tx.GetHash()))
+                vHashUpdate.push_back(tx.GetHash());
+        }
+        // AcceptToMemoryPool/addUnchecked assume that new mempool entries have
+        // no in-mempool children, which is generally not true when adding
+        // previously-confirmed transactions back to the mempool.
+        mempool.UpdateTransactionsFromBlock(vHashUpdate);
+        // The resurrected transactions skipped the size limit so that their
+        // descendants could be relinked first; enforce it now.
+        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
         if (sproutAnchorBeforeDisconnect != sproutAnchorAfterDisconnect) {
             // The anchor may not change between block disconnects,
             // in which case we don't want to evict from the mempool yet!
@@ -3121,7 +3231,14 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
                 InvalidBlockFound(pindexNew, state);
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
-        mapBlockSource.erase(pindexNew->GetBlockHash());
+        std::map<uint256, NodeId>::iterator itSource = mapBlockSource.find(pindexNew->GetBlockHash());
+        if (itSource != mapBlockSource.end()) {
+            // The peer was first to give us this block, so is likely to be
+            // first with the next one too
+            if (!IsInitialBlockDownload())
+                MaybeSetPeerAsAnnouncingHeaderAndIDs(itSource->second);
+            mapBlockSource.erase(itSource);
+        }
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
@@ -3136,6 +3253,12 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
+    // Orphans the block includes or conflicts with are of no more use, and
+    // those spending its transactions may now be accepted
+    orphanPool.EraseForBlock(pblock->vtx);
+    BOOST_FOREACH(const CTransaction& tx, pblock->vtx)
+        orphanPool.AddWork(tx.GetHash());
+    ScheduleOrphanWork();
 
     // Remove transactions that expire at new block height from mempool
     mempool.removeExpired(pindexNew->nHeight);
@@ -3347,6 +3470,7 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
         boost::this_thread::interruption_point();
 
         bool fInitialDownload;
+        std::set<NodeId> setCmpctPeers;
         {
             LOCK(cs_main);
             pindexMostWork = FindMostWorkChain();
@@ -3360,21 +3484,65 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
 
             pindexNewTip = chainActive.Tip();
             fInitialDownload = IsInitialBlockDownload();
+
+            // Peers that asked for it get the new tip as a cmpctblock right
+            // away, if we have it at hand
+            if (fCompactBlocks && !fInitialDownload && pblock && pblock->GetHash() == pindexNewTip->GetBlockHash()) {
+                for (std::map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+                    if (it->second.fPreferHeaderAndIDs)
+                        setCmpctPeers.insert(it->first);
+            }
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
 
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Serialize the new tip once, for all the peers that are about to
+            // ask for it, unless it was when it was relayed early
+            CSharedNetMsg msgCmpctBlock;
+            if (pblock && pblock->GetHash() == hashNewTip) {
+                {
+                    LOCK(cs_mostRecentBlock);
+                    if (hashMostRecentBlock == hashNewTip)
+                        msgCmpctBlock = msgMostRecentCmpctBlock;
+                }
+                if (!msgCmpctBlock) {
+                    CSharedNetMsg msgBlock = MakeSharedMessage("block", *pblock);
+                    if (fCompactBlocks)
+                        msgCmpctBlock = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
+                    LOCK(cs_mostRecentBlock);
+                    hashMostRecentBlock = hashNewTip;
+                    msgMostRecentBlock = msgBlock;
+                    msgMostRecentCmpctBlock = msgCmpctBlock;
+                    pblockMostRecent.reset();
+                }
+            }
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainParams.Checkpoints());
+            std::vector<CNode*> vCmpctNodes;
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        if (setCmpctPeers.count(pnode->GetId())) {
+                            pnode->AddRef();
+                            vCmpctNodes.push_back(pnode);
+                        } else {
+                            pnode->PushBlockHash(hashNewTip);
+                        }
+                    }
+                }
+            }
+            // Pushed once cs_vNodes is released, so as not to hold up the
+            // socket handler, to all but the peers that sent us the block or
+            // were sent it early
+            BOOST_FOREACH(CNode* pnode, vCmpctNodes) {
+                if (pnode->AddInventoryKnown(CInv(MSG_BLOCK, hashNewTip)))
+                    pnode->PushSharedMessage(msgCmpctBlock);
+                pnode->Release();
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -4017,15 +4185,85 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 }
 
 
+/**
+ * Hand a block that extends our tip on to the peers that asked for new
+ * blocks as cmpctblock right away, once its header, proof of work and
+ * merkle root check out, and before its transactions are validated. The
+ * peers validate it themselves, and don't hold a compact block that turns
+ * out invalid against whoever sent it.
+ */
+static void RelayBlockEarly(const CBlock& block, CNode* pfrom)
+{
+    uint256 hash = block.GetHash();
+    std::set<NodeId> setCmpctPeers;
+    {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload() || chainActive.Tip() == NULL || block.hashPrevBlock != chainActive.Tip()->GetBlockHash())
+            return;
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi != mapBlockIndex.end() && (mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK)))
+            return;
+
+        // The checks the peers make of the header of a cmpctblock; the
+        // header stays in the index for when the block is accepted
+        CValidationState state;
+        CBlockIndex* pindex = NULL;
+        if (!AcceptBlockHeader(block, state, &pindex))
+            return;
+
+        for (std::map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+            if (it->second.fPreferHeaderAndIDs)
+                setCmpctPeers.insert(it->first);
+    }
+    if (setCmpctPeers.empty())
+        return;
+
+    // A block whose transactions don't match its header is not worth sending
+    bool fMutated;
+    if (block.BuildMerkleTree(&fMutated) != block.hashMerkleRoot || fMutated)
+        return;
+
+    LogPrint("cmpctblock", "relaying block %s before validating it\n", hash.ToString());
+    CSharedNetMsg msgCmpctBlock = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    CSharedNetMsg msgBlock = MakeSharedMessage("block", block);
+    {
+        LOCK(cs_mostRecentBlock);
+        hashMostRecentBlock = hash;
+        msgMostRecentBlock = msgBlock;
+        msgMostRecentCmpctBlock = msgCmpctBlock;
+        pblockMostRecent.reset(new CBlock(block));
+    }
+
+    std::vector<CNode*> vCmpctNodes;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode != pfrom && setCmpctPeers.count(pnode->GetId())) {
+                pnode->AddRef();
+                vCmpctNodes.push_back(pnode);
+            }
+        }
+    }
+    BOOST_FOREACH(CNode* pnode, vCmpctNodes) {
+        if (pnode->AddInventoryKnown(CInv(MSG_BLOCK, hash)))
+            pnode->PushSharedMessage(msgCmpctBlock);
+        pnode->Release();
+    }
+}
+
 bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp)
 {
+    // A block extending our tip goes out to peers while it is validated
+    if (fEarlyBlockRelay && dbp == NULL)
+        RelayBlockEarly(*pblock, pfrom);
+
     // Preliminary checks
     auto verifier = libzprime::ProofVerifier::Disabled();
     bool checked = CheckBlock(*pblock, state, verifier);
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -4676,8 +4914,7 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    orphanPool.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -5141,7 +5378,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
+                   txAdmissionQueue.IsQueued(inv.hash) ||
+                   orphanPool.Exists(inv.hash) ||
                    pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
@@ -5159,133 +5397,196 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
+    // A requested block is read from disk and sent once cs_main is released,
+    // so that a big block for one peer doesn't hold up the others
+    CInv invBlock;
+    CDiskBlockPos posBlock;
+    uint256 hashContinueTip;
+    bool fSendCmpctBlock = false;
+    bool fBulkBlock = false;
 
-    while (it != pfrom->vRecvGetData.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
-            break;
+    {
+        LOCK(cs_main);
 
-        const CInv &inv = *it;
-        {
-            boost::this_thread::interruption_point();
-            it++;
+        while (it != pfrom->vRecvGetData.end()) {
+            // Don't bother if send buffer is too full to respond anyway
+            if (pfrom->nSendSize >= SendBufferSize())
+                break;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            const CInv &inv = *it;
             {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                boost::this_thread::interruption_point();
+                it++;
+
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    bool send = false;
+                    static const int nOneWeek = 7 * 24 * 60 * 60;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
-                }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
-                {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // Blocks more than a week old are historical: they are
+                    // sent behind anything else queued to the peer, and not
+                    // at all once serving them would eat into what is left
+                    // of the upload target for relaying new blocks
+                    bool fHistorical = send && pindexBestHeader != NULL &&
+                        pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek;
+                    if (send && (fHistorical || inv.type == MSG_FILTERED_BLOCK) && CNode::OutboundTargetReached(true) && !pfrom->fWhitelisted)
                     {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
-                        {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
-                        }
-                        // else
-                            // no response
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                        pfrom->fDisconnect = true;
+                        send = false;
                     }
-
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                     {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue.SetNull();
+                        // Send block from disk, below
+                        invBlock = inv;
+                        posBlock = mi->second->GetBlockPos();
+                        fBulkBlock = fHistorical;
+                        // Older blocks are unlikely to be reconstructed from
+                        // the peer's mempool, so are sent in full
+                        fSendCmpctBlock = inv.type == MSG_CMPCT_BLOCK && chainActive.Contains(mi->second) &&
+                            mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+
+                        // Trigger the peer node to send a getblocks request for the next batch of inventory
+                        if (inv.hash == pfrom->hashContinue)
+                        {
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                            pfrom->hashContinue.SetNull();
+                        }
                     }
                 }
-            }
-            else if (inv.IsKnownType())
-            {
-                // Check the mempool to see if a transaction is expiring soon.  If so, do not send to peer.
-                // Note that a transaction enters the mempool first, before the serialized form is cached
-                // in mapRelay after a successful relay.
-                bool isExpiringSoon = false;
-                bool pushed = false;
-                CTransaction tx;
-                bool isInMempool = mempool.lookup(inv.hash, tx);
-                if (isInMempool) {
-                    isExpiringSoon = IsExpiringSoonTx(tx, currentHeight + 1);
-                }
+                else if (inv.IsKnownType())
+                {
+                    // Check the mempool to see if a transaction is expiring soon.  If so, do not send to peer.
+                    // Note that a transaction enters the mempool first, before the serialized form is cached
+                    // in mapRelay after a successful relay.
+                    bool isExpiringSoon = false;
+                    bool pushed = false;
+                    CTransaction tx;
+                    bool isInMempool = mempool.lookup(inv.hash, tx);
+                    if (isInMempool) {
+                        isExpiringSoon = IsExpiringSoonTx(tx, currentHeight + 1);
+                    }
 
-                if (!isExpiringSoon) {
-                    // Send stream from relay memory
-                    {
-                        LOCK(cs_mapRelay);
-                        map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                        if (mi != mapRelay.end()) {
-                            pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                            pushed = true;
+                    if (!isExpiringSoon) {
+                        // Send stream from relay memory
+                        {
+                            LOCK(cs_mapRelay);
+                            map<CInv, CSharedNetMsg>::iterator mi = mapRelay.find(inv);
+                            if (mi != mapRelay.end()) {
+                                pfrom->PushSharedMessage(mi->second);
+                                pushed = true;
+                            }
                         }
-                    }
-                    if (!pushed && inv.type == MSG_TX) {
-                        if (isInMempool) {
-                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                            ss.reserve(1000);
-                            ss << tx;
-                            pfrom->PushMessage("tx", ss);
-                            pushed = true;
+                        if (!pushed && inv.type == MSG_TX) {
+                            if (isInMempool) {
+                                CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                                ss.reserve(1000);
+                                ss << tx;
+                                pfrom->PushMessage("tx", ss);
+                                pushed = true;
+                            }
                         }
                     }
-                }
 
-                if (!pushed) {
-                    vNotFound.push_back(inv);
+                    if (!pushed) {
+                        vNotFound.push_back(inv);
+                    }
                 }
-            }
 
-            // Track requests for our stuff.
-            GetMainSignals().Inventory(inv.hash);
+                // Track requests for our stuff.
+                GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
-                break;
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    break;
+            }
         }
     }
 
     pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
 
+    if (!posBlock.IsNull())
+    {
+        // The latest tip is at hand already serialized
+        CSharedNetMsg msgCached;
+        if (invBlock.type != MSG_FILTERED_BLOCK) {
+            LOCK(cs_mostRecentBlock);
+            if (invBlock.hash == hashMostRecentBlock)
+                msgCached = fSendCmpctBlock ? msgMostRecentCmpctBlock : msgMostRecentBlock;
+        }
+        // The block can be pruned away once cs_main is released
+        CBlock block;
+        if (msgCached)
+            pfrom->PushSharedMessage(msgCached);
+        else if (!ReadBlockFromDisk(block, posBlock) || block.GetHash() != invBlock.hash) {
+            LogPrintf("%s: cannot load block %s requested by peer=%d from disk\n", __func__, invBlock.hash.ToString(), pfrom->GetId());
+            vNotFound.push_back(invBlock);
+        }
+        else if (fSendCmpctBlock)
+        {
+            CBlockHeaderAndShortTxIDs cmpctblock(block);
+            pfrom->PushMessage("cmpctblock", cmpctblock);
+        }
+        else if (invBlock.type == MSG_BLOCK || invBlock.type == MSG_CMPCT_BLOCK)
+            pfrom->PushSharedMessage(MakeSharedMessage("block", block), fBulkBlock);
+        else // MSG_FILTERED_BLOCK)
+        {
+            LOCK(pfrom->cs_filter);
+            if (pfrom->pfilter)
+            {
+                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                pfrom->PushMessage("merkleblock", merkleBlock);
+                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                // This avoids hurting performance by pointlessly requiring a round-trip
+                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                // they must either disconnect and retry or request the full block.
+                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                // however we MUST always provide at least what the remote peer needs
+                typedef std::pair<unsigned int, uint256> PairType;
+                std::vector<unsigned int> vUnseen;
+                {
+                    LOCK(pfrom->cs_inventory);
+                    BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                        if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            vUnseen.push_back(pair.first);
+                }
+                BOOST_FOREACH(unsigned int nTx, vUnseen)
+                    pfrom->PushMessage("tx", block.vtx[nTx]);
+            }
+            // else
+                // no response
+        }
+
+        if (!hashContinueTip.IsNull())
+        {
+            // Bypass PushInventory, this must send even if redundant,
+            // and we want it right after the last block so they don't
+            // wait for other stuff first. A bulk block must not be
+            // overtaken by it, so it is queued as bulk too.
+            vector<CInv> vInv;
+            vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
+            pfrom->PushSharedMessage(MakeSharedMessage("inv", vInv), fBulkBlock);
+        }
+    }
+
     if (!vNotFound.empty()) {
         // Let the peer know that we didn't find what it asked for, so it doesn't
         // have to wait around forever. Currently only SPV clients actually care
@@ -5298,6 +5599,193 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+static void ProcessOrphanWork();
+
+/**
+ * Retry up to ORPHAN_WORK_BATCH queued orphans. Those that are accepted queue
+ * their own orphans in turn; those that are invalid get their peer punished.
+ */
+static void ProcessOrphanBatch() EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    set<NodeId> setMisbehaving;
+    uint256 orphanHash;
+    for (unsigned int n = 0; n < ORPHAN_WORK_BATCH && orphanPool.PopWork(orphanHash); n++)
+    {
+        const COrphanPool::Entry* entry = orphanPool.Get(orphanHash);
+        const CTransaction orphanTx = entry->tx;
+        NodeId fromPeer = entry->fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (setMisbehaving.count(fromPeer))
+            continue;
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            orphanPool.Erase(orphanHash);
+            orphanPool.AddWork(orphanHash);
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                setMisbehaving.insert(fromPeer);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            orphanPool.Erase(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+        mempool.check(pcoinsTip);
+    }
+}
+
+/**
+ * Have the queued orphans retried on the scheduler thread, a batch at a
+ * time, so that resolving a long chain of orphans holds up neither the
+ * caller nor other users of cs_main for long. Without a scheduler (in
+ * tests) they are retried right away.
+ */
+static void ScheduleOrphanWork() EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    if (fOrphanWorkScheduled || !orphanPool.HasWork())
+        return;
+    if (pOrphanScheduler) {
+        fOrphanWorkScheduled = true;
+        pOrphanScheduler->scheduleFromNow(&ProcessOrphanWork, 0);
+    } else {
+        while (orphanPool.HasWork())
+            ProcessOrphanBatch();
+    }
+}
+
+static void ProcessOrphanWork()
+{
+    LOCK(cs_main);
+    fOrphanWorkScheduled = false;
+    ProcessOrphanBatch();
+    ScheduleOrphanWork();
+}
+
+void StartOrphanProcessing(CScheduler& scheduler)
+{
+    LOCK(cs_main);
+    pOrphanScheduler = &scheduler;
+    ScheduleOrphanWork();
+}
+
+/**
+ * Try to add a transaction relayed by pfrom to the mempool, and relay or
+ * reject it. Orphans waiting on it are queued for another attempt. Called
+ * either from the message handler or by the admission queue once the
+ * stateless checks have run.
+ */
+static void ProcessTransaction(CNode* pfrom, const CTransaction& tx)
+{
+    CInv inv(MSG_TX, tx.GetHash());
+
+    LOCK(cs_main);
+
+    bool fMissingInputs = false;
+    CValidationState state;
+
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv);
+
+    if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        orphanPool.AddWork(inv.hash);
+        ScheduleOrphanWork();
+    }
+    // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
+    else if (fMissingInputs &&
+             tx.vjoinsplit.empty() &&
+             tx.vShieldedSpend.empty() &&
+             tx.vShieldedOutput.empty())
+    {
+        orphanPool.Expire(GetTime());
+        orphanPool.Add(tx, pfrom->GetId(), GetTime());
+
+        // DoS prevention: do not allow the orphan pool to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = orphanPool.Limit(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", string("tx"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+CTxAdmissionQueue txAdmissionQueue(&ProcessTransaction);
+
+/** Announce the transactions a reconciliation found the peer to be missing */
+static void AnnounceReconciledTxs(CNode* pnode, const std::vector<uint256>& vTxids)
+{
+    vector<CInv> vInv;
+    {
+        LOCK(pnode->cs_inventory);
+        BOOST_FOREACH(const uint256& hash, vTxids) {
+            CInv inv(MSG_TX, hash);
+            if (mempool.exists(hash) && pnode->setInventoryKnown.insert(inv).second)
+                vInv.push_back(inv);
+        }
+    }
+    // Pushed after releasing cs_inventory, as SendMessages takes cs_vSend first
+    for (size_t i = 0; i < vInv.size(); i += MAX_INV_SZ) {
+        vector<CInv> vBatch(vInv.begin() + i, vInv.begin() + std::min<size_t>(vInv.size(), i + MAX_INV_SZ));
+        pnode->PushMessage("inv", vBatch);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5383,7 +5871,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -5462,6 +5953,151 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we take compact blocks, though not to announce with
+        // them until it has been first to give us a new tip
+        if (fCompactBlocks)
+            pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+
+        // Tell the peer we'd rather have new blocks announced with headers than inv
+        pfrom->PushMessage("sendheaders");
+
+        // Offer to reconcile transaction announcements in place of inv
+        if (fTxReconciliation) {
+            uint64_t nLocalSalt;
+            {
+                LOCK(pfrom->cs_inventory);
+                nLocalSalt = pfrom->txrecon.nLocalSalt;
+            }
+            pfrom->PushMessage("sendtxrcncl", TXRECONCILIATION_VERSION, nLocalSalt);
+        }
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCmpctBlock = false;
+        uint64_t nCmpctBlockVersion = 0;
+        vRecv >> fAnnounceUsingCmpctBlock >> nCmpctBlockVersion;
+        if (fCompactBlocks && nCmpctBlockVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            nodestate->fProvidesCmpctBlocks = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounceUsingCmpctBlock;
+        }
+    }
+
+
+    else if (strCommand == "sendtxrcncl")
+    {
+        uint32_t nReconVersion = 0;
+        uint64_t nRemoteSalt = 0;
+        vRecv >> nReconVersion >> nRemoteSalt;
+        LOCK(pfrom->cs_inventory);
+        if (fTxReconciliation && nReconVersion == TXRECONCILIATION_VERSION && !pfrom->txrecon.fEnabled) {
+            // Whoever made the connection asks for the reconciliations
+            pfrom->txrecon.Enable(!pfrom->fInbound, nRemoteSalt);
+            pfrom->txrecon.nNextRequest = PoissonNextSend(GetTimeMicros(), RECON_REQUEST_INTERVAL);
+            LogPrint("net", "reconciling transactions with peer=%d\n", pfrom->id);
+        }
+    }
+
+
+    else if (strCommand == "reqrecon")
+    {
+        uint32_t nRemoteSetSize = 0;
+        vRecv >> nRemoteSetSize;
+        std::vector<uint256> vAnnounce;
+        CTxReconSketch sketch;
+        {
+            LOCK(pfrom->cs_inventory);
+            CTxReconState& recon = pfrom->txrecon;
+            if (!recon.fEnabled || recon.fInitiator || recon.nRoundStart != 0) {
+                LogPrint("net", "unexpected reqrecon from peer=%d\n", pfrom->id);
+                return true;
+            }
+            recon.StartRound(GetTimeMicros());
+            size_t nCells = GetReconSketchCells(recon.GetSnapshot().size(), nRemoteSetSize);
+            if (nCells > MAX_RECON_SKETCH_CELLS) {
+                // Too far apart to reconcile: an empty sketch has both sides
+                // announce their whole set
+                vAnnounce = recon.FinishRound();
+            } else {
+                sketch = recon.SketchSnapshot(nCells);
+            }
+        }
+        pfrom->PushMessage("sketch", sketch);
+        AnnounceReconciledTxs(pfrom, vAnnounce);
+    }
+
+
+    else if (strCommand == "sketch")
+    {
+        CTxReconSketch sketch;
+        vRecv >> sketch;
+        // Our sketches are always a multiple of RECON_SKETCH_HASHES in size
+        bool fMalformed = sketch.GetCells() > MAX_RECON_SKETCH_CELLS || sketch.GetCells() % RECON_SKETCH_HASHES != 0;
+        if (fMalformed)
+            Misbehaving(pfrom->GetId(), 20);
+        std::vector<uint256> vAnnounce;
+        // An empty sketch means the peer gave up, and needs no reply
+        bool fReply = sketch.GetCells() != 0 || fMalformed;
+        bool fDecoded = false;
+        std::vector<uint32_t> vOnlyTheirs;
+        {
+            LOCK(pfrom->cs_inventory);
+            CTxReconState& recon = pfrom->txrecon;
+            if (!recon.fEnabled || !recon.fInitiator || recon.nRoundStart == 0) {
+                LogPrint("net", "unexpected sketch from peer=%d\n", pfrom->id);
+                return true;
+            }
+            if (fMalformed || sketch.GetCells() == 0) {
+                vAnnounce = recon.FinishRound();
+            } else {
+                // What's left of our sketch after taking out the peer's is
+                // what each side has that the other doesn't
+                CTxReconSketch diff = recon.SketchSnapshot(sketch.GetCells());
+                std::vector<uint32_t> vOnlyOurs;
+                fDecoded = diff.Subtract(sketch) && diff.Decode(vOnlyOurs, vOnlyTheirs);
+                if (fDecoded) {
+                    vAnnounce = recon.FinishRound(&vOnlyOurs);
+                } else {
+                    LogPrint("net", "reconciliation with peer=%d failed, announcing %u transactions\n", pfrom->id, recon.GetSnapshot().size());
+                    vOnlyTheirs.clear();
+                    vAnnounce = recon.FinishRound();
+                }
+            }
+        }
+        if (fReply)
+            pfrom->PushMessage("reconcildiff", fDecoded, vOnlyTheirs);
+        AnnounceReconciledTxs(pfrom, vAnnounce);
+    }
+
+
+    else if (strCommand == "reconcildiff")
+    {
+        bool fSuccess = false;
+        std::vector<uint32_t> vShortIDs;
+        vRecv >> fSuccess >> vShortIDs;
+        std::vector<uint256> vAnnounce;
+        {
+            LOCK(pfrom->cs_inventory);
+            CTxReconState& recon = pfrom->txrecon;
+            if (!recon.fEnabled || recon.fInitiator || recon.nRoundStart == 0) {
+                LogPrint("net", "unexpected reconcildiff from peer=%d\n", pfrom->id);
+                return true;
+            }
+            // On failure the peer has no idea what we have, so announce it all
+            vAnnounce = fSuccess ? recon.FinishRound(&vShortIDs) : recon.FinishRound();
+        }
+        AnnounceReconciledTxs(pfrom, vAnnounce);
     }
 
 
@@ -5558,6 +6194,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return error("message inv size() = %u", vInv.size());
         }
 
+        // The peer has all of it, whatever we make of it under cs_main
+        {
+            LOCK(pfrom->cs_inventory);
+            BOOST_FOREACH(const CInv& inv, vInv)
+                pfrom->setInventoryKnown.insert(inv);
+        }
+
         LOCK(cs_main);
 
         std::vector<CInv> vToFetch;
@@ -5567,7 +6210,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             const CInv &inv = vInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
@@ -5589,8 +6231,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate)) {
+                        // A new block is most likely made of transactions we
+                        // already have, so take it as a compact block if we can
+                        if (fCompactBlocks && nodestate->fProvidesCmpctBlocks)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -5716,140 +6363,36 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // The peer has these headers now, so new blocks building on them
+        // can be announced with headers. Without any, it is at our tip.
+        State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
-        else if (fMissingInputs &&
-                 tx.vjoinsplit.empty() &&
-                 tx.vShieldedSpend.empty() &&
-                 tx.vShieldedOutput.empty())
-        {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
-            }
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        // Proofs make shielded transactions expensive to check, so leave the
+        // stateless checks to the admission queue instead of holding up this
+        // thread and cs_main
+        bool fShielded = !tx.vjoinsplit.empty() || !tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty();
+        int nHeight = 0;
+        bool fQueue = false;
+        if (fShielded && txAdmissionQueue.IsRunning()) {
+            LOCK(cs_main);
+            fQueue = !AlreadyHave(inv);
+            nHeight = chainActive.Height() + 1;
         }
+        // When the queue is full, for this peer or overall, the checks are
+        // done here after all
+        if (!fQueue || txAdmissionQueue.Submit(pfrom, tx, nHeight) == TXADMISSION_REFUSED)
+            ProcessTransaction(pfrom, tx);
     }
 
 
@@ -5876,6 +6419,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        // An announcement of a few new headers we can't connect most likely
+        // skipped blocks we never heard of; fetch the headers in between
+        // rather than treat it as misbehaviour, unless it keeps happening
+        CNodeState *nodestate = State(pfrom->GetId());
+        if (mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end() && nCount < MAX_BLOCKS_TO_ANNOUNCE) {
+            nodestate->nUnconnectingHeaders++;
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                headers[0].GetHash().ToString(), headers[0].hashPrevBlock.ToString(),
+                pindexBestHeader->nHeight, pfrom->id, nodestate->nUnconnectingHeaders);
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                Misbehaving(pfrom->GetId(), 20);
+            return true;
+        }
+
         CBlockIndex *pindexLast = NULL;
         BOOST_FOREACH(const CBlockHeader& header, headers) {
             CValidationState state;
@@ -5893,6 +6452,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        if (nodestate->nUnconnectingHeaders > 0)
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        nodestate->nUnconnectingHeaders = 0;
+
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
@@ -5904,6 +6467,40 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
         }
 
+        // Announced headers with at least as much work as our tip are
+        // fetched right away when we are close to synced, as with an inv
+        if (pindexLast && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork &&
+            chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20) {
+            vector<CBlockIndex*> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            int nTransitLimit = GetBlocksInTransitLimit(nodestate);
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (unsigned int)nTransitLimit) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(pindexWalk->GetBlockHash()))
+                    vToFetch.push_back(pindexWalk);
+                pindexWalk = pindexWalk->pprev;
+            }
+            // A reorg this deep is left to the parallel download in SendMessages
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n", pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
+                    if (nodestate->nBlocksInFlight >= nTransitLimit)
+                        break;
+                    // A single new block on our tip is most likely made of
+                    // transactions we already have
+                    if (vToFetch.size() == 1 && pindex->pprev == chainActive.Tip() && fCompactBlocks && nodestate->fProvidesCmpctBlocks)
+                        vGetData.push_back(CInv(MSG_CMPCT_BLOCK, pindex->GetBlockHash()));
+                    else
+                        vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(), pindex->nHeight, pfrom->id);
+                }
+                if (!vGetData.empty())
+                    pfrom->PushMessage("getdata", vGetData);
+            }
+        }
+
         CheckBlockIndex();
     }
 
@@ -5937,6 +6534,229 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("cmpctblock", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect to anything we know; fetch the headers in between
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                }
+                return true;
+            }
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                return true;
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            bool fInFlightFromPeer = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            CNodeState *nodestate = State(pfrom->GetId());
+
+            // Only blocks on our tip can be filled in from the mempool
+            if (pindex->pprev != chainActive.Tip()) {
+                if (!fInFlightFromPeer && itInFlight == mapBlocksInFlight.end() &&
+                    pindex->nChainWork > chainActive.Tip()->nChainWork &&
+                    nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate)) {
+                    MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex);
+                    fInFlightFromPeer = true;
+                }
+                if (fInFlightFromPeer) {
+                    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            if (itInFlight != mapBlocksInFlight.end() && !fInFlightFromPeer) {
+                // Another peer is sending us the block; use this one only if
+                // it needs no round trip
+                PartiallyDownloadedBlock partialBlock(&mempool);
+                if (partialBlock.InitData(cmpctblock, orphanPool.GetTransactions()) == READ_STATUS_OK &&
+                    partialBlock.FillBlock(block, std::vector<CTransaction>()) == READ_STATUS_OK)
+                    fBlockReconstructed = true;
+            } else {
+                if (!fInFlightFromPeer) {
+                    if (nodestate->nBlocksInFlight >= GetBlocksInTransitLimit(nodestate))
+                        return true;
+                    MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex);
+                    itInFlight = mapBlocksInFlight.find(hash);
+                }
+                std::shared_ptr<PartiallyDownloadedBlock>& partialBlock = itInFlight->second.second->partialBlock;
+                partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                ReadStatus status = partialBlock->InitData(cmpctblock, orphanPool.GetTransactions());
+                if (status == READ_STATUS_INVALID) {
+                    MarkBlockAsReceived(hash);
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                    return true;
+                } else if (status == READ_STATUS_FAILED) {
+                    // Short id collisions; fall back to the full block
+                    partialBlock.reset();
+                    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                    return true;
+                }
+
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock->IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (req.indexes.empty()) {
+                    ReadStatus status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+                    partialBlock.reset();
+                    if (status == READ_STATUS_OK) {
+                        fBlockReconstructed = true;
+                    } else {
+                        std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                        pfrom->PushMessage("getdata", vInv);
+                    }
+                } else {
+                    req.blockhash = hash;
+                    pfrom->PushMessage("getblocktxn", req);
+                }
+            }
+        }
+
+        if (fBlockReconstructed) {
+            // Peers may relay a compact block before validating it (see
+            // -earlyblockrelay), so one whose header checked out above isn't
+            // held against them if it turns out invalid
+            CValidationState state;
+            ProcessNewBlock(state, pfrom, &block, true, NULL);
+            if (state.IsInvalid()) {
+                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash);
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        // A block relayed before it was validated is served from memory,
+        // without waiting for cs_main while it is
+        std::shared_ptr<const CBlock> pblockCached;
+        {
+            LOCK(cs_mostRecentBlock);
+            if (req.blockhash == hashMostRecentBlock)
+                pblockCached = pblockMostRecent;
+        }
+
+        CDiskBlockPos pos;
+        bool fSendFull = false;
+        if (!pblockCached) {
+            LOCK(cs_main);
+            BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+            if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+            // The peer can't be filling in an older block from its mempool,
+            // so serve it in full, through getdata and its checks
+            if (!chainActive.Contains(it->second) || it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH)
+                fSendFull = true;
+            else
+                pos = it->second->GetBlockPos();
+        }
+
+        if (fSendFull) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock blockRead;
+        if (!pblockCached && (!ReadBlockFromDisk(blockRead, pos) || blockRead.GetHash() != req.blockhash)) {
+            LogPrintf("%s: cannot load block %s requested by peer=%d from disk\n", __func__, req.blockhash.ToString(), pfrom->id);
+            return true;
+        }
+        const CBlock& block = pblockCached ? *pblockCached : blockRead;
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockRead = false;
+        {
+            LOCK(cs_main);
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            std::shared_ptr<PartiallyDownloadedBlock>& partialBlock = itInFlight->second.second->partialBlock;
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            partialBlock.reset();
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // A short id collision put the wrong transaction in; fall back to the full block
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+            } else {
+                fBlockRead = true;
+            }
+        }
+
+        if (fBlockRead) {
+            // As with cmpctblock, an invalid block isn't held against the peer
+            CValidationState state;
+            ProcessNewBlock(state, pfrom, &block, true, NULL);
+            if (state.IsInvalid()) {
+                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), resp.blockhash);
+            }
+        }
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -5952,7 +6772,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -6077,12 +6900,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert(Params().AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -6205,11 +7036,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
-// requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
     //if (fDebug)
-    //    LogPrintf("%s(%u messages)\n", __func__, pfrom->vRecvMsg.size());
+    //    LogPrintf("%s(%u messages)\n", __func__, pfrom->vProcessMsg.size());
 
     //
     // Message format
@@ -6227,26 +7057,19 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
-    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
-    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
+    // The socket handler only hands over complete messages, and the message
+    // is ours once popped
+    std::list<CNetMessage> msgs;
+    while (!pfrom->fDisconnect) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
         // get next message
-        CNetMessage& msg = *it;
-
-        //if (fDebug)
-        //    LogPrintf("%s(message %u msgsz, %u bytes, complete:%s)\n", __func__,
-        //            msg.hdr.nMessageSize, msg.vRecv.size(),
-        //            msg.complete() ? "Y" : "N");
-
-        // end, if an incomplete message is found
-        if (!msg.complete())
+        msgs.clear();
+        if (!pfrom->PopProcessMsg(msgs))
             break;
-
-        // at this point, any failure means we can delete the current message
-        it++;
+        CNetMessage& msg = msgs.front();
 
         // Scan for message start
         if (memcmp(msg.hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0) {
@@ -6318,14 +7141,29 @@ bool ProcessMessages(CNode* pfrom)
         break;
     }
 
-    // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
-
     return fOk;
 }
 
 
+namespace {
+class CompareInvMempoolOrder
+{
+    CTxMemPool *mp;
+public:
+    CompareInvMempoolOrder(CTxMemPool *mempool)
+    {
+        mp = mempool;
+    }
+
+    bool operator()(const uint256& a, const uint256& b)
+    {
+        // As std::make_heap produces a max-heap, we want the entries which
+        // should be sent first to compare greater
+        return mp->CompareDepthAndTime(b, a);
+    }
+};
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -6375,8 +7213,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_inventory);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6391,24 +7231,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_inventory);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000) {
+                vector<CAddress> vAddrMsg(vAddr.begin() + i, vAddr.begin() + std::min(i + 1000, vAddr.size()));
+                pto->PushMessage("addr", vAddrMsg);
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -6431,6 +7271,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
         state.rejects.clear();
 
+        // Ask the peer to start, or stop, announcing new blocks as cmpctblock
+        if (state.fProvidesCmpctBlocks && state.fWantHeaderAndIDs != state.fSentWantHeaderAndIDs) {
+            pto->PushMessage("sendcmpct", state.fWantHeaderAndIDs, CMPCTBLOCKS_VERSION);
+            state.fSentWantHeaderAndIDs = state.fWantHeaderAndIDs;
+        }
+
         // Start block sync
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
@@ -6454,56 +7300,148 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             GetMainSignals().Broadcast(nTimeBestReceived);
         }
 
+        //
+        // Message: headers
+        //
+        // New blocks go to peers that asked with sendheaders as headers, as
+        // long as they connect to a header the peer has and there are few
+        // enough; otherwise the new tip is announced with an inv
+        {
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = !state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE;
+            CBlockIndex *pBestIndex = NULL;
+            ProcessBlockAvailability(pto->GetId());
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                BOOST_FOREACH(const uint256 &hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // The announcements don't connect; e.g. a reorg to a
+                        // chain we already announced part of
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue;
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // The peer doesn't have the parent either
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (!fRevertToInv && !vHeaders.empty()) {
+                LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                    vHeaders.back().GetHash().ToString(), pto->id);
+                pto->PushMessage("headers", vHeaders);
+                state.pindexBestHeaderSent = pBestIndex;
+            } else if (fRevertToInv && !pto->vBlockHashesToAnnounce.empty()) {
+                // Only the last block is announced; the peer asks for the
+                // headers in between
+                const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                assert(mi != mapBlockIndex.end());
+                CBlockIndex *pindex = mi->second;
+                if (chainActive[pindex->nHeight] != pindex) {
+                    LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                        hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                }
+                if (!PeerHasHeader(&state, pindex))
+                    pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         //
         // Message: inventory
         //
+        int64_t nNow = GetTimeMicros();
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
+        std::vector<uint256> vReconAnnounce;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vInv.reserve(std::max<size_t>(pto->vInventoryToSend.size(), INVENTORY_BROADCAST_MAX));
+
+            // Blocks go out right away
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                // returns true if wasn't already contained in the set
+                if (pto->setInventoryKnown.insert(inv).second)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
+                    vInv.push_back(inv);
+                    if (vInv.size() == MAX_INV_SZ)
                     {
-                        vInvWait.push_back(inv);
-                        continue;
+                        pto->PushMessage("inv", vInv);
+                        vInv.clear();
                     }
                 }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
+            }
+            pto->vInventoryToSend.clear();
+
+            // Transactions are trickled at random intervals, so that the
+            // order they reach peers in gives less away about where they
+            // came from, a few at a time to damp transaction floods
+            if (pto->nNextInvSend < nNow || pto->fWhitelisted) {
+                // Outbound peers are less likely to be spying, so trickle to them twice as often
+                pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
+                std::vector<uint256> vInvTx(pto->setInventoryTxToSend.begin(), pto->setInventoryTxToSend.end());
+                // Parents are announced before their children
+                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
+                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                unsigned int nRelayedTransactions = 0;
+                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                    uint256 hash = vInvTx.back();
+                    vInvTx.pop_back();
+                    pto->setInventoryTxToSend.erase(hash);
+                    // Gone from the mempool since it was queued, e.g. mined or replaced
+                    if (!mempool.exists(hash))
+                        continue;
+                    CInv inv(MSG_TX, hash);
+                    if (!pto->setInventoryKnown.insert(inv).second)
+                        continue;
                     vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
+                    nRelayedTransactions++;
+                    if (vInv.size() == MAX_INV_SZ)
                     {
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+
+            // Reconciliation rounds are driven by the side that made the connection
+            CTxReconState& recon = pto->txrecon;
+            if (recon.fEnabled && recon.fInitiator && recon.nRoundStart == 0 && recon.nNextRequest < nNow) {
+                recon.nNextRequest = PoissonNextSend(nNow, RECON_REQUEST_INTERVAL);
+                recon.StartRound(nNow);
+                pto->PushMessage("reqrecon", (uint32_t)recon.GetSnapshot().size());
+            } else if (recon.nRoundStart != 0 && recon.nRoundStart < nNow - RECON_RESPONSE_TIMEOUT * 1000000LL) {
+                LogPrint("net", "reconciliation with peer=%d timed out\n", pto->id);
+                vReconAnnounce = recon.FinishRound();
+            }
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
+        if (!vReconAnnounce.empty())
+            AnnounceReconciledTxs(pto, vReconAnnounce);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -6538,10 +7476,37 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        state.nRTT = pto->nPingUsecTime;
+        int nTransitLimit = GetBlocksInTransitLimit(&state);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nTransitLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex* pindexWaiting = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nTransitLimit - state.nBlocksInFlight, vToDownload, staller, pindexWaiting);
+
+            // Take over the first block holding up the download window if
+            // the peer it was asked of is far slower than this one would be,
+            // rather than wait for it to stall the window
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itWaiting =
+                pindexWaiting ? mapBlocksInFlight.find(pindexWaiting->GetBlockHash()) : mapBlocksInFlight.end();
+            if (state.nBlockServiceTime != 0 && itWaiting != mapBlocksInFlight.end() && itWaiting->second.first != pto->GetId()) {
+                NodeId slow = itWaiting->second.first;
+                int64_t nWaited = nNow - itWaiting->second.second->nTime;
+                int64_t nExpected = state.nBlockServiceTime * (state.nBlocksInFlight + 1) + state.nRTT;
+                if (nWaited > BLOCK_REASSIGN_MIN_TIME && nWaited > BLOCK_REASSIGN_FACTOR * nExpected) {
+                    LogPrint("net", "Reassigning block %s (%d) from peer=%d to peer=%d after %dms\n", pindexWaiting->GetBlockHash().ToString(),
+                        pindexWaiting->nHeight, slow, pto->id, nWaited / 1000);
+                    // Count the wait against the slow peer, so it is given fewer blocks
+                    UpdateBlockServiceTime(State(slow), nWaited);
+                    MarkBlockAsReceived(pindexWaiting->GetBlockHash());
+                    vToDownload.insert(vToDownload.begin(), pindexWaiting);
+                    if (vToDownload.size() > (unsigned int)(nTransitLimit - state.nBlocksInFlight))
+                        vToDownload.pop_back();
+                    if (staller == slow)
+                        staller = -1;
+                }
+            }
+
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
@@ -6591,6 +7556,212 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Mempool persistence
+//
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Transactions LoadMempool leaves waiting in the admission queue at a time */
+static const size_t MEMPOOL_LOAD_QUEUE_SIZE = 1000;
+
+namespace {
+
+struct CMempoolDumpEntry
+{
+    CTransaction tx;
+    int64_t nTime;
+    double dPriorityDelta;
+    CAmount nFeeDelta;
+    size_t nAncestors;
+
+    bool operator<(const CMempoolDumpEntry& other) const { return nAncestors < other.nAncestors; }
+};
+
+/** Progress of LoadMempool, guarded by cs_main */
+struct CMempoolLoadState
+{
+    int64_t nCommitted;
+    int64_t nAccepted;
+    int64_t nFailed;
+    int64_t nAlreadyThere;
+
+    CMempoolLoadState() : nCommitted(0), nAccepted(0), nFailed(0), nAlreadyThere(0) {}
+};
+
+} // anon namespace
+
+static CCriticalSection cs_dumpmempool;
+
+static void CommitLoadedTransaction(boost::shared_ptr<CMempoolLoadState> loadState, int64_t nTime,
+                                    double dPriorityDelta, CAmount nFeeDelta, CNode* pfrom, const CTransaction& tx)
+{
+    LOCK(cs_main);
+    const uint256& hash = tx.GetHash();
+    if (dPriorityDelta != 0 || nFeeDelta != 0)
+        mempool.PrioritiseTransaction(hash, hash.ToString(), dPriorityDelta, nFeeDelta);
+
+    CValidationState state;
+    if (mempool.exists(hash)) {
+        loadState->nAlreadyThere++;
+    } else if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime)) {
+        loadState->nAccepted++;
+    } else {
+        loadState->nFailed++;
+    }
+    loadState->nCommitted++;
+}
+
+bool LoadMempool()
+{
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    // Queued transactions may still be committed after an early return
+    boost::shared_ptr<CMempoolLoadState> loadState(new CMempoolLoadState());
+    int64_t nSubmitted = 0;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unknown mempool file version %d. Continuing anyway.\n", nVersion);
+            return false;
+        }
+        uint64_t nCount;
+        file >> nCount;
+
+        // The proofs and signatures are checked on the admission queue's
+        // threads, and the transactions committed in file order, parents first
+        while (nCount--) {
+            CTransaction tx;
+            int64_t nTime;
+            double dPriorityDelta;
+            CAmount nFeeDelta;
+            file >> tx >> nTime >> dPriorityDelta >> nFeeDelta;
+
+            int nHeight;
+            {
+                LOCK(cs_main);
+                nHeight = chainActive.Height() + 1;
+            }
+            CTxAdmissionQueue::CommitFunction commit = boost::bind(&CommitLoadedTransaction, loadState,
+                                                                   nTime, dPriorityDelta, nFeeDelta, _1, _2);
+            // Leave the queue to relayed transactions now and then
+            while (txAdmissionQueue.size() >= MEMPOOL_LOAD_QUEUE_SIZE && !ShutdownRequested())
+                MilliSleep(10);
+            if (ShutdownRequested())
+                return false;
+            switch (txAdmissionQueue.Submit(NULL, tx, nHeight, commit)) {
+            case TXADMISSION_REFUSED:
+                commit(NULL, tx);
+                nSubmitted++;
+                break;
+            case TXADMISSION_QUEUED:
+                nSubmitted++;
+                break;
+            case TXADMISSION_DUPLICATE: {
+                // A peer relayed it meanwhile, so commit is never called;
+                // its deltas still apply once it is in the pool
+                LOCK(cs_main);
+                const uint256& hash = tx.GetHash();
+                if (dPriorityDelta != 0 || nFeeDelta != 0)
+                    mempool.PrioritiseTransaction(hash, hash.ToString(), dPriorityDelta, nFeeDelta);
+                loadState->nAlreadyThere++;
+                break;
+            }
+            }
+        }
+        file >> mapDeltas;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    while (true) {
+        {
+            LOCK(cs_main);
+            if (loadState->nCommitted == nSubmitted)
+                break;
+        }
+        if (ShutdownRequested())
+            return false;
+        MilliSleep(10);
+    }
+
+    // Deltas for transactions that are not in the pool yet
+    for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+        mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+    LOCK(cs_main);
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i already there, in %.3fs\n",
+              loadState->nAccepted, loadState->nFailed, loadState->nAlreadyThere, (GetTimeMicros() - nStart) * 0.000001);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::vector<CMempoolDumpEntry> vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it) {
+            CMempoolDumpEntry entry;
+            entry.tx = it->GetTx();
+            entry.nTime = it->GetTime();
+            entry.dPriorityDelta = 0;
+            entry.nFeeDelta = 0;
+            entry.nAncestors = it->GetCountWithAncestors();
+            std::map<uint256, std::pair<double, CAmount> >::iterator itDelta = mapDeltas.find(entry.tx.GetHash());
+            if (itDelta != mapDeltas.end()) {
+                entry.dPriorityDelta = itDelta->second.first;
+                entry.nFeeDelta = itDelta->second.second;
+                mapDeltas.erase(itDelta);
+            }
+            vEntries.push_back(entry);
+        }
+    }
+    // A transaction has more ancestors than any of its parents, so this
+    // writes parents first and LoadMempool can accept them in file order
+    std::stable_sort(vEntries.begin(), vEntries.end());
+
+    int64_t nMid = GetTimeMicros();
+
+    LOCK(cs_dumpmempool);
+    try {
+        boost::filesystem::path pathNew = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathNew.string().c_str(), "wb");
+        if (!filestr)
+            return false;
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        uint64_t nVersion = MEMPOOL_DUMP_VERSION;
+        file << nVersion;
+        file << (uint64_t)vEntries.size();
+        BOOST_FOREACH(const CMempoolDumpEntry& entry, vEntries)
+            file << entry.tx << entry.nTime << entry.dPriorityDelta << entry.nFeeDelta;
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathNew, GetDataDir() / "mempool.dat");
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 static class CMainCleanup
 {
 public:
@@ -6603,8 +7774,7 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanPool.clear();
     }
 } instance_of_cmaincleanup;
 
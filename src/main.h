@@ -43,9 +43,12 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBloomFilter;
 class CInv;
+class CScheduler;
 class CScriptCheck;
+class CTxAdmissionQueue;
 class CValidationInterface;
 class CValidationState;
 class PrecomputedTransactionData;
@@ -71,6 +74,18 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** Default for -txexpirydelta, in number of blocks */
 static const unsigned int DEFAULT_TX_EXPIRY_DELTA = 20;
 /** The number of blocks within expiry height when a tx is considered to be expiring soon */
@@ -85,13 +100,24 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of blocks that can be requested at any given time from a peer whose throughput is not known yet. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks in flight from a single peer, adapted to its throughput and round trip time. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** A block in flight from a slow peer is moved to a faster one once it has waited BLOCK_REASSIGN_FACTOR times as
+ *  long as the faster peer would take to deliver it, and at least BLOCK_REASSIGN_MIN_TIME microseconds. */
+static const int BLOCK_REASSIGN_FACTOR = 4;
+static const int64_t BLOCK_REASSIGN_MIN_TIME = 1000000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 160;
+/** Maximum number of new blocks announced to a peer in one headers message; more are announced with an inv. */
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Number of headers messages in a row a peer may send that don't connect to our block index before being penalised. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -104,6 +130,12 @@ static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
+/** Average delay between trickled inventory transmissions in seconds.
+ *  Blocks and whitelisted receivers bypass this, outbound peers get half this delay. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of inventory items to send per transmission.
+ *  Limits the impact of low-fee transaction floods. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
 
 // Sanity check the magic numbers when we change them
 BOOST_STATIC_ASSERT(DEFAULT_BLOCK_MAX_SIZE <= MAX_BLOCK_SIZE);
@@ -122,6 +154,8 @@ extern unsigned int expiryDelta;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+/** Runs the stateless checks on relayed shielded transactions off cs_main; see txadmission.h */
+extern CTxAdmissionQueue txAdmissionQueue;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
@@ -159,6 +193,12 @@ extern bool fCoinbaseEnforcedProtectionEnabled;
 extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
+/** Whether to relay blocks as compact blocks (-compactblocks) */
+extern bool fCompactBlocks;
+/** Whether to hand new blocks on to peers before validating them fully (-earlyblockrelay) */
+extern bool fEarlyBlockRelay;
+/** Whether to reconcile transaction announcements with peers that support it (-txreconciliation) */
+extern bool fTxReconciliation;
 extern int64_t nMaxTipAge;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
@@ -191,6 +231,8 @@ static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
 /** Unregister a network node */
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
+/** Retry orphan transactions on the scheduler thread once their parents arrive */
+void StartOrphanProcessing(CScheduler& scheduler);
 
 /**
  * Process an incoming block. This only returns after the best known valid
@@ -279,7 +321,15 @@ void PruneAndFlush();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
+
+/** Load the mempool from disk, checking the transactions on the admission queue's threads */
+bool LoadMempool();
+/** Dump the mempool to disk */
+bool DumpMempool();
 
 
 struct CNodeStateStats {
@@ -287,6 +337,11 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    bool fProvidesCmpctBlocks;
+    bool fPreferHeaderAndIDs;
+    bool fPreferHeaders;
+    int nBlocksInTransitLimit;
+    int64_t nBlockServiceTime;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -464,6 +519,7 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -32,11 +32,12 @@
 
 #include "sodium.h"
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
+#include <memory>
 #include <mutex>
 
 using namespace std;
@@ -46,54 +47,110 @@ using namespace std;
 // BitcoinMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// Coin-age priority of a mempool entry, for filling the priority area:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+struct TxCoinAgePriorityCompare
+{
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByFee()(*(b.second), *(a.second)); // Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
+
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// A mempool entry whose ancestor state has been reduced by ancestors already
+// selected for the block, so that what is left of its package can be ranked
+// against the untouched entries in mapTx.
 //
-class COrphan
+struct CTxMemPoolModifiedEntry
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry) :
+        iter(entry), nSizeWithAncestors(entry->GetSizeWithAncestors()),
+        nModFeesWithAncestors(entry->GetModFeesWithAncestors()) {}
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+struct CompareCTxMemPoolIter
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
+        return &(*a) < &(*b);
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+struct modifiedentry_iter
+{
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Same ordering as CompareTxMemPoolEntryByAncestorFee, on the modified state
+struct CompareModifiedEntry
 {
-    bool byFee;
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
+    }
+};
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+// A transaction always has more ancestors than any of its in-mempool parents,
+// so sorting a package by ancestor count puts parents first.
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
+{
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    void operator() (CTxMemPoolModifiedEntry& e)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
     }
+
+    CTxMemPool::txiter iter;
 };
 
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
@@ -106,346 +163,1288 @@ void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams,
     }
 }
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+/** Seconds after which a template that left out a better-paying transaction for lack of space is rebuilt */
+static const int64_t TEMPLATE_REBUILD_INTERVAL = 5;
+
+static int64_t GetLockTimeCutoff(const CBlockIndex* pindexPrev, int64_t nBlockTime)
 {
-    const CChainParams& chainparams = Params();
-    // Create new block
-    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    return (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+           ? pindexPrev->GetMedianTimePast()
+           : nBlockTime;
+}
 
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+// Backs the coins view of a detached CBlockCandidate; finds nothing.
+static CCoinsView viewDetached;
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+//
+// The transactions selected so far for a block on top of pindexPrev, with the
+// coins view and Sapling tree they leave behind so that more transactions can
+// be appended later. The view is attached to pcoinsTip, which requires
+// cs_main, or detached once everything the transactions need has been
+// prefetched.
+//
+class CBlockCandidate
+{
+public:
+    CBlockIndex* pindexPrev;
+    int nHeight;
+    uint32_t consensusBranchId;
+    int64_t nLockTimeCutoff;
+
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+
+    CCoinsViewCache view;
+    SaplingMerkleTree sapling_tree;
+
+    std::vector<CTransaction> vtx;
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    std::set<uint256> setTxHashes;
+
+    uint64_t nBlockSize;
+    int nBlockSigOps;
+    CAmount nFees;
+    CFeeRate feeRateMin; //! lowest fee rate of the selected transactions
+
+    CBlockCandidate(CBlockIndex* pindexPrevIn, int64_t nTime);
+
+    /** Back the view with baseIn. The first call loads the Sapling tree of pindexPrev. Requires cs_main. */
+    void Attach(CCoinsView& baseIn);
+    void Detach() { view.SetBackend(viewDetached); }
+
+    /** Load the coins, nullifiers and anchors tx refers to into the view. Requires cs_main. */
+    void Prefetch(const CTransaction& tx);
+
+    /** Whether transactions of this total size and legacy sigops are within the limits of the block */
+    bool Fits(uint64_t nPackageSize, unsigned int nPackageSigOps) const;
+
+    /** Append tx if it is valid on top of the transactions selected so far */
+    bool AddTransaction(const CTransaction& tx, unsigned int nTxSize);
+
+private:
+    // We want to track the value pool, but if the miner gets
+    // invoked on an old block before the hardcoded fallback
+    // is active we don't want to trip up any assertions. So,
+    // we only adhere to the turnstile (as a miner) if we
+    // actually have all of the information necessary to do
+    // so.
+    CAmount sproutValue;
+    CAmount saplingValue;
+    bool monitoring_pool_balances;
+
+    bool fLoaded;
+};
+
+CBlockCandidate::CBlockCandidate(CBlockIndex* pindexPrevIn, int64_t nTime) :
+    pindexPrev(pindexPrevIn), view(&viewDetached), nBlockSize(1000), nBlockSigOps(100), nFees(0),
+    sproutValue(0), saplingValue(0), monitoring_pool_balances(true), fLoaded(false)
+{
+    const CChainParams& chainparams = Params();
+    nHeight = pindexPrev->nHeight + 1;
+    consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+    nLockTimeCutoff = GetLockTimeCutoff(pindexPrev, nTime);
 
     // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
     // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
-
-    {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
-        pblock->nTime = GetAdjustedTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-        CCoinsViewCache view(pcoinsTip);
+    if (chainparams.ZIP209Enabled()) {
+        if (pindexPrev->nChainSproutValue) {
+            sproutValue = *pindexPrev->nChainSproutValue;
+        } else {
+            monitoring_pool_balances = false;
+        }
+        if (pindexPrev->nChainSaplingValue) {
+            saplingValue = *pindexPrev->nChainSaplingValue;
+        } else {
+            monitoring_pool_balances = false;
+        }
+    }
+}
 
-        SaplingMerkleTree sapling_tree;
+void CBlockCandidate::Attach(CCoinsView& baseIn)
+{
+    view.SetBackend(baseIn);
+    if (!fLoaded) {
         assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
+        // Needed by ContextualCheckInputs once the view is detached
+        view.GetBestBlock();
+        fLoaded = true;
+    }
+}
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
+void CBlockCandidate::Prefetch(const CTransaction& tx)
+{
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        view.HaveCoins(txin.prevout.hash);
+    BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+        BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers)
+            view.GetNullifier(nf, SPROUT);
+        SproutMerkleTree tree;
+        view.GetSproutAnchorAt(joinsplit.anchor, tree);
+    }
+    BOOST_FOREACH(const SpendDescription& spend, tx.vShieldedSpend) {
+        view.GetNullifier(spend.nullifier, SAPLING);
+        SaplingMerkleTree tree;
+        view.GetSaplingAnchorAt(spend.anchor, tree);
+    }
+}
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->GetTx();
+bool CBlockCandidate::Fits(uint64_t nPackageSize, unsigned int nPackageSigOps) const
+{
+    // Size limits
+    if (nBlockSize + nPackageSize >= nBlockMaxSize)
+        return false;
 
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
+    // Legacy limits on sigOps:
+    if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
-                continue;
+    return true;
+}
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+bool CBlockCandidate::AddTransaction(const CTransaction& tx, unsigned int nTxSize)
+{
+    if (!view.HaveInputs(tx))
+        return false;
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+    CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    CValidationState state;
+    PrecomputedTransactionData txdata(tx);
+    if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, Params().GetConsensus(), consensusBranchId))
+        return false;
 
-                int nConf = nHeight - coins->nHeight;
+    if (Params().ZIP209Enabled() && monitoring_pool_balances) {
+        // Does this transaction lead to a turnstile violation?
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            nTotalIn += tx.GetShieldedValueIn();
+        CAmount sproutValueDummy = sproutValue;
+        CAmount saplingValueDummy = saplingValue;
+
+        saplingValueDummy += -tx.valueBalance;
 
-            if (fMissingInputs) continue;
+        for (auto js : tx.vjoinsplit) {
+            sproutValueDummy += js.vpub_old;
+            sproutValueDummy -= js.vpub_new;
+        }
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+        if (sproutValueDummy < 0) {
+            LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
+            return false;
+        }
+        if (saplingValueDummy < 0) {
+            LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
+            return false;
+        }
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        sproutValue = sproutValueDummy;
+        saplingValue = saplingValueDummy;
+    }
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+    UpdateCoins(tx, view, nHeight);
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+    BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
+        sapling_tree.append(outDescription.cm);
+    }
+
+    // Added
+    vtx.push_back(tx);
+    vTxFees.push_back(nTxFees);
+    vTxSigOps.push_back(nTxSigOps);
+    setTxHashes.insert(tx.GetHash());
+    nBlockSize += nTxSize;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+
+    CFeeRate feeRate(nTxFees, nTxSize);
+    if (vtx.size() == 1 || feeRate < feeRateMin)
+        feeRateMin = feeRate;
+
+    return true;
+}
+
+//
+// Chooses mempool transactions for a block, in the order they should be added:
+// by coin-age priority until the priority area is full, then in packages of a
+// transaction together with its ancestors not yet chosen, best ancestor fee
+// rate first, so that a child can pay for its parents. Sizes and legacy sigops
+// are counted as though everything chosen were valid; CBlockCandidate does the
+// real checks when the packages are added. Requires mempool.cs.
+//
+class CPackageSelector
+{
+public:
+    /** Transactions that go into the block together, parents first */
+    typedef std::vector<CTxMemPool::txiter> Package;
+
+    /** Start from what block already contains */
+    CPackageSelector(const CBlockCandidate& block);
+
+    /** Choose transactions for the rest of the block, adding the time each step takes to pTimes */
+    void SelectAll(std::vector<Package>& vPackages, CBlockAssemblyTimes* pTimes = NULL);
+
+    /**
+     * Choose the package completing entry it, if it may be added to what has
+     * been chosen so far. fSkippedBetter is set if it was left out for lack of
+     * space although it pays more than anything in the block.
+     */
+    bool SelectPackage(CTxMemPool::txiter it, Package& package, bool& fSkippedBetter);
+
+private:
+    const int nHeight;
+    const int64_t nLockTimeCutoff;
+    const unsigned int nBlockMaxSize;
+    const unsigned int nBlockPrioritySize;
+    const unsigned int nBlockMinSize;
+    const CFeeRate feeRateMin;
+    const bool fPrintPriority;
+
+    uint64_t nBlockSize;
+    int nBlockSigOps;
+    CTxMemPool::setEntries inBlock;
+
+    bool IsSelectable(CTxMemPool::txiter it) const;
+    bool TestPackage(uint64_t nPackageSize, unsigned int nPackageSigOps) const;
+    bool IsStillDependent(CTxMemPool::txiter it) const;
+    void OnlyUnselected(CTxMemPool::setEntries& testSet) const;
+    void AddToBlock(CTxMemPool::txiter it, Package& package);
+    void AddPackageToBlock(const CTxMemPool::setEntries& entries, Package& package);
+    void AddPriorityTxs(std::vector<Package>& vPackages);
+    void AddPackageTxs(std::vector<Package>& vPackages);
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const;
+};
+
+CPackageSelector::CPackageSelector(const CBlockCandidate& block) :
+    nHeight(block.nHeight), nLockTimeCutoff(block.nLockTimeCutoff),
+    nBlockMaxSize(block.nBlockMaxSize), nBlockPrioritySize(block.nBlockPrioritySize),
+    nBlockMinSize(block.nBlockMinSize), feeRateMin(block.feeRateMin),
+    fPrintPriority(GetBoolArg("-printpriority", false)),
+    nBlockSize(block.nBlockSize), nBlockSigOps(block.nBlockSigOps)
+{
+    AssertLockHeld(mempool.cs);
+    BOOST_FOREACH(const uint256& hash, block.setTxHashes) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it != mempool.mapTx.end())
+            inBlock.insert(it);
+    }
+}
+
+bool CPackageSelector::IsSelectable(CTxMemPool::txiter it) const
+{
+    const CTransaction& tx = it->GetTx();
+    return !tx.IsCoinBase() && IsFinalTx(tx, nHeight, nLockTimeCutoff) && !IsExpiredTx(tx, nHeight);
+}
+
+bool CPackageSelector::TestPackage(uint64_t nPackageSize, unsigned int nPackageSigOps) const
+{
+    return nBlockSize + nPackageSize < nBlockMaxSize && nBlockSigOps + nPackageSigOps < MAX_BLOCK_SIGOPS;
+}
+
+bool CPackageSelector::IsStillDependent(CTxMemPool::txiter it) const
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(it)) {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
+
+void CPackageSelector::OnlyUnselected(CTxMemPool::setEntries& testSet) const
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
+        // Only test txs not already in the block
+        if (inBlock.count(*iit))
+            testSet.erase(iit++);
+        else
+            iit++;
+    }
+}
+
+void CPackageSelector::AddToBlock(CTxMemPool::txiter it, Package& package)
+{
+    package.push_back(it);
+    inBlock.insert(it);
+    nBlockSize += it->GetTxSize();
+    nBlockSigOps += GetLegacySigOpCount(it->GetTx());
+
+    if (fPrintPriority) {
+        double dPriority = it->GetPriority(nHeight);
+        CAmount dummy = 0;
+        mempool.ApplyDeltas(it->GetTx().GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            dPriority, CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), it->GetTx().GetHash().ToString());
+    }
+}
+
+void CPackageSelector::AddPackageToBlock(const CTxMemPool::setEntries& entries, Package& package)
+{
+    std::vector<CTxMemPool::txiter> sortedEntries(entries.begin(), entries.end());
+    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+    BOOST_FOREACH(CTxMemPool::txiter it, sortedEntries)
+        AddToBlock(it, package);
+}
+
+void CPackageSelector::SelectAll(std::vector<Package>& vPackages, CBlockAssemblyTimes* pTimes)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    AddPriorityTxs(vPackages);
+    int64_t nTimePriority = GetTimeMicros();
+    AddPackageTxs(vPackages);
+    if (pTimes) {
+        pTimes->nPriority += nTimePriority - nTimeStart;
+        pTimes->nPackages += GetTimeMicros() - nTimePriority;
+    }
+}
+
+void CPackageSelector::AddPriorityTxs(std::vector<Package>& vPackages)
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    // Transactions waiting for a parent to be added
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+        if (inBlock.count(mi))
+            continue;
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy = 0;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue:
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        double actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        if (IsStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        if (!IsSelectable(iter) || !TestPackage(iter->GetTxSize(), GetLegacySigOpCount(iter->GetTx())))
+            continue;
+
+        Package package;
+        AddToBlock(iter, package);
+        vPackages.push_back(package);
+
+        // Once past the priority size or out of high-priority transactions,
+        // the rest are chosen by fee rate
+        if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority))
+            break;
+
+        // Queue transactions that were waiting for this one
+        BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            waitPriIter wpiter = waitPriMap.find(child);
+            if (wpiter != waitPriMap.end()) {
+                vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                waitPriMap.erase(wpiter);
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &(mi->GetTx())));
         }
+    }
+}
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        // We want to track the value pool, but if the miner gets
-        // invoked on an old block before the hardcoded fallback
-        // is active we don't want to trip up any assertions. So,
-        // we only adhere to the turnstile (as a miner) if we
-        // actually have all of the information necessary to do
-        // so.
-        CAmount sproutValue = 0;
-        CAmount saplingValue = 0;
-        bool monitoring_pool_balances = true;
-        if (chainparams.ZIP209Enabled()) {
-            if (pindexPrev->nChainSproutValue) {
-                sproutValue = *pindexPrev->nChainSproutValue;
+void CPackageSelector::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+                                              indexed_modified_transaction_set& mapModifiedTx) const
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+            if (inBlock.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
             } else {
-                monitoring_pool_balances = false;
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
             }
-            if (pindexPrev->nChainSaplingValue) {
-                saplingValue = *pindexPrev->nChainSaplingValue;
+        }
+    }
+}
+
+void CPackageSelector::AddPackageTxs(std::vector<Package>& vPackages)
+{
+    // Entries whose ancestors are partly in the block, with their package
+    // reduced to the ancestors that are not
+    indexed_modified_transaction_set mapModifiedTx;
+    // Modified entries that didn't fit, so that their mapTx entry is skipped
+    CTxMemPool::setEntries failedTx;
+
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    // Give up once nearly full and nothing has fitted for a while
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end()) {
+            CTxMemPool::txiter it = mempool.mapTx.project<0>(mi);
+            if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it)) {
+                ++mi;
+                continue;
+            }
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+        CTxMemPool::txiter iter;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                iter = modit->iter;
+                fUsingModified = true;
             } else {
-                monitoring_pool_balances = false;
+                ++mi;
             }
         }
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+        uint64_t nPackageSize = fUsingModified ? modit->nSizeWithAncestors : iter->GetSizeWithAncestors();
+        CAmount nPackageFees = fUsingModified ? modit->nModFeesWithAncestors : iter->GetModFeesWithAncestors();
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+        if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        OnlyUnselected(ancestors);
+        ancestors.insert(iter);
+
+        unsigned int nPackageSigOps = 0;
+        bool fSelectable = true;
+        BOOST_FOREACH(CTxMemPool::txiter it, ancestors) {
+            nPackageSigOps += GetLegacySigOpCount(it->GetTx());
+            fSelectable = fSelectable && IsSelectable(it);
+        }
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        if (!fSelectable || !TestPackage(nPackageSize, nPackageSigOps)) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize + 1000 > nBlockMaxSize)
+                return;
+            continue;
+        }
+        nConsecutiveFailed = 0;
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+        Package package;
+        AddPackageToBlock(ancestors, package);
+        vPackages.push_back(package);
+        BOOST_FOREACH(CTxMemPool::txiter it, ancestors)
+            mapModifiedTx.erase(it);
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
 
-            if (!view.HaveInputs(tx))
-                continue;
+bool CPackageSelector::SelectPackage(CTxMemPool::txiter it, Package& package, bool& fSkippedBetter)
+{
+    if (inBlock.count(it))
+        return false;
+
+    CTxMemPool::setEntries ancestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    mempool.CalculateMemPoolAncestors(*it, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+    OnlyUnselected(ancestors);
+    ancestors.insert(it);
+
+    uint64_t nPackageSize = 0;
+    CAmount nPackageFees = 0;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH(CTxMemPool::txiter a, ancestors) {
+        if (!IsSelectable(a))
+            return false;
+        nPackageSize += a->GetTxSize();
+        nPackageFees += a->GetModifiedFee();
+        nPackageSigOps += GetLegacySigOpCount(a->GetTx());
+    }
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+    if (!TestPackage(nPackageSize, nPackageSigOps)) {
+        if (CFeeRate(nPackageFees, nPackageSize) > feeRateMin)
+            fSkippedBetter = true;
+        return false;
+    }
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+    // Same policy as SelectAll: below the relay fee only a high-priority
+    // transaction on its own may fill the priority area, and anything may
+    // fill the minimum block size.
+    if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) && nBlockSize + nPackageSize >= nBlockMinSize) {
+        if (ancestors.size() > 1 || nBlockSize + nPackageSize >= nBlockPrioritySize)
+            return false;
+        double dPriority = it->GetPriority(nHeight);
+        CAmount dummyFee = 0;
+        mempool.ApplyDeltas(it->GetTx().GetHash(), dPriority, dummyFee);
+        if (!AllowFree(dPriority))
+            return false;
+    }
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            PrecomputedTransactionData txdata(tx);
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, Params().GetConsensus(), consensusBranchId))
-                continue;
+    AddPackageToBlock(ancestors, package);
+    return true;
+}
 
-            if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
-                // Does this transaction lead to a turnstile violation?
+/**
+ * Append the transactions of a package to block if the package fits,
+ * stopping at the first invalid one since the rest may depend on it.
+ */
+static void AddPackage(CBlockCandidate& block, const std::vector<CTransaction>& package)
+{
+    std::vector<unsigned int> vTxSize;
+    uint64_t nPackageSize = 0;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH(const CTransaction& tx, package) {
+        vTxSize.push_back(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+        nPackageSize += vTxSize.back();
+        nPackageSigOps += GetLegacySigOpCount(tx);
+    }
+    if (!block.Fits(nPackageSize, nPackageSigOps))
+        return;
 
-                CAmount sproutValueDummy = sproutValue;
-                CAmount saplingValueDummy = saplingValue;
+    for (size_t i = 0; i < package.size(); i++) {
+        if (!block.AddTransaction(package[i], vTxSize[i]))
+            break;
+    }
+}
 
-                saplingValueDummy += -tx.valueBalance;
+/** Copy the transactions of selected packages, which may then be used without mempool.cs */
+static void CopyPackages(const std::vector<CPackageSelector::Package>& vSelected,
+                         std::vector<std::vector<CTransaction> >& vPackages)
+{
+    vPackages.reserve(vPackages.size() + vSelected.size());
+    BOOST_FOREACH(const CPackageSelector::Package& selected, vSelected) {
+        vPackages.push_back(std::vector<CTransaction>());
+        vPackages.back().reserve(selected.size());
+        BOOST_FOREACH(CTxMemPool::txiter it, selected)
+            vPackages.back().push_back(it->GetTx());
+    }
+}
 
-                for (auto js : tx.vjoinsplit) {
-                    sproutValueDummy += js.vpub_old;
-                    sproutValueDummy -= js.vpub_new;
-                }
+/** Make a block from the transactions of block, with a coinbase paying scriptPubKeyIn */
+static CBlockTemplate* CreateBlockTemplate(const CBlockCandidate& block, const CScript& scriptPubKeyIn)
+{
+    const CChainParams& chainparams = Params();
+    // Create new block
+    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if(!pblocktemplate.get())
+        return NULL;
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-                if (sproutValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
-                    continue;
-                }
-                if (saplingValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
-                    continue;
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (Params().MineBlocksOnDemand())
+        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+
+    // Add dummy coinbase tx as first transaction
+    pblock->vtx.reserve(block.vtx.size() + 1);
+    pblock->vtx.push_back(CTransaction());
+    pblock->vtx.insert(pblock->vtx.end(), block.vtx.begin(), block.vtx.end());
+    pblocktemplate->vTxFees.push_back(-block.nFees);
+    pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), block.vTxFees.begin(), block.vTxFees.end());
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), block.vTxSigOps.begin(), block.vTxSigOps.end());
+
+    nLastBlockTx = block.vtx.size();
+    nLastBlockSize = block.nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u\n", block.nBlockSize);
+
+    const int nHeight = block.nHeight;
+    CBlockIndex* pindexPrev = block.pindexPrev;
+
+    // Create coinbase tx
+    CMutableTransaction txNew = CreateNewContextualCMutableTransaction(chainparams.GetConsensus(), nHeight);
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    txNew.vout[0].nValue = GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    // Set to 0 so expiry height does not apply to coinbase txs
+    txNew.nExpiryHeight = 0;
+
+    if ((nHeight > 0) && (nHeight <= chainparams.GetConsensus().GetLastFoundersRewardBlockHeight())) {
+        // Founders reward is 20% of the block subsidy
+        auto vFoundersReward = txNew.vout[0].nValue / 5;
+        // Take some reward away from us
+        txNew.vout[0].nValue -= vFoundersReward;
+
+        // And give it to the founders
+        txNew.vout.push_back(CTxOut(vFoundersReward, chainparams.GetFoundersRewardScriptAtHeight(nHeight)));
+    }
+
+    // Add fees
+    txNew.vout[0].nValue += block.nFees;
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+
+    pblock->vtx[0] = txNew;
+
+    // Randomise nonce
+    arith_uint256 nonce = UintToArith256(GetRandHash());
+    // Clear the top and bottom 16 bits (for local use as thread flags and counters)
+    nonce <<= 32;
+    nonce >>= 16;
+    pblock->nNonce = ArithToUint256(nonce);
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblock->hashFinalSaplingRoot   = block.sapling_tree.root();
+    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
+    pblock->nSolution.clear();
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    return pblocktemplate.release();
+}
+
+//
+// Keeps a CBlockCandidate for the current tip up to date as transactions enter
+// and leave the mempool, so that CreateNewBlock can return a template without
+// scanning the mempool. A rebuild selects transactions under mempool.cs only,
+// holds cs_main just long enough to prefetch the coins they spend, and
+// validates them holding neither, apart from the moment GetSpendHeight takes
+// cs_main for each transaction. Transactions that arrive afterwards are
+// appended to the existing candidate together with any ancestors it lacks;
+// removals of selected transactions, tip changes and prioritisation cause a
+// rebuild.
+//
+// Lock order: cs, cs_main, mempool.cs, csPending. The update thread holds cs
+// while it waits for cs_main, so Get must not be called with cs_main held.
+//
+class CBlockTemplateUpdater : public CValidationInterface
+{
+public:
+    CBlockTemplateUpdater() : nMempoolUpdated(0), nLastRebuild(0), fSkippedBetter(false),
+        nPendingEvents(0), fTipChanged(false) {}
+
+    void Start();
+    void Stop();
+
+    /**
+     * Return a template on top of the current tip, checked with
+     * TestBlockValidity. Must be called without cs_main held.
+     */
+    CBlockTemplate* Get(const CScript& scriptPubKeyIn);
+
+protected:
+    void ChainTip(const CBlockIndex *pindex, const CBlock *pblock, SproutMerkleTree sproutTree, SaplingMerkleTree saplingTree, bool added);
+
+private:
+    CCriticalSection cs;
+    std::unique_ptr<CBlockCandidate> candidate;
+    unsigned int nMempoolUpdated; //! mempool.GetTransactionsUpdated() the candidate reflects
+    int64_t nLastRebuild;
+    bool fSkippedBetter; //! a package paying more than the candidate's lowest fee rate did not fit
+
+    // Changes not yet applied to the candidate
+    boost::mutex csPending;
+    boost::condition_variable condPending;
+    std::vector<uint256> vAdded;
+    std::set<uint256> setRemoved;
+    unsigned int nPendingEvents;
+    bool fTipChanged;
+
+    boost::thread thread;
+
+    void EntryAdded(const uint256& hash);
+    void EntryRemoved(const uint256& hash);
+    bool IsCurrent();
+    bool Update();
+    void ThreadUpdate();
+};
+
+void CBlockTemplateUpdater::Start()
+{
+    RegisterValidationInterface(this);
+    mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateUpdater::EntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateUpdater::EntryRemoved, this, _1));
+    thread = boost::thread(boost::bind(&CBlockTemplateUpdater::ThreadUpdate, this));
+}
+
+void CBlockTemplateUpdater::Stop()
+{
+    thread.interrupt();
+    thread.join();
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&CBlockTemplateUpdater::EntryAdded, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&CBlockTemplateUpdater::EntryRemoved, this, _1));
+    UnregisterValidationInterface(this);
+}
+
+void CBlockTemplateUpdater::EntryAdded(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(csPending);
+    vAdded.push_back(hash);
+    nPendingEvents++;
+    condPending.notify_one();
+}
+
+void CBlockTemplateUpdater::EntryRemoved(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(csPending);
+    setRemoved.insert(hash);
+    nPendingEvents++;
+    condPending.notify_one();
+}
+
+void CBlockTemplateUpdater::ChainTip(const CBlockIndex *pindex, const CBlock *pblock, SproutMerkleTree sproutTree, SaplingMerkleTree saplingTree, bool added)
+{
+    boost::unique_lock<boost::mutex> lock(csPending);
+    fTipChanged = true;
+    condPending.notify_one();
+}
+
+bool CBlockTemplateUpdater::IsCurrent()
+{
+    AssertLockHeld(cs);
+    if (!candidate)
+        return false;
+
+    LOCK(mempool.cs);
+    boost::unique_lock<boost::mutex> lock(csPending);
+    if (fTipChanged || nPendingEvents != 0 || mempool.GetTransactionsUpdated() != nMempoolUpdated)
+        return false;
+    return !(fSkippedBetter && GetTime() - nLastRebuild >= TEMPLATE_REBUILD_INTERVAL);
+}
+
+/**
+ * Bring the candidate up to date with the mempool and tip. Returns false if
+ * the tip changed while doing so, in which case the next call rebuilds.
+ */
+bool CBlockTemplateUpdater::Update()
+{
+    AssertLockHeld(cs);
+    int64_t nTimeStart = GetTimeMicros();
+
+    CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        pindexPrev = chainActive.Tip();
+    }
+    const int64_t nTime = GetAdjustedTime();
+
+    // Take the pending changes and select the transactions they call for
+    // together, so that both reflect the same mempool state.
+    bool fRebuild;
+    unsigned int nUpdated;
+    std::unique_ptr<CBlockCandidate> rebuilt;
+    std::vector<std::vector<CTransaction> > vPackages;
+    {
+        LOCK(mempool.cs);
+        nUpdated = mempool.GetTransactionsUpdated();
+
+        std::vector<uint256> vAddedNow;
+        std::set<uint256> setRemovedNow;
+        unsigned int nEvents;
+        bool fTipChangedNow;
+        {
+            boost::unique_lock<boost::mutex> lock(csPending);
+            vAddedNow.swap(vAdded);
+            setRemovedNow.swap(setRemoved);
+            nEvents = nPendingEvents;
+            nPendingEvents = 0;
+            fTipChangedNow = fTipChanged;
+            fTipChanged = false;
+        }
+
+        // Anything that moved the mempool counter without an add or remove
+        // notification (prioritisation, clear) can't be applied incrementally.
+        fRebuild = !candidate || fTipChangedNow || candidate->pindexPrev != pindexPrev ||
+                   nUpdated != nMempoolUpdated + nEvents ||
+                   (fSkippedBetter && GetTime() - nLastRebuild >= TEMPLATE_REBUILD_INTERVAL);
+        if (!fRebuild) {
+            BOOST_FOREACH(const uint256& hash, setRemovedNow) {
+                if (candidate->setTxHashes.count(hash)) {
+                    fRebuild = true;
+                    break;
                 }
+            }
+        }
 
-                sproutValue = sproutValueDummy;
-                saplingValue = saplingValueDummy;
+        std::vector<CPackageSelector::Package> vSelected;
+        if (fRebuild) {
+            rebuilt.reset(new CBlockCandidate(pindexPrev, nTime));
+            CPackageSelector selector(*rebuilt);
+            selector.SelectAll(vSelected);
+        } else {
+            CPackageSelector selector(*candidate);
+            BOOST_FOREACH(const uint256& hash, vAddedNow) {
+                CTxMemPool::txiter it = mempool.mapTx.find(hash);
+                if (it == mempool.mapTx.end())
+                    continue;
+                CPackageSelector::Package package;
+                if (selector.SelectPackage(it, package, fSkippedBetter))
+                    vSelected.push_back(package);
             }
+        }
+        CopyPackages(vSelected, vPackages);
+    }
 
-            UpdateCoins(tx, view, nHeight);
+    CBlockCandidate& block = fRebuild ? *rebuilt : *candidate;
+    {
+        LOCK(cs_main);
+        if (chainActive.Tip() != pindexPrev) {
+            boost::unique_lock<boost::mutex> lock(csPending);
+            fTipChanged = true;
+            return false;
+        }
 
-            BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
-                sapling_tree.append(outDescription.cm);
-            }
+        block.Attach(*pcoinsTip);
+        BOOST_FOREACH(const std::vector<CTransaction>& package, vPackages) {
+            BOOST_FOREACH(const CTransaction& tx, package)
+                block.Prefetch(tx);
+        }
+        block.Detach();
+    }
+    int64_t nTimePrefetch = GetTimeMicros();
+
+    BOOST_FOREACH(const std::vector<CTransaction>& package, vPackages)
+        AddPackage(block, package);
+    if (fRebuild) {
+        candidate.swap(rebuilt);
+        nLastRebuild = GetTime();
+        fSkippedBetter = false;
+    }
+    nMempoolUpdated = nUpdated;
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    LogPrint("bench", "    - %s block template: %u txs, %.2fms (prefetch %.2fms)\n",
+        fRebuild ? "Rebuilt" : "Updated", candidate->vtx.size(),
+        0.001 * (GetTimeMicros() - nTimeStart), 0.001 * (nTimePrefetch - nTimeStart));
+    return true;
+}
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
+CBlockTemplate* CBlockTemplateUpdater::Get(const CScript& scriptPubKeyIn)
+{
+    AssertLockNotHeld(cs_main);
+    while (true) {
+        std::unique_ptr<CBlockTemplate> pblocktemplate;
+        CBlockIndex* pindexPrev;
+        {
+            LOCK(cs);
+            // Catch up with whatever the update thread has not applied yet
+            if (!IsCurrent()) {
+                while (!Update())
+                    boost::this_thread::interruption_point();
             }
+            pblocktemplate.reset(CreateBlockTemplate(*candidate, scriptPubKeyIn));
+            pindexPrev = candidate->pindexPrev;
+        }
+        if (!pblocktemplate)
+            return NULL;
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+        LOCK(cs_main);
+        if (chainActive.Tip() != pindexPrev) {
+            // Built on a tip that is gone by now, so build again
+            boost::unique_lock<boost::mutex> lock(csPending);
+            fTipChanged = true;
+            continue;
         }
+        CValidationState state;
+        if (!TestBlockValidity(state, pblocktemplate->block, pindexPrev, false, false))
+            throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+        return pblocktemplate.release();
+    }
+}
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        // Create coinbase tx
-        CMutableTransaction txNew = CreateNewContextualCMutableTransaction(chainparams.GetConsensus(), nHeight);
-        txNew.vin.resize(1);
-        txNew.vin[0].prevout.SetNull();
-        txNew.vout.resize(1);
-        txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-        txNew.vout[0].nValue = GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-        // Set to 0 so expiry height does not apply to coinbase txs
-        txNew.nExpiryHeight = 0;
-
-        if ((nHeight > 0) && (nHeight <= chainparams.GetConsensus().GetLastFoundersRewardBlockHeight())) {
-            // Founders reward is 20% of the block subsidy
-            auto vFoundersReward = txNew.vout[0].nValue / 5;
-            // Take some reward away from us
-            txNew.vout[0].nValue -= vFoundersReward;
-
-            // And give it to the founders
-            txNew.vout.push_back(CTxOut(vFoundersReward, chainparams.GetFoundersRewardScriptAtHeight(nHeight)));
+void CBlockTemplateUpdater::ThreadUpdate()
+{
+    RenameThread("zprime-template");
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(csPending);
+            if (nPendingEvents == 0 && !fTipChanged)
+                condPending.timed_wait(lock, boost::posix_time::seconds(1));
+        }
+        try {
+            LOCK(cs);
+            if (!IsCurrent())
+                Update();
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
         }
+    }
+}
+
+static std::mutex templateUpdaterMutex;
+static std::shared_ptr<CBlockTemplateUpdater> templateUpdater;
 
-        // Add fees
-        txNew.vout[0].nValue += nFees;
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+bool StartBlockTemplateUpdates()
+{
+    if (!GetBoolArg("-incrementaltemplate", DEFAULT_INCREMENTAL_TEMPLATE))
+        return false;
+
+    std::lock_guard<std::mutex> lock(templateUpdaterMutex);
+    if (!templateUpdater) {
+        templateUpdater = std::make_shared<CBlockTemplateUpdater>();
+        templateUpdater->Start();
+        LogPrintf("Keeping a block template up to date in the background\n");
+    }
+    return true;
+}
+
+void StopBlockTemplateUpdates()
+{
+    std::shared_ptr<CBlockTemplateUpdater> updater;
+    {
+        std::lock_guard<std::mutex> lock(templateUpdaterMutex);
+        updater.swap(templateUpdater);
+    }
+    if (updater)
+        updater->Stop();
+}
 
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
+/** Make a block from a scan of the whole mempool, adding the time each step takes to pTimes */
+static CBlockTemplate* AssembleBlock(const CScript& scriptPubKeyIn, CBlockAssemblyTimes* pTimes)
+{
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
 
-        // Randomise nonce
-        arith_uint256 nonce = UintToArith256(GetRandHash());
-        // Clear the top and bottom 16 bits (for local use as thread flags and counters)
-        nonce <<= 32;
-        nonce >>= 16;
-        pblock->nNonce = ArithToUint256(nonce);
+    {
+        LOCK2(cs_main, mempool.cs);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        CBlockCandidate block(pindexPrev, GetAdjustedTime());
+        block.Attach(*pcoinsTip);
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->hashFinalSaplingRoot   = sapling_tree.root();
-        UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
-        pblock->nSolution.clear();
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+        // Collect transactions into block
+        std::vector<CPackageSelector::Package> vSelected;
+        CPackageSelector selector(block);
+        selector.SelectAll(vSelected, pTimes);
+        int64_t nTimeSelected = GetTimeMicros();
+        std::vector<std::vector<CTransaction> > vPackages;
+        CopyPackages(vSelected, vPackages);
+        BOOST_FOREACH(const std::vector<CTransaction>& package, vPackages)
+            AddPackage(block, package);
+
+        pblocktemplate.reset(CreateBlockTemplate(block, scriptPubKeyIn));
+        if (!pblocktemplate)
+            return NULL;
+        int64_t nTimeAssembled = GetTimeMicros();
 
         CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
+        if (!TestBlockValidity(state, pblocktemplate->block, pindexPrev, false, false))
             throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+        if (pTimes) {
+            pTimes->nAssemble += nTimeAssembled - nTimeSelected;
+            pTimes->nValidity += GetTimeMicros() - nTimeAssembled;
+        }
     }
 
     return pblocktemplate.release();
 }
 
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    std::shared_ptr<CBlockTemplateUpdater> updater;
+    {
+        std::lock_guard<std::mutex> lock(templateUpdaterMutex);
+        updater = templateUpdater;
+    }
+    if (updater)
+        return updater->Get(scriptPubKeyIn);
+
+    return AssembleBlock(scriptPubKeyIn, NULL);
+}
+
+CBlockTemplate* CreateNewBlockTimed(const CScript& scriptPubKeyIn, CBlockAssemblyTimes& times)
+{
+    return AssembleBlock(scriptPubKeyIn, &times);
+}
+
+/**
+ * The template handed out by getblocktemplate. It is shared by every caller
+ * and longpoll waiter until the tip or the mempool changes, so a burst of
+ * requests costs one CreateNewBlock; each new one gets a new work id. It is
+ * built on request, or also in the background if started that way.
+ */
+class CBlockTemplateService : public CValidationInterface
+{
+public:
+    CBlockTemplateService() : fScriptKept(false), nWorkId(GetTime()), nMempoolUpdated(0), nTimeBuilt(0),
+        fWake(false), fBackground(false) {}
+
+    void Start(bool fBackgroundIn);
+    void Stop();
+
+    std::shared_ptr<const CBlockTemplate> Get(uint64_t& nWorkIdOut);
+    bool Wait(uint64_t nWorkIdKnown, int64_t nTimeout);
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex);
+
+private:
+    //! Held while checking for and building a new template, so that callers
+    //! arriving meanwhile wait for it rather than build their own
+    boost::mutex csBuild;
+    boost::shared_ptr<CReserveScript> coinbaseScript; //! what current pays to
+    bool fScriptKept; //! whether a template paying to coinbaseScript was handed out
+    uint256 hashScriptTip; //! the tip of the first one that was
+
+    boost::mutex cs;
+    boost::condition_variable condNew;
+    boost::condition_variable condWake;
+    std::shared_ptr<const CBlockTemplate> current;
+    uint64_t nWorkId;
+    unsigned int nMempoolUpdated; //! mempool.GetTransactionsUpdated() current reflects
+    int64_t nTimeBuilt;
+    bool fWake;
+
+    bool fBackground;
+    boost::thread thread;
+
+    void EntryChanged(const uint256& hash);
+    bool IsStale();
+    bool Build();
+    void ThreadBuild();
+};
+
+void CBlockTemplateService::Start(bool fBackgroundIn)
+{
+    fBackground = fBackgroundIn;
+    if (!fBackground)
+        return;
+    RegisterValidationInterface(this);
+    mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateService::EntryChanged, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateService::EntryChanged, this, _1));
+    thread = boost::thread(boost::bind(&CBlockTemplateService::ThreadBuild, this));
+}
+
+void CBlockTemplateService::Stop()
+{
+    if (!fBackground)
+        return;
+    thread.interrupt();
+    thread.join();
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&CBlockTemplateService::EntryChanged, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&CBlockTemplateService::EntryChanged, this, _1));
+    UnregisterValidationInterface(this);
+}
+
+void CBlockTemplateService::EntryChanged(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    fWake = true;
+    condWake.notify_one();
+}
+
+void CBlockTemplateService::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    fWake = true;
+    condWake.notify_one();
+}
+
+bool CBlockTemplateService::IsStale()
+{
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+    unsigned int nUpdated = mempool.GetTransactionsUpdated();
+    int64_t nInterval = GetArg("-blocktemplateinterval", DEFAULT_BLOCK_TEMPLATE_INTERVAL);
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (!current || current->block.hashPrevBlock != hashTip)
+        return true;
+    return nUpdated != nMempoolUpdated && GetTime() - nTimeBuilt >= nInterval;
+}
+
+bool CBlockTemplateService::Build()
+{
+    int64_t nTimeStart = GetTimeMicros();
+    unsigned int nUpdated = mempool.GetTransactionsUpdated();
+
+    // Keep paying to the same script until a template paying to it is handed
+    // out, and then for the rest of that height, rather than use up a key
+    // for every template built
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+    boost::shared_ptr<CReserveScript> script = coinbaseScript;
+    if (!script || (fScriptKept && hashScriptTip != hashTip)) {
+        script.reset();
+        GetMainSignals().ScriptForMining(script);
+    }
+    if (!script || script->reserveScript.empty())
+        return false;
+
+    std::shared_ptr<const CBlockTemplate> pblocktemplate(CreateNewBlock(script->reserveScript));
+    if (!pblocktemplate)
+        throw std::runtime_error("CBlockTemplateService::Build(): out of memory");
+    if (script != coinbaseScript) {
+        coinbaseScript = script;
+        fScriptKept = false;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        current = pblocktemplate;
+        ++nWorkId;
+        nMempoolUpdated = nUpdated;
+        nTimeBuilt = GetTime();
+    }
+    condNew.notify_all();
+
+    LogPrint("bench", "    - Shared block template: %u txs, %.2fms\n",
+        pblocktemplate->block.vtx.size(), 0.001 * (GetTimeMicros() - nTimeStart));
+    GetMainSignals().UpdatedBlockTemplate(pblocktemplate->block);
+    return true;
+}
+
+std::shared_ptr<const CBlockTemplate> CBlockTemplateService::Get(uint64_t& nWorkIdOut)
+{
+    boost::unique_lock<boost::mutex> lockBuild(csBuild);
+    if (IsStale() && !Build())
+        return NULL;
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    // Mark script as important because it is now used for a coinbase output
+    if (!fScriptKept) {
+        coinbaseScript->KeepScript();
+        fScriptKept = true;
+        hashScriptTip = current->block.hashPrevBlock;
+    }
+    nWorkIdOut = nWorkId;
+    return current;
+}
+
+bool CBlockTemplateService::Wait(uint64_t nWorkIdKnown, int64_t nTimeout)
+{
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(nTimeout);
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (nWorkId == nWorkIdKnown) {
+        if (!condNew.timed_wait(lock, deadline))
+            return nWorkId != nWorkIdKnown;
+    }
+    return true;
+}
+
+void CBlockTemplateService::ThreadBuild()
+{
+    RenameThread("zprime-gbt");
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            // Wake up now and then anyway, for mempool changes that had to
+            // wait out -blocktemplateinterval
+            if (!fWake)
+                condWake.timed_wait(lock, boost::posix_time::seconds(1));
+            fWake = false;
+        }
+        if (IsInitialBlockDownload())
+            continue;
+        try {
+            boost::unique_lock<boost::mutex> lockBuild(csBuild);
+            if (IsStale())
+                Build();
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+    }
+}
+
+static std::mutex templateServiceMutex;
+static std::shared_ptr<CBlockTemplateService> templateService;
+
+void StartBlockTemplateService(bool fBackground)
+{
+    std::lock_guard<std::mutex> lock(templateServiceMutex);
+    if (!templateService) {
+        templateService = std::make_shared<CBlockTemplateService>();
+        templateService->Start(fBackground);
+        if (fBackground)
+            LogPrintf("Building block templates in the background\n");
+    }
+}
+
+void StopBlockTemplateService()
+{
+    std::shared_ptr<CBlockTemplateService> service;
+    {
+        std::lock_guard<std::mutex> lock(templateServiceMutex);
+        service.swap(templateService);
+    }
+    if (service)
+        service->Stop();
+}
+
+std::shared_ptr<const CBlockTemplate> GetSharedBlockTemplate(uint64_t& nWorkId)
+{
+    std::shared_ptr<CBlockTemplateService> service;
+    {
+        std::lock_guard<std::mutex> lock(templateServiceMutex);
+        service = templateService;
+    }
+    if (!service)
+        return NULL;
+    return service->Get(nWorkId);
+}
+
+bool WaitForSharedBlockTemplate(uint64_t nWorkId, int64_t nTimeout)
+{
+    std::shared_ptr<CBlockTemplateService> service;
+    {
+        std::lock_guard<std::mutex> lock(templateServiceMutex);
+        service = templateService;
+    }
+    if (!service) {
+        MilliSleep(nTimeout);
+        return false;
+    }
+    return service->Wait(nWorkId, nTimeout);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Internal miner
@@ -771,6 +1770,8 @@ void GenerateBitcoins(bool fGenerate, int nThreads, const CChainParams& chainpar
     if (nThreads == 0 || !fGenerate)
         return;
 
+    StartBlockTemplateUpdates();
+
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++) {
         minerThreads->create_thread(boost::bind(&BitcoinMiner, boost::cref(chainparams)));
@@ -9,6 +9,7 @@
 #include "primitives/block.h"
 
 #include <boost/optional.hpp>
+#include <memory>
 #include <stdint.h>
 
 class CBlockIndex;
@@ -16,6 +17,13 @@ class CChainParams;
 class CScript;
 namespace Consensus { struct Params; };
 
+/** Default for -incrementaltemplate */
+static const bool DEFAULT_INCREMENTAL_TEMPLATE = true;
+/** Default for -blocktemplateinterval, in seconds */
+static const int64_t DEFAULT_BLOCK_TEMPLATE_INTERVAL = 1;
+/** Default for -blocktemplateservice */
+static const bool DEFAULT_BLOCK_TEMPLATE_SERVICE = false;
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -23,9 +31,64 @@ struct CBlockTemplate
     std::vector<int64_t> vTxSigOps;
 };
 
-/** Generate a new block, without valid proof-of-work */
+/**
+ * Generate a new block, without valid proof-of-work. While block template
+ * updates are running this must be called without cs_main held.
+ */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 
+/** Time spent in each step of assembling a block, in microseconds */
+struct CBlockAssemblyTimes
+{
+    int64_t nPriority; //! choosing transactions by coin-age priority
+    int64_t nPackages; //! choosing the rest by ancestor fee rate
+    int64_t nAssemble; //! checking them against the coins and filling in the block
+    int64_t nValidity; //! TestBlockValidity
+
+    CBlockAssemblyTimes() : nPriority(0), nPackages(0), nAssemble(0), nValidity(0) {}
+};
+
+/**
+ * Generate a new block from a scan of the whole mempool, as CreateNewBlock
+ * does without block template updates, adding the time each step takes to
+ * times. For benchmarks.
+ */
+CBlockTemplate* CreateNewBlockTimed(const CScript& scriptPubKeyIn, CBlockAssemblyTimes& times);
+/**
+ * Keep a block template for the current tip up to date in the background, so
+ * that CreateNewBlock does not have to scan the mempool. Returns false if
+ * disabled with -incrementaltemplate=0; does nothing if already running.
+ */
+bool StartBlockTemplateUpdates();
+/** Stop the updates started by StartBlockTemplateUpdates */
+void StopBlockTemplateUpdates();
+
+/**
+ * Start sharing the template getblocktemplate hands out. With fBackground,
+ * it is built as soon as the tip changes and at most every
+ * -blocktemplateinterval seconds while the mempool changes, and each one is
+ * published through UpdatedBlockTemplate; otherwise only on request. Does
+ * nothing if already running.
+ */
+void StartBlockTemplateService(bool fBackground);
+/** Stop the service started by StartBlockTemplateService */
+void StopBlockTemplateService();
+/**
+ * Get the template shared by every caller until the tip or the mempool
+ * changes, and its work id. It is built first if it is out of date, and only
+ * once however many callers are waiting for it. Returns NULL if the service
+ * is not running or there is no script to pay the coinbase to, and throws if
+ * building the template fails. The script is only kept from the wallet's
+ * keypool once a template paying to it is returned here. Must be called
+ * without cs_main held.
+ */
+std::shared_ptr<const CBlockTemplate> GetSharedBlockTemplate(uint64_t& nWorkId);
+/**
+ * Wait up to nTimeout milliseconds for a shared template other than the one
+ * with work id nWorkId. Returns false on timeout.
+ */
+bool WaitForSharedBlockTemplate(uint64_t nWorkId, int64_t nTimeout);
+
 #ifdef ENABLE_MINING
 /** Get script for -mineraddress */
 void GetScriptForMinerAddress(boost::shared_ptr<CReserveScript> &script);
@@ -22,8 +22,15 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include <math.h>
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -49,6 +56,25 @@ using namespace std;
 
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 8;
+    /** Milliseconds the socket handler waits for events; also how often select() polls pnode->vSend */
+    const int SOCKET_EVENTS_TIMEOUT = 50;
+    /** Maximum events taken from epoll_wait at a time */
+    const int MAX_EPOLL_EVENTS = 256;
+    /** Maximum reads from one node per round, so a fast peer can't starve the others */
+    const int MAX_RECV_PER_ROUND = 4;
+
+    /**
+     * A message handler thread's wakeup. Nodes are sharded across the threads
+     * by id, so each node's messages are processed, and its messages sent, by
+     * the same thread in order.
+     */
+    struct MessageHandlerShard {
+        boost::mutex mutex;
+        boost::condition_variable cond;
+        bool fWake;
+
+        MessageHandlerShard() : fWake(false) {}
+    };
 
     struct ListenSocket {
         SOCKET socket;
@@ -77,7 +103,7 @@ std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedNetMsg> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -95,12 +121,63 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-static boost::condition_variable messageHandlerCondition;
+static SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpoll = -1;
+#endif
+static int nMessageHandlerThreads = 1;
+static MessageHandlerShard vMessageHandlerShards[MAX_MSGHANDLER_THREADS];
 
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+bool SetSocketEventsMode(const std::string& strMode)
+{
+    if (strMode == "select") {
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        nSocketEventsMode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+SocketEventsMode GetSocketEventsMode()
+{
+    return nSocketEventsMode;
+}
+
+/** Whether the socket handler can wait on hSocket; select() can only take descriptors below FD_SETSIZE */
+static bool IsUsableSocket(const SOCKET& hSocket)
+{
+    return nSocketEventsMode != SOCKETEVENTS_SELECT || IsSelectableSocket(hSocket);
+}
+
+/**
+ * Register pnode's socket with the socket handler, once for its lifetime:
+ * closing the socket removes it again. Requires cs_vNodes, so the node
+ * can't be disconnected meanwhile.
+ */
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode != SOCKETEVENTS_EPOLL)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("socket epoll_ctl error %s, disconnecting peer=%d\n", NetworkErrorString(errno), pnode->id);
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
 void AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -316,6 +393,10 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -379,7 +460,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsUsableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -393,6 +474,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 
         {
             LOCK(cs_vNodes);
+            RegisterNodeSocket(pnode);
             vNodes.push_back(pnode);
         }
 
@@ -421,6 +503,11 @@ void CNode::CloseSocketDisconnect()
     TRY_LOCK(cs_vRecvMsg, lockRecv);
     if (lockRecv)
         vRecvMsg.clear();
+    TRY_LOCK(cs_vProcessMsg, lockProcess);
+    if (lockProcess) {
+        vProcessMsg.clear();
+        nProcessQueueSize = 0;
+    }
 }
 
 void CNode::PushVersion()
@@ -552,6 +639,10 @@ void CNode::copyStats(CNodeStats &stats)
     stats.nSendBytes = nSendBytes;
     stats.nRecvBytes = nRecvBytes;
     stats.fWhitelisted = fWhitelisted;
+    {
+        LOCK(cs_inventory);
+        stats.fTxReconciliation = txrecon.fEnabled;
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -570,6 +661,15 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_vSend);
+        stats.mapSendMsgCmdTotals = mapSendMsgCmdTotals;
+    }
+    {
+        LOCK(cs_vRecvMsg);
+        stats.mapRecvMsgCmdTotals = mapRecvMsgCmdTotals;
+    }
 }
 
 // requires LOCK(cs_vRecvMsg)
@@ -604,13 +704,46 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+
+            mapMsgCmdTotals::iterator i = mapRecvMsgCmdTotals.find(msg.hdr.GetCommand());
+            if (i == mapRecvMsgCmdTotals.end())
+                i = mapRecvMsgCmdTotals.find(NET_MESSAGE_COMMAND_OTHER);
+            assert(i != mapRecvMsgCmdTotals.end());
+            i->second.nBytes += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+            i->second.nMsgs++;
+        }
+    }
+
+    // Hand the complete messages over to the message handler, holding the
+    // lock it pops them with only for the splice
+    std::list<CNetMessage>::iterator it = vRecvMsg.begin();
+    size_t nSizeAdded = 0;
+    for (; it != vRecvMsg.end() && it->complete(); ++it)
+        nSizeAdded += it->vRecv.size() + 24;
+    if (it != vRecvMsg.begin()) {
+        {
+            LOCK(cs_vProcessMsg);
+            vProcessMsg.splice(vProcessMsg.end(), vRecvMsg, vRecvMsg.begin(), it);
+            nProcessQueueSize += nSizeAdded;
+            fPauseRecv = nProcessQueueSize > ReceiveFloodSize();
         }
+        WakeMessageHandler(this);
     }
 
     return true;
 }
 
+bool CNode::PopProcessMsg(std::list<CNetMessage>& msgs)
+{
+    LOCK(cs_vProcessMsg);
+    if (vProcessMsg.empty())
+        return false;
+    msgs.splice(msgs.begin(), vProcessMsg, vProcessMsg.begin());
+    nProcessQueueSize -= msgs.front().vRecv.size() + 24;
+    fPauseRecv = nProcessQueueSize > ReceiveFloodSize();
+    return true;
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -669,23 +802,51 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+        size_t nToSend = 0;
+        int nBytes;
+#ifdef WIN32
+        const CSerializeData &data = **it;
+        nToSend = data.size() - pnode->nSendOffset;
+        nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand as many queued messages as we can to the kernel at once
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        for (std::deque<CSharedNetMsg>::iterator itSend = it; itSend != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++itSend, ++nIov) {
+            size_t nOffset = itSend == it ? pnode->nSendOffset : 0;
+            iov[nIov].iov_base = const_cast<char*>(&(**itSend)[nOffset]);
+            iov[nIov].iov_len = (*itSend)->size() - nOffset;
+            nToSend += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Move past the messages sent in full
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -707,10 +868,18 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
+    size_t nSent = it - pnode->vSendMsg.begin();
+    pnode->nSendPriority = nSent < pnode->nSendPriority ? pnode->nSendPriority - nSent : 0;
+    // A bulk message that is part way out can't be overtaken any more
+    if (pnode->nSendOffset > 0 && pnode->nSendPriority == 0)
+        pnode->nSendPriority = 1;
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
+//! Nodes with edge-triggered events not yet fully serviced (socket handler thread only)
+static set<CNode*> setPendingRecv;
+static set<CNode*> setPendingSend;
 
 class CNodeRef {
 public:
@@ -926,7 +1095,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsUsableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -967,84 +1136,169 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
 
     {
         LOCK(cs_vNodes);
+        RegisterNodeSocket(pnode);
         vNodes.push_back(pnode);
     }
 }
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    //
+    // Disconnect nodes
+    //
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    setPendingRecv.erase(pnode);
+                    setPendingSend.erase(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+/**
+ * Receive up to a buffer's worth from pnode's socket. Returns false once
+ * there is nothing more to read for now, or the socket was closed.
+ * Requires pnode->cs_vRecvMsg.
+ */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+/**
+ * Whether pnode can take more from its socket without going over the receive
+ * flood limit, or its share of the transaction admission queue
+ */
+static bool CanReceive(CNode* pnode)
+{
+    return !pnode->fPauseRecv && !pnode->fPauseRecvTxAdmission;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+    }
+}
+
+static void ThreadSocketHandlerSelect()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = SOCKET_EVENTS_TIMEOUT * 1000; // frequency to poll pnode->vSend
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -1095,9 +1349,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && CanReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -1155,39 +1407,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1205,30 +1425,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1238,6 +1435,163 @@ void ThreadSocketHandler()
     }
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Service pnode's pending send. Returns false if it has to be tried again,
+ * because another thread holds cs_vSend.
+ */
+static bool ServicePendingSend(CNode* pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return true;
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+        return false;
+    // Whatever SocketSendData leaves unsent is waiting for the socket to
+    // become writable, which raises another event
+    if (!pnode->vSendMsg.empty())
+        SocketSendData(pnode);
+    return true;
+}
+
+/**
+ * Service pnode's pending receive. Returns false if there may be more to
+ * read: the node is at its receive flood limit, has data of its own still to
+ * send (which goes first, as with select), or has had its share for this
+ * round, in which case fMore is set.
+ */
+static bool ServicePendingRecv(CNode* pnode, bool& fMore)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return true;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend || !pnode->vSendMsg.empty())
+            return false;
+    }
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return false;
+    for (int i = 0; i < MAX_RECV_PER_ROUND; i++) {
+        if (!CanReceive(pnode))
+            return false;
+        if (!SocketRecvData(pnode))
+            return true;
+    }
+    fMore = true;
+    return false;
+}
+
+/**
+ * Each socket is registered once, edge-triggered, so the kernel reports a
+ * node only when it becomes readable or writable. A node stays on
+ * setPendingRecv until a read would block and on setPendingSend until its
+ * send buffer has been offered to the socket, so one round costs
+ * O(nodes with events) however many are connected.
+ */
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    bool fMore = false;
+    std::vector<struct epoll_event> vEvents(MAX_EPOLL_EVENTS);
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        int nEvents = epoll_wait(hEpoll, vEvents.data(), vEvents.size(), fMore ? 0 : SOCKET_EVENTS_TIMEOUT);
+        boost::this_thread::interruption_point();
+        if (nEvents < 0) {
+            if (errno != EINTR) {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(SOCKET_EVENTS_TIMEOUT);
+            }
+            nEvents = 0;
+        }
+
+        // Nodes are only deleted by this thread, so the pointers stay valid
+        // until the next DisconnectNodes
+        bool fAccept = false;
+        for (int i = 0; i < nEvents; i++) {
+            CNode* pnode = static_cast<CNode*>(vEvents[i].data.ptr);
+            if (pnode == NULL) {
+                fAccept = true;
+                continue;
+            }
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                setPendingRecv.insert(pnode);
+            if (vEvents[i].events & EPOLLOUT)
+                setPendingSend.insert(pnode);
+        }
+
+        //
+        // Accept new connections
+        //
+        if (fAccept) {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            {
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
+            }
+        }
+
+        //
+        // Service the nodes with events, sending first
+        //
+        for (std::set<CNode*>::iterator it = setPendingSend.begin(); it != setPendingSend.end(); ) {
+            if (ServicePendingSend(*it))
+                setPendingSend.erase(it++);
+            else
+                ++it;
+        }
+        fMore = false;
+        for (std::set<CNode*>::iterator it = setPendingRecv.begin(); it != setPendingRecv.end(); ) {
+            boost::this_thread::interruption_point();
+            if (ServicePendingRecv(*it, fMore))
+                setPendingRecv.erase(it++);
+            else
+                ++it;
+        }
+
+        //
+        // Inactivity checking
+        //
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck) {
+            nLastInactivityCheck = nTime;
+            vector<CNode*> vNodesCopy;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
+            }
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            {
+                if (pnode->hSocket != INVALID_SOCKET)
+                    InactivityCheck(pnode);
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->Release();
+            }
+        }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL) {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
+
 
 void ThreadDNSAddressSeed()
 {
@@ -1293,17 +1647,40 @@ void ThreadDNSAddressSeed()
 
 
 
+// Changes to addrman as of the last flush of peers.dat
+static CCriticalSection cs_dumpAddresses;
+static uint64_t nAddrManChangesDumped = 0;
+
 void DumpAddresses()
 {
+    // One flush at a time, so the last to rename its file into place has the newest addresses
+    LOCK(cs_dumpAddresses);
+    uint64_t nChanges = addrman.GetChanges();
+    if (nChanges == nAddrManChangesDumped) {
+        LogPrint("net", "No address changes to flush to peers.dat\n");
+        return;
+    }
+
     int64_t nStart = GetTimeMillis();
 
+    // addrman is only locked while it is serialized to memory, not for the disk write
     CAddrDB adb;
-    adb.Write(addrman);
+    if (adb.Write(addrman))
+        nAddrManChangesDumped = nChanges;
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
 }
 
+void static ThreadDumpAddresses()
+{
+    // The disk sync of a flush shouldn't hold up the other tasks on the scheduler thread
+    while (true) {
+        MilliSleep(DUMP_ADDRESSES_INTERVAL * 1000);
+        DumpAddresses();
+    }
+}
+
 void static ProcessOneShot()
 {
     string strDest;
@@ -1522,10 +1899,17 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void WakeMessageHandler(CNode* pnode)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    MessageHandlerShard& shard = vMessageHandlerShards[pnode->GetId() % nMessageHandlerThreads];
+    boost::unique_lock<boost::mutex> lock(shard.mutex);
+    shard.fWake = true;
+    shard.cond.notify_one();
+}
+
+void ThreadMessageHandler(int nShard)
+{
+    MessageHandlerShard& shard = vMessageHandlerShards[nShard];
 
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
@@ -1533,39 +1917,38 @@ void ThreadMessageHandler()
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->GetId() % nMessageHandlerThreads == nShard) {
+                    pnode->AddRef();
+                    vNodesCopy.push_back(pnode);
+                }
             }
         }
 
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages. Each thread picks one of its
+        // nodes to trickle to in one of every nMessageHandlerThreads rounds, so
+        // about one node is trickled to per round overall.
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (!vNodesCopy.empty() && GetRand(nMessageHandlerThreads) == 0)
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
+        bool fMoreWork = false;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (pnode->fDisconnect)
                 continue;
 
-            // Receive messages
+            // Receive messages. Leave closing the socket to the socket
+            // handler, which may be reading from it meanwhile.
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->fDisconnect = true;
+
+            if (pnode->nSendSize < SendBufferSize())
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (!pnode->vRecvGetData.empty() || pnode->HasProcessMsg())
                 {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+                    fMoreWork = true;
                 }
             }
             boost::this_thread::interruption_point();
@@ -1585,8 +1968,10 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        if (!fMoreWork && !shard.fWake)
+            shard.cond.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        shard.fWake = false;
     }
 }
 
@@ -1617,7 +2002,7 @@ bool BindListenPort(const CService &addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (!IsUsableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -1756,6 +2141,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     LogPrintf("Loaded %i addresses from peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
+    {
+        LOCK(cs_dumpAddresses);
+        nAddrManChangesDumped = addrman.GetChanges();
+    }
     fAddressesInitialized = true;
 
     if (semOutbound == NULL) {
@@ -1769,6 +2158,27 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     Discover(threadGroup);
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("epoll_create1 failed with error %s, using select\n", NetworkErrorString(errno));
+            nSocketEventsMode = SOCKETEVENTS_SELECT;
+        }
+        // Listen sockets are level-triggered, and told apart from nodes by a NULL pointer
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            if (hEpoll == -1)
+                break;
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("socket epoll_ctl error %s for listen socket\n", NetworkErrorString(errno));
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", nSocketEventsMode == SOCKETEVENTS_EPOLL ? "epoll" : "select");
+
     //
     // Start threads
     //
@@ -1788,10 +2198,13 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    nMessageHandlerThreads = std::max(1, std::min((int)GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS), MAX_MSGHANDLER_THREADS));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
-    scheduler.scheduleEvery(&DumpAddresses, DUMP_ADDRESSES_INTERVAL);
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "dumpaddr", &ThreadDumpAddresses));
 }
 
 bool StopNode()
@@ -1833,7 +2246,15 @@ public:
             delete pnode;
         vNodes.clear();
         vNodesDisconnected.clear();
+        setPendingRecv.clear();
+        setPendingSend.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1873,8 +2294,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // framed once for every peer that asks for it
+        mapRelay.insert(std::make_pair(inv, MakeSharedMessage(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1892,6 +2314,11 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -1902,6 +2329,85 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now) {
+        // The time frame is over, start a new cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+void CNode::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe) {
+        // Starting a new cycle keeps the time left in it within the new time frame
+        nMaxOutboundCycleStartTime = GetTime();
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit) {
+        // Keep enough of the target to relay a full block every block
+        // interval for the rest of the cycle
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / Params().GetConsensus().nPowTargetSpacing * MAX_BLOCK_SIZE;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) {
+        return true;
+    }
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -2080,9 +2586,14 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    nProcessQueueSize = 0;
+    fPauseRecv = false;
+    fPauseRecvTxAdmission = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendPriority = 0;
+    nNextInvSend = 0;
     hashContinue = uint256();
     nStartingHeight = -1;
     fGetAddr = false;
@@ -2100,6 +2611,15 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
         id = nLastNodeId++;
     }
 
+    // Every message type is counted from the start, so that the maps don't
+    // grow with whatever commands a peer makes up
+    BOOST_FOREACH(const std::string& strCommand, GetAllNetMessageTypes()) {
+        mapSendMsgCmdTotals[strCommand] = CNetMsgTotals();
+        mapRecvMsgCmdTotals[strCommand] = CNetMsgTotals();
+    }
+    mapSendMsgCmdTotals[NET_MESSAGE_COMMAND_OTHER] = CNetMsgTotals();
+    mapRecvMsgCmdTotals[NET_MESSAGE_COMMAND_OTHER] = CNetMsgTotals();
+
     if (fLogIPs)
         LogPrint("net", "Added connection to %s peer=%d\n", addrName, id);
     else
@@ -2156,6 +2676,20 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+static void FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2192,26 +2726,64 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    FinalizeMessageHeader(ssSend);
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    CSerializeData data;
+    ssSend.GetAndClear(data);
+    AccountForSentMessage(data);
+    nSendSize += data.size();
+    vSendMsg.insert(vSendMsg.begin() + nSendPriority++, std::make_shared<const CSerializeData>(std::move(data)));
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
+
+// requires LOCK(cs_vSend)
+void CNode::AccountForSentMessage(const CSerializeData& msg)
+{
+    std::string strCommand(&msg[MESSAGE_START_SIZE], strnlen(&msg[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE));
+    mapMsgCmdTotals::iterator i = mapSendMsgCmdTotals.find(strCommand);
+    if (i == mapSendMsgCmdTotals.end())
+        i = mapSendMsgCmdTotals.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapSendMsgCmdTotals.end());
+    i->second.nBytes += msg.size();
+    i->second.nMsgs++;
+}
+
+void CNode::PushSharedMessage(const CSharedNetMsg& msg, bool fBulk)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes%s) peer=%d\n",
+             SanitizeString(std::string(&(*msg)[MESSAGE_START_SIZE], strnlen(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE))),
+             msg->size() - CMessageHeader::HEADER_SIZE, fBulk ? ", bulk" : "", id);
+
+    AccountForSentMessage(*msg);
+    nSendSize += msg->size();
+    if (fBulk)
+        vSendMsg.push_back(msg);
+    else
+        vSendMsg.insert(vSendMsg.begin() + nSendPriority++, msg);
+
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
+CDataStream BeginSharedMessage(const char* pszCommand)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+    return ss;
+}
+
+CSharedNetMsg EndSharedMessage(CDataStream& ss)
+{
+    FinalizeMessageHeader(ss);
+    CSerializeData data;
+    ss.GetAndClear(data);
+    return std::make_shared<const CSerializeData>(std::move(data));
+}
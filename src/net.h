@@ -16,10 +16,14 @@
 #include "random.h"
 #include "streams.h"
 #include "sync.h"
+#include "txreconciliation.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <list>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -59,12 +63,50 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** Default for -msghandlerthreads */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+/** -socketevents default: epoll where it is available */
+#ifdef HAVE_SYS_EPOLL_H
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
+/** -maxuploadtarget default: no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The time frame -maxuploadtarget applies to (in seconds) */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Maximum number of queued messages handed to the kernel in one send call */
+static const int MAX_SEND_IOV = 64;
 /** The period before a network upgrade activates, where connections to upgrading peers are preferred (in blocks). */
 static const int NETWORK_UPGRADE_PEER_PREFERENCE_BLOCK_PERIOD = 24 * 24 * 3;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
+/**
+ * A message with its header, serialized once and then queued as is to any
+ * number of peers, e.g. a transaction or a new block relayed to all of them.
+ */
+typedef std::shared_ptr<const CSerializeData> CSharedNetMsg;
+
+/** Start a shared message: a stream holding its header, to serialize the payload into */
+CDataStream BeginSharedMessage(const char* pszCommand);
+/** Fill in the payload size and checksum, and take the message out of ss */
+CSharedNetMsg EndSharedMessage(CDataStream& ss);
+
+template<typename T>
+CSharedNetMsg MakeSharedMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss = BeginSharedMessage(pszCommand);
+    ss << payload;
+    return EndSharedMessage(ss);
+}
+
 void AddOneShot(const std::string& strDest);
 void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
@@ -78,6 +120,17 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Wake the message handler thread that serves pnode */
+void WakeMessageHandler(CNode* pnode);
+
+/** How the socket handler waits for sockets to become ready */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+/** Set from -socketevents, before StartNode; false if strMode is unknown or not available on this platform */
+bool SetSocketEventsMode(const std::string& strMode);
+SocketEventsMode GetSocketEventsMode();
 
 typedef int NodeId;
 
@@ -147,7 +200,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedNetMsg> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -169,6 +222,17 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic of one message type with a peer */
+struct CNetMsgTotals
+{
+    uint64_t nBytes;
+    uint64_t nMsgs;
+
+    CNetMsgTotals() : nBytes(0), nMsgs(0) {}
+};
+
+typedef std::map<std::string, CNetMsgTotals> mapMsgCmdTotals;
+
 class CNodeStats
 {
 public:
@@ -189,6 +253,9 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    bool fTxReconciliation;
+    mapMsgCmdTotals mapSendMsgCmdTotals;
+    mapMsgCmdTotals mapRecvMsgCmdTotals;
 };
 
 
@@ -247,13 +314,28 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedNetMsg> vSendMsg;
+    // Entries at the front of vSendMsg that go before the bulk messages
+    // behind them: everything but historical blocks, and a bulk message
+    // that has started to go out
+    size_t nSendPriority;
+    mapMsgCmdTotals mapSendMsgCmdTotals;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
-    std::deque<CNetMessage> vRecvMsg;
+    std::list<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Complete messages, handed over from vRecvMsg for the message handler
+    std::list<CNetMessage> vProcessMsg;
+    size_t nProcessQueueSize;
+    CCriticalSection cs_vProcessMsg;
+    // Whether the socket handler stops reading until vProcessMsg drains
+    std::atomic<bool> fPauseRecv;
+    // Whether the socket handler stops reading until some of the node's
+    // transactions in the admission queue are committed
+    std::atomic<bool> fPauseRecvTxAdmission;
     uint64_t nRecvBytes;
+    mapMsgCmdTotals mapRecvMsgCmdTotals; // guarded by cs_vRecvMsg
     int nRecvVersion;
 
     int64_t nLastSend;
@@ -285,7 +367,7 @@ public:
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
-    int nRefCount;
+    std::atomic<int> nRefCount;
     NodeId id;
 protected:
 
@@ -306,7 +388,7 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay, guarded by cs_inventory as other message handlers relay to this node
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
@@ -315,6 +397,13 @@ public:
     // inventory based relay
     mruset<CInv> setInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    // Transactions to announce at the next trickle, in place of vInventoryToSend
+    std::set<uint256> setInventoryTxToSend;
+    // When the next trickle of transactions is due (in microseconds)
+    int64_t nNextInvSend;
+    CTxReconState txrecon;
+    //! New blocks to announce, as headers or inv as SendMessages sees fit
+    std::vector<uint256> vBlockHashesToAnnounce;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -341,6 +430,14 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Outbound limit, guarded by cs_totalBytesSent
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+
+    void AccountForSentMessage(const CSerializeData& msg);
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -357,23 +454,24 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    unsigned int GetTotalRecvSize()
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+
+    /** Take the oldest complete message into msgs, returning false if there is none */
+    bool PopProcessMsg(std::list<CNetMessage>& msgs);
+    bool HasProcessMsg()
     {
-        unsigned int total = 0;
-        BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
-            total += msg.vRecv.size() + 24;
-        return total;
+        LOCK(cs_vProcessMsg);
+        return !vProcessMsg.empty();
     }
 
-    // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
-
-    // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
+        LOCK2(cs_vRecvMsg, cs_vProcessMsg);
         nRecvVersion = nVersionIn;
         BOOST_FOREACH(CNetMessage &msg, vRecvMsg)
             msg.SetVersion(nVersionIn);
+        BOOST_FOREACH(CNetMessage &msg, vProcessMsg)
+            msg.SetVersion(nVersionIn);
     }
 
     CNode* AddRef()
@@ -391,11 +489,13 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -409,23 +509,36 @@ public:
     }
 
 
-    void AddInventoryKnown(const CInv& inv)
+    /** Returns false if the peer was known to have inv already */
+    bool AddInventoryKnown(const CInv& inv)
     {
-        {
-            LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
-        }
+        LOCK(cs_inventory);
+        return setInventoryKnown.insert(inv).second;
     }
 
     void PushInventory(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (setInventoryKnown.count(inv))
+                return;
+            // Transactions are reconciled with peers that take part in it,
+            // and trickled to the others
+            if (inv.type == MSG_TX) {
+                if (!txrecon.Add(inv.hash))
+                    setInventoryTxToSend.insert(inv.hash);
+            } else {
                 vInventoryToSend.push_back(inv);
+            }
         }
     }
 
+    void PushBlockHash(const uint256& hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -439,6 +552,10 @@ public:
 
     void PushVersion();
 
+    //! Queue a message made with MakeSharedMessage, without copying it.
+    //! Bulk messages, i.e. historical blocks, let any other message overtake them.
+    void PushSharedMessage(const CSharedNetMsg& msg, bool fBulk = false);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -634,6 +751,23 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Set the upload target, in bytes per timeframe; 0 is no limit
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    static void SetMaxOutboundTimeframe(uint64_t timeframe);
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! Whether the upload target is reached; with historicalBlockServingLimit,
+    //! whether what is left of it is needed to relay new blocks
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //! Bytes left in the current cycle; 0 with no limit
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! Seconds left in the current cycle; 0 with no limit
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 
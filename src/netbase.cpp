@@ -25,6 +25,7 @@
 #include <arpa/inet.h>
 #endif
 #include <fcntl.h>
+#include <poll.h>
 #endif
 
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
@@ -235,6 +236,30 @@ struct timeval MillisToTimeval(int64_t nTimeout)
     return timeout;
 }
 
+/**
+ * Wait up to nTimeout milliseconds for hSocket to become readable, or
+ * writable if fWrite. Returns like select(): 1 if ready, 0 on timeout, or
+ * SOCKET_ERROR. Uses poll() where available, which unlike select() takes
+ * descriptors from FD_SETSIZE up.
+ */
+static int WaitForSocket(SOCKET hSocket, bool fWrite, int64_t nTimeout)
+{
+#ifdef WIN32
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    return select(hSocket + 1, fWrite ? NULL : &fdset, fWrite ? &fdset : NULL, NULL, &timeout);
+#else
+    struct pollfd pfd;
+    pfd.fd = hSocket;
+    pfd.events = fWrite ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    int nRet = poll(&pfd, 1, nTimeout);
+    return nRet > 0 ? 1 : nRet;
+#endif
+}
+
 /**
  * Read bytes from socket. This will either read the full number of bytes requested
  * or return False on error or timeout.
@@ -263,14 +288,7 @@ bool static InterruptibleRecv(char* data, size_t len, int timeout, SOCKET& hSock
         } else { // Other error or blocking
             int nErr = WSAGetLastError();
             if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL) {
-                if (!IsSelectableSocket(hSocket)) {
-                    return false;
-                }
-                struct timeval tval = MillisToTimeval(std::min(endTime - curTime, maxWait));
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                FD_SET(hSocket, &fdset);
-                int nRet = select(hSocket + 1, &fdset, NULL, NULL, &tval);
+                int nRet = WaitForSocket(hSocket, false, std::min(endTime - curTime, maxWait));
                 if (nRet == SOCKET_ERROR) {
                     return false;
                 }
@@ -464,11 +482,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
         {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+            int nRet = WaitForSocket(hSocket, true, nTimeout);
             if (nRet == 0)
             {
                 LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
@@ -0,0 +1,192 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netreplay.h"
+
+#include "chainparams.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "protocol.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <algorithm>
+#include <limits>
+
+CNetReplay::CNetReplay() : nTotalTime(0)
+{
+    // The node writes what it sends straight to its socket when it can, so
+    // give it one end of a socket pair and drain the other, rather than
+    // have it disconnect on a failed write
+    SOCKET hSocket = INVALID_SOCKET;
+    hRemote = INVALID_SOCKET;
+#ifndef WIN32
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        hSocket = fds[0];
+        hRemote = fds[1];
+    }
+#endif
+    pnode = new CNode(hSocket, CAddress(CService("127.0.0.1", 0)), "", true);
+}
+
+CNetReplay::~CNetReplay()
+{
+    // Transactions waiting in the admission queue hold a reference to the
+    // node until they are committed, which takes cs_main
+    while (pnode->GetRefCount() > 0)
+        MilliSleep(10);
+    delete pnode;
+    CloseSocket(hRemote);
+}
+
+void CNetReplay::DiscardSent()
+{
+    LOCK(pnode->cs_vSend);
+    pnode->vSendMsg.clear();
+    pnode->nSendSize = 0;
+    pnode->nSendOffset = 0;
+    if (hRemote != INVALID_SOCKET) {
+        char buf[0x10000];
+        while (recv(hRemote, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+    }
+}
+
+bool CNetReplay::Replay(const std::vector<unsigned char>& vStream, size_t nChunkSize)
+{
+    assert(nChunkSize > 0);
+    int64_t nReplayStart = GetTimeMicros();
+    size_t nPos = 0;
+    while (nPos < vStream.size() && !pnode->fDisconnect) {
+        // Frame the message by the size in its header, as the node will. A
+        // header that doesn't fit is handed over as it is.
+        size_t nLen = vStream.size() - nPos;
+        std::string strCommand;
+        if (nLen >= CMessageHeader::HEADER_SIZE) {
+            CDataStream ss((const char*)&vStream[nPos], (const char*)&vStream[nPos + CMessageHeader::HEADER_SIZE], SER_NETWORK, INIT_PROTO_VERSION);
+            CMessageHeader hdr(Params().MessageStart());
+            ss >> hdr;
+            strCommand = hdr.GetCommand();
+            nLen = std::min<size_t>(nLen, CMessageHeader::HEADER_SIZE + (size_t)hdr.nMessageSize);
+        }
+
+        // A stream that starts after the handshake
+        if (pnode->nVersion == 0 && strCommand != "version") {
+            pnode->nVersion = PROTOCOL_VERSION;
+            pnode->SetRecvVersion(PROTOCOL_VERSION);
+            {
+                LOCK(pnode->cs_vSend);
+                pnode->ssSend.SetVersion(PROTOCOL_VERSION);
+            }
+            pnode->fSuccessfullyConnected = true;
+        }
+
+        if (!pnode->mapRecvMsgCmdTotals.count(strCommand))
+            strCommand = NET_MESSAGE_COMMAND_OTHER;
+        CNetReplayCmdStats& stats = mapStats[strCommand];
+        stats.nMsgs++;
+        stats.nBytes += nLen;
+
+        int64_t nStart = GetTimeMicros();
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            for (size_t i = 0; i < nLen; i += nChunkSize) {
+                if (!pnode->ReceiveMsgBytes((const char*)&vStream[nPos + i], std::min(nChunkSize, nLen - i))) {
+                    pnode->fDisconnect = true;
+                    break;
+                }
+            }
+        }
+        int64_t nParsed = GetTimeMicros();
+        stats.nParseTime += nParsed - nStart;
+        nPos += nLen;
+
+        while (!pnode->fDisconnect && (pnode->HasProcessMsg() || !pnode->vRecvGetData.empty())) {
+            if (!ProcessMessages(pnode))
+                pnode->fDisconnect = true;
+            DiscardSent();
+        }
+        int64_t nProcessTime = GetTimeMicros() - nParsed;
+        stats.nProcessTime += nProcessTime;
+        stats.nMaxProcessTime = std::max(stats.nMaxProcessTime, nProcessTime);
+    }
+    nTotalTime += GetTimeMicros() - nReplayStart;
+    return !pnode->fDisconnect;
+}
+
+void AppendNetMessage(std::vector<unsigned char>& vStream, const std::string& strCommand, const std::vector<unsigned char>& vPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), strCommand.c_str(), vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    hdr.nChecksum = ReadLE32(hash.begin());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    vStream.insert(vStream.end(), ss.begin(), ss.end());
+    vStream.insert(vStream.end(), vPayload.begin(), vPayload.end());
+}
+
+template <typename T>
+static void AppendNetMessage(std::vector<unsigned char>& vStream, const std::string& strCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    AppendNetMessage(vStream, strCommand, std::vector<unsigned char>(ss.begin(), ss.end()));
+}
+
+std::vector<unsigned char> MakeSyntheticNetStream(int nRounds)
+{
+    LOCK(cs_main);
+    std::vector<unsigned char> vStream;
+
+    CDataStream ssVersion(SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+    ssVersion << PROTOCOL_VERSION << (uint64_t)NODE_NETWORK << GetTime() << CAddress(CService("127.0.0.1", 0))
+              << CAddress(CService("127.0.0.1", Params().GetDefaultPort())) << nNonce << std::string("/netreplay/")
+              << chainActive.Height() << true;
+    AppendNetMessage(vStream, "version", std::vector<unsigned char>(ssVersion.begin(), ssVersion.end()));
+    AppendNetMessage(vStream, "verack", std::vector<unsigned char>());
+
+    const Consensus::Params& consensus = Params().GetConsensus();
+    CBlock blockTip;
+    bool fHaveBlock = chainActive.Tip() && ReadBlockFromDisk(blockTip, chainActive.Tip());
+    for (int i = 0; i < nRounds; i++) {
+        std::vector<CInv> vInv;
+        for (int j = 0; j < 16; j++)
+            vInv.push_back(CInv(MSG_TX, GetRandHash()));
+        AppendNetMessage(vStream, "inv", vInv);
+
+        // Spends a coin nobody has, so it ends up an orphan
+        CMutableTransaction mtx = CreateNewContextualCMutableTransaction(consensus, chainActive.Height() + 1);
+        mtx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0), CScript() << OP_TRUE));
+        uint160 keyid;
+        GetRandBytes(keyid.begin(), keyid.size());
+        mtx.vout.push_back(CTxOut(COIN, GetScriptForDestination(CKeyID(keyid))));
+        AppendNetMessage(vStream, "tx", CTransaction(mtx));
+
+        // The last headers of the active chain, as they would be announced
+        std::vector<CBlock> vHeaders;
+        for (CBlockIndex* pindex = chainActive.Tip(); pindex && vHeaders.size() < 160; pindex = pindex->pprev)
+            vHeaders.push_back(pindex->GetBlockHeader());
+        std::reverse(vHeaders.begin(), vHeaders.end());
+        AppendNetMessage(vStream, "headers", vHeaders);
+
+        if (fHaveBlock)
+            AppendNetMessage(vStream, "block", blockTip);
+
+        std::vector<CInv> vGetData;
+        if (chainActive.Tip())
+            vGetData.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+        vGetData.push_back(CInv(MSG_TX, GetRandHash()));
+        AppendNetMessage(vStream, "getdata", vGetData);
+
+        AppendNetMessage(vStream, "ping", GetRand(std::numeric_limits<uint64_t>::max()));
+    }
+    return vStream;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NETREPLAY_H
+#define BITCOIN_NETREPLAY_H
+
+#include "compat.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class CNode;
+
+/** Size of the pieces a stream is handed to the node in by default, as a socket read would */
+static const size_t DEFAULT_NETREPLAY_CHUNK_SIZE = 64 * 1024;
+
+/** What replaying the messages of one command took */
+struct CNetReplayCmdStats
+{
+    uint64_t nMsgs;
+    uint64_t nBytes;
+    /** Time taken to hand the bytes to the node, which frames them into messages (in microseconds) */
+    int64_t nParseTime;
+    /** Time taken to process the messages, getdata replies included (in microseconds) */
+    int64_t nProcessTime;
+    /** Longest time a single message took to process (in microseconds) */
+    int64_t nMaxProcessTime;
+
+    CNetReplayCmdStats() : nMsgs(0), nBytes(0), nParseTime(0), nProcessTime(0), nMaxProcessTime(0) {}
+};
+
+typedef std::map<std::string, CNetReplayCmdStats> mapNetReplayStats;
+
+/**
+ * Feeds a stream of bytes as a peer would send them to an inbound node that
+ * isn't connected to anything, and runs the message handler on each message
+ * in turn, timing both. What the node sends back is thrown away, and the
+ * node is left out of vNodes, so SendMessages never runs for it.
+ *
+ * The stream may be recorded from a real peer, or made up with
+ * MakeSyntheticNetStream. A stream that doesn't start with a version
+ * message is replayed as if the handshake had been done already.
+ *
+ * Transactions and blocks in the stream are processed like any peer's, so
+ * end up in the mempool and chain, and may be relayed on: only replay into
+ * a node on a test network. Misbehaviour is scored as for any peer, but
+ * the node isn't banned for it, as that is up to SendMessages.
+ *
+ * Must be used, and destroyed, without holding cs_main, which processing
+ * the messages takes as it needs to, as do the transaction verification
+ * threads before the node can be deleted.
+ */
+class CNetReplay
+{
+private:
+    CNode* pnode;
+    /** The other end of the node's socket */
+    SOCKET hRemote;
+    mapNetReplayStats mapStats;
+    int64_t nTotalTime;
+
+    void DiscardSent();
+
+public:
+    CNetReplay();
+    ~CNetReplay();
+
+    /**
+     * Replay the messages of vStream, handing each to the node in pieces of
+     * at most nChunkSize bytes. Returns false if the node would have been
+     * disconnected; a truncated last message is not an error.
+     */
+    bool Replay(const std::vector<unsigned char>& vStream, size_t nChunkSize = DEFAULT_NETREPLAY_CHUNK_SIZE);
+
+    const mapNetReplayStats& GetStats() const { return mapStats; }
+    /** Total time the replays took (in microseconds) */
+    int64_t GetTotalTime() const { return nTotalTime; }
+    const CNode* GetNode() const { return pnode; }
+};
+
+/** Append a message as it goes over the wire, header and all, to vStream */
+void AppendNetMessage(std::vector<unsigned char>& vStream, const std::string& strCommand, const std::vector<unsigned char>& vPayload);
+
+/**
+ * Make up a stream of what a busy peer sends: a handshake, then nRounds of
+ * inv, tx, headers, block, getdata and ping, about the active chain and
+ * made-up transactions. Takes cs_main.
+ */
+std::vector<unsigned char> MakeSyntheticNetStream(int nRounds);
+
+#endif // BITCOIN_NETREPLAY_H
@@ -0,0 +1,237 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "orphanpool.h"
+
+#include "random.h"
+#include "util.h"
+#include "version.h"
+
+#include <boost/foreach.hpp>
+
+COrphanPool::COrphanPool() : nTotalSize(0), nNextSweep(0)
+{
+}
+
+bool COrphanPool::Add(const CTransaction& tx, NodeId peer, int64_t nNow)
+{
+    uint256 hash = tx.GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    size_t sz = GetSerializeSize(tx, SER_NETWORK, tx.nVersion);
+    if (sz > MAX_ORPHAN_TX_SIZE)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    // Make room within the peer's own budget
+    std::map<NodeId, PeerOrphans>::iterator itPeer;
+    while ((itPeer = mapPeers.find(peer)) != mapPeers.end() && itPeer->second.nSize + sz > MAX_ORPHAN_PEER_SIZE)
+        Erase(itPeer->second.lOrphans.front());
+
+    PeerOrphans& peerOrphans = mapPeers[peer];
+    Entry& entry = mapOrphans[hash];
+    entry.tx = tx;
+    entry.fromPeer = peer;
+    entry.nTimeExpire = nNow + ORPHAN_TX_EXPIRE_TIME;
+    entry.nSize = sz;
+    entry.nListPos = vOrphanList.size();
+    entry.itPeer = peerOrphans.lOrphans.insert(peerOrphans.lOrphans.end(), hash);
+    vOrphanList.push_back(hash);
+    peerOrphans.nSize += sz;
+    nTotalSize += sz;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapOrphansByPrev[txin.prevout.hash].insert(hash);
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
+             mapOrphans.size(), mapOrphansByPrev.size());
+    return true;
+}
+
+bool COrphanPool::Exists(const uint256& hash) const
+{
+    return mapOrphans.count(hash) != 0;
+}
+
+const COrphanPool::Entry* COrphanPool::Get(const uint256& hash) const
+{
+    OrphanMap::const_iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return NULL;
+    return &it->second;
+}
+
+std::vector<const CTransaction*> COrphanPool::GetTransactions() const
+{
+    std::vector<const CTransaction*> vtx;
+    vtx.reserve(mapOrphans.size());
+    for (OrphanMap::const_iterator it = mapOrphans.begin(); it != mapOrphans.end(); ++it)
+        vtx.push_back(&it->second.tx);
+    return vtx;
+}
+
+bool COrphanPool::Erase(const uint256& hashIn)
+{
+    OrphanMap::iterator it = mapOrphans.find(hashIn);
+    if (it == mapOrphans.end())
+        return false;
+    // hashIn may refer to a list entry that is about to go away
+    const uint256 hash = hashIn;
+    const Entry& entry = it->second;
+
+    BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
+    {
+        ByPrevMap::iterator itPrev = mapOrphansByPrev.find(txin.prevout.hash);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    // Move the last orphan into this one's slot
+    size_t nPos = entry.nListPos;
+    if (nPos + 1 != vOrphanList.size()) {
+        vOrphanList[nPos] = vOrphanList.back();
+        mapOrphans[vOrphanList[nPos]].nListPos = nPos;
+    }
+    vOrphanList.pop_back();
+
+    std::map<NodeId, PeerOrphans>::iterator itPeer = mapPeers.find(entry.fromPeer);
+    itPeer->second.nSize -= entry.nSize;
+    itPeer->second.lOrphans.erase(entry.itPeer);
+    if (itPeer->second.lOrphans.empty())
+        mapPeers.erase(itPeer);
+
+    nTotalSize -= entry.nSize;
+    mapOrphans.erase(it);
+    return true;
+}
+
+unsigned int COrphanPool::EraseForPeer(NodeId peer)
+{
+    std::map<NodeId, PeerOrphans>::iterator itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return 0;
+
+    // Erasing the last orphan also erases the peer's entry
+    std::vector<uint256> vErase(itPeer->second.lOrphans.begin(), itPeer->second.lOrphans.end());
+    BOOST_FOREACH(const uint256& hash, vErase)
+        Erase(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", vErase.size(), peer);
+    return vErase.size();
+}
+
+unsigned int COrphanPool::EraseForBlock(const std::vector<CTransaction>& vtx)
+{
+    std::vector<uint256> vErase;
+    BOOST_FOREACH(const CTransaction& tx, vtx) {
+        if (mapOrphans.count(tx.GetHash()))
+            vErase.push_back(tx.GetHash());
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            ByPrevMap::const_iterator itPrev = mapOrphansByPrev.find(txin.prevout.hash);
+            if (itPrev == mapOrphansByPrev.end())
+                continue;
+            BOOST_FOREACH(const uint256& hash, itPrev->second) {
+                const CTransaction& orphanTx = mapOrphans[hash].tx;
+                BOOST_FOREACH(const CTxIn& orphanIn, orphanTx.vin) {
+                    if (orphanIn.prevout == txin.prevout) {
+                        vErase.push_back(hash);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    unsigned int nErased = 0;
+    BOOST_FOREACH(const uint256& hash, vErase)
+        nErased += Erase(hash) ? 1 : 0;
+    if (nErased > 0)
+        LogPrint("mempool", "Erased %d orphan tx included or conflicted by block\n", nErased);
+    return nErased;
+}
+
+unsigned int COrphanPool::Expire(int64_t nNow)
+{
+    if (nNow < nNextSweep)
+        return 0;
+
+    std::vector<uint256> vErase;
+    int64_t nMinExpire = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+    for (OrphanMap::const_iterator it = mapOrphans.begin(); it != mapOrphans.end(); ++it) {
+        if (it->second.nTimeExpire <= nNow)
+            vErase.push_back(it->first);
+        else
+            nMinExpire = std::min(it->second.nTimeExpire, nMinExpire);
+    }
+    // Sweep again when the next orphan expires, but not too often
+    nNextSweep = nMinExpire + ORPHAN_TX_EXPIRE_INTERVAL;
+
+    BOOST_FOREACH(const uint256& hash, vErase)
+        Erase(hash);
+    if (!vErase.empty())
+        LogPrint("mempool", "Erased %d orphan tx due to expiration\n", vErase.size());
+    return vErase.size();
+}
+
+unsigned int COrphanPool::Limit(size_t nMaxOrphans, size_t nMaxBytes)
+{
+    unsigned int nEvicted = 0;
+    while (!vOrphanList.empty() && (mapOrphans.size() > nMaxOrphans || nTotalSize > nMaxBytes))
+    {
+        // Evict a random orphan:
+        Erase(vOrphanList[GetRand(vOrphanList.size())]);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+void COrphanPool::AddWork(const uint256& hashParent)
+{
+    ByPrevMap::const_iterator itPrev = mapOrphansByPrev.find(hashParent);
+    if (itPrev == mapOrphansByPrev.end())
+        return;
+    BOOST_FOREACH(const uint256& hash, itPrev->second) {
+        if (setWork.insert(hash).second)
+            vWork.push_back(hash);
+    }
+}
+
+bool COrphanPool::PopWork(uint256& hash)
+{
+    while (!vWork.empty()) {
+        hash = vWork.front();
+        vWork.pop_front();
+        setWork.erase(hash);
+        if (mapOrphans.count(hash))
+            return true;
+    }
+    return false;
+}
+
+void COrphanPool::clear()
+{
+    mapOrphans.clear();
+    mapOrphansByPrev.clear();
+    vOrphanList.clear();
+    mapPeers.clear();
+    nTotalSize = 0;
+    nNextSweep = 0;
+    vWork.clear();
+    setWork.clear();
+}
+
+size_t COrphanPool::GetPeerSize(NodeId peer) const
+{
+    std::map<NodeId, PeerOrphans>::const_iterator itPeer = mapPeers.find(peer);
+    return itPeer == mapPeers.end() ? 0 : itPeer->second.nSize;
+}
@@ -0,0 +1,113 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ORPHANPOOL_H
+#define BITCOIN_ORPHANPOOL_H
+
+#include "coins.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/** Largest orphan transaction kept, in bytes */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Total size of the orphans kept, in bytes */
+static const size_t MAX_ORPHAN_TOTAL_SIZE = 200000;
+/** Total size of the orphans kept from any one peer, in bytes */
+static const size_t MAX_ORPHAN_PEER_SIZE = 50000;
+/** Seconds an orphan is kept for */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between sweeps for expired orphans */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Number of orphans retried at a time before cs_main is released */
+static const unsigned int ORPHAN_WORK_BATCH = 100;
+
+/**
+ * Transactions whose inputs are missing, kept until their parents arrive.
+ *
+ * The pool is bounded by count, by total size, and by the size held for
+ * each peer: a peer that goes over its budget loses its own oldest orphans,
+ * so it cannot push out those of other peers. Orphans expire after
+ * ORPHAN_TX_EXPIRE_TIME. Eviction to the global bounds is random, from a
+ * vector so each eviction is O(1), and each peer's orphans are listed so that
+ * dropping a peer only touches its own.
+ *
+ * When a parent arrives, in a block or in the mempool, AddWork queues the
+ * orphans spending it; the caller drains the queue with PopWork in batches.
+ *
+ * Not thread-safe; main.cpp guards its pool with cs_main.
+ */
+class COrphanPool
+{
+public:
+    struct Entry {
+        CTransaction tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        size_t nSize;
+        size_t nListPos; //! position in vOrphanList
+        std::list<uint256>::iterator itPeer; //! position in the peer's list
+    };
+
+    COrphanPool();
+
+    /** Add tx from peer, first evicting that peer's oldest orphans if it would go over its budget */
+    bool Add(const CTransaction& tx, NodeId peer, int64_t nNow);
+    bool Exists(const uint256& hash) const;
+    /** Look up an orphan; the pointer is valid until the pool is next modified */
+    const Entry* Get(const uint256& hash) const;
+    bool Erase(const uint256& hash);
+    /** All orphans, for compact block reconstruction; valid until the pool is next modified */
+    std::vector<const CTransaction*> GetTransactions() const;
+
+    /** Drop the orphans received from peer */
+    unsigned int EraseForPeer(NodeId peer);
+    /** Drop the orphans that vtx includes or conflicts with */
+    unsigned int EraseForBlock(const std::vector<CTransaction>& vtx);
+    /** Drop expired orphans; only sweeps every ORPHAN_TX_EXPIRE_INTERVAL */
+    unsigned int Expire(int64_t nNow);
+    /** Evict random orphans until there are at most nMaxOrphans of at most nMaxBytes in total */
+    unsigned int Limit(size_t nMaxOrphans, size_t nMaxBytes = MAX_ORPHAN_TOTAL_SIZE);
+
+    /** Queue the orphans spending outputs of hashParent for another attempt */
+    void AddWork(const uint256& hashParent);
+    bool PopWork(uint256& hash);
+    bool HasWork() const { return !setWork.empty(); }
+
+    void clear();
+    size_t size() const { return mapOrphans.size(); }
+    size_t GetTotalSize() const { return nTotalSize; }
+    size_t GetPeerSize(NodeId peer) const;
+
+private:
+    typedef boost::unordered_map<uint256, Entry, CCoinsKeyHasher> OrphanMap;
+    typedef boost::unordered_map<uint256, std::set<uint256>, CCoinsKeyHasher> ByPrevMap;
+
+    struct PeerOrphans {
+        std::list<uint256> lOrphans; //! oldest first
+        size_t nSize;
+        PeerOrphans() : nSize(0) {}
+    };
+
+    OrphanMap mapOrphans;
+    ByPrevMap mapOrphansByPrev;
+    std::vector<uint256> vOrphanList;
+    std::map<NodeId, PeerOrphans> mapPeers;
+    size_t nTotalSize;
+    int64_t nNextSweep;
+
+    //! Orphans to retry, in the order their parents arrived
+    std::deque<uint256> vWork;
+    std::set<uint256> setWork;
+};
+
+#endif // BITCOIN_ORPHANPOOL_H
@@ -11,53 +11,63 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <algorithm>
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
                                 unsigned int maxConfirms, double _decay, std::string _dataTypeString)
 {
     decay = _decay;
+    decayScale = 1;
     dataTypeString = _dataTypeString;
 
     buckets.insert(buckets.end(), defaultBuckets.begin(), defaultBuckets.end());
     buckets.push_back(std::numeric_limits<double>::infinity());
 
-    for (unsigned int i = 0; i < buckets.size(); i++) {
-        bucketMap[buckets[i]] = i;
-    }
-
     confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
     unconfTxs.resize(maxConfirms);
     for (unsigned int i = 0; i < maxConfirms; i++) {
         confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
         unconfTxs[i].resize(buckets.size());
     }
 
     oldUnconfTxs.resize(buckets.size());
-    curBlockTxCt.resize(buckets.size());
+    unconfTotal.resize(buckets.size());
     txCtAvg.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
     avg.resize(buckets.size());
 }
 
-// Zero out the data for the current block
-void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
+void TxConfirmStats::NewBlock(unsigned int nBlockHeight)
 {
+    // Transactions that entered the mempool MAX_CONFIRMS blocks ago move
+    // to the old counts, freeing their row for this block
+    std::vector<int>& row = unconfTxs[nBlockHeight % unconfTxs.size()];
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+        oldUnconfTxs[j] += row[j];
+        unconfTotal[j] -= row[j];
+        row[j] = 0;
     }
+
+    decayScale *= decay;
+    if (decayScale < MIN_DECAY_SCALE)
+        Renormalize();
+}
+
+void TxConfirmStats::Renormalize()
+{
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        for (unsigned int i = 0; i < confAvg.size(); i++)
+            confAvg[i][j] *= decayScale;
+        avg[j] *= decayScale;
+        txCtAvg[j] *= decayScale;
+    }
+    decayScale = 1;
 }
 
 unsigned int TxConfirmStats::FindBucketIndex(double val)
 {
-    auto it = bucketMap.lower_bound(val);
-    assert(it != bucketMap.end());
-    return it->second;
+    std::vector<double>::const_iterator it = std::lower_bound(buckets.begin(), buckets.end(), val);
+    assert(it != buckets.end());
+    return it - buckets.begin();
 }
 
 void TxConfirmStats::Record(int blocksToConfirm, double val)
@@ -66,21 +76,12 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     if (blocksToConfirm < 1)
         return;
     unsigned int bucketindex = FindBucketIndex(val);
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
-    curBlockTxCt[bucketindex]++;
-    curBlockVal[bucketindex] += val;
-}
-
-void TxConfirmStats::UpdateMovingAverages()
-{
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
-        avg[j] = avg[j] * decay + curBlockVal[j];
-        txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+    double weight = 1 / decayScale;
+    for (size_t i = blocksToConfirm; i <= confAvg.size(); i++) {
+        confAvg[i - 1][bucketindex] += weight;
     }
+    txCtAvg[bucketindex] += weight;
+    avg[bucketindex] += val * weight;
 }
 
 // returns -1 on error conditions
@@ -118,11 +119,13 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     // Start counting from highest(default) or lowest fee/pri transactions
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
-        totalNum += txCtAvg[bucket];
-        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
-        extraNum += oldUnconfTxs[bucket];
+        nConf += confAvg[confTarget - 1][bucket] * decayScale;
+        totalNum += txCtAvg[bucket] * decayScale;
+        // Count the txs that entered the mempool confTarget or more blocks
+        // ago: all of the bucket's but those of the last confTarget blocks
+        extraNum += unconfTotal[bucket] + oldUnconfTxs[bucket];
+        for (unsigned int confct = 0; confct < (unsigned int)confTarget; confct++)
+            extraNum -= unconfTxs[(nBlockHeight + bins - confct) % bins][bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
         // (Only count the confirmed data points, so that each confirmation count
@@ -184,6 +187,8 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
 void TxConfirmStats::Write(CAutoFile& fileout)
 {
+    // The file holds the true averages
+    Renormalize();
     fileout << decay;
     fileout << buckets;
     fileout << avg;
@@ -226,29 +231,24 @@ void TxConfirmStats::Read(CAutoFile& filein)
     // Now that we've processed the entire fee estimate data file and not
     // thrown any errors, we can copy it to our data structures
     decay = fileDecay;
+    decayScale = 1;
     buckets = fileBuckets;
     avg = fileAvg;
     confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
 
-    // Resize the current block variables which aren't stored in the data file
+    // Resize the mempool counts, which aren't stored in the data file,
     // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-
     unconfTxs.resize(maxConfirms);
     for (unsigned int i = 0; i < maxConfirms; i++) {
         unconfTxs[i].resize(buckets.size());
     }
     oldUnconfTxs.resize(buckets.size());
-
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+    unconfTotal.assign(buckets.size(), 0);
+    for (unsigned int i = 0; i < maxConfirms; i++) {
+        for (unsigned int j = 0; j < buckets.size(); j++)
+            unconfTotal[j] += unconfTxs[i][j];
+    }
 
     LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
              numBuckets, dataTypeString, maxConfirms);
@@ -259,6 +259,7 @@ unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
     unsigned int bucketindex = FindBucketIndex(val);
     unsigned int blockIndex = nBlockHeight % unconfTxs.size();
     unconfTxs[blockIndex][bucketindex]++;
+    unconfTotal[bucketindex]++;
     LogPrint("estimatefee", "adding to %s", dataTypeString);
     return bucketindex;
 }
@@ -283,9 +284,10 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
     }
     else {
         unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
+        if (unconfTxs[blockIndex][bucketindex] > 0) {
             unconfTxs[blockIndex][bucketindex]--;
-        else
+            unconfTotal[bucketindex]--;
+        } else
             LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
     }
@@ -303,13 +305,15 @@ void CBlockPolicyEstimator::removeTx(uint256 hash)
     unsigned int entryHeight = pos->second.blockHeight;
     unsigned int bucketIndex = pos->second.bucketIndex;
 
-    if (stats != NULL)
+    if (stats != NULL) {
         stats->removeTx(entryHeight, nBestSeenHeight, bucketIndex);
+        nStatsVersion++;
+    }
     mapMemPoolTxs.erase(hash);
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0)
+    : nBestSeenHeight(0), nStatsVersion(1)
 {
     minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
     std::vector<double> vfeelist;
@@ -391,11 +395,13 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
         mapMemPoolTxs[hash].stats = &priStats;
         mapMemPoolTxs[hash].bucketIndex =  priStats.NewTx(txHeight, curPri);
+        nStatsVersion++;
     }
     // Record this as a fee estimate
     else if (isFeeDataPoint(feeRate, curPri)) {
         mapMemPoolTxs[hash].stats = &feeStats;
         mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+        nStatsVersion++;
     }
     else {
         LogPrint("estimatefee", "not adding");
@@ -452,6 +458,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
         return;
     }
     nBestSeenHeight = nBlockHeight;
+    nStatsVersion++;
 
     // Only want to be updating estimates when our blockchain is synced,
     // otherwise we'll miscalculate how many blocks its taking to get included.
@@ -482,29 +489,38 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     else
         feeUnlikely = CFeeRate(feeUnlikelyEst);
 
-    // Clear the current block states
-    feeStats.ClearCurrent(nBlockHeight);
-    priStats.ClearCurrent(nBlockHeight);
+    // Decay the moving averages for the new block
+    feeStats.NewBlock(nBlockHeight);
+    priStats.NewBlock(nBlockHeight);
 
-    // Repopulate the current block states
+    // and add this block's transactions to them
     for (unsigned int i = 0; i < entries.size(); i++)
         processBlockTx(nBlockHeight, entries[i]);
 
-    // Update all exponential averages with the current block states
-    feeStats.UpdateMovingAverages();
-    priStats.UpdateMovingAverages();
-
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
              entries.size(), mapMemPoolTxs.size());
 }
 
+double CBlockPolicyEstimator::CachedEstimate(std::vector<std::pair<uint64_t, double> >& cache, TxConfirmStats& stats,
+                                             int confTarget, double sufficientTxVal)
+{
+    if (cache.size() < stats.GetMaxConfirms())
+        cache.resize(stats.GetMaxConfirms());
+    std::pair<uint64_t, double>& cached = cache[confTarget - 1];
+    if (cached.first != nStatsVersion) {
+        cached.second = stats.EstimateMedianVal(confTarget, sufficientTxVal, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+        cached.first = nStatsVersion;
+    }
+    return cached.second;
+}
+
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
     // Return failure if trying to analyze a target we're not tracking
     if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median = CachedEstimate(feeCache, feeStats, confTarget, SUFFICIENT_FEETXS);
 
     if (median < 0)
         return CFeeRate(0);
@@ -518,7 +534,7 @@ double CBlockPolicyEstimator::estimatePriority(int confTarget)
     if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
         return -1;
 
-    return priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    return CachedEstimate(priCache, priStats, confTarget, SUFFICIENT_PRITXS);
 }
 
 void CBlockPolicyEstimator::Write(CAutoFile& fileout)
@@ -535,4 +551,5 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein)
     feeStats.Read(filein);
     priStats.Read(filein);
     nBestSeenHeight = nFileBestSeenHeight;
+    nStatsVersion++;
 }
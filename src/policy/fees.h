@@ -10,6 +10,7 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 class CAutoFile;
@@ -64,11 +65,18 @@ class CTxMemPoolEntry;
  * the number of transactions we've seen in that fee bucket when calculating
  * an estimate for any number of confirmations below the number of blocks
  * they've been outstanding.
+ *
+ * The moving averages are decayed lazily, through a common scale factor,
+ * so a block costs O(transactions in the block) to process rather than
+ * touching every counter of every bucket.
  */
 
 /** Decay of .998 is a half-life of 346 blocks or about 2.4 days */
 static const double DEFAULT_DECAY = .998;
 
+/** Fold the decay into the moving averages once it has scaled them by this much (~10000 blocks) */
+static const double MIN_DECAY_SCALE = 1e-9;
+
 /**
  * We will instantiate two instances of this class, one to track transactions
  * that were included in a block due to fee, and one for txs included due to
@@ -84,27 +92,26 @@ class TxConfirmStats
 {
 private:
     //Define the buckets we will group transactions into (both fee buckets and priority buckets)
-    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive), ascending
+
+    // The moving averages below are all kept scaled by 1 / decayScale, so
+    // that decaying them for a new block only has to update decayScale and
+    // recording a transaction adds 1 / decayScale to its bucket. The true
+    // average is the stored value times decayScale. Renormalize folds the
+    // scale back into the averages before it gets small enough to lose
+    // precision.
+    double decayScale;
 
     // For each bucket X:
-    // Count the total # of txs in each bucket
-    // Track the historical moving average of this total over blocks
+    // Track the historical moving average of the total # of txs in each bucket
     std::vector<double> txCtAvg;
-    // and calcuate the total for the current block to update the moving average
-    std::vector<int> curBlockTxCt;
 
-    // Count the total # of txs confirmed within Y blocks in each bucket
-    // Track the historical moving average of theses totals over blocks
+    // Track the historical moving averages of the total # of txs confirmed
+    // within Y blocks in each bucket
     std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calcuate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
 
-    // Sum the total priority/fee of all txs in each bucket
-    // Track the historical moving average of this total over blocks
+    // Track the historical moving average of the total priority/fee of all txs in each bucket
     std::vector<double> avg;
-    // and calculate the total for the current block to update the moving average
-    std::vector<double> curBlockVal;
 
     // Combine the conf counts with tx counts to calculate the confirmation % for each Y,X
     // Combine the total value with the tx counts to calculate the avg fee/priority per bucket
@@ -116,9 +123,14 @@ private:
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
     std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    // and their total over all Y, for each bucket
+    std::vector<int> unconfTotal;
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    /** Multiply the decay accumulated so far into the moving averages */
+    void Renormalize();
+
 public:
     /** Find the bucket index of a given value */
     unsigned int FindBucketIndex(double val);
@@ -135,11 +147,16 @@ public:
      */
     void Initialize(std::vector<double>& defaultBuckets, unsigned int maxConfirms, double decay, std::string dataTypeString);
 
-    /** Clear the state of the curBlock variables to start counting for the new block */
-    void ClearCurrent(unsigned int nBlockHeight);
+    /**
+     * Start counting for a new block: decay the historical moving averages
+     * and retire the mempool counts that have now been outstanding for
+     * longer than we track. Costs O(buckets), however many transactions
+     * the estimator has seen.
+     */
+    void NewBlock(unsigned int nBlockHeight);
 
     /**
-     * Record a new transaction data point in the current block stats
+     * Record a new transaction data point in the moving averages for the current block
      * @param blocksToConfirm the number of blocks it took this transaction to confirm
      * @param val either the fee or the priority when entered of the transaction
      * @warning blocksToConfirm is 1-based and has to be >= 1
@@ -153,10 +170,6 @@ public:
     void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight,
                   unsigned int bucketIndex);
 
-    /** Update our estimates by decaying our historical moving average and updating
-        with the data gathered from the current block */
-    void UpdateMovingAverages();
-
     /**
      * Calculate a fee or priority estimate.  Find the lowest value bucket (or range of buckets
      * to make sure we have enough data points) whose transactions still have sufficient likelihood
@@ -279,5 +292,17 @@ private:
     /** Breakpoints to help determine whether a transaction was confirmed by priority or Fee */
     CFeeRate feeLikely, feeUnlikely;
     double priLikely, priUnlikely;
+
+    /**
+     * Bumped whenever the stats change. The wallet asks for an estimate for
+     * every transaction it creates, often several times over while it
+     * selects coins, so estimates are cached per confirmation target until
+     * the next change.
+     */
+    uint64_t nStatsVersion;
+    std::vector<std::pair<uint64_t, double> > feeCache, priCache;
+
+    double CachedEstimate(std::vector<std::pair<uint64_t, double> >& cache, TxConfirmStats& stats,
+                          int confTarget, double sufficientTxVal);
 };
 #endif /*BITCOIN_POLICYESTIMATOR_H */
@@ -17,9 +17,50 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
-    "filtered block"
+    "filtered block",
+    "cmpct block"
 };
 
+static const char* ppszNetMessageTypes[] =
+{
+    "version",
+    "verack",
+    "addr",
+    "inv",
+    "getdata",
+    "merkleblock",
+    "getblocks",
+    "getheaders",
+    "tx",
+    "headers",
+    "block",
+    "getaddr",
+    "mempool",
+    "ping",
+    "pong",
+    "alert",
+    "notfound",
+    "filterload",
+    "filteradd",
+    "filterclear",
+    "reject",
+    "sendheaders",
+    "sendcmpct",
+    "cmpctblock",
+    "getblocktxn",
+    "blocktxn",
+    "sendtxrcncl",
+    "reqrecon",
+    "sketch",
+    "reconcildiff",
+};
+static const std::vector<std::string> vNetMessageTypes(ppszNetMessageTypes, ppszNetMessageTypes + ARRAYLEN(ppszNetMessageTypes));
+
+const std::vector<std::string>& GetAllNetMessageTypes()
+{
+    return vNetMessageTypes;
+}
+
 CMessageHeader::CMessageHeader(const MessageStartChars& pchMessageStartIn)
 {
     memcpy(pchMessageStart, pchMessageStartIn, MESSAGE_START_SIZE);
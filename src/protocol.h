@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -65,6 +66,12 @@ public:
     unsigned int nChecksum;
 };
 
+/** Counted in place of any message type not in GetAllNetMessageTypes() */
+#define NET_MESSAGE_COMMAND_OTHER "*other*"
+
+/** All the message types of the protocol, for per-type traffic accounting */
+const std::vector<std::string>& GetAllNetMessageTypes();
+
 /** nServices flags */
 enum {
     // NODE_NETWORK means that the node is capable of serving the block chain. It is currently
@@ -154,6 +161,8 @@ enum {
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Like MSG_FILTERED_BLOCK, only valid in a getdata, asking for a cmpctblock
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // BITCOIN_PROTOCOL_H
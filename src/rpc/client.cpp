@@ -105,6 +105,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "zcrawjoinsplit", 4 },
     { "zcbenchmark", 1 },
     { "zcbenchmark", 2 },
+    { "zcbenchmark", 3 },
     { "getblocksubsidy", 0},
     { "z_listaddresses", 0},
     { "z_listreceivedbyaddress", 1},
@@ -123,6 +124,10 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "z_sendmany", 1},
     { "z_sendmany", 2},
     { "z_sendmany", 3},
+    { "z_sendmanybulk", 1},
+    { "z_sendmanybulk", 2},
+    { "z_sendmanybulk", 3},
+    { "z_sendmanybulk", 4},
     { "z_shieldcoinbase", 2},
     { "z_shieldcoinbase", 3},
     { "z_getoperationstatus", 0},
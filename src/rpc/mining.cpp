@@ -458,7 +458,9 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             "  \"sizelimit\" : n,                  (numeric) limit of block size\n"
             "  \"curtime\" : ttt,                  (numeric) current timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"bits\" : \"xxx\",                 (string) compressed target of next block\n"
-            "  \"height\" : n                      (numeric) The height of the next block\n"
+            "  \"height\" : n,                     (numeric) The height of the next block\n"
+            "  \"longpollid\" : \"xxx\",           (string) id to wait on for the next template with a longpoll request\n"
+            "  \"workid\" : \"xxx\"                (string) id of this template, the same for every caller until the tip or the mempool changes\n"
             "}\n"
 
             "\nExamples:\n"
@@ -537,147 +539,135 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "zPrime is downloading blocks...");
 
-    static unsigned int nTransactionsUpdatedLast;
-
-    if (!lpval.isNull())
-    {
-        // Wait to respond until either the best block changes, OR a minute has passed and there are more transactions
-        uint256 hashWatchedChain;
-        boost::system_time checktxtime;
-        unsigned int nTransactionsUpdatedLastLP;
-
-        if (lpval.isStr())
+    // The template is built once per tip or mempool change and shared by
+    // every caller. Release the wallet and main lock while waiting for it.
+    uint64_t nWorkId = 0;
+    std::shared_ptr<const CBlockTemplate> pblocktemplate;
+    LEAVE_CRITICAL_SECTION(cs_main);
+    try {
+        if (!lpval.isNull())
         {
-            // Format: <hashBestChain><nTransactionsUpdatedLast>
-            std::string lpstr = lpval.get_str();
+            // Wait to respond until either the best block or the template changes
+            uint256 hashWatchedChain;
+            uint64_t nWorkIdLP;
 
-            hashWatchedChain.SetHex(lpstr.substr(0, 64));
-            nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
-        }
-        else
-        {
-            // NOTE: Spec does not specify behaviour for non-string longpollid, but this makes testing easier
-            hashWatchedChain = chainActive.Tip()->GetBlockHash();
-            nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
-        }
-
-        // Release the wallet and main lock while waiting
-        LEAVE_CRITICAL_SECTION(cs_main);
-        {
-            checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+            if (lpval.isStr())
+            {
+                // Format: <hashBestChain><nWorkId>
+                std::string lpstr = lpval.get_str();
 
-            boost::unique_lock<boost::mutex> lock(csBestBlock);
-            while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
+                hashWatchedChain.SetHex(lpstr.substr(0, 64));
+                nWorkIdLP = atoi64(lpstr.substr(64));
+            }
+            else
             {
-                if (!cvBlockChange.timed_wait(lock, checktxtime))
+                // NOTE: Spec does not specify behaviour for non-string longpollid, but this makes testing easier
                 {
-                    // Timeout: Check transactions for update
-                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
-                        break;
-                    checktxtime += boost::posix_time::seconds(10);
+                    LOCK(cs_main);
+                    hashWatchedChain = chainActive.Tip()->GetBlockHash();
                 }
+                GetSharedBlockTemplate(nWorkIdLP);
             }
-        }
-        ENTER_CRITICAL_SECTION(cs_main);
-
-        if (!IsRPCRunning())
-            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
-        // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
-    }
-
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlockWithKey, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
 
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
+            // With -blocktemplateservice, new templates are built as soon as
+            // the tip changes, so this mostly wakes up on one. Checking the
+            // tip covers a failed build, and templates built only on request.
+            unsigned int nTransactionsUpdatedLastLP = mempool.GetTransactionsUpdated();
+            int64_t nTimeLP = GetTime();
+            while (IsRPCRunning() && !WaitForSharedBlockTemplate(nWorkIdLP, 1000))
+            {
+                LOCK(cs_main);
+                if (chainActive.Tip()->GetBlockHash() != hashWatchedChain)
+                    break;
+                // Timeout: Check transactions for update
+                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP && GetTime() - nTimeLP >= 60)
+                    break;
+            }
         }
 
-        boost::shared_ptr<CReserveScript> coinbaseScript;
-        GetMainSignals().ScriptForMining(coinbaseScript);
-
-        // Throw an error if no script was provided
-        if (!coinbaseScript->reserveScript.size())
-            throw JSONRPCError(RPC_INTERNAL_ERROR, "No coinbase script available (mining requires a wallet or -mineraddress)");
-
-        pblocktemplate = CreateNewBlock(coinbaseScript->reserveScript);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        if (IsRPCRunning()) {
+            try {
+                pblocktemplate = GetSharedBlockTemplate(nWorkId);
+            } catch (const std::exception& e) {
+                throw JSONRPCError(RPC_INTERNAL_ERROR, strprintf("Couldn't create new block template: %s", e.what()));
+            }
+        }
+    } catch (...) {
+        ENTER_CRITICAL_SECTION(cs_main);
+        throw;
+    }
+    ENTER_CRITICAL_SECTION(cs_main);
 
-        // Mark script as important because it was used at least for one coinbase output
-        coinbaseScript->KeepScript();
+    if (!IsRPCRunning())
+        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "No coinbase script available (mining requires a wallet or -mineraddress)");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    const CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    // The tip may have moved since the template was built
+    CBlockIndex* pindexPrev = mapBlockIndex[pblock->hashPrevBlock];
 
-    // Update nTime
-    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-    pblock->nNonce = uint256();
+    // Update nTime, on a copy as the template is shared
+    CBlockHeader header = pblock->GetBlockHeader();
+    UpdateTime(&header, Params().GetConsensus(), pindexPrev);
 
     UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal");
 
-    UniValue txCoinbase = NullUniValue;
-    UniValue transactions(UniValue::VARR);
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
+    // Encode the transactions once per template
+    static uint64_t nWorkIdEncoded = 0;
+    static UniValue txCoinbase = NullUniValue;
+    static UniValue transactions(UniValue::VARR);
+    if (nWorkIdEncoded != nWorkId)
+    {
+        txCoinbase = NullUniValue;
+        transactions = UniValue(UniValue::VARR);
+        map<uint256, int64_t> setTxIndex;
+        int i = 0;
+        BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-        if (tx.IsCoinBase() && !coinbasetxn)
-            continue;
+            if (tx.IsCoinBase() && !coinbasetxn)
+                continue;
 
-        UniValue entry(UniValue::VOBJ);
+            UniValue entry(UniValue::VOBJ);
 
-        entry.push_back(Pair("data", EncodeHexTx(tx)));
+            entry.push_back(Pair("data", EncodeHexTx(tx)));
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            entry.push_back(Pair("hash", txHash.GetHex()));
 
-        UniValue deps(UniValue::VARR);
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
-        }
-        entry.push_back(Pair("depends", deps));
+            UniValue deps(UniValue::VARR);
+            BOOST_FOREACH (const CTxIn &in, tx.vin)
+            {
+                if (setTxIndex.count(in.prevout.hash))
+                    deps.push_back(setTxIndex[in.prevout.hash]);
+            }
+            entry.push_back(Pair("depends", deps));
 
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
+            int index_in_template = i - 1;
+            entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
+            entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
 
-        if (tx.IsCoinBase()) {
-            // Show founders' reward if it is required
-            if (pblock->vtx[0].vout.size() > 1) {
-                // Correct this if GetBlockTemplate changes the order
-                entry.push_back(Pair("foundersreward", (int64_t)tx.vout[1].nValue));
+            if (tx.IsCoinBase()) {
+                // Show founders' reward if it is required
+                if (pblock->vtx[0].vout.size() > 1) {
+                    // Correct this if GetBlockTemplate changes the order
+                    entry.push_back(Pair("foundersreward", (int64_t)tx.vout[1].nValue));
+                }
+                entry.push_back(Pair("required", true));
+                txCoinbase = entry;
+            } else {
+                transactions.push_back(entry);
             }
-            entry.push_back(Pair("required", true));
-            txCoinbase = entry;
-        } else {
-            transactions.push_back(entry);
         }
+        nWorkIdEncoded = nWorkId;
     }
 
     UniValue aux(UniValue::VOBJ);
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+    arith_uint256 hashTarget = arith_uint256().SetCompact(header.nBits);
 
     static UniValue aMutable(UniValue::VARR);
     if (aMutable.empty())
@@ -700,15 +690,16 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         result.push_back(Pair("coinbaseaux", aux));
         result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
     }
-    result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
+    result.push_back(Pair("longpollid", pblock->hashPrevBlock.GetHex() + i64tostr(nWorkId)));
+    result.push_back(Pair("workid", i64tostr(nWorkId)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
     result.push_back(Pair("noncerange", "00000000ffffffff"));
     result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
     result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
-    result.push_back(Pair("curtime", pblock->GetBlockTime()));
-    result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
+    result.push_back(Pair("curtime", header.GetBlockTime()));
+    result.push_back(Pair("bits", strprintf("%08x", header.nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
 
     return result;
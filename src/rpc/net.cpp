@@ -106,7 +106,29 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"cmpctblocks\": true|false,  (boolean) Whether the peer takes compact blocks\n"
+            "    \"cmpctblocks_hb\": true|false, (boolean) Whether the peer wants new blocks announced to it as compact blocks\n"
+            "    \"sendheaders\": true|false,  (boolean) Whether the peer wants new blocks announced to it as headers\n"
+            "    \"inflight_limit\": n,        (numeric) How many blocks we keep in flight from this peer at most\n"
+            "    \"blockservicetime\": n,      (numeric) The average time in milliseconds this peer has taken to deliver a block, if measured\n"
+            "    \"txreconciliation\": true|false, (boolean) Whether transaction announcements are reconciled with the peer\n"
+            "    \"bytessent_per_msg\": {\n"
+            "       \"cmd\": n,               (numeric) The total bytes sent aggregated by message type\n"
+            "       ...\n"
+            "    },\n"
+            "    \"msgssent_per_msg\": {\n"
+            "       \"cmd\": n,               (numeric) The number of messages sent by message type\n"
+            "       ...\n"
+            "    },\n"
+            "    \"bytesrecv_per_msg\": {\n"
+            "       \"cmd\": n,               (numeric) The total bytes received aggregated by message type\n"
+            "       ...\n"
+            "    },\n"
+            "    \"msgsrecv_per_msg\": {\n"
+            "       \"cmd\": n,               (numeric) The number of messages received by message type\n"
+            "       ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -156,8 +178,36 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("cmpctblocks", statestats.fProvidesCmpctBlocks));
+            obj.push_back(Pair("cmpctblocks_hb", statestats.fPreferHeaderAndIDs));
+            obj.push_back(Pair("sendheaders", statestats.fPreferHeaders));
+            obj.push_back(Pair("inflight_limit", statestats.nBlocksInTransitLimit));
+            if (statestats.nBlockServiceTime > 0)
+                obj.push_back(Pair("blockservicetime", statestats.nBlockServiceTime / 1000.0));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("txreconciliation", stats.fTxReconciliation));
+
+        // Message types never seen with the peer are left out
+        UniValue sendPerMsgCmd(UniValue::VOBJ), sendMsgsPerMsgCmd(UniValue::VOBJ);
+        BOOST_FOREACH(const mapMsgCmdTotals::value_type& i, stats.mapSendMsgCmdTotals) {
+            if (i.second.nMsgs) {
+                sendPerMsgCmd.push_back(Pair(i.first, i.second.nBytes));
+                sendMsgsPerMsgCmd.push_back(Pair(i.first, i.second.nMsgs));
+            }
+        }
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsgCmd));
+        obj.push_back(Pair("msgssent_per_msg", sendMsgsPerMsgCmd));
+
+        UniValue recvPerMsgCmd(UniValue::VOBJ), recvMsgsPerMsgCmd(UniValue::VOBJ);
+        BOOST_FOREACH(const mapMsgCmdTotals::value_type& i, stats.mapRecvMsgCmdTotals) {
+            if (i.second.nMsgs) {
+                recvPerMsgCmd.push_back(Pair(i.first, i.second.nBytes));
+                recvMsgsPerMsgCmd.push_back(Pair(i.first, i.second.nMsgs));
+            }
+        }
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
+        obj.push_back(Pair("msgsrecv_per_msg", recvMsgsPerMsgCmd));
 
         ret.push_back(obj);
     }
@@ -364,7 +414,16 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\":\n"
+            "  {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -375,6 +434,15 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
 
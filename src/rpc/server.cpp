@@ -303,20 +303,22 @@ bool StartRPC()
     fRPCRunning = true;
     g_rpcSignals.Started();
 
-    // Launch one async rpc worker.  The ability to launch multiple workers is not recommended at present and thus the option is disabled.
-    getAsyncRPCQueue()->addWorker();
-/*
+    // Operations of one type share a limit, and operations spending funds
+    // (e.g. a z_sendmany and a z_mergetoaddress) are never run concurrently,
+    // as they would select the same notes and utxos.
+    std::shared_ptr<AsyncRPCQueue> q = getAsyncRPCQueue();
+    q->setDefaultConcurrencyLimit(std::max<int64_t>(GetArg("-rpcasyncoplimit", 1), 0));
+
     int n = GetArg("-rpcasyncthreads", 1);
-    if (n<1) {
+    if (n < 1) {
         LogPrintf("ERROR: Invalid value %d for -rpcasyncthreads.  Must be at least 1.\n", n);
-        strerr = strprintf(_("An error occurred while setting up the Async RPC threads, invalid parameter value of %d (must be at least 1)."), n);
+        std::string strerr = strprintf(_("An error occurred while setting up the Async RPC threads, invalid parameter value of %d (must be at least 1)."), n);
         uiInterface.ThreadSafeMessageBox(strerr, "", CClientUIInterface::MSG_ERROR);
         StartShutdown();
-        return;
+        return false;
     }
     for (int i = 0; i < n; i++)
-        getAsyncRPCQueue()->addWorker();
-*/
+        q->addWorker();
     return true;
 }
 
@@ -12,6 +12,7 @@
 #include "keystore.h"
 #include "main.h"
 #include "net.h"
+#include "orphanpool.h"
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
@@ -27,16 +28,8 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/test/data/test_case.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+// Tests this internal-to-main.cpp object:
+extern COrphanPool orphanPool;
 
 CService ip(uint32_t i)
 {
@@ -110,13 +103,26 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
+static std::vector<uint256> vOrphanHashes;
+
 CTransaction RandomOrphan()
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    const COrphanPool::Entry* entry = NULL;
+    while (!entry)
+        entry = orphanPool.Get(vOrphanHashes[GetRand(vOrphanHashes.size())]);
+    return entry->tx;
+}
+
+static CMutableTransaction SimpleOrphan(const uint256& hashPrev, size_t nScriptSize)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(nScriptSize, 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
 }
 
 // Parameterized testing over consensus branch ids
@@ -141,7 +147,8 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        orphanPool.Add(tx, i, GetTime());
+        vOrphanHashes.push_back(tx.GetHash());
     }
 
     // ... and 50 that depend on other orphans:
@@ -158,7 +165,8 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0, SIGHASH_ALL, consensusBranchId);
 
-        AddOrphanTx(tx, i);
+        orphanPool.Add(tx, i, GetTime());
+        vOrphanHashes.push_back(tx.GetHash());
     }
 
     // This really-big orphan should be ignored:
@@ -182,25 +190,72 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!orphanPool.Add(tx, i, GetTime()));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanPool.size();
+        orphanPool.EraseForPeer(i);
+        BOOST_CHECK(orphanPool.size() < sizeBefore);
+        BOOST_CHECK_EQUAL(orphanPool.GetPeerSize(i), 0);
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    // Test Limit():
+    orphanPool.Limit(40);
+    BOOST_CHECK(orphanPool.size() <= 40);
+    orphanPool.Limit(10);
+    BOOST_CHECK(orphanPool.size() <= 10);
+    orphanPool.Limit(0);
+    BOOST_CHECK_EQUAL(orphanPool.size(), 0);
+    BOOST_CHECK_EQUAL(orphanPool.GetTotalSize(), 0);
+    vOrphanHashes.clear();
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanBudgets)
+{
+    orphanPool.clear();
+    int64_t nTime = GetTime();
+
+    // A peer over its budget loses its own oldest orphans, not anyone else's
+    CMutableTransaction txOther = SimpleOrphan(GetRandHash(), 100);
+    BOOST_CHECK(orphanPool.Add(txOther, 1, nTime));
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 20; i++) {
+        CMutableTransaction tx = SimpleOrphan(GetRandHash(), 4000);
+        BOOST_CHECK(orphanPool.Add(tx, 0, nTime));
+        vHashes.push_back(tx.GetHash());
+    }
+    BOOST_CHECK(orphanPool.GetPeerSize(0) <= MAX_ORPHAN_PEER_SIZE);
+    BOOST_CHECK(!orphanPool.Exists(vHashes.front()));
+    BOOST_CHECK(orphanPool.Exists(vHashes.back()));
+    BOOST_CHECK(orphanPool.Exists(txOther.GetHash()));
+
+    // The total size budget applies across peers
+    orphanPool.Limit(100, 20000);
+    BOOST_CHECK(orphanPool.GetTotalSize() <= 20000);
+
+    // Orphans of a parent are queued once, and dropped with the block that includes them
+    orphanPool.clear();
+    CMutableTransaction txParent = SimpleOrphan(GetRandHash(), 10);
+    CMutableTransaction txChild = SimpleOrphan(txParent.GetHash(), 10);
+    BOOST_CHECK(orphanPool.Add(txParent, 0, nTime));
+    BOOST_CHECK(orphanPool.Add(txChild, 0, nTime));
+    orphanPool.AddWork(txParent.GetHash());
+    orphanPool.AddWork(txParent.GetHash());
+    uint256 hash;
+    BOOST_CHECK(orphanPool.PopWork(hash));
+    BOOST_CHECK(hash == txChild.GetHash());
+    BOOST_CHECK(!orphanPool.PopWork(hash));
+    orphanPool.EraseForBlock(std::vector<CTransaction>(1, txParent));
+    BOOST_CHECK(!orphanPool.Exists(txParent.GetHash()));
+    BOOST_CHECK(orphanPool.Exists(txChild.GetHash()));
+
+    // Orphans expire
+    BOOST_CHECK_EQUAL(orphanPool.Expire(nTime + ORPHAN_TX_EXPIRE_TIME - 1), 0);
+    orphanPool.Expire(nTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL);
+    BOOST_CHECK_EQUAL(orphanPool.size(), 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,8 +6,10 @@
 #include <string>
 #include <boost/test/unit_test.hpp>
 
+#include "clientversion.h"
 #include "hash.h"
 #include "random.h"
+#include "streams.h"
 
 using namespace std;
 
@@ -180,9 +182,9 @@ BOOST_AUTO_TEST_CASE(addrman_select)
     BOOST_CHECK(addrman.size() == 7);
 
     // Test 12: Select pulls from new and tried regardless of port number.
-    BOOST_CHECK(addrman.Select().ToString() == "250.4.6.6:8333");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.2.2:9999");
-    BOOST_CHECK(addrman.Select().ToString() == "250.3.3.3:9999");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
+    BOOST_CHECK(addrman.Select().ToString() == "250.4.5.5:7777");
+    BOOST_CHECK(addrman.Select().ToString() == "250.3.1.1:8333");
     BOOST_CHECK(addrman.Select().ToString() == "250.4.4.4:8333");
 }
 
@@ -331,6 +333,43 @@ BOOST_AUTO_TEST_CASE(addrman_delete)
     BOOST_CHECK(info2 == NULL);
 }
 
+BOOST_AUTO_TEST_CASE(addrman_changes)
+{
+    CAddrManTest addrman;
+
+    // Set addrman addr placement to be deterministic.
+    addrman.MakeDeterministic();
+
+    CAddress addr1 = CAddress(CService("250.1.1.1", 8333));
+    CNetAddr source = CNetAddr("252.2.2.2");
+
+    // Only changes to what peers.dat holds are counted.
+    uint64_t nChanges = addrman.GetChanges();
+    addrman.Add(addr1, source);
+    BOOST_CHECK(addrman.GetChanges() != nChanges);
+
+    nChanges = addrman.GetChanges();
+    addrman.Select();
+    addrman.GetAddr();
+    BOOST_CHECK(addrman.GetChanges() == nChanges);
+
+    addrman.Attempt(addr1);
+    BOOST_CHECK(addrman.GetChanges() != nChanges);
+
+    nChanges = addrman.GetChanges();
+    addrman.Good(addr1);
+    BOOST_CHECK(addrman.GetChanges() != nChanges);
+
+    // Loading addresses isn't a change.
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+    CAddrManTest addrman2;
+    ssPeers >> addrman2;
+    BOOST_CHECK(addrman2.size() == 1);
+    BOOST_CHECK(addrman2.GetChanges() == 0);
+    BOOST_CHECK(addrman2.Select().ToString() == "250.1.1.1:8333");
+}
+
 BOOST_AUTO_TEST_CASE(addrman_getaddr)
 {
     CAddrManTest addrman;
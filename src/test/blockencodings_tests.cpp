@@ -0,0 +1,159 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion = 4;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    stream >> cmpctblock2;
+    return cmpctblock2;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    CMutableTransaction tx2(block.vtx[2]);
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(tx2));
+
+    // The coinbase is prefilled and the rest filled in from the mempool,
+    // except for vtx[1]
+    CBlockHeaderAndShortTxIDs shortIDs = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(shortIDs.BlockTxCount(), 3U);
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, std::vector<const CTransaction*>()) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+
+    // The wrong transaction fails the merkle root check, and too few are invalid
+    CBlock block2;
+    {
+        PartiallyDownloadedBlock tmp = partialBlock;
+        BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_INVALID);
+        partialBlock = tmp;
+    }
+    {
+        PartiallyDownloadedBlock tmp = partialBlock;
+        BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>(1, block.vtx[2])) == READ_STATUS_FAILED);
+        partialBlock = tmp;
+    }
+
+    CBlock block3;
+    BOOST_CHECK(partialBlock.FillBlock(block3, std::vector<CTransaction>(1, block.vtx[1])) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block3.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block3.vtx.size(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(ExtraTransactionsTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    // Transactions not in the mempool can come from elsewhere, e.g. orphans
+    std::vector<const CTransaction*> extra;
+    extra.push_back(&block.vtx[1]);
+    extra.push_back(&block.vtx[2]);
+
+    CBlockHeaderAndShortTxIDs shortIDs = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, extra) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetExtraCount(), 2U);
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    block.vtx.resize(1);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockHeaderAndShortTxIDs shortIDs = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, std::vector<const CTransaction*>()) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.push_back(0);
+    req1.indexes.push_back(1);
+    req1.indexes.push_back(3);
+    req1.indexes.push_back(65535);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK(req1.indexes == req2.indexes);
+
+    // Indexes past 16 bits don't deserialize
+    CDataStream stream2(SER_NETWORK, PROTOCOL_VERSION);
+    stream2 << req1.blockhash;
+    WriteCompactSize(stream2, 2);
+    WriteCompactSize(stream2, 65535);
+    WriteCompactSize(stream2, 0);
+    BOOST_CHECK_THROW(stream2 >> req2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
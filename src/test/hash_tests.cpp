@@ -47,4 +47,30 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vectors from the SipHash reference implementation, key 00..0f
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x74f839c593dc67fdull);
+    static const unsigned char t1[7] = {1,2,3,4,5,6,7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+    static const unsigned char t2[1] = {16};
+    hasher.Write(t2, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x699ae9f52cbe4794ull);
+
+    // The uint256 specialization matches hashing the same 32 bytes
+    std::vector<unsigned char> vData;
+    for (unsigned char i = 0; i < 32; i++)
+        vData.push_back(i);
+    uint256 x(vData);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, x), 0x7127512f72f27cceull);
+    BOOST_CHECK_EQUAL(CSipHasher(1, 2).Write(&vData[0], 32).Finalize(), SipHashUint256(1, 2, x));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
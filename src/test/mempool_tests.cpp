@@ -9,6 +9,7 @@
 
 #include "test/test_bitcoin.h"
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
@@ -157,6 +158,233 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     BOOST_CHECK(it == pool.mapTx.get<1>().end());
 }
 
+BOOST_AUTO_TEST_CASE(MempoolPackageStateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // Low-fee parent with two outputs
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+
+    // High-fee child paying for it
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(50000LL).FromTx(txChild));
+
+    // Grandchild spending the child and the parent's other output
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(2);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout = COutPoint(txChild.GetHash(), 0);
+    txGrandChild.vin[1].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[1].prevout = COutPoint(txParent.GetHash(), 1);
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 11000LL;
+    pool.addUnchecked(txGrandChild.GetHash(), entry.Fee(2000LL).FromTx(txGrandChild));
+
+    // Unrelated transaction
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 11000LL;
+    pool.addUnchecked(txOther.GetHash(), entry.Fee(10000LL).FromTx(txOther));
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = pool.mapTx.find(txGrandChild.GetHash());
+    uint64_t nParentSize = itParent->GetTxSize();
+    uint64_t nChildSize = itChild->GetTxSize();
+    uint64_t nGrandChildSize = itGrandChild->GetTxSize();
+
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itParent).size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(itGrandChild).size(), 2);
+
+    BOOST_CHECK_EQUAL(itParent->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nParentSize + nChildSize + nGrandChildSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 53000LL);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nParentSize + nChildSize + nGrandChildSize);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 53000LL);
+
+    // The ancestor fee rate index puts the child, which pays for its parent,
+    // first; should be txChild, txGrandChild, txOther, txParent
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator it = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txChild.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txGrandChild.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txOther.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txParent.GetHash().ToString());
+    BOOST_CHECK(it == pool.mapTx.get<ancestor_score>().end());
+
+    // Prioritisation changes the modified fees of the whole package
+    pool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0, 100000LL);
+    BOOST_CHECK_EQUAL(itParent->GetModifiedFee(), 101000LL);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 153000LL);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithAncestors(), 151000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 153000LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.get<ancestor_score>().begin()->GetTx().GetHash().ToString(), txParent.GetHash().ToString());
+
+    // Removing the child alone, as when it is mined, leaves the others linked
+    std::list<CTransaction> removed;
+    pool.remove(txChild, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 103000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nParentSize + nGrandChildSize);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(itGrandChild).size(), 1);
+
+    // Removing the parent recursively takes the grandchild with it
+    removed.clear();
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    pool.ClearPrioritisation(txParent.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction tx1, tx2, tx3, tx4;
+    CMutableTransaction* txs[] = { &tx1, &tx2, &tx3, &tx4 };
+    for (int i = 0; i < 4; i++) {
+        txs[i]->vin.resize(1);
+        txs[i]->vin[0].scriptSig = CScript() << OP_11;
+        txs[i]->vout.resize(1);
+        txs[i]->vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txs[i]->vout[0].nValue = 10000LL * (i + 1);
+    }
+    // tx3 spends tx2 and pays enough to lift it above tx1
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5000LL).FromTx(tx2));
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(20000LL).FromTx(tx3));
+    pool.addUnchecked(tx4.GetHash(), entry.Fee(1000LL).FromTx(tx4));
+    size_t nTx4Size = pool.mapTx.find(tx4.GetHash())->GetTxSize();
+
+    // The lowest descendant fee rate goes first, and sets the minimum fee
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK(!pool.exists(tx4.GetHash()));
+    CAmount nRollingFee = CFeeRate(1000LL, nTx4Size).GetFeePerK() + ::minRelayTxFee.GetFeePerK();
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nRollingFee);
+
+    // tx1 pays less than the tx2 package, so it goes before it
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+
+    // Evicting a parent evicts its descendants
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    nRollingFee = pool.GetMinFee(1).GetFeePerK();
+    BOOST_CHECK(nRollingFee > CFeeRate(1000LL, nTx4Size).GetFeePerK() + ::minRelayTxFee.GetFeePerK());
+
+    // The minimum fee only decays once a block has come in, and four times
+    // faster while the pool is nearly empty
+    int64_t nTime = GetTime();
+    SetMockTime(nTime);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(std::vector<CTransaction>(), 1, conflicts);
+    SetMockTime(nTime + CTxMemPool::ROLLING_FEE_HALFLIFE / 4);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000).GetFeePerK(), std::max(nRollingFee / 2, ::minRelayTxFee.GetFeePerK()));
+    SetMockTime(nTime + CTxMemPool::ROLLING_FEE_HALFLIFE * 10);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000).GetFeePerK(), 0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpiryTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction tx1, tx2, tx3;
+    CMutableTransaction* txs[] = { &tx1, &tx2, &tx3 };
+    for (int i = 0; i < 3; i++) {
+        txs[i]->vin.resize(1);
+        txs[i]->vin[0].scriptSig = CScript() << OP_11;
+        txs[i]->vout.resize(1);
+        txs[i]->vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txs[i]->vout[0].nValue = 10000LL * (i + 1);
+    }
+    tx1.nExpiryHeight = 20;
+    tx2.nExpiryHeight = 10;
+    tx3.nExpiryHeight = 0;
+    pool.addUnchecked(tx1.GetHash(), entry.FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.FromTx(tx2));
+    pool.addUnchecked(tx3.GetHash(), entry.FromTx(tx3));
+
+    // The expiry index puts the earliest expiry first and never-expiring txs last
+    CTxMemPool::indexed_transaction_set::index<expiry_height>::type::iterator it = pool.mapTx.get<expiry_height>().begin();
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), tx2.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), tx1.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), tx3.GetHash().ToString());
+
+    pool.removeExpired(10);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    pool.removeExpired(11);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    pool.removeExpired(1000);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPruneSpentTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(3);
+    for (int i = 0; i < 3; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 10000LL;
+    }
+
+    // Spend the first and last outputs
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[1].scriptSig = CScript() << OP_11;
+    txChild.vin[1].prevout = COutPoint(txParent.GetHash(), 2);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 20000LL;
+    pool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+
+    CCoins coins(txParent, 1);
+    pool.pruneSpent(txParent.GetHash(), coins);
+    BOOST_CHECK(!coins.IsAvailable(0));
+    BOOST_CHECK(coins.IsAvailable(1));
+    BOOST_CHECK(!coins.IsAvailable(2));
+}
+
 BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     CTxMemPool pool(CFeeRate(0));
     TestMemPoolEntryHelper entry;
@@ -222,4 +450,51 @@ BOOST_AUTO_TEST_CASE(SetSanityCheck) {
     BOOST_CHECK_EQUAL(pool.GetCheckFrequency(), 0);
 }
 
+// Block template updates rely on every change to the transactions updated
+// counter being either an add or remove notification, or a reason to rebuild.
+static void CountNotification(std::vector<uint256>& vHashes, const uint256& hash)
+{
+    vHashes.push_back(hash);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolNotifications) {
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<uint256> vAdded, vRemoved;
+    pool.NotifyEntryAdded.connect(boost::bind(&CountNotification, boost::ref(vAdded), _1));
+    pool.NotifyEntryRemoved.connect(boost::bind(&CountNotification, boost::ref(vRemoved), _1));
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+
+    unsigned int nUpdated = pool.GetTransactionsUpdated();
+    pool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    pool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+    BOOST_CHECK_EQUAL(vAdded.size(), 2);
+    BOOST_CHECK(vAdded[0] == txParent.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetTransactionsUpdated(), nUpdated + 2);
+
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(vRemoved.size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetTransactionsUpdated(), nUpdated + 4);
+
+    // Prioritisation changes block templates without a notification
+    pool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0, 1000);
+    BOOST_CHECK_EQUAL(pool.GetTransactionsUpdated(), nUpdated + 5);
+    BOOST_CHECK_EQUAL(vAdded.size() + vRemoved.size(), 4);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,192 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "hash.h"
+#include "net.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+static CDataStream MakeMessage(const char* pszCommand, uint64_t nonce)
+{
+    CDataStream payload(SER_NETWORK, PROTOCOL_VERSION);
+    payload << nonce;
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss.write(&payload[0], payload.size());
+    return ss;
+}
+
+BOOST_AUTO_TEST_CASE(ProcessMsgHandoff)
+{
+    CAddress addr(CService("250.1.1.1", 8233));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    CDataStream ping1 = MakeMessage("ping", 1);
+    CDataStream ping2 = MakeMessage("ping", 2);
+    std::vector<char> vBytes(ping1.begin(), ping1.end());
+    vBytes.insert(vBytes.end(), ping2.begin(), ping2.end());
+
+    LOCK(node.cs_vRecvMsg);
+    // Only complete messages are handed over
+    BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[0], ping1.size() + 10));
+    BOOST_CHECK_EQUAL(node.vProcessMsg.size(), 1U);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.ReceiveMsgBytes(&vBytes[ping1.size() + 10], vBytes.size() - ping1.size() - 10));
+    BOOST_CHECK_EQUAL(node.vProcessMsg.size(), 2U);
+    BOOST_CHECK(node.vRecvMsg.empty());
+    BOOST_CHECK_EQUAL(node.nProcessQueueSize, vBytes.size());
+    BOOST_CHECK(!node.fPauseRecv);
+
+    // and popped in order
+    std::list<CNetMessage> msgs;
+    uint64_t nonce;
+    BOOST_CHECK(node.PopProcessMsg(msgs));
+    msgs.front().vRecv >> nonce;
+    BOOST_CHECK_EQUAL(nonce, 1U);
+    msgs.clear();
+    BOOST_CHECK(node.PopProcessMsg(msgs));
+    msgs.front().vRecv >> nonce;
+    BOOST_CHECK_EQUAL(nonce, 2U);
+    BOOST_CHECK(!node.PopProcessMsg(msgs));
+    BOOST_CHECK_EQUAL(node.nProcessQueueSize, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(ProcessMsgFloodPause)
+{
+    CAddress addr(CService("250.1.1.2", 8233));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    mapArgs["-maxreceivebuffer"] = "1";
+
+    // Queue up just over the 1000 byte flood limit
+    CDataStream ping = MakeMessage("ping", 1);
+    LOCK(node.cs_vRecvMsg);
+    while (node.nProcessQueueSize <= ReceiveFloodSize()) {
+        BOOST_CHECK(!node.fPauseRecv);
+        BOOST_CHECK(node.ReceiveMsgBytes(&ping[0], ping.size()));
+    }
+    BOOST_CHECK(node.fPauseRecv);
+
+    // Reading resumes once the message handler catches up
+    std::list<CNetMessage> msgs;
+    BOOST_CHECK(node.PopProcessMsg(msgs));
+    BOOST_CHECK(!node.fPauseRecv);
+    mapArgs.erase("-maxreceivebuffer");
+}
+
+BOOST_AUTO_TEST_CASE(SendPriority)
+{
+    CAddress addr(CService("250.1.1.4", 8233));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    CSharedNetMsg block1 = MakeSharedMessage("block", (uint64_t)1);
+    CSharedNetMsg block2 = MakeSharedMessage("block", (uint64_t)2);
+
+    LOCK(node.cs_vSend);
+    // A bulk message that has started to go out stays in front
+    node.PushSharedMessage(block1, true);
+    node.nSendOffset = 5;
+    SocketSendData(&node);
+    BOOST_CHECK_EQUAL(node.nSendPriority, 1U);
+
+    // but others overtake the bulk messages queued behind it
+    node.PushSharedMessage(block2, true);
+    node.PushMessage("ping", (uint64_t)3);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 3U);
+    BOOST_CHECK(node.vSendMsg[0] == block1);
+    BOOST_CHECK(node.vSendMsg[2] == block2);
+    CDataStream ping = MakeMessage("ping", 3);
+    BOOST_CHECK(std::equal(node.vSendMsg[1]->begin(), node.vSendMsg[1]->end(), ping.begin()));
+    BOOST_CHECK_EQUAL(node.nSendSize, 2 * block1->size() + ping.size());
+
+    // Both are counted by message type
+    BOOST_CHECK_EQUAL(node.mapSendMsgCmdTotals["block"].nMsgs, 2U);
+    BOOST_CHECK_EQUAL(node.mapSendMsgCmdTotals["block"].nBytes, 2 * block1->size());
+    BOOST_CHECK_EQUAL(node.mapSendMsgCmdTotals["ping"].nMsgs, 1U);
+    BOOST_CHECK_EQUAL(node.mapSendMsgCmdTotals[NET_MESSAGE_COMMAND_OTHER].nMsgs, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(OutboundTarget)
+{
+    // Start a new cycle
+    SetMockTime(GetTime() + 2 * MAX_UPLOAD_TIMEFRAME);
+    CNode::RecordBytesSent(0);
+    uint64_t nBuffer = MAX_UPLOAD_TIMEFRAME / Params().GetConsensus().nPowTargetSpacing * MAX_BLOCK_SIZE;
+    CNode::SetMaxOutboundTarget(nBuffer + 1000);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nBuffer + 1000);
+
+    // Historical blocks stop first, keeping enough to relay new blocks for
+    // the rest of the cycle
+    CNode::RecordBytesSent(1000);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    // which is less later on
+    SetMockTime(GetTime() + MAX_UPLOAD_TIMEFRAME / 2);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    CNode::RecordBytesSent(nBuffer);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // The next cycle starts afresh
+    SetMockTime(GetTime() + MAX_UPLOAD_TIMEFRAME);
+    CNode::RecordBytesSent(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    CNode::SetMaxOutboundTarget(0);
+    SetMockTime(0);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(SocketSendGather)
+{
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    CAddress addr(CService("250.1.1.3", 8233));
+    CNode node(fds[0], addr, "", true);
+
+    // A shared message is framed just like one pushed the usual way
+    CSharedNetMsg msg = MakeSharedMessage("ping", (uint64_t)1);
+    CDataStream ping1 = MakeMessage("ping", 1);
+    BOOST_CHECK(msg->size() == ping1.size() && std::equal(msg->begin(), msg->end(), ping1.begin()));
+
+    // Queue it twice, as if for two peers, behind a partly sent message
+    CDataStream ping2 = MakeMessage("ping", 2);
+    std::vector<char> vExpected(ping2.begin() + 5, ping2.end());
+    vExpected.insert(vExpected.end(), msg->begin(), msg->end());
+    vExpected.insert(vExpected.end(), msg->begin(), msg->end());
+    {
+        LOCK(node.cs_vSend);
+        node.vSendMsg.push_back(std::make_shared<const CSerializeData>(ping2.begin(), ping2.end()));
+        node.vSendMsg.push_back(msg);
+        node.vSendMsg.push_back(msg);
+        node.nSendSize = ping2.size() + 2 * msg->size();
+        node.nSendOffset = 5;
+        BOOST_CHECK_EQUAL(msg.use_count(), 3);
+
+        SocketSendData(&node);
+        BOOST_CHECK(node.vSendMsg.empty());
+        BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+        BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    }
+    BOOST_CHECK_EQUAL(msg.use_count(), 1);
+
+    std::vector<char> vReceived(vExpected.size() + 1);
+    BOOST_CHECK_EQUAL(recv(fds[1], &vReceived[0], vReceived.size(), MSG_DONTWAIT), (ssize_t)vExpected.size());
+    vReceived.resize(vExpected.size());
+    BOOST_CHECK(vReceived == vExpected);
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netreplay.h"
+#include "net.h"
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(netreplay_tests, TestingSetup)
+
+static uint64_t CountMsgs(const mapNetReplayStats& mapStats, const std::string& strCommand)
+{
+    mapNetReplayStats::const_iterator it = mapStats.find(strCommand);
+    return it == mapStats.end() ? 0 : it->second.nMsgs;
+}
+
+BOOST_AUTO_TEST_CASE(replay_synthetic)
+{
+    std::vector<unsigned char> vStream = MakeSyntheticNetStream(5);
+
+    // Blocks are bigger than the pieces, so they are framed from several
+    CNetReplay replay;
+    BOOST_CHECK(replay.Replay(vStream, 100));
+    BOOST_CHECK(replay.GetNode()->fSuccessfullyConnected);
+
+    const mapNetReplayStats& mapStats = replay.GetStats();
+    BOOST_CHECK_EQUAL(CountMsgs(mapStats, "version"), 1U);
+    BOOST_CHECK_EQUAL(CountMsgs(mapStats, "verack"), 1U);
+    const char* pszCommands[] = {"inv", "tx", "headers", "block", "getdata", "ping"};
+    uint64_t nBytes = 0;
+    BOOST_FOREACH(const char* pszCommand, pszCommands)
+        BOOST_CHECK_EQUAL(CountMsgs(mapStats, pszCommand), 5U);
+    for (mapNetReplayStats::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+        nBytes += it->second.nBytes;
+    BOOST_CHECK_EQUAL(nBytes, vStream.size());
+}
+
+BOOST_AUTO_TEST_CASE(replay_after_handshake)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << (uint64_t)1;
+    std::vector<unsigned char> vStream;
+    AppendNetMessage(vStream, "ping", std::vector<unsigned char>(ss.begin(), ss.end()));
+    AppendNetMessage(vStream, "notacommand", std::vector<unsigned char>());
+
+    CNetReplay replay;
+    BOOST_CHECK(replay.Replay(vStream));
+    BOOST_CHECK(replay.GetNode()->fSuccessfullyConnected);
+    BOOST_CHECK_EQUAL(CountMsgs(replay.GetStats(), "ping"), 1U);
+    BOOST_CHECK_EQUAL(CountMsgs(replay.GetStats(), NET_MESSAGE_COMMAND_OTHER), 1U);
+
+    // A truncated message is left waiting for the rest
+    vStream.resize(vStream.size() - 10);
+    CNetReplay replay2;
+    BOOST_CHECK(replay2.Replay(vStream));
+    BOOST_CHECK(!replay2.GetNode()->fDisconnect);
+}
+
+BOOST_AUTO_TEST_CASE(replay_fuzzed)
+{
+    // Corrupted streams may get the peer disconnected, but nothing worse
+    std::vector<unsigned char> vStream = MakeSyntheticNetStream(2);
+    seed_insecure_rand(true);
+    for (int i = 0; i < 200; i++) {
+        std::vector<unsigned char> vFuzzed(vStream);
+        int nFlips = 1 + insecure_rand() % 8;
+        for (int j = 0; j < nFlips; j++)
+            vFuzzed[insecure_rand() % vFuzzed.size()] ^= 1 << (insecure_rand() % 8);
+        if (insecure_rand() % 4 == 0)
+            vFuzzed.resize(insecure_rand() % vFuzzed.size());
+        CNetReplay replay;
+        replay.Replay(vFuzzed, 1 + insecure_rand() % 512);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
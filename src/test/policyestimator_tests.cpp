@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "policy/fees.h"
+#include "clientversion.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
@@ -182,6 +184,18 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() < origFeeEst[i-1] - deltaFee);
         BOOST_CHECK(mpool.estimatePriority(i) < origPriEst[i-1] - deltaPri);
     }
+
+    // Everything has been mined, so a pool reading back the saved estimates
+    // (with the decay folded back in) should estimate the same
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(mpool.WriteFeeEstimates(file));
+    rewind(file.Get());
+    CTxMemPool mpoolRead(CFeeRate(1000));
+    BOOST_CHECK(mpoolRead.ReadFeeEstimates(file));
+    for (int i = 1; i <= (int)MAX_BLOCK_CONFIRMS; i++) {
+        BOOST_CHECK(std::abs(mpoolRead.estimateFee(i).GetFeePerK() - mpool.estimateFee(i).GetFeePerK()) <= 1);
+        BOOST_CHECK_CLOSE(mpoolRead.estimatePriority(i), mpool.estimatePriority(i), 1e-6);
+    }
 }
 
 
@@ -17,6 +17,7 @@
 #include "asyncrpcoperation.h"
 #include "wallet/asyncrpcoperation_mergetoaddress.h"
 #include "wallet/asyncrpcoperation_sendmany.h"
+#include "wallet/asyncrpcoperation_sendmanybulk.h"
 #include "wallet/asyncrpcoperation_shieldcoinbase.h"
 
 #include "init.h"
@@ -832,6 +833,129 @@ BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_parallel_cancel)
     BOOST_CHECK(ids.size()==0);
 }
 
+// Records the order in which operations are started
+std::vector<std::string> gStartOrder;
+std::mutex gStartOrderLock;
+// Most spending operations seen executing at once
+std::atomic<int> gSpending(0);
+std::atomic<int> gMaxSpending(0);
+
+class PriorityOperation : public AsyncRPCOperation {
+public:
+    PriorityOperation(std::string name, OperationPriority priority, std::string type, bool spends = false) :
+        name_(name), priority_(priority), type_(type), spends_(spends) {}
+    virtual ~PriorityOperation() {}
+    virtual OperationPriority getPriority() const { return priority_; }
+    virtual std::string getType() const { return type_; }
+    virtual bool spendsFunds() const { return spends_; }
+    virtual void main() {
+        set_state(OperationStatus::EXECUTING);
+        {
+            std::lock_guard<std::mutex> guard(gStartOrderLock);
+            gStartOrder.push_back(name_);
+        }
+        if (spends_) {
+            int n = ++gSpending;
+            if (n > gMaxSpending) {
+                gMaxSpending = n;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        if (spends_) {
+            gSpending--;
+        }
+        set_state(OperationStatus::SUCCESS);
+    }
+private:
+    std::string name_;
+    OperationPriority priority_;
+    std::string type_;
+    bool spends_;
+};
+
+// This tests that higher priority operations are started first
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_priority)
+{
+    gStartOrder.clear();
+
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    std::shared_ptr<AsyncRPCOperation> merge(new PriorityOperation("merge", OperationPriority::LOW, "z_mergetoaddress"));
+    std::shared_ptr<AsyncRPCOperation> shield(new PriorityOperation("shield", OperationPriority::NORMAL, "z_shieldcoinbase"));
+    std::shared_ptr<AsyncRPCOperation> payout(new PriorityOperation("payout", OperationPriority::HIGH, "z_sendmany"));
+    q->addOperation(merge);
+    q->addOperation(shield);
+    q->addOperation(payout);
+
+    BOOST_CHECK_EQUAL(q->getQueuePosition(payout->getId()), 0);
+    BOOST_CHECK_EQUAL(q->getQueuePosition(shield->getId()), 1);
+    BOOST_CHECK_EQUAL(q->getQueuePosition(merge->getId()), 2);
+    BOOST_CHECK_EQUAL(q->getQueuePosition("opid-1234"), -1);
+
+    q->addWorker();
+    q->finishAndWait();
+
+    BOOST_CHECK(gStartOrder == std::vector<std::string>({"payout", "shield", "merge"}));
+    BOOST_CHECK_EQUAL(find_value(payout->getStatus().get_obj(), "priority").get_str(), "high");
+}
+
+// This tests that the per-type concurrency limit holds back operations
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_concurrency_limit)
+{
+    gStartOrder.clear();
+
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->setDefaultConcurrencyLimit(1);
+    std::shared_ptr<AsyncRPCOperation> payout1(new PriorityOperation("payout1", OperationPriority::HIGH, "z_sendmany"));
+    std::shared_ptr<AsyncRPCOperation> payout2(new PriorityOperation("payout2", OperationPriority::HIGH, "z_sendmany"));
+    std::shared_ptr<AsyncRPCOperation> merge(new PriorityOperation("merge", OperationPriority::LOW, "z_mergetoaddress"));
+    q->addOperation(payout1);
+    q->addOperation(payout2);
+    q->addOperation(merge);
+
+    // With two workers, the second payout must wait for the first, so the
+    // merge is started next even though it has a lower priority.
+    q->addWorker();
+    q->addWorker();
+    q->finishAndWait();
+
+    BOOST_CHECK_EQUAL(gStartOrder.size(), 3);
+    BOOST_CHECK_EQUAL(gStartOrder[0], "payout1");
+    BOOST_CHECK_EQUAL(gStartOrder[1], "merge");
+    BOOST_CHECK_EQUAL(gStartOrder[2], "payout2");
+}
+
+// This tests that operations spending funds never execute at the same time
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_spending_exclusive)
+{
+    gStartOrder.clear();
+    gMaxSpending = 0;
+
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->setDefaultConcurrencyLimit(0);
+    std::shared_ptr<AsyncRPCOperation> payout1(new PriorityOperation("payout1", OperationPriority::HIGH, "z_sendmany", true));
+    std::shared_ptr<AsyncRPCOperation> payout2(new PriorityOperation("payout2", OperationPriority::HIGH, "z_sendmany", true));
+    std::shared_ptr<AsyncRPCOperation> merge(new PriorityOperation("merge", OperationPriority::LOW, "z_mergetoaddress", true));
+    std::shared_ptr<AsyncRPCOperation> other(new PriorityOperation("other", OperationPriority::LOW, "generic"));
+    q->addOperation(payout1);
+    q->addOperation(payout2);
+    q->addOperation(merge);
+    q->addOperation(other);
+
+    // Without a per-type limit the workers are free, but only the operation
+    // that spends nothing may start alongside the first payout.
+    q->addWorker();
+    q->addWorker();
+    q->addWorker();
+    q->finishAndWait();
+
+    BOOST_CHECK_EQUAL(gMaxSpending.load(), 1);
+    BOOST_CHECK_EQUAL(gStartOrder.size(), 4);
+    BOOST_CHECK_EQUAL(gStartOrder[0], "payout1");
+    BOOST_CHECK_EQUAL(gStartOrder[1], "other");
+    BOOST_CHECK_EQUAL(gStartOrder[2], "payout2");
+    BOOST_CHECK_EQUAL(gStartOrder[3], "merge");
+}
+
 // This tests z_getoperationstatus, z_getoperationresult, z_listoperationids
 BOOST_AUTO_TEST_CASE(rpc_z_getoperations)
 {
@@ -1355,6 +1479,103 @@ BOOST_AUTO_TEST_CASE(rpc_z_sendmany_taddr_to_sapling)
 }
 
 
+BOOST_AUTO_TEST_CASE(rpc_z_sendmanybulk_parameters)
+{
+    RegtestActivateSapling();
+
+    LOCK(pwalletMain->cs_wallet);
+
+    if (!pwalletMain->HaveHDSeed()) {
+        pwalletMain->GenerateNewSeed();
+    }
+
+    std::string zaddr1 = EncodePaymentAddress(pwalletMain->GenerateNewSaplingZKey());
+    std::string taddr1 = EncodeDestination(pwalletMain->GenerateNewKey().GetID());
+
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk toofewargs"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk just too many args here now"), runtime_error);
+
+    // from address must be a Sapling zaddr
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk " + taddr1 + " "
+            "[{\"address\":\"" + taddr1 + "\", \"amount\":1.0}]"), runtime_error);
+
+    // empty amounts
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk " + zaddr1 + " []"), runtime_error);
+
+    // memo with a taddr recipient
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk " + zaddr1 + " "
+            "[{\"address\":\"" + taddr1 + "\", \"amount\":1.0, \"memo\":\"ABCD\"}]"), runtime_error);
+
+    // minconf cannot be zero when sending from a zaddr
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk " + zaddr1 + " "
+            "[{\"address\":\"" + taddr1 + "\", \"amount\":1.0}] 0"), runtime_error);
+
+    // outputs_per_tx must be positive
+    BOOST_CHECK_THROW(CallRPC("z_sendmanybulk " + zaddr1 + " "
+            "[{\"address\":\"" + taddr1 + "\", \"amount\":1.0}] 1 0.0001 0"), runtime_error);
+
+    // no notes to spend
+    try {
+        CallRPC("z_sendmanybulk " + zaddr1 + " [{\"address\":\"" + taddr1 + "\", \"amount\":1.0}]");
+        BOOST_FAIL("Should have caused an error");
+    } catch (const runtime_error& e) {
+        BOOST_CHECK(string(e.what()).find("Insufficient shielded funds") != string::npos);
+    }
+
+    // Partition recipients and notes into transactions
+    auto pa = boost::get<libzprime::SaplingPaymentAddress>(DecodePaymentAddress(zaddr1));
+    std::vector<SaplingNoteEntry> notes;
+    for (CAmount value : {5 * COIN, 1 * COIN, 2 * COIN, 3 * COIN}) {
+        SaplingNoteEntry entry;
+        entry.op = SaplingOutPoint(GetRandHash(), 0);
+        entry.note = libzprime::SaplingNote(pa, value);
+        notes.push_back(entry);
+    }
+    std::vector<SendManyRecipient> recipients;
+    for (int i = 0; i < 5; i++) {
+        recipients.push_back(SendManyRecipient(taddr1, COIN / 2, ""));
+    }
+
+    // Each pair of recipients is covered by the smallest single note above 1 + fee
+    auto batches = AsyncRPCOperation_sendmanybulk::partition(notes, recipients, 10000, 2, MAX_TX_SIZE_AFTER_SAPLING);
+    BOOST_CHECK_EQUAL(batches.size(), 3);
+    BOOST_CHECK_EQUAL(batches[0].firstRecipient, 0);
+    BOOST_CHECK_EQUAL(batches[0].recipients.size(), 2);
+    BOOST_CHECK_EQUAL(batches[0].notes.size(), 1);
+    BOOST_CHECK_EQUAL(batches[0].notes[0].note.value(), 2 * COIN);
+    BOOST_CHECK_EQUAL(batches[1].notes[0].note.value(), 3 * COIN);
+    BOOST_CHECK_EQUAL(batches[2].firstRecipient, 4);
+    BOOST_CHECK_EQUAL(batches[2].recipients.size(), 1);
+    BOOST_CHECK_EQUAL(batches[2].notes.size(), 1);
+    BOOST_CHECK_EQUAL(batches[2].notes[0].note.value(), 1 * COIN);
+
+    // Notes are never shared between transactions
+    std::set<SaplingOutPoint> reserved;
+    for (const SendManyBulkBatch& batch : batches) {
+        for (const SaplingNoteEntry& entry : batch.notes) {
+            BOOST_CHECK(reserved.insert(entry.op).second);
+        }
+    }
+
+    // Without a single note large enough, notes are accumulated from the largest down
+    recipients = { SendManyRecipient(taddr1, 7 * COIN, "") };
+    batches = AsyncRPCOperation_sendmanybulk::partition(notes, recipients, 10000, 2, MAX_TX_SIZE_AFTER_SAPLING);
+    BOOST_CHECK_EQUAL(batches.size(), 1);
+    BOOST_CHECK_EQUAL(batches[0].notes.size(), 2);
+
+    // Not enough funds for every transaction
+    recipients = { SendManyRecipient(taddr1, 6 * COIN, ""), SendManyRecipient(taddr1, 6 * COIN, "") };
+    BOOST_CHECK_THROW(AsyncRPCOperation_sendmanybulk::partition(notes, recipients, 10000, 1, MAX_TX_SIZE_AFTER_SAPLING), UniValue);
+
+    // Transaction too large
+    recipients = { SendManyRecipient(zaddr1, COIN / 2, "") };
+    BOOST_CHECK_THROW(AsyncRPCOperation_sendmanybulk::partition(notes, recipients, 10000, 1, 100), UniValue);
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
 /*
  * This test covers storing encrypted zkeys in the wallet.
  */
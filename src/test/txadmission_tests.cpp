@@ -0,0 +1,207 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "consensus/upgrades.h"
+#include "main.h"
+#include "net.h"
+#include "streams.h"
+#include "txadmission.h"
+#include "utiltime.h"
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txadmission_tests, BasicTestingSetup)
+
+static CTxAdmissionQueue* pqueue;
+
+static void RecordCommit(std::vector<uint256>& vCommitted, std::vector<bool>& vResults,
+                         CNode* pfrom, const CTransaction& tx)
+{
+    uint32_t nBranchId = CurrentEpochBranchId(1, Params().GetConsensus());
+    CValidationState state;
+    vResults.push_back(pqueue->GetStatelessResult(tx.GetHash(), nBranchId, state) && !state.IsValid());
+    vCommitted.push_back(tx.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(CommitInSubmissionOrder)
+{
+    std::vector<uint256> vSubmitted, vCommitted;
+    std::vector<bool> vResults;
+    CTxAdmissionQueue queue(boost::bind(&RecordCommit, boost::ref(vCommitted), boost::ref(vResults), _1, _2));
+    pqueue = &queue;
+    queue.Start(4);
+    BOOST_CHECK(queue.IsRunning());
+
+    // Transactions without inputs fail CheckTransaction, but are still
+    // committed, in order, with that result
+    for (int i = 0; i < 50; i++) {
+        CMutableTransaction mtx;
+        mtx.nLockTime = i;
+        vSubmitted.push_back(mtx.GetHash());
+        BOOST_CHECK_EQUAL(queue.Submit(NULL, mtx, 1), TXADMISSION_QUEUED);
+    }
+    for (int i = 0; i < 1000 && queue.size() > 0; i++)
+        MilliSleep(10);
+    queue.Stop();
+    BOOST_CHECK(!queue.IsRunning());
+
+    BOOST_CHECK(vCommitted == vSubmitted);
+    BOOST_CHECK_EQUAL(std::count(vResults.begin(), vResults.end(), true), 50);
+
+    // Only the transaction being committed has a result
+    CValidationState state;
+    BOOST_CHECK(!queue.GetStatelessResult(vSubmitted[0], CurrentEpochBranchId(1, Params().GetConsensus()), state));
+}
+
+static std::atomic<bool> fHoldCommit;
+
+static void HoldCommit(std::vector<uint256>& vCommitted, CNode* pfrom, const CTransaction& tx)
+{
+    while (fHoldCommit)
+        MilliSleep(1);
+    vCommitted.push_back(tx.GetHash());
+}
+
+static CTransaction MakeTx(int n)
+{
+    CMutableTransaction mtx;
+    mtx.nLockTime = n;
+    return mtx;
+}
+
+BOOST_AUTO_TEST_CASE(DedupeAndPeerLimit)
+{
+    std::vector<uint256> vCommitted;
+    CTxAdmissionQueue queue(boost::bind(&HoldCommit, boost::ref(vCommitted), _1, _2));
+    queue.Start(2);
+    CAddress addr(CService("127.0.0.1", 0));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    // Keep the first transaction committing, so the rest wait
+    fHoldCommit = true;
+    BOOST_CHECK_EQUAL(queue.Submit(NULL, MakeTx(0), 1), TXADMISSION_QUEUED);
+    for (int i = 0; i < 1000 && queue.size() > 0; i++)
+        MilliSleep(10);
+    BOOST_CHECK(!queue.IsQueued(MakeTx(0).GetHash()));
+
+    for (size_t i = 1; i <= MAX_TXADMISSION_QUEUE_PEER; i++) {
+        BOOST_CHECK(!node.fPauseRecvTxAdmission);
+        BOOST_CHECK_EQUAL(queue.Submit(&node, MakeTx(i), 1), TXADMISSION_QUEUED);
+    }
+    BOOST_CHECK(node.fPauseRecvTxAdmission);
+    BOOST_CHECK_EQUAL(node.GetRefCount(), (int)MAX_TXADMISSION_QUEUE_PEER);
+    BOOST_CHECK_EQUAL(queue.Submit(&node, MakeTx(MAX_TXADMISSION_QUEUE_PEER + 1), 1), TXADMISSION_REFUSED);
+    BOOST_CHECK_EQUAL(queue.Submit(NULL, MakeTx(MAX_TXADMISSION_QUEUE_PEER + 1), 1), TXADMISSION_QUEUED);
+
+    // Transactions queued or being committed already are dropped
+    BOOST_CHECK(queue.IsQueued(MakeTx(1).GetHash()));
+    BOOST_CHECK_EQUAL(queue.Submit(NULL, MakeTx(0), 1), TXADMISSION_DUPLICATE);
+    BOOST_CHECK_EQUAL(queue.Submit(NULL, MakeTx(1), 1), TXADMISSION_DUPLICATE);
+    BOOST_CHECK_EQUAL(queue.size(), MAX_TXADMISSION_QUEUE_PEER + 1);
+
+    fHoldCommit = false;
+    for (int i = 0; i < 1000 && queue.size() > 0; i++)
+        MilliSleep(10);
+    queue.Stop();
+
+    BOOST_CHECK_EQUAL(vCommitted.size(), MAX_TXADMISSION_QUEUE_PEER + 2);
+    for (size_t i = 0; i < vCommitted.size(); i++)
+        BOOST_CHECK(vCommitted[i] == MakeTx(i).GetHash());
+    BOOST_CHECK(!node.fPauseRecvTxAdmission);
+    BOOST_CHECK_EQUAL(node.GetRefCount(), 0);
+}
+
+static void AcceptCommit(std::string& strRejectReason, CNode* pfrom, const CTransaction& tx)
+{
+    LOCK(cs_main);
+    CValidationState state;
+    bool fMissingInputs;
+    AcceptToMemoryPool(mempool, state, tx, false, &fMissingInputs);
+    strRejectReason = state.GetRejectReason();
+}
+
+BOOST_FIXTURE_TEST_CASE(AcceptReusesStatelessResult, TestingSetup)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+
+    // Expired at the height it is queued for, but not at the next block,
+    // where AcceptToMemoryPool checking it again would only find its
+    // inputs missing
+    CMutableTransaction mtx;
+    mtx.fOverwintered = true;
+    mtx.nVersion = OVERWINTER_TX_VERSION;
+    mtx.nVersionGroupId = OVERWINTER_VERSION_GROUP_ID;
+    mtx.nExpiryHeight = 50;
+    mtx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    mtx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+
+    std::string strRejectReason;
+    txAdmissionQueue.Start(1);
+    BOOST_CHECK_EQUAL(txAdmissionQueue.Submit(NULL, mtx, 100, boost::bind(&AcceptCommit, boost::ref(strRejectReason), _1, _2)),
+                      TXADMISSION_QUEUED);
+    for (int i = 0; i < 1000 && txAdmissionQueue.size() > 0; i++)
+        MilliSleep(10);
+    txAdmissionQueue.Stop();
+    BOOST_CHECK_EQUAL(strRejectReason, "tx-overwinter-expired");
+
+    // Revert to default
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+    SelectParams(CBaseChainParams::MAIN);
+}
+
+static void RunLoadMempool(bool& fLoaded)
+{
+    fLoaded = LoadMempool();
+}
+
+BOOST_FIXTURE_TEST_CASE(LoadMempoolSkipsQueuedDuplicate, TestingSetup)
+{
+    std::vector<uint256> vCommitted;
+    CTxAdmissionQueue::CommitFunction commit = boost::bind(&HoldCommit, boost::ref(vCommitted), _1, _2);
+    txAdmissionQueue.Start(1);
+
+    // A peer relayed the saved transaction while the previous one commits
+    fHoldCommit = true;
+    BOOST_CHECK_EQUAL(txAdmissionQueue.Submit(NULL, MakeTx(0), 1, commit), TXADMISSION_QUEUED);
+    for (int i = 0; i < 1000 && txAdmissionQueue.size() > 0; i++)
+        MilliSleep(10);
+    BOOST_CHECK_EQUAL(txAdmissionQueue.Submit(NULL, MakeTx(1), 1, commit), TXADMISSION_QUEUED);
+
+    {
+        FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "wb");
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!file.IsNull());
+        file << (uint64_t)1 << (uint64_t)1;
+        file << MakeTx(1) << GetTime() << 0.0 << (CAmount)0;
+        file << std::map<uint256, std::pair<double, CAmount> >();
+    }
+
+    // The duplicate is never committed for the load, so it mustn't wait on it
+    bool fLoaded = false;
+    boost::thread loader(boost::bind(&RunLoadMempool, boost::ref(fLoaded)));
+    bool fJoined = loader.timed_join(boost::posix_time::seconds(10));
+    BOOST_CHECK(fJoined);
+    BOOST_CHECK(fLoaded);
+
+    fHoldCommit = false;
+    for (int i = 0; i < 1000 && txAdmissionQueue.size() > 0; i++)
+        MilliSleep(10);
+    txAdmissionQueue.Stop();
+    if (!fJoined)
+        loader.detach();
+
+    BOOST_CHECK_EQUAL(vCommitted.size(), 2U);
+    for (size_t i = 0; i < vCommitted.size(); i++)
+        BOOST_CHECK(vCommitted[i] == MakeTx(i).GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txreconciliation.h"
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txreconciliation_tests, BasicTestingSetup)
+
+static std::vector<uint32_t> Sorted(std::vector<uint32_t> v)
+{
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(sketch_decode)
+{
+    // Spread out but fixed ids, as a sketch fails to decode now and then
+    std::vector<uint32_t> vCommon, vOnlyA, vOnlyB;
+    for (uint32_t i = 0; i < 200; i++)
+        vCommon.push_back(i * 2654435761U);
+    for (uint32_t i = 200; i < 210; i++)
+        vOnlyA.push_back(i * 2654435761U);
+    for (uint32_t i = 210; i < 215; i++)
+        vOnlyB.push_back(i * 2654435761U);
+
+    size_t nCells = GetReconSketchCells(vCommon.size() + vOnlyA.size(), vCommon.size() + vOnlyB.size());
+    BOOST_CHECK(nCells <= MAX_RECON_SKETCH_CELLS);
+    CTxReconSketch a(nCells), b(nCells);
+    BOOST_CHECK_EQUAL(a.GetCells() % 3, 0U);
+    BOOST_FOREACH(uint32_t id, vCommon) {
+        a.Add(id);
+        b.Add(id);
+    }
+    BOOST_FOREACH(uint32_t id, vOnlyA)
+        a.Add(id);
+    BOOST_FOREACH(uint32_t id, vOnlyB)
+        b.Add(id);
+
+    // The sketch goes over the wire
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << b;
+    CTxReconSketch b2;
+    stream >> b2;
+    BOOST_CHECK_EQUAL(b2.GetCells(), b.GetCells());
+
+    a.Subtract(b2);
+    std::vector<uint32_t> vOurs, vTheirs;
+    BOOST_CHECK(a.Decode(vOurs, vTheirs));
+    BOOST_CHECK(Sorted(vOurs) == Sorted(vOnlyA));
+    BOOST_CHECK(Sorted(vTheirs) == Sorted(vOnlyB));
+}
+
+BOOST_AUTO_TEST_CASE(sketch_too_small)
+{
+    // Far more differences than cells can't be listed
+    CTxReconSketch a(30), b(30);
+    for (uint32_t i = 0; i < 100; i++)
+        a.Add(i * 2654435761U);
+    a.Subtract(b);
+    std::vector<uint32_t> vOurs, vTheirs;
+    BOOST_CHECK(!a.Decode(vOurs, vTheirs));
+
+    // Nor can an empty one
+    CTxReconSketch empty;
+    BOOST_CHECK(!empty.Decode(vOurs, vTheirs));
+}
+
+BOOST_AUTO_TEST_CASE(sketch_mismatched_size)
+{
+    // A peer can send a sketch of any size, which ours never are
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(stream, 4);
+    for (int i = 0; i < 4 * 3; i++)
+        stream << (uint32_t)i;
+    CTxReconSketch theirs;
+    stream >> theirs;
+    BOOST_CHECK_EQUAL(theirs.GetCells(), 4U);
+    BOOST_CHECK(theirs.GetCells() % RECON_SKETCH_HASHES != 0);
+
+    // Asked for the same number of cells, ours is rounded up
+    CTxReconSketch ours(theirs.GetCells());
+    ours.Add(1);
+    BOOST_CHECK_EQUAL(ours.GetCells(), 6U);
+    BOOST_CHECK(!ours.Subtract(theirs));
+    std::vector<uint32_t> vOurs, vTheirs;
+    BOOST_CHECK(ours.Decode(vOurs, vTheirs));
+    BOOST_CHECK(vOurs.size() == 1 && vOurs[0] == 1 && vTheirs.empty());
+}
+
+BOOST_AUTO_TEST_CASE(recon_state)
+{
+    CTxReconState a, b;
+    BOOST_CHECK(!a.Add(GetRandHash()));
+
+    // Both sides agree on the short ids, whichever made the connection
+    a.Enable(true, b.nLocalSalt);
+    b.Enable(false, a.nLocalSalt);
+    BOOST_CHECK(a.fInitiator && !b.fInitiator);
+    uint256 txid = GetRandHash();
+    BOOST_CHECK_EQUAL(a.GetShortID(txid), b.GetShortID(txid));
+
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 20; i++) {
+        vTxids.push_back(GetRandHash());
+        BOOST_CHECK(a.Add(vTxids.back()));
+    }
+    // Adding a transaction again is harmless
+    BOOST_CHECK(a.Add(vTxids[0]));
+    BOOST_CHECK_EQUAL(a.GetSetSize(), 20U);
+
+    a.StartRound(1);
+    BOOST_CHECK_EQUAL(a.GetSetSize(), 0U);
+    BOOST_CHECK_EQUAL(a.GetSnapshot().size(), 20U);
+    BOOST_CHECK(a.Add(GetRandHash()));
+    BOOST_CHECK_EQUAL(a.GetSetSize(), 1U);
+
+    // Only the asked for transactions are handed back, and unknown ids are skipped
+    std::vector<uint32_t> vShortIDs;
+    vShortIDs.push_back(a.GetShortID(vTxids[3]));
+    vShortIDs.push_back(a.GetShortID(vTxids[7]));
+    vShortIDs.push_back(a.GetShortID(GetRandHash()));
+    std::vector<uint256> vFound = a.FinishRound(&vShortIDs);
+    BOOST_CHECK_EQUAL(vFound.size(), 2U);
+    BOOST_CHECK(vFound[0] == vTxids[3]);
+    BOOST_CHECK(vFound[1] == vTxids[7]);
+    BOOST_CHECK_EQUAL(a.nRoundStart, 0);
+    BOOST_CHECK(a.GetSnapshot().empty());
+
+    // A failed round hands back the whole set
+    a.StartRound(2);
+    BOOST_CHECK_EQUAL(a.FinishRound().size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -252,6 +252,9 @@ TransactionBuilderResult TransactionBuilder::Build()
     // Sapling spends and outputs
     //
 
+    // The proofs are created one at a time on a single context: it sums the
+    // value commitment randomness the binding signature is made with, and
+    // librustzcash offers no way to combine contexts from several threads.
     auto ctx = librustzcash_sapling_proving_ctx_init();
 
     // Create Sapling SpendDescriptions
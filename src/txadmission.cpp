@@ -0,0 +1,190 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txadmission.h"
+
+#include "chainparams.h"
+#include "consensus/upgrades.h"
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+CTxAdmissionQueue::CTxAdmissionQueue(const CommitFunction& commitIn) :
+    commit(commitIn), nThreads(0), itNext(queue.end()), fCommitting(false), nBranchCommitting(0)
+{
+}
+
+CTxAdmissionQueue::~CTxAdmissionQueue()
+{
+    Stop();
+}
+
+void CTxAdmissionQueue::Start(int nThreadsIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nThreads > 0 || nThreadsIn <= 0)
+        return;
+    nThreads = nThreadsIn;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CTxAdmissionQueue::Thread, this));
+}
+
+void CTxAdmissionQueue::Stop()
+{
+    threads.interrupt_all();
+    threads.join_all();
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (std::list<Job>::iterator it = queue.begin(); it != queue.end(); it++) {
+        if (it->pfrom)
+            ReleasePeer(it->pfrom);
+    }
+    queue.clear();
+    setQueued.clear();
+    itNext = queue.end();
+    fCommitting = false;
+    nThreads = 0;
+}
+
+bool CTxAdmissionQueue::IsRunning() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nThreads > 0;
+}
+
+size_t CTxAdmissionQueue::size() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queue.size();
+}
+
+TxAdmissionResult CTxAdmissionQueue::Submit(CNode* pfrom, const CTransaction& tx, int nHeight, const CommitFunction& commitIn)
+{
+    Job job;
+    job.pfrom = pfrom;
+    job.tx = tx;
+    job.commit = commitIn;
+    job.nHeight = nHeight;
+    job.nBranchId = CurrentEpochBranchId(nHeight, Params().GetConsensus());
+    job.fChecked = false;
+
+    uint256 hash = tx.GetHash();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // Nothing would pick the job up after Stop
+    if (nThreads == 0)
+        return TXADMISSION_REFUSED;
+    if (setQueued.count(hash) || hash == hashCommitting)
+        return TXADMISSION_DUPLICATE;
+    if (queue.size() >= MAX_TXADMISSION_QUEUE_SIZE)
+        return TXADMISSION_REFUSED;
+    if (pfrom) {
+        size_t& nQueuedPeer = mapQueuedPeer[pfrom];
+        if (nQueuedPeer >= MAX_TXADMISSION_QUEUE_PEER)
+            return TXADMISSION_REFUSED;
+        if (++nQueuedPeer >= MAX_TXADMISSION_QUEUE_PEER)
+            pfrom->fPauseRecvTxAdmission = true;
+        pfrom->AddRef();
+    }
+    setQueued.insert(hash);
+    queue.push_back(job);
+    if (itNext == queue.end())
+        itNext = --queue.end();
+    condWorker.notify_one();
+    return TXADMISSION_QUEUED;
+}
+
+bool CTxAdmissionQueue::IsQueued(const uint256& hash) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return setQueued.count(hash) > 0;
+}
+
+void CTxAdmissionQueue::ReleasePeer(CNode* pfrom)
+{
+    std::map<CNode*, size_t>::iterator it = mapQueuedPeer.find(pfrom);
+    if (it != mapQueuedPeer.end() && --it->second == 0)
+        mapQueuedPeer.erase(it);
+    pfrom->fPauseRecvTxAdmission = false;
+    pfrom->Release();
+}
+
+bool CTxAdmissionQueue::GetStatelessResult(const uint256& hash, uint32_t nBranchId, CValidationState& state) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (hashCommitting.IsNull() || hash != hashCommitting || nBranchId != nBranchCommitting)
+        return false;
+    state = stateCommitting;
+    return true;
+}
+
+void CTxAdmissionQueue::Thread()
+{
+    RenameThread("zprime-txverify");
+    while (true) {
+        std::list<Job>::iterator it;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (itNext == queue.end())
+                condWorker.wait(lock);
+            it = itNext++;
+        }
+
+        // The job stays in the queue until it is committed, and only this
+        // thread touches it until fChecked is set
+        CValidationState state;
+        auto verifier = libzprime::ProofVerifier::Strict();
+        if (!CheckTransaction(it->tx, state, verifier)) {
+            LogPrint("mempool", "%s: CheckTransaction failed for %s\n", __func__, it->tx.GetHash().ToString());
+        } else if (!ContextualCheckTransaction(it->tx, state, it->nHeight, 10)) {
+            LogPrint("mempool", "%s: ContextualCheckTransaction failed for %s\n", __func__, it->tx.GetHash().ToString());
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            it->state = state;
+            it->fChecked = true;
+            if (fCommitting)
+                continue;
+            fCommitting = true;
+        }
+        CommitChecked();
+    }
+}
+
+void CTxAdmissionQueue::CommitChecked()
+{
+    while (true) {
+        boost::this_thread::interruption_point();
+        Job job;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (queue.empty() || !queue.front().fChecked) {
+                fCommitting = false;
+                return;
+            }
+            job = queue.front();
+            queue.pop_front();
+            hashCommitting = job.tx.GetHash();
+            setQueued.erase(hashCommitting);
+            nBranchCommitting = job.nBranchId;
+            stateCommitting = job.state;
+        }
+
+        try {
+            if (job.commit)
+                job.commit(job.pfrom, job.tx);
+            else
+                commit(job.pfrom, job.tx);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (job.pfrom)
+            ReleasePeer(job.pfrom);
+        hashCommitting.SetNull();
+    }
+}
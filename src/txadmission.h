@@ -0,0 +1,126 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXADMISSION_H
+#define BITCOIN_TXADMISSION_H
+
+#include "consensus/validation.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <set>
+
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CNode;
+
+/** Default for -txverifythreads, 0 = check transactions in the message handler */
+static const int DEFAULT_TXVERIFY_THREADS = 2;
+/** Maximum number of transaction verification threads */
+static const int MAX_TXVERIFY_THREADS = 16;
+/** Maximum number of transactions waiting in the admission queue */
+static const size_t MAX_TXADMISSION_QUEUE_SIZE = 5000;
+/** Maximum number of those that may come from a single peer */
+static const size_t MAX_TXADMISSION_QUEUE_PEER = 100;
+
+/** What became of a transaction handed to CTxAdmissionQueue::Submit */
+enum TxAdmissionResult {
+    TXADMISSION_REFUSED,   //! not queued, so left to the caller
+    TXADMISSION_QUEUED,    //! will be checked and committed
+    TXADMISSION_DUPLICATE, //! dropped, as it is queued or being committed already
+};
+
+/**
+ * Splits mempool admission of relayed transactions in two. The stateless
+ * checks (proofs, the signatures over the shielded sighash, and sanity
+ * checks) run on a pool of worker threads without cs_main. Each transaction
+ * is then handed to the commit function, one at a time and in the order they
+ * were submitted, for the checks against the chain state and the mempool.
+ *
+ * While a transaction is being committed, AcceptToMemoryPool picks up the
+ * outcome of its stateless checks through GetStatelessResult instead of
+ * running them again under cs_main.
+ *
+ * A peer with MAX_TXADMISSION_QUEUE_PEER transactions waiting has receiving
+ * paused until one of them is committed.
+ */
+class CTxAdmissionQueue
+{
+public:
+    typedef boost::function<void (CNode* pfrom, const CTransaction& tx)> CommitFunction;
+
+    explicit CTxAdmissionQueue(const CommitFunction& commitIn);
+    ~CTxAdmissionQueue();
+
+    void Start(int nThreads);
+    void Stop();
+    bool IsRunning() const;
+
+    /**
+     * Queue tx received from pfrom (which may be NULL) to be checked against
+     * the rules for block nHeight, and then committed with commitIn if given.
+     * Refuses tx if the queue is not running or is full, overall or for
+     * pfrom. A tx that is queued or being committed already is dropped,
+     * without calling commitIn.
+     */
+    TxAdmissionResult Submit(CNode* pfrom, const CTransaction& tx, int nHeight, const CommitFunction& commitIn = CommitFunction());
+
+    /** Whether a transaction is waiting to be committed */
+    bool IsQueued(const uint256& hash) const;
+
+    /**
+     * Get the outcome of the stateless checks for the transaction being
+     * committed, if it is hash and was checked under consensus branch nBranchId.
+     */
+    bool GetStatelessResult(const uint256& hash, uint32_t nBranchId, CValidationState& state) const;
+
+    /** Number of transactions submitted and not yet committed */
+    size_t size() const;
+
+private:
+    struct Job {
+        CNode* pfrom;
+        CTransaction tx;
+        CommitFunction commit;
+        int nHeight;
+        uint32_t nBranchId;
+        bool fChecked;
+        CValidationState state;
+    };
+
+    CommitFunction commit;
+
+    mutable boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::thread_group threads;
+    int nThreads;
+
+    //! Submitted transactions, oldest first
+    std::list<Job> queue;
+    //! The first job no worker has picked up yet
+    std::list<Job>::iterator itNext;
+    //! Whether a worker is committing; only one commits at a time
+    bool fCommitting;
+    //! Hashes of the queued transactions
+    std::set<uint256> setQueued;
+    //! Number of queued transactions from each peer that has any
+    std::map<CNode*, size_t> mapQueuedPeer;
+
+    //! The job being committed
+    uint256 hashCommitting;
+    uint32_t nBranchCommitting;
+    CValidationState stateCommitting;
+
+    void Thread();
+    void CommitChecked();
+    //! Give up a job's hold on pfrom; requires mutex
+    void ReleasePeer(CNode* pfrom);
+};
+
+#endif // BITCOIN_TXADMISSION_H
@@ -20,7 +20,9 @@ using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
     nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0),
-    hadNoDependencies(false), spendsCoinbase(false)
+    hadNoDependencies(false), spendsCoinbase(false), feeDelta(0),
+    nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0),
+    nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -31,12 +33,20 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  bool _spendsCoinbase, uint32_t _nBranchId):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
     hadNoDependencies(poolHasNoInputsOf),
-    spendsCoinbase(_spendsCoinbase), nBranchId(_nBranchId)
+    spendsCoinbase(_spendsCoinbase), nBranchId(_nBranchId), feeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
     nModSize = tx.CalculateModifiedSize(nTxSize);
     nUsageSize = RecursiveDynamicUsage(tx);
     feeRate = CFeeRate(nFee, nTxSize);
+
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -53,8 +63,257 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateFeeDelta(int64_t newFeeDelta)
+{
+    nModFeesWithDescendants += newFeeDelta - feeDelta;
+    nModFeesWithAncestors += newFeeDelta - feeDelta;
+    feeDelta = newFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithAncestors += modifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nModFeesWithAncestors += modifyFee;
+    nCountWithAncestors += modifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+// Update the given tx for any in-mempool descendants.
+// Assumes that the children of updateIt are already linked in mapLinks.
+void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap& cachedDescendants, const std::set<uint256>& setExclude)
+{
+    setEntries stageEntries, setAllDescendants;
+    stageEntries = GetMemPoolChildren(updateIt);
+
+    while (!stageEntries.empty()) {
+        const txiter cit = *stageEntries.begin();
+        setAllDescendants.insert(cit);
+        stageEntries.erase(cit);
+        const setEntries& setChildren = GetMemPoolChildren(cit);
+        BOOST_FOREACH(const txiter childEntry, setChildren) {
+            cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
+            if (cacheIt != cachedDescendants.end()) {
+                // We've already calculated this one, just add the entries for this set
+                // but don't traverse again.
+                BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
+                    setAllDescendants.insert(cacheEntry);
+                }
+            } else if (!setAllDescendants.count(childEntry)) {
+                // Schedule for later processing
+                stageEntries.insert(childEntry);
+            }
+        }
+    }
+    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // Update and add to cached descendant map
+    int64_t modifySize = 0;
+    CAmount modifyFee = 0;
+    int64_t modifyCount = 0;
+    BOOST_FOREACH(txiter cit, setAllDescendants) {
+        if (!setExclude.count(cit->GetTx().GetHash())) {
+            modifySize += cit->GetTxSize();
+            modifyFee += cit->GetModifiedFee();
+            modifyCount++;
+            cachedDescendants[updateIt].insert(cit);
+            // Update ancestor state for each descendant
+            mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1));
+        }
+    }
+    mapTx.modify(updateIt, update_descendant_state(modifySize, modifyFee, modifyCount));
+}
+
+void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256>& vHashesToUpdate)
+{
+    LOCK(cs);
+    // For each entry in vHashesToUpdate, store the set of in-mempool, but not
+    // in-vHashesToUpdate transactions, so that we don't have to recalculate
+    // descendants when we come across a previously seen entry.
+    cacheMap mapMemPoolDescendantsToUpdate;
+
+    // Use a set for lookups into vHashesToUpdate (these entries are already
+    // accounted for in the state of their ancestors)
+    std::set<uint256> setAlreadyIncluded(vHashesToUpdate.begin(), vHashesToUpdate.end());
+
+    // Iterate in reverse, so that whenever we are looking at a transaction
+    // we are sure that all in-mempool descendants have already been processed.
+    // This maximizes the benefit of the descendant cache and guarantees that
+    // the children of each entry are linked before UpdateForDescendants.
+    BOOST_REVERSE_FOREACH(const uint256& hash, vHashesToUpdate) {
+        // we cache the in-mempool children to avoid duplicate updates
+        setEntries setChildren;
+        txiter it = mapTx.find(hash);
+        if (it == mapTx.end())
+            continue;
+        // First calculate the children from mapNextTx, link them to this
+        // entry and this entry to them.
+        for (unsigned int i = 0; i < it->GetTx().vout.size(); i++) {
+            nextTxMap::iterator iter = mapNextTx.find(COutPoint(hash, i));
+            if (iter == mapNextTx.end())
+                continue;
+            const uint256& childHash = iter->second.ptx->GetHash();
+            txiter childIter = mapTx.find(childHash);
+            assert(childIter != mapTx.end());
+            // We can skip updating entries we've encountered before or that
+            // are in the block (which are already accounted for).
+            if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
+                UpdateChild(it, childIter, true);
+                UpdateParent(childIter, it, true);
+            }
+        }
+        UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                           uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                           uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                           std::string& errString, bool fSearchForParents) const
+{
+    LOCK(cs);
+
+    setEntries parentHashes;
+    const CTransaction& tx = entry.GetTx();
+
+    if (fSearchForParents) {
+        // Get parents of this transaction that are in the mempool.
+        // GetMemPoolParents() is only valid for entries in the mempool, so we
+        // look the inputs up in mapTx instead.
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            txiter piter = mapTx.find(tx.vin[i].prevout.hash);
+            if (piter != mapTx.end()) {
+                parentHashes.insert(piter);
+                if (parentHashes.size() + 1 > limitAncestorCount) {
+                    errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+                    return false;
+                }
+            }
+        }
+    } else {
+        // If we're not searching for parents, we require this to be an
+        // entry in the mempool already.
+        txiter it = mapTx.iterator_to(entry);
+        parentHashes = GetMemPoolParents(it);
+    }
+
+    size_t totalSizeWithAncestors = entry.GetTxSize();
+
+    while (!parentHashes.empty()) {
+        txiter stageit = *parentHashes.begin();
+
+        setAncestors.insert(stageit);
+        parentHashes.erase(stageit);
+        totalSizeWithAncestors += stageit->GetTxSize();
+
+        if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantSize);
+            return false;
+        } else if (stageit->GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantCount);
+            return false;
+        } else if (totalSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
+
+        const setEntries& setMemPoolParents = GetMemPoolParents(stageit);
+        BOOST_FOREACH(const txiter& phash, setMemPoolParents) {
+            // If this is a new ancestor, add it.
+            if (setAncestors.count(phash) == 0) {
+                parentHashes.insert(phash);
+            }
+            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries& setAncestors)
+{
+    setEntries parentIters = GetMemPoolParents(it);
+    // add or remove this tx as a child of each parent
+    BOOST_FOREACH(txiter piter, parentIters) {
+        UpdateChild(piter, it, add);
+    }
+    const int64_t updateCount = (add ? 1 : -1);
+    const int64_t updateSize = updateCount * it->GetTxSize();
+    const CAmount updateFee = updateCount * it->GetModifiedFee();
+    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+        mapTx.modify(ancestorIt, update_descendant_state(updateSize, updateFee, updateCount));
+    }
+}
+
+void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries& setAncestors)
+{
+    int64_t updateCount = setAncestors.size();
+    int64_t updateSize = 0;
+    CAmount updateFee = 0;
+    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+        updateSize += ancestorIt->GetTxSize();
+        updateFee += ancestorIt->GetModifiedFee();
+    }
+    mapTx.modify(it, update_ancestor_state(updateSize, updateFee, updateCount));
+}
+
+void CTxMemPool::UpdateChildrenForRemoval(txiter it)
+{
+    const setEntries& setMemPoolChildren = GetMemPoolChildren(it);
+    BOOST_FOREACH(txiter updateIt, setMemPoolChildren) {
+        UpdateParent(updateIt, it, false);
+    }
+}
+
+void CTxMemPool::UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool updateDescendants)
+{
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    if (updateDescendants) {
+        // Only the statistics are updated here; mapLinks must stay intact
+        // until every removal below has walked it.
+        BOOST_FOREACH(txiter removeIt, entriesToRemove) {
+            setEntries setDescendants;
+            CalculateDescendants(removeIt, setDescendants);
+            setDescendants.erase(removeIt); // don't update state for self
+            int64_t modifySize = -((int64_t)removeIt->GetTxSize());
+            CAmount modifyFee = -removeIt->GetModifiedFee();
+            BOOST_FOREACH(txiter dit, setDescendants) {
+                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1));
+            }
+        }
+    }
+    BOOST_FOREACH(txiter removeIt, entriesToRemove) {
+        setEntries setAncestors;
+        std::string dummy;
+        // Walk mapLinks rather than the inputs: while a disconnected block is
+        // being added back, before UpdateTransactionsFromBlock has run, the
+        // linked ancestors are exactly those whose state includes this entry.
+        CalculateMemPoolAncestors(*removeIt, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        // Note that UpdateAncestorsOf severs the child links that point to
+        // removeIt in the entries for the parents of removeIt.
+        UpdateAncestorsOf(false, removeIt, setAncestors);
+    }
+    // After updating all the ancestor sizes, we can now sever the link between each
+    // transaction being removed and any mempool children.
+    BOOST_FOREACH(txiter removeIt, entriesToRemove) {
+        UpdateChildrenForRemoval(removeIt);
+    }
+}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), lastRollingFeeUpdate(GetTime()),
+    blockSinceLastRollingFeeBump(false), rollingMinimumFeeRate(0), fLoaded(false)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -73,12 +332,10 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 {
     LOCK(cs);
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
+    // look up each of the outputs in mapNextTx, and remove the spent ones from coins
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (mapNextTx.count(COutPoint(hashTx, i)))
+            coins.Spend(i);
     }
 }
 
@@ -96,15 +353,44 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 
 
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
+{
+    LOCK(cs);
+    setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+    return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    mapTx.insert(entry);
-    const CTransaction& tx = mapTx.find(hash)->GetTx();
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    std::pair<txiter, bool> inserted = mapTx.insert(entry);
+    if (!inserted.second)
+        return false;
+    txiter newit = inserted.first;
+    mapLinks.insert(make_pair(newit, TxLinks()));
+
+    // Update transaction for any feeDelta created by PrioritiseTransaction
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second)
+        mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+    const CTransaction& tx = newit->GetTx();
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        // A new entry can't have children in the pool, unless it was in a
+        // block that got disconnected; UpdateTransactionsFromBlock links
+        // those afterwards.
+        txiter pit = mapTx.find(tx.vin[i].prevout.hash);
+        if (pit != mapTx.end())
+            UpdateParent(newit, pit, true);
+    }
+    UpdateAncestorsOf(true, newit, setAncestors);
+    UpdateEntryForAncestors(newit, setAncestors);
     BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
         BOOST_FOREACH(const uint256 &nf, joinsplit.nullifiers) {
             mapSproutNullifiers[nf] = &tx;
@@ -117,61 +403,95 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     totalTxSize += entry.GetTxSize();
     cachedInnerUsage += entry.DynamicMemoryUsage();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
+    NotifyEntryAdded(hash);
 
     return true;
 }
 
 
+void CTxMemPool::removeUnchecked(txiter it, std::list<CTransaction>& removed)
+{
+    const uint256 hash = it->GetTx().GetHash();
+    const CTransaction& tx = it->GetTx();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapNextTx.erase(txin.prevout);
+    BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+        BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
+            mapSproutNullifiers.erase(nf);
+        }
+    }
+    for (const SpendDescription &spendDescription : tx.vShieldedSpend) {
+        mapSaplingNullifiers.erase(spendDescription.nullifier);
+    }
+    removed.push_back(tx);
+    totalTxSize -= it->GetTxSize();
+    cachedInnerUsage -= it->DynamicMemoryUsage();
+    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
+    mapLinks.erase(it);
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+    minerPolicyEstimator->removeTx(hash);
+    NotifyEntryRemoved(hash);
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants) const
+{
+    setEntries stage;
+    if (setDescendants.count(entryit) == 0) {
+        stage.insert(entryit);
+    }
+    // Traverse down the children of entry, only adding children that are not
+    // accounted for in setDescendants already (because those children have either
+    // already been walked, or will be walked in this iteration).
+    while (!stage.empty()) {
+        txiter it = *stage.begin();
+        setDescendants.insert(it);
+        stage.erase(it);
+
+        const setEntries& setChildren = GetMemPoolChildren(it);
+        BOOST_FOREACH(const txiter& childiter, setChildren) {
+            if (!setDescendants.count(childiter)) {
+                stage.insert(childiter);
+            }
+        }
+    }
+}
+
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        setEntries txToRemove;
+        txiter origit = mapTx.find(origTx.GetHash());
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                nextTxMap::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                assert(nextit != mapTx.end());
+                txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty())
-        {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx.find(hash)->GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
-                BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
-                    mapSproutNullifiers.erase(nf);
-                }
-            }
-            for (const SpendDescription &spendDescription : tx.vShieldedSpend) {
-                mapSaplingNullifiers.erase(spendDescription.nullifier);
+        setEntries setAllRemoves;
+        if (fRecursive) {
+            BOOST_FOREACH(txiter it, txToRemove) {
+                CalculateDescendants(it, setAllRemoves);
             }
-            removed.push_back(tx);
-            totalTxSize -= mapTx.find(hash)->GetTxSize();
-            cachedInnerUsage -= mapTx.find(hash)->DynamicMemoryUsage();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-            minerPolicyEstimator->removeTx(hash);
+        } else {
+            setAllRemoves.swap(txToRemove);
+        }
+        // Descendants left behind by a non-recursive remove lose an ancestor
+        UpdateForRemoveFromMempool(setAllRemoves, !fRecursive);
+        BOOST_FOREACH(txiter it, setAllRemoves) {
+            removeUnchecked(it, removed);
         }
     }
 }
@@ -252,7 +572,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
     list<CTransaction> result;
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        nextTxMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
@@ -264,7 +584,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 
     BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
         BOOST_FOREACH(const uint256 &nf, joinsplit.nullifiers) {
-            std::map<uint256, const CTransaction*>::iterator it = mapSproutNullifiers.find(nf);
+            nullifierMap::iterator it = mapSproutNullifiers.find(nf);
             if (it != mapSproutNullifiers.end()) {
                 const CTransaction &txConflict = *it->second;
                 if (txConflict != tx) {
@@ -274,7 +594,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
         }
     }
     for (const SpendDescription &spendDescription : tx.vShieldedSpend) {
-        std::map<uint256, const CTransaction*>::iterator it = mapSaplingNullifiers.find(spendDescription.nullifier);
+        nullifierMap::iterator it = mapSaplingNullifiers.find(spendDescription.nullifier);
         if (it != mapSaplingNullifiers.end()) {
             const CTransaction &txConflict = *it->second;
             if (txConflict != tx) {
@@ -286,15 +606,17 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 
 void CTxMemPool::removeExpired(unsigned int nBlockHeight)
 {
-    // Remove expired txs from the mempool
+    // Remove expired txs from the mempool. The expiry index puts the entries
+    // that expire first at the front, so stop at the first one still valid.
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++)
+    typedef indexed_transaction_set::index<expiry_height>::type::const_iterator expiryiter;
+    for (expiryiter it = mapTx.get<expiry_height>().begin(); it != mapTx.get<expiry_height>().end(); it++)
     {
         const CTransaction& tx = it->GetTx();
-        if (IsExpiredTx(tx, nBlockHeight)) {
-            transactionsToRemove.push_back(tx);
-        }
+        if (!IsExpiredTx(tx, nBlockHeight))
+            break;
+        transactionsToRemove.push_back(tx);
     }
     for (const CTransaction& tx : transactionsToRemove) {
         list<CTransaction> removed;
@@ -328,6 +650,8 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 /**
@@ -355,10 +679,16 @@ void CTxMemPool::removeWithoutBranchId(uint32_t nMemPoolBranchId)
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapSproutNullifiers.clear();
+    mapSaplingNullifiers.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -385,7 +715,12 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
+        txlinksMap::const_iterator linksiter = mapLinks.find(it);
+        assert(linksiter != mapLinks.end());
+        const TxLinks& links = linksiter->second;
+        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
             indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
@@ -393,17 +728,59 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            nextTxMap::const_iterator it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == GetMemPoolParents(it));
+
+        // Verify the ancestor state against the linked ancestors
+        setEntries setAncestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+        uint64_t nCountCheck = setAncestors.size() + 1;
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+            nSizeCheck += ancestorIt->GetTxSize();
+            nFeesCheck += ancestorIt->GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == nCountCheck);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+
+        // Check the children against mapNextTx, and the descendant state
+        // against the descendants
+        setEntries setChildrenCheck;
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            nextTxMap::const_iterator iter = mapNextTx.find(COutPoint(tx.GetHash(), i));
+            if (iter == mapNextTx.end())
+                continue;
+            txiter childit = mapTx.find(iter->second.ptx->GetHash());
+            assert(childit != mapTx.end()); // mapNextTx points to in-mempool transactions
+            setChildrenCheck.insert(childit);
+        }
+        assert(setChildrenCheck == GetMemPoolChildren(it));
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH(txiter descendantIt, setDescendants) {
+            nSizeCheck += descendantIt->GetTxSize();
+            nFeesCheck += descendantIt->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size());
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
 
         boost::unordered_map<uint256, SproutMerkleTree, CCoinsKeyHasher> intermediates;
 
@@ -460,7 +837,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (nextTxMap::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->GetTx();
@@ -479,7 +856,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
 void CTxMemPool::checkNullifiers(ShieldedType type) const
 {
-    const std::map<uint256, const CTransaction*>* mapToUse;
+    const nullifierMap* mapToUse;
     switch (type) {
         case SPROUT:
             mapToUse = &mapSproutNullifiers;
@@ -509,6 +886,21 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
         vtxid.push_back(mi->GetTx().GetHash());
 }
 
+bool CTxMemPool::CompareDepthAndTime(const uint256& hasha, const uint256& hashb)
+{
+    LOCK(cs);
+    indexed_transaction_set::const_iterator i = mapTx.find(hasha);
+    if (i == mapTx.end()) return false;
+    indexed_transaction_set::const_iterator j = mapTx.find(hashb);
+    if (j == mapTx.end()) return true;
+    uint64_t counta = i->GetCountWithAncestors();
+    uint64_t countb = j->GetCountWithAncestors();
+    if (counta == countb) {
+        return i->GetTime() < j->GetTime();
+    }
+    return counta < countb;
+}
+
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
@@ -571,6 +963,27 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end()) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            // Now update all ancestors' modified fees with descendants
+            setEntries setAncestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+                mapTx.modify(ancestorIt, update_descendant_state(0, nFeeDelta, 0));
+            }
+            // ... and all descendants' modified fees with ancestors
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            BOOST_FOREACH(txiter descendantIt, setDescendants) {
+                mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0));
+            }
+        }
+        // Block templates built since are out of date
+        nTransactionsUpdated++;
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -635,8 +1048,122 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
     return mempool.exists(txid) || base->HaveCoins(txid);
 }
 
+bool CTxMemPool::IsLoaded() const
+{
+    LOCK(cs);
+    return fLoaded;
+}
+
+void CTxMemPool::SetIsLoaded(bool fLoadedIn)
+{
+    LOCK(cs);
+    fLoaded = fLoadedIn;
+}
+
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 6 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 6 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + cachedInnerUsage;
+    // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapSproutNullifiers) + memusage::DynamicUsage(mapSaplingNullifiers) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < ::minRelayTxFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), ::minRelayTxFee);
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+
+    unsigned nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        // Anything that enters the pool from now on has to pay more than the
+        // package just evicted, by at least the relay fee, so that a flood
+        // of transactions cannot cycle through the pool for free.
+        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + ::minRelayTxFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nTxnRemoved += stage.size();
+
+        std::list<CTransaction> removedTxs;
+        UpdateForRemoveFromMempool(stage, false);
+        BOOST_FOREACH(txiter iter, stage) {
+            removeUnchecked(iter, removedTxs);
+        }
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries s;
+    if (add && mapLinks[entry].children.insert(child).second) {
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
+    } else if (!add && mapLinks[entry].children.erase(child)) {
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    }
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries s;
+    if (add && mapLinks[entry].parents.insert(parent).second) {
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
+    } else if (!add && mapLinks[entry].parents.erase(parent)) {
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    }
 }
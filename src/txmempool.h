@@ -6,7 +6,9 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <limits>
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
@@ -17,6 +19,9 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 
+#include <boost/signals2/signal.hpp>
+#include <boost/unordered_map.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -35,7 +40,9 @@ inline bool AllowFree(double dPriority)
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
- * CTxMemPool stores these:
+ * CTxMemPool stores these, along with the aggregate size and fees of each
+ * entry's in-mempool ancestors and descendants (each including the entry
+ * itself). Fees in these aggregates are modified by PrioritiseTransaction.
  */
 class CTxMemPoolEntry
 {
@@ -52,6 +59,15 @@ private:
     bool hadNoDependencies; //! Not dependent on any other txs when it entered the mempool
     bool spendsCoinbase; //! keep track of transactions that spend a coinbase
     uint32_t nBranchId; //! Branch ID this transaction is known to commit to, cached for efficiency
+    int64_t feeDelta; //! Fee delta from PrioritiseTransaction
+
+    uint64_t nCountWithDescendants; //! Number of in-mempool descendants, including this one
+    uint64_t nSizeWithDescendants; //! ... and their total size
+    CAmount nModFeesWithDescendants; //! ... and their total modified fees
+
+    uint64_t nCountWithAncestors; //! Number of in-mempool ancestors, including this one
+    uint64_t nSizeWithAncestors; //! ... and their total size
+    CAmount nModFeesWithAncestors; //! ... and their total modified fees
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -72,6 +88,60 @@ public:
 
     bool GetSpendsCoinbase() const { return spendsCoinbase; }
     uint32_t GetValidatedBranchId() const { return nBranchId; }
+
+    CAmount GetModifiedFee() const { return nFee + feeDelta; }
+    void UpdateFeeDelta(int64_t newFeeDelta);
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(int64_t _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    int64_t feeDelta;
 };
 
 // extracts a TxMemPoolEntry's transaction hash
@@ -87,7 +157,7 @@ struct mempoolentry_txid
 class CompareTxMemPoolEntryByFee
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         if (a.GetFeeRate() == b.GetFeeRate())
             return a.GetTime() < b.GetTime();
@@ -95,6 +165,61 @@ public:
     }
 };
 
+/**
+ * Sort by the fee rate of an entry together with its in-mempool ancestors,
+ * the rate a miner earns by including the whole package.
+ */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+        double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/**
+ * Sort by the fee rate of an entry together with its in-mempool descendants,
+ * lowest first: the package whose eviction costs the least when the pool is
+ * full. Among equal rates the newest entry goes first.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModFeesWithDescendants() * b.GetSizeWithDescendants();
+        double f2 = (double)b.GetModFeesWithDescendants() * a.GetSizeWithDescendants();
+        if (f1 == f2)
+            return a.GetTime() > b.GetTime();
+        return f1 < f2;
+    }
+};
+
+// extracts the height after which a TxMemPoolEntry expires; entries that
+// never expire sort last
+struct mempoolentry_expiry
+{
+    typedef uint32_t result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        const CTransaction& tx = entry.GetTx();
+        if (tx.nExpiryHeight == 0 || tx.IsCoinBase())
+            return std::numeric_limits<uint32_t>::max();
+        return tx.nExpiryHeight;
+    }
+};
+
+// Multi_index tag names
+struct ancestor_score {};
+struct descendant_score {};
+struct expiry_height {};
+
 class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -131,12 +256,26 @@ private:
     uint64_t totalTxSize = 0; //! sum of all mempool tx' byte sizes
     uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
 
-    std::map<uint256, const CTransaction*> mapSproutNullifiers;
-    std::map<uint256, const CTransaction*> mapSaplingNullifiers;
+public:
+    typedef boost::unordered_map<uint256, const CTransaction*, CCoinsKeyHasher> nullifierMap;
+    typedef boost::unordered_map<COutPoint, CInPoint, COutPointHasher> nextTxMap;
+
+private:
+    nullifierMap mapSproutNullifiers;
+    nullifierMap mapSaplingNullifiers;
+
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
 
+    bool fLoaded; //! whether the pool has been loaded from disk at startup
+
+    void trackPackageRemoved(const CFeeRate& rate);
     void checkNullifiers(ShieldedType type) const;
-    
+
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
+
     typedef boost::multi_index_container<
         CTxMemPoolEntry,
         boost::multi_index::indexed_by<
@@ -146,15 +285,66 @@ public:
             boost::multi_index::ordered_non_unique<
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByFee
+            >,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee
+            >,
+            // sorted by fee rate with descendants, lowest first
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by expiry height
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<expiry_height>,
+                mempoolentry_expiry
             >
         >
     > indexed_transaction_set;
 
     mutable CCriticalSection cs;
     indexed_transaction_set mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    const setEntries & GetMemPoolParents(txiter entry) const;
+    const setEntries & GetMemPoolChildren(txiter entry) const;
+
+private:
+    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+
+public:
+    nextTxMap mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /**
+     * Called with cs held whenever a transaction enters or leaves the pool.
+     * Each call corresponds to one increment of GetTransactionsUpdated().
+     */
+    boost::signals2::signal<void (const uint256&)> NotifyEntryAdded;
+    boost::signals2::signal<void (const uint256&)> NotifyEntryRemoved;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -167,17 +357,66 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(double dFrequency = 1.0) { nCheckFrequency = static_cast<uint32_t>(dFrequency * 4294967295.0); }
 
+    /**
+     * addUnchecked must update the state of all ancestors of the entry being
+     * added; the overload taking setAncestors lets AcceptToMemoryPool pass the
+     * ancestors it already computed while checking the package limits.
+     */
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate = true);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeWithAnchor(const uint256 &invalidRoot, ShieldedType type);
     void removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
+    /** Remove the transactions that expire before nBlockHeight, walking the expiry index */
     void removeExpired(unsigned int nBlockHeight);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void removeWithoutBranchId(uint32_t nMemPoolBranchId);
     void clear();
+
+    /**
+     * Called after transactions from a disconnected block have been added
+     * back to the pool, in block order. Those transactions may have in-mempool
+     * children that addUnchecked could not know about; link them and fix up
+     * the ancestor and descendant state.
+     */
+    void UpdateTransactionsFromBlock(const std::vector<uint256>& vHashesToUpdate);
+
+    /**
+     * Find all in-mempool ancestors of entry, failing if the entry and its
+     * ancestors would exceed any of the given package limits. With
+     * fSearchForParents the parents are looked up through entry's inputs,
+     * which works for entries not (yet) in mapTx; otherwise mapLinks is used.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string& errString, bool fSearchForParents = true) const;
+
+    /** Add it and all of its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
+
+    /**
+     * The minimum fee rate to get into the pool, which may itself not be
+     * enough to get into a full pool. Raised whenever TrimToSize evicts a
+     * package and decays back towards the relay fee once blocks come in,
+     * faster while the pool is well below sizelimit.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /**
+     * Evict packages with the lowest descendant fee rate until the pool's
+     * dynamic memory usage is at most sizelimit.
+     */
+    void TrimToSize(size_t sizelimit);
     void queryHashes(std::vector<uint256>& vtxid);
+    /**
+     * Whether hasha should be announced before hashb: parents before their
+     * children, then in the order they entered the pool. Transactions not in
+     * the pool go last.
+     */
+    bool CompareDepthAndTime(const uint256& hasha, const uint256& hashb);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
@@ -226,10 +465,27 @@ public:
 
     size_t DynamicMemoryUsage() const;
 
+    /** Whether the startup load from disk has finished; see LoadMempool */
+    bool IsLoaded() const;
+    void SetIsLoaded(bool fLoadedIn);
+
     /** Return nCheckFrequency */
     uint32_t GetCheckFrequency() const {
         return nCheckFrequency;
     }
+
+private:
+    void UpdateForDescendants(txiter updateIt, cacheMap& cachedDescendants, const std::set<uint256>& setExclude);
+    void UpdateAncestorsOf(bool add, txiter hash, setEntries& setAncestors);
+    void UpdateEntryForAncestors(txiter it, const setEntries& setAncestors);
+    /**
+     * Update the links and package state of everything that stays in the
+     * pool when entriesToRemove leave it. Descendants only need updating if
+     * they are not being removed as well.
+     */
+    void UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool updateDescendants);
+    void UpdateChildrenForRemoval(txiter entry);
+    void removeUnchecked(txiter entry, std::list<CTransaction>& removed);
 };
 
 /** 
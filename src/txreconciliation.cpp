@@ -0,0 +1,177 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txreconciliation.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <limits>
+
+/** The MurmurHash3 finalizer of id mixed with seed: short ids are random already, so this is enough to spread them */
+static inline uint32_t MixID(uint32_t id, uint32_t seed)
+{
+    uint32_t h = id ^ seed;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint32_t CheckSum(uint32_t id)
+{
+    return MixID(id, 0x9e3779b9);
+}
+
+CTxReconSketch::CTxReconSketch(size_t nCells) :
+    vCells((nCells + RECON_SKETCH_HASHES - 1) / RECON_SKETCH_HASHES * RECON_SKETCH_HASHES)
+{
+}
+
+void CTxReconSketch::Toggle(uint32_t id, int32_t sign)
+{
+    size_t nPart = vCells.size() / RECON_SKETCH_HASHES;
+    assert(nPart > 0);
+    uint32_t check = CheckSum(id);
+    for (size_t i = 0; i < RECON_SKETCH_HASHES; i++) {
+        Cell& cell = vCells[i * nPart + MixID(id, i) % nPart];
+        cell.count += sign;
+        cell.keySum ^= id;
+        cell.checkSum ^= check;
+    }
+}
+
+bool CTxReconSketch::Subtract(const CTxReconSketch& other)
+{
+    // The other sketch may come from a peer, so may be of any size
+    if (vCells.size() != other.vCells.size())
+        return false;
+    for (size_t i = 0; i < vCells.size(); i++) {
+        vCells[i].count -= other.vCells[i].count;
+        vCells[i].keySum ^= other.vCells[i].keySum;
+        vCells[i].checkSum ^= other.vCells[i].checkSum;
+    }
+    return true;
+}
+
+bool CTxReconSketch::Decode(std::vector<uint32_t>& vOnlyOurs, std::vector<uint32_t>& vOnlyTheirs) const
+{
+    vOnlyOurs.clear();
+    vOnlyTheirs.clear();
+    if (vCells.empty() || vCells.size() % RECON_SKETCH_HASHES != 0)
+        return false;
+
+    // Peel off the ids of cells holding just one, which may empty others
+    // down to one in turn. A sketch from a peer may be made up, so never
+    // take out more ids than there are cells.
+    CTxReconSketch sketch(*this);
+    std::vector<size_t> vPure;
+    for (size_t i = 0; i < sketch.vCells.size(); i++)
+        vPure.push_back(i);
+    while (!vPure.empty()) {
+        const Cell& cell = sketch.vCells[vPure.back()];
+        vPure.pop_back();
+        if ((cell.count != 1 && cell.count != -1) || cell.checkSum != CheckSum(cell.keySum))
+            continue;
+        if (vOnlyOurs.size() + vOnlyTheirs.size() >= sketch.vCells.size())
+            return false;
+        uint32_t id = cell.keySum;
+        int32_t sign = cell.count;
+        (sign > 0 ? vOnlyOurs : vOnlyTheirs).push_back(id);
+        sketch.Toggle(id, -sign);
+        size_t nPart = sketch.vCells.size() / RECON_SKETCH_HASHES;
+        for (size_t i = 0; i < RECON_SKETCH_HASHES; i++)
+            vPure.push_back(i * nPart + MixID(id, i) % nPart);
+    }
+
+    for (size_t i = 0; i < sketch.vCells.size(); i++) {
+        const Cell& cell = sketch.vCells[i];
+        if (cell.count != 0 || cell.keySum != 0 || cell.checkSum != 0)
+            return false;
+    }
+    return true;
+}
+
+size_t GetReconSketchCells(size_t nLocalSize, size_t nRemoteSize)
+{
+    // At least the difference in size, plus a share of the smaller set for
+    // the transactions each side has and the other hasn't heard of yet
+    size_t nDiff = std::max(nLocalSize, nRemoteSize) - std::min(nLocalSize, nRemoteSize);
+    size_t nEstimate = nDiff + std::min(nLocalSize, nRemoteSize) / 4 + 1;
+    // Small sketches need more room to decode reliably
+    return 2 * nEstimate + 6;
+}
+
+CTxReconState::CTxReconState() : k0(0), k1(0), fEnabled(false), fInitiator(false), nRoundStart(0), nNextRequest(0)
+{
+    nLocalSalt = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+void CTxReconState::Enable(bool fInitiatorIn, uint64_t nRemoteSalt)
+{
+    // Both sides compute the same keys, whichever order the salts are in
+    static const unsigned char TAG[] = "zPrime tx reconciliation";
+    unsigned char salts[16];
+    WriteLE64(&salts[0], std::min(nLocalSalt, nRemoteSalt));
+    WriteLE64(&salts[8], std::max(nLocalSalt, nRemoteSalt));
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(TAG, sizeof(TAG) - 1).Write(salts, sizeof(salts)).Finalize(hash);
+    k0 = ReadLE64(&hash[0]);
+    k1 = ReadLE64(&hash[8]);
+    fInitiator = fInitiatorIn;
+    fEnabled = true;
+}
+
+uint32_t CTxReconState::GetShortID(const uint256& txid) const
+{
+    return (uint32_t)SipHashUint256(k0, k1, txid);
+}
+
+bool CTxReconState::Add(const uint256& txid)
+{
+    if (!fEnabled || mapSet.size() >= MAX_RECON_SET_SIZE)
+        return false;
+    // A transaction colliding with another on short id is announced with inv
+    std::pair<std::map<uint32_t, uint256>::iterator, bool> ret = mapSet.insert(std::make_pair(GetShortID(txid), txid));
+    return ret.second || ret.first->second == txid;
+}
+
+void CTxReconState::StartRound(int64_t nNow)
+{
+    assert(nRoundStart == 0 && mapSnapshot.empty());
+    mapSnapshot.swap(mapSet);
+    nRoundStart = nNow;
+}
+
+CTxReconSketch CTxReconState::SketchSnapshot(size_t nCells) const
+{
+    CTxReconSketch sketch(nCells);
+    for (std::map<uint32_t, uint256>::const_iterator it = mapSnapshot.begin(); it != mapSnapshot.end(); ++it)
+        sketch.Add(it->first);
+    return sketch;
+}
+
+std::vector<uint256> CTxReconState::FinishRound(const std::vector<uint32_t>* pvShortIDs)
+{
+    std::vector<uint256> vTxids;
+    if (pvShortIDs) {
+        for (size_t i = 0; i < pvShortIDs->size(); i++) {
+            std::map<uint32_t, uint256>::const_iterator it = mapSnapshot.find((*pvShortIDs)[i]);
+            if (it != mapSnapshot.end())
+                vTxids.push_back(it->second);
+        }
+    } else {
+        for (std::map<uint32_t, uint256>::const_iterator it = mapSnapshot.begin(); it != mapSnapshot.end(); ++it)
+            vTxids.push_back(it->second);
+    }
+    mapSnapshot.clear();
+    nRoundStart = 0;
+    return vTxids;
+}
@@ -0,0 +1,144 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRECONCILIATION_H
+#define BITCOIN_TXRECONCILIATION_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+/** Version of the reconciliation protocol announced in sendtxrcncl */
+static const uint32_t TXRECONCILIATION_VERSION = 1;
+/** Default for -txreconciliation */
+static const bool DEFAULT_TXRECONCILIATION = false;
+/** Average time between reconciliations with a peer, asked for by the side that made the connection (in seconds) */
+static const int RECON_REQUEST_INTERVAL = 8;
+/** A reconciliation the peer hasn't answered in this long is given up, and its transactions announced with inv (in seconds) */
+static const int RECON_RESPONSE_TIMEOUT = 60;
+/** Transactions past this many waiting to be reconciled with a peer are announced to it with inv instead */
+static const size_t MAX_RECON_SET_SIZE = 4000;
+/** Maximum number of cells in a sketch; larger differences are announced with inv instead */
+static const size_t MAX_RECON_SKETCH_CELLS = 3000;
+/** Number of cells each id is added to, one in each third of the sketch; sketches are a multiple of this in size */
+static const size_t RECON_SKETCH_HASHES = 3;
+
+/**
+ * An invertible Bloom lookup table of 32-bit short transaction ids. One set's
+ * sketch subtracted from another's of the same size holds just the ids that
+ * are in one set and not the other, which can be listed as long as there
+ * aren't more of them than about half the number of cells.
+ */
+class CTxReconSketch
+{
+private:
+    struct Cell
+    {
+        int32_t count;
+        uint32_t keySum;
+        uint32_t checkSum;
+
+        Cell() : count(0), keySum(0), checkSum(0) {}
+
+        ADD_SERIALIZE_METHODS;
+
+        template <typename Stream, typename Operation>
+        inline void SerializationOp(Stream& s, Operation ser_action) {
+            READWRITE(count);
+            READWRITE(keySum);
+            READWRITE(checkSum);
+        }
+    };
+
+    std::vector<Cell> vCells;
+
+    void Toggle(uint32_t id, int32_t sign);
+
+public:
+    CTxReconSketch() {}
+    /** nCells is rounded up to a multiple of 3 */
+    explicit CTxReconSketch(size_t nCells);
+
+    size_t GetCells() const { return vCells.size(); }
+
+    void Add(uint32_t id) { Toggle(id, 1); }
+
+    /** Take the ids of other out of this sketch; false, leaving this one as it was, if they differ in size */
+    bool Subtract(const CTxReconSketch& other);
+
+    /**
+     * List the ids left in this sketch after a Subtract: those only in the
+     * set the sketch was made of, and those only in the one subtracted.
+     * Returns false if there are too many to list.
+     */
+    bool Decode(std::vector<uint32_t>& vOnlyOurs, std::vector<uint32_t>& vOnlyTheirs) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(vCells);
+    }
+};
+
+/** Number of sketch cells to reconcile sets of these sizes with, from an estimate of their difference */
+size_t GetReconSketchCells(size_t nLocalSize, size_t nRemoteSize);
+
+/**
+ * Reconciliation of the transactions to announce to one peer, with both
+ * sides keeping a set of short ids in place of sending an inv for each.
+ * Every RECON_REQUEST_INTERVAL on average the side that made the
+ * connection sends reqrecon with the size of its set, and the peer answers
+ * with a sketch of its own set. The difference of the two sketches tells
+ * the initiator which transactions each side is missing; it announces
+ * those the peer lacks, and asks the peer to announce the others with
+ * reconcildiff. When the difference can't be decoded both sides announce
+ * their whole set instead.
+ *
+ * Guarded by the peer's cs_inventory.
+ */
+class CTxReconState
+{
+private:
+    uint64_t k0, k1;
+    /** Transactions to reconcile in the next round, by short id */
+    std::map<uint32_t, uint256> mapSet;
+    /** Transactions of the round in progress */
+    std::map<uint32_t, uint256> mapSnapshot;
+
+public:
+    /** Salt this side contributes to the short id keys, sent in sendtxrcncl */
+    uint64_t nLocalSalt;
+    /** Both sides sent sendtxrcncl */
+    bool fEnabled;
+    /** We made the connection, so we ask for reconciliations */
+    bool fInitiator;
+    /** A round is in progress since this time (in microseconds), 0 if none */
+    int64_t nRoundStart;
+    /** When the initiator asks for the next round (in microseconds) */
+    int64_t nNextRequest;
+
+    CTxReconState();
+
+    void Enable(bool fInitiatorIn, uint64_t nRemoteSalt);
+
+    uint32_t GetShortID(const uint256& txid) const;
+
+    /** Queue a transaction for the next round; false if it must be announced with inv instead */
+    bool Add(const uint256& txid);
+
+    size_t GetSetSize() const { return mapSet.size(); }
+
+    /** Start a round with the set queued so far */
+    void StartRound(int64_t nNow);
+    const std::map<uint32_t, uint256>& GetSnapshot() const { return mapSnapshot; }
+    CTxReconSketch SketchSnapshot(size_t nCells) const;
+    /** End the round, handing back the transactions of the snapshot with the given short ids, or all of them */
+    std::vector<uint256> FinishRound(const std::vector<uint32_t>* pvShortIDs = NULL);
+};
+
+#endif // BITCOIN_TXRECONCILIATION_H
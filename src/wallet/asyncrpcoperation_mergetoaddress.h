@@ -76,6 +76,19 @@ public:
 
     virtual UniValue getStatus() const;
 
+    // Background job; yields to user payouts waiting in the queue
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::LOW;
+    }
+
+    virtual std::string getType() const {
+        return "z_mergetoaddress";
+    }
+
+    virtual bool spendsFunds() const {
+        return true;
+    }
+
     bool testmode = false; // Set to true to disable sending txs and generating proofs
 
     bool paymentDisclosureMode = false; // Set to true to save esk for encrypted notes in payment disclosure database.
@@ -24,6 +24,19 @@ public:
 
     virtual UniValue getStatus() const;
 
+    // Background job; yields to user payouts waiting in the queue
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::LOW;
+    }
+
+    virtual std::string getType() const {
+        return "saplingmigration";
+    }
+
+    virtual bool spendsFunds() const {
+        return true;
+    }
+
 private:
     int targetHeight_;
 
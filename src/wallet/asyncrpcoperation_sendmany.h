@@ -73,6 +73,19 @@ public:
 
     virtual UniValue getStatus() const;
 
+    // Payouts requested by users are started ahead of background jobs
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::HIGH;
+    }
+
+    virtual std::string getType() const {
+        return "z_sendmany";
+    }
+
+    virtual bool spendsFunds() const {
+        return true;
+    }
+
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
 
     bool paymentDisclosureMode = false; // Set to true to save esk for encrypted notes in payment disclosure database.
@@ -0,0 +1,438 @@
+// Copyright (c) 2016 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "asyncrpcoperation_sendmanybulk.h"
+#include "amount.h"
+#include "consensus/upgrades.h"
+#include "core_io.h"
+#include "init.h"
+#include "key_io.h"
+#include "main.h"
+#include "rpc/protocol.h"
+#include "rpc/server.h"
+#include "util.h"
+#include "utilmoneystr.h"
+#include "wallet.h"
+#include "miner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+#include <boost/thread.hpp>
+
+using namespace libzprime;
+
+extern UniValue sendrawtransaction(const UniValue& params, bool fHelp);
+
+// Bytes added to a transaction by a P2PKH output
+#define CTXOUT_REGULAR_SIZE     34
+
+static std::array<unsigned char, ZC_MEMO_SIZE> get_memo_from_hex_string(std::string s) {
+    // initialize to default memo (no_memo), see section 5.5 of the protocol spec
+    std::array<unsigned char, ZC_MEMO_SIZE> memo = {{0xF6}};
+
+    std::vector<unsigned char> rawMemo = ParseHex(s.c_str());
+
+    // If ParseHex comes across a non-hex char, it will stop but still return results so far.
+    size_t slen = s.length();
+    if (slen % 2 !=0 || (slen>0 && rawMemo.size()!=slen/2)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Memo must be in hexadecimal format");
+    }
+
+    if (rawMemo.size() > ZC_MEMO_SIZE) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Memo size of %d is too big, maximum allowed is %d", rawMemo.size(), ZC_MEMO_SIZE));
+    }
+
+    std::copy(rawMemo.begin(), rawMemo.end(), memo.begin());
+    return memo;
+}
+
+AsyncRPCOperation_sendmanybulk::AsyncRPCOperation_sendmanybulk(
+        int nextBlockHeight,
+        std::string fromAddress,
+        std::vector<SendManyBulkBatch> batches,
+        CAmount fee,
+        UniValue contextInfo) :
+        contextinfo_(contextInfo), nextBlockHeight_(nextBlockHeight), fee_(fee), fromaddress_(fromAddress), batches_(batches)
+{
+    if (fee < 0 || fee > MAX_MONEY) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Fee is out of range");
+    }
+
+    if (fromAddress.size() == 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "From address parameter missing");
+    }
+
+    if (batches.empty()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No recipients");
+    }
+
+    auto address = DecodePaymentAddress(fromAddress);
+    if (boost::get<libzprime::SaplingPaymentAddress>(&address) == nullptr) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid from address, should be a Sapling zaddr");
+    }
+    // We don't need to lock on the wallet as spending key related methods are thread-safe
+    if (!boost::apply_visitor(HaveSpendingKeyForPaymentAddress(pwalletMain), address)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid from address, no spending key found for zaddr");
+    }
+    spendingkey_ = boost::get<libzprime::SaplingExtendedSpendingKey>(
+        boost::apply_visitor(GetSpendingKeyForPaymentAddress(pwalletMain), address).get());
+
+    // Log the context info i.e. the call parameters to z_sendmanybulk
+    if (LogAcceptCategory("zrpcunsafe")) {
+        LogPrint("zrpcunsafe", "%s: z_sendmanybulk initialized (params=%s)\n", getId(), contextInfo.write());
+    } else {
+        LogPrint("zrpc", "%s: z_sendmanybulk initialized (transactions=%d)\n", getId(), batches_.size());
+    }
+
+    // Reserve the notes now, so that operations queued behind this one cannot select them
+    lock_notes();
+}
+
+AsyncRPCOperation_sendmanybulk::~AsyncRPCOperation_sendmanybulk() {
+}
+
+/**
+ * Notes are taken for each transaction in turn. A transaction is funded by the
+ * smallest single note that covers it if there is one, so that large notes are
+ * kept for the transactions that need them; otherwise notes are accumulated
+ * from the largest down.
+ */
+std::vector<SendManyBulkBatch> AsyncRPCOperation_sendmanybulk::partition(
+        std::vector<SaplingNoteEntry> notes,
+        const std::vector<SendManyRecipient>& recipients,
+        CAmount fee,
+        size_t maxOutputsPerTx,
+        size_t maxTxSize)
+{
+    assert(maxOutputsPerTx > 0);
+
+    // sort in descending order, so big notes appear first
+    std::sort(notes.begin(), notes.end(),
+        [](const SaplingNoteEntry& i, const SaplingNoteEntry& j) -> bool {
+            return i.note.value() > j.note.value();
+        });
+
+    CAmount available = 0;
+    for (const SaplingNoteEntry& entry : notes) {
+        available += entry.note.value();
+    }
+
+    std::vector<SendManyBulkBatch> batches;
+    for (size_t first = 0; first < recipients.size(); first += maxOutputsPerTx) {
+        SendManyBulkBatch batch;
+        batch.firstRecipient = first;
+        size_t last = std::min(first + maxOutputsPerTx, recipients.size());
+        batch.recipients.assign(recipients.begin() + first, recipients.begin() + last);
+
+        CAmount targetAmount = fee;
+        for (const SendManyRecipient& r : batch.recipients) {
+            targetAmount += std::get<1>(r);
+        }
+
+        // notes are sorted in descending order, so the best fit is the last one covering the target
+        auto bestFit = notes.end();
+        for (auto it = notes.begin(); it != notes.end() && CAmount(it->note.value()) >= targetAmount; ++it) {
+            bestFit = it;
+        }
+
+        CAmount selected = 0;
+        if (bestFit != notes.end()) {
+            selected = bestFit->note.value();
+            batch.notes.push_back(*bestFit);
+            notes.erase(bestFit);
+        } else {
+            auto it = notes.begin();
+            while (it != notes.end() && selected < targetAmount) {
+                selected += it->note.value();
+                batch.notes.push_back(*it);
+                ++it;
+            }
+            notes.erase(notes.begin(), it);
+        }
+
+        if (selected < targetAmount) {
+            throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS,
+                strprintf("Insufficient shielded funds for transaction %d of %d, have %s, need %s more",
+                batches.size() + 1, (recipients.size() + maxOutputsPerTx - 1) / maxOutputsPerTx,
+                FormatMoney(available), FormatMoney(targetAmount - selected)));
+        }
+
+        // Estimate the size of the transaction, allowing for a change output
+        CMutableTransaction mtx;
+        mtx.fOverwintered = true;
+        mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+        mtx.nVersion = SAPLING_TX_VERSION;
+        mtx.vShieldedSpend.resize(batch.notes.size());
+        mtx.vShieldedOutput.resize(1);
+        size_t txsize = 0;
+        for (const SendManyRecipient& r : batch.recipients) {
+            if (IsValidDestination(DecodeDestination(std::get<0>(r)))) {
+                txsize += CTXOUT_REGULAR_SIZE;
+            } else {
+                mtx.vShieldedOutput.push_back(OutputDescription());
+            }
+        }
+        txsize += GetSerializeSize(CTransaction(mtx), SER_NETWORK, mtx.nVersion);
+        if (txsize > maxTxSize) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER,
+                strprintf("Transaction %d would be larger than limit of %d bytes, use fewer outputs per transaction",
+                batches.size() + 1, maxTxSize));
+        }
+
+        batches.push_back(batch);
+    }
+
+    return batches;
+}
+
+void AsyncRPCOperation_sendmanybulk::main() {
+    if (isCancelled()) {
+        unlock_notes(); // clean up
+        return;
+    }
+
+    set_state(OperationStatus::EXECUTING);
+    start_execution_clock();
+
+    bool success = false;
+
+#ifdef ENABLE_MINING
+    GenerateBitcoins(false, 0, Params());
+#endif
+
+    try {
+        success = main_impl();
+    } catch (const UniValue& objError) {
+        int code = find_value(objError, "code").get_int();
+        std::string message = find_value(objError, "message").get_str();
+        set_error_code(code);
+        set_error_message(message);
+    } catch (const runtime_error& e) {
+        set_error_code(-1);
+        set_error_message("runtime error: " + string(e.what()));
+    } catch (const logic_error& e) {
+        set_error_code(-1);
+        set_error_message("logic error: " + string(e.what()));
+    } catch (const exception& e) {
+        set_error_code(-1);
+        set_error_message("general exception: " + string(e.what()));
+    } catch (...) {
+        set_error_code(-2);
+        set_error_message("unknown error");
+    }
+
+#ifdef ENABLE_MINING
+    GenerateBitcoins(GetBoolArg("-gen", false), GetArg("-genproclimit", 1), Params());
+#endif
+
+    stop_execution_clock();
+
+    if (success) {
+        set_state(OperationStatus::SUCCESS);
+    } else {
+        set_state(OperationStatus::FAILED);
+    }
+
+    std::string s = strprintf("%s: z_sendmanybulk finished (status=%s", getId(), getStateAsString());
+    if (success) {
+        s += strprintf(", transactions=%d)\n", batches_.size());
+    } else {
+        s += strprintf(", error=%s)\n", getErrorMessage());
+    }
+    LogPrintf("%s",s);
+
+    unlock_notes(); // clean up
+}
+
+/**
+ * Witnesses for every transaction are fetched against one anchor while holding
+ * the wallet lock. The transactions are then built and proved in parallel
+ * without any locks held, and finally sent one by one in request order.
+ */
+bool AsyncRPCOperation_sendmanybulk::main_impl() {
+    SaplingExpandedSpendingKey expsk = spendingkey_.expsk;
+    uint256 ovk = expsk.full_viewing_key().ovk;
+
+    // Fetch Sapling anchor and witnesses
+    uint256 anchor;
+    std::vector<std::vector<boost::optional<SaplingWitness>>> witnesses(batches_.size());
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        std::vector<SaplingOutPoint> ops;
+        for (const SendManyBulkBatch& batch : batches_) {
+            for (const SaplingNoteEntry& entry : batch.notes) {
+                ops.push_back(entry.op);
+            }
+        }
+        std::vector<boost::optional<SaplingWitness>> allWitnesses;
+        pwalletMain->GetSaplingNoteWitnesses(ops, allWitnesses, anchor);
+
+        auto it = allWitnesses.begin();
+        for (size_t i = 0; i < batches_.size(); i++) {
+            witnesses[i].assign(it, it + batches_[i].notes.size());
+            it += batches_[i].notes.size();
+        }
+    }
+
+    std::vector<TransactionBuilder> builders;
+    for (size_t i = 0; i < batches_.size(); i++) {
+        const SendManyBulkBatch& batch = batches_[i];
+        TransactionBuilder builder(Params().GetConsensus(), nextBlockHeight_, pwalletMain);
+        builder.SetFee(fee_);
+
+        for (size_t j = 0; j < batch.notes.size(); j++) {
+            if (!witnesses[i][j]) {
+                throw JSONRPCError(RPC_WALLET_ERROR, "Missing witness for Sapling note");
+            }
+            builder.AddSaplingSpend(expsk, batch.notes[j].note, anchor, witnesses[i][j].get());
+        }
+
+        for (const SendManyRecipient& r : batch.recipients) {
+            auto address = std::get<0>(r);
+            auto value = std::get<1>(r);
+            auto hexMemo = std::get<2>(r);
+
+            CTxDestination taddr = DecodeDestination(address);
+            if (IsValidDestination(taddr)) {
+                builder.AddTransparentOutput(taddr, value);
+            } else {
+                auto addr = DecodePaymentAddress(address);
+                assert(boost::get<libzprime::SaplingPaymentAddress>(&addr) != nullptr);
+                auto to = boost::get<libzprime::SaplingPaymentAddress>(addr);
+                builder.AddSaplingOutput(ovk, to, value, get_memo_from_hex_string(hexMemo));
+            }
+        }
+
+        builders.push_back(builder);
+    }
+
+    // Build the transactions, one per worker at a time, with a worker per core
+    size_t nWorkers = std::min<size_t>(std::max(GetNumCores(), 1), builders.size());
+
+    std::vector<boost::optional<CTransaction>> txs(builders.size());
+    std::vector<std::string> errors(builders.size());
+    std::atomic<size_t> nextBuild(0);
+    auto buildAll = [&]() {
+        for (size_t i = nextBuild++; i < builders.size(); i = nextBuild++) {
+            try {
+                auto result = builders[i].Build();
+                if (result.IsTx()) {
+                    txs[i] = result.GetTxOrThrow();
+                } else {
+                    errors[i] = "Failed to build transaction: " + result.GetError();
+                }
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            } catch (...) {
+                errors[i] = "unknown error";
+            }
+        }
+    };
+
+    LogPrint("zrpc", "%s: building %d transactions with %d workers\n", getId(), builders.size(), nWorkers);
+    if (nWorkers <= 1) {
+        buildAll();
+    } else {
+        boost::thread_group builderThreads;
+        for (size_t t = 0; t < nWorkers; t++) {
+            builderThreads.create_thread(buildAll);
+        }
+        builderThreads.join_all();
+    }
+
+    // Send the transactions
+    UniValue transactions(UniValue::VARR);
+    size_t nSent = 0;
+    for (size_t i = 0; i < batches_.size(); i++) {
+        UniValue o(UniValue::VOBJ);
+        o.push_back(Pair("first_recipient", (uint64_t)batches_[i].firstRecipient));
+        o.push_back(Pair("outputs", (uint64_t)batches_[i].recipients.size()));
+
+        if (txs[i]) {
+            auto signedtxn = EncodeHexTx(txs[i].get());
+            if (!testmode) {
+                try {
+                    UniValue params = UniValue(UniValue::VARR);
+                    params.push_back(signedtxn);
+                    UniValue sendResultValue = sendrawtransaction(params, false);
+                    if (sendResultValue.isNull()) {
+                        throw JSONRPCError(RPC_WALLET_ERROR, "sendrawtransaction did not return an error or a txid.");
+                    }
+                    o.push_back(Pair("txid", sendResultValue.get_str()));
+                    nSent++;
+                } catch (const UniValue& objError) {
+                    errors[i] = find_value(objError, "message").get_str();
+                } catch (const std::exception& e) {
+                    // Keep going, so the txids of the batches already sent are returned
+                    errors[i] = e.what();
+                }
+            } else {
+                // Test mode does not send the transaction to the network.
+                o.push_back(Pair("test", 1));
+                o.push_back(Pair("txid", txs[i]->GetHash().ToString()));
+                o.push_back(Pair("hex", signedtxn));
+                nSent++;
+            }
+        }
+
+        if (!errors[i].empty()) {
+            LogPrintf("%s: z_sendmanybulk transaction %d failed (error=%s)\n", getId(), i, errors[i]);
+            o.push_back(Pair("error", errors[i]));
+        }
+        transactions.push_back(o);
+    }
+
+    if (nSent == 0) {
+        throw JSONRPCError(RPC_WALLET_ERROR, strprintf("No transactions were sent: %s", errors[0]));
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("sent", (uint64_t)nSent));
+    result.push_back(Pair("failed", (uint64_t)(batches_.size() - nSent)));
+    result.push_back(Pair("transactions", transactions));
+    set_result(result);
+
+    return true;
+}
+
+/**
+ * Lock input notes
+ */
+void AsyncRPCOperation_sendmanybulk::lock_notes() {
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    for (const SendManyBulkBatch& batch : batches_) {
+        for (const SaplingNoteEntry& entry : batch.notes) {
+            pwalletMain->LockNote(entry.op);
+        }
+    }
+}
+
+/**
+ * Unlock input notes
+ */
+void AsyncRPCOperation_sendmanybulk::unlock_notes() {
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    for (const SendManyBulkBatch& batch : batches_) {
+        for (const SaplingNoteEntry& entry : batch.notes) {
+            pwalletMain->UnlockNote(entry.op);
+        }
+    }
+}
+
+/**
+ * Override getStatus() to append the operation's input parameters to the default status object.
+ */
+UniValue AsyncRPCOperation_sendmanybulk::getStatus() const {
+    UniValue v = AsyncRPCOperation::getStatus();
+    if (contextinfo_.isNull()) {
+        return v;
+    }
+
+    UniValue obj = v.get_obj();
+    obj.push_back(Pair("method", "z_sendmanybulk"));
+    obj.push_back(Pair("params", contextinfo_ ));
+    return obj;
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2016 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ASYNCRPCOPERATION_SENDMANYBULK_H
+#define ASYNCRPCOPERATION_SENDMANYBULK_H
+
+#include "asyncrpcoperation.h"
+#include "amount.h"
+#include "primitives/transaction.h"
+#include "transaction_builder.h"
+#include "zprime/Address.hpp"
+#include "wallet.h"
+#include "wallet/asyncrpcoperation_sendmany.h"
+
+#include <array>
+#include <vector>
+
+#include <univalue.h>
+
+// Default number of recipients paid by each transaction if caller does not specify one.
+#define Z_SENDMANYBULK_DEFAULT_OUTPUTS_PER_TX 50
+
+using namespace libzprime;
+
+// The notes reserved for one transaction of a bulk payout, and the recipients it pays.
+struct SendManyBulkBatch
+{
+    size_t firstRecipient = 0;                  // index of recipients[0] in the request
+    std::vector<SendManyRecipient> recipients;
+    std::vector<SaplingNoteEntry> notes;
+};
+
+class AsyncRPCOperation_sendmanybulk : public AsyncRPCOperation {
+public:
+    AsyncRPCOperation_sendmanybulk(
+        int nextBlockHeight,
+        std::string fromAddress,
+        std::vector<SendManyBulkBatch> batches,
+        CAmount fee = ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE,
+        UniValue contextInfo = NullUniValue);
+    virtual ~AsyncRPCOperation_sendmanybulk();
+
+    // We don't want to be copied or moved around
+    AsyncRPCOperation_sendmanybulk(AsyncRPCOperation_sendmanybulk const&) = delete;             // Copy construct
+    AsyncRPCOperation_sendmanybulk(AsyncRPCOperation_sendmanybulk&&) = delete;                  // Move construct
+    AsyncRPCOperation_sendmanybulk& operator=(AsyncRPCOperation_sendmanybulk const&) = delete;  // Copy assign
+    AsyncRPCOperation_sendmanybulk& operator=(AsyncRPCOperation_sendmanybulk &&) = delete;      // Move assign
+
+    /**
+     * Split recipients into transactions of at most maxOutputsPerTx outputs and
+     * assign each transaction its own set of notes covering its outputs plus fee.
+     * Throws a JSONRPCError if the notes cannot cover every transaction, or if a
+     * transaction would exceed maxTxSize.
+     */
+    static std::vector<SendManyBulkBatch> partition(
+        std::vector<SaplingNoteEntry> notes,
+        const std::vector<SendManyRecipient>& recipients,
+        CAmount fee,
+        size_t maxOutputsPerTx,
+        size_t maxTxSize);
+
+    virtual void main();
+
+    virtual UniValue getStatus() const;
+
+    // Payouts requested by users are started ahead of background jobs
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::HIGH;
+    }
+
+    virtual std::string getType() const {
+        return "z_sendmanybulk";
+    }
+
+    virtual bool spendsFunds() const {
+        return true;
+    }
+
+    bool testmode = false;  // Set to true to disable sending txs
+
+private:
+    friend class TEST_FRIEND_AsyncRPCOperation_sendmanybulk;    // class for unit testing
+
+    UniValue contextinfo_;     // optional data to include in return value from getStatus()
+
+    int nextBlockHeight_;
+    CAmount fee_;
+    std::string fromaddress_;
+    SaplingExtendedSpendingKey spendingkey_;
+
+    std::vector<SendManyBulkBatch> batches_;
+
+    void lock_notes();
+    void unlock_notes();
+    bool main_impl();
+};
+
+#endif /* ASYNCRPCOPERATION_SENDMANYBULK_H */
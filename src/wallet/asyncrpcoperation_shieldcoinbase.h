@@ -61,6 +61,18 @@ public:
 
     virtual UniValue getStatus() const;
 
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::NORMAL;
+    }
+
+    virtual std::string getType() const {
+        return "z_shieldcoinbase";
+    }
+
+    virtual bool spendsFunds() const {
+        return true;
+    }
+
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
 
     bool paymentDisclosureMode = false; // Set to true to save esk for encrypted notes in payment disclosure database.
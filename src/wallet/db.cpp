@@ -148,11 +148,28 @@ void CDBEnv::MakeMock()
     fMockDb = true;
 }
 
+bool CDBEnv::IsLogStore(const std::string& strFile)
+{
+    LOCK(cs_db);
+    if (mapLogDb[strFile] != NULL)
+        return true;
+    if (fMockDb)
+        return false;
+    boost::filesystem::path pathFile = boost::filesystem::path(strPath) / strFile;
+    if (boost::filesystem::exists(pathFile))
+        return CLogDB::IsLogFile(pathFile);
+    return GetArg("-walletstore", DEFAULT_WALLET_STORE) == "log";
+}
+
 CDBEnv::VerifyResult CDBEnv::Verify(const std::string& strFile, bool (*recoverFunc)(CDBEnv& dbenv, const std::string& strFile))
 {
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    // A log store checks its records as it replays them on open
+    if (IsLogStore(strFile))
+        return VERIFY_OK;
+
     Db db(dbenv, 0);
     int result = db.verify(strFile.c_str(), NULL, NULL, 0);
     if (result == 0)
@@ -218,13 +235,13 @@ bool CDBEnv::Salvage(const std::string& strFile, bool fAggressive, std::vector<C
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
     dbenv->txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || IsLogStore(strFile))
         return;
     dbenv->lsn_reset(strFile.c_str(), 0);
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), plog(NULL), activeTxn(NULL), activeBatch(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -244,6 +261,30 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
 
         strFile = strFilename;
         ++bitdb.mapFileUseCount[strFile];
+
+        if (bitdb.IsLogStore(strFile)) {
+            plog = bitdb.mapLogDb[strFile];
+            if (plog == NULL) {
+                plog = new CLogDB(GetDataDir() / strFile);
+                if (!plog->Open(fCreate)) {
+                    delete plog;
+                    plog = NULL;
+                    --bitdb.mapFileUseCount[strFile];
+                    throw runtime_error(strprintf("CDB: can't open log store %s", strFilename));
+                }
+
+                if (fCreate && !Exists(string("version"))) {
+                    bool fTmp = fReadOnly;
+                    fReadOnly = false;
+                    WriteVersion(CLIENT_VERSION);
+                    fReadOnly = fTmp;
+                }
+
+                bitdb.mapLogDb[strFile] = plog;
+            }
+            return;
+        }
+
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
             pdb = new Db(bitdb.dbenv, 0);
@@ -285,9 +326,14 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (activeTxn || activeBatch)
         return;
 
+    if (plog) {
+        plog->Flush();
+        return;
+    }
+
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
     if (fReadOnly)
@@ -298,15 +344,18 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plog)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    delete activeBatch;
+    activeBatch = NULL;
     pdb = NULL;
 
     if (fFlushOnClose)
         Flush();
+    plog = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -314,10 +363,91 @@ void CDB::Close()
     }
 }
 
+bool CDB::ReadLog(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    CSerializeData key(ssKey.begin(), ssKey.end());
+    CSerializeData value;
+    bool fErased = false;
+    if (activeBatch && activeBatch->Find(key, value, fErased)) {
+        if (fErased)
+            return false;
+    } else if (!plog->Read(key, value)) {
+        return false;
+    }
+    ssValue.write(&value[0], value.size());
+    return true;
+}
+
+bool CDB::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    CSerializeData key(ssKey.begin(), ssKey.end());
+    CSerializeData value(ssValue.begin(), ssValue.end());
+    if (!activeBatch)
+        return plog->Write(key, value, fOverwrite);
+    if (!fOverwrite && ExistsLog(ssKey))
+        return false;
+    activeBatch->Write(key, value);
+    return true;
+}
+
+bool CDB::EraseLog(const CDataStream& ssKey)
+{
+    CSerializeData key(ssKey.begin(), ssKey.end());
+    if (!activeBatch)
+        return plog->Erase(key);
+    activeBatch->Erase(key);
+    return true;
+}
+
+bool CDB::ExistsLog(const CDataStream& ssKey)
+{
+    CSerializeData key(ssKey.begin(), ssKey.end());
+    CSerializeData value;
+    bool fErased = false;
+    if (activeBatch && activeBatch->Find(key, value, fErased))
+        return !fErased;
+    return plog->Exists(key);
+}
+
+/**
+ * Cursors over a log store see committed records only, in the key order of a
+ * Berkeley DB btree. Only DB_NEXT and DB_SET_RANGE are supported.
+ */
+int CDB::ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    CSerializeData key, value;
+    bool fFound;
+    if (fFlags == DB_SET_RANGE) {
+        fFound = pcursor->plog->Seek(CSerializeData(ssKey.begin(), ssKey.end()), false, key, value);
+    } else if (fFlags == DB_NEXT) {
+        fFound = pcursor->plog->Seek(pcursor->lastKey, pcursor->fStarted, key, value);
+    } else {
+        return EINVAL;
+    }
+    if (!fFound)
+        return DB_NOTFOUND;
+    pcursor->lastKey = key;
+    pcursor->fStarted = true;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(&key[0], key.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(&value[0], value.size());
+    return 0;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        if (mapLogDb[strFile] != NULL) {
+            // Sync the log store to disk. It stays loaded, so that opening
+            // the file again does not replay the whole log.
+            mapLogDb[strFile]->Flush();
+        }
         if (mapDb[strFile] != NULL) {
             // Close the database handle
             Db* pdb = mapDb[strFile];
@@ -339,6 +469,17 @@ bool CDBEnv::RemoveDb(const string& strFile)
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    if (bitdb.IsLogStore(strFile)) {
+        // Compaction swaps the file under the open store, so there is no need
+        // to wait for other users to close it
+        LogPrintf("CDB::Rewrite: Compacting %s...\n", strFile);
+        CDB db(strFile.c_str(), "r+");
+        bool fSuccess = db.plog->Compact(pszSkip) && db.WriteVersion(CLIENT_VERSION);
+        if (!fSuccess)
+            LogPrintf("CDB::Rewrite: Failed to compact %s\n", strFile);
+        return fSuccess;
+    }
+
     while (true) {
         {
             LOCK(bitdb.cs_db);
@@ -366,7 +507,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -441,7 +582,7 @@ void CDBEnv::Flush(bool fShutdown)
                 LogPrint("db", "CDBEnv::Flush: %s checkpoint\n", strFile);
                 dbenv->txn_checkpoint(0, 0, 0);
                 LogPrint("db", "CDBEnv::Flush: %s detach\n", strFile);
-                if (!fMockDb)
+                if (!fMockDb && !IsLogStore(strFile))
                     dbenv->lsn_reset(strFile.c_str(), 0);
                 LogPrint("db", "CDBEnv::Flush: %s closed\n", strFile);
                 mapFileUseCount.erase(mi++);
@@ -452,6 +593,10 @@ void CDBEnv::Flush(bool fShutdown)
         if (fShutdown) {
             char** listp;
             if (mapFileUseCount.empty()) {
+                for (auto& entry : mapLogDb) {
+                    delete entry.second;
+                    entry.second = NULL;
+                }
                 dbenv->log_archive(&listp, DB_ARCH_REMOVE);
                 Close();
                 if (!fMockDb)
@@ -11,6 +11,7 @@
 #include "streams.h"
 #include "sync.h"
 #include "version.h"
+#include "wallet/logdb.h"
 
 #include <map>
 #include <string>
@@ -22,6 +23,9 @@
 
 extern unsigned int nWalletDBUpdated;
 
+/** Storage engine for wallet files that do not exist yet ("bdb" or "log") */
+static const char* const DEFAULT_WALLET_STORE = "bdb";
+
 class CDBEnv
 {
 private:
@@ -38,6 +42,7 @@ public:
     DbEnv *dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CLogDB*> mapLogDb;
 
     CDBEnv();
     ~CDBEnv();
@@ -46,6 +51,13 @@ public:
     void MakeMock();
     bool IsMock() { return fMockDb; }
 
+    /**
+     * Whether strFile is a log store rather than a Berkeley database. A file
+     * that does not exist yet will be created as a log store if
+     * -walletstore=log is set.
+     */
+    bool IsLogStore(const std::string& strFile);
+
     /**
      * Verify that database file strFile is OK. If it is not,
      * call the callback to try to recover.
@@ -87,13 +99,42 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/**
+ * Cursor over the records of a Berkeley database or of a log store. Like a
+ * Dbc, it is released by calling close().
+ */
+class CDBCursor
+{
+public:
+    Dbc* pdbc;
+    CLogDB* plog;
+    CSerializeData lastKey;
+    bool fStarted;
+
+    explicit CDBCursor(Dbc* pdbcIn) : pdbc(pdbcIn), plog(NULL), fStarted(false) {}
+    explicit CDBCursor(CLogDB* plogIn) : pdbc(NULL), plog(plogIn), fStarted(false) {}
+
+    void close()
+    {
+        if (pdbc)
+            pdbc->close();
+        delete this;
+    }
+
+private:
+    ~CDBCursor() {}
+};
+
+
+/** RAII class that provides access to a Berkeley database or log store */
 class CDB
 {
 protected:
     Db* pdb;
+    CLogDB* plog;
     std::string strFile;
     DbTxn* activeTxn;
+    CLogDB::Batch* activeBatch;
     bool fReadOnly;
     bool fFlushOnClose;
 
@@ -109,16 +150,35 @@ private:
     void operator=(const CDB&);
 
 protected:
+    bool ReadLog(const CDataStream& ssKey, CDataStream& ssValue);
+    bool WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseLog(const CDataStream& ssKey);
+    bool ExistsLog(const CDataStream& ssKey);
+    int ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog) {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            if (!ReadLog(ssKey, ssValue))
+                return false;
+            try {
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -146,7 +206,7 @@ protected:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -155,12 +215,16 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (plog)
+            return WriteLog(ssKey, ssValue, fOverwrite);
+
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -175,7 +239,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -184,6 +248,10 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog)
+            return EraseLog(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -197,13 +265,17 @@ protected:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog)
+            return ExistsLog(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -214,19 +286,24 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (plog)
+            return new CDBCursor(plog);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
     {
+        if (pcursor->plog)
+            return ReadAtLogCursor(pcursor, ssKey, ssValue, fFlags);
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
@@ -240,7 +317,7 @@ protected:
         }
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->pdbc->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -265,6 +342,12 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog) {
+            if (activeBatch)
+                return false;
+            activeBatch = new CLogDB::Batch();
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -276,6 +359,14 @@ public:
 
     bool TxnCommit()
     {
+        if (plog) {
+            if (!activeBatch)
+                return false;
+            bool ret = plog->WriteBatch(*activeBatch);
+            delete activeBatch;
+            activeBatch = NULL;
+            return ret;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -285,6 +376,13 @@ public:
 
     bool TxnAbort()
     {
+        if (plog) {
+            if (!activeBatch)
+                return false;
+            delete activeBatch;
+            activeBatch = NULL;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -303,6 +401,8 @@ public:
         return Write(std::string("version"), nVersion);
     }
 
+    bool IsLogStore() const { return plog != NULL; }
+
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
 };
 
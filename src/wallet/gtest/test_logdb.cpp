@@ -0,0 +1,171 @@
+#include <gtest/gtest.h>
+
+#include "util.h"
+#include "wallet/logdb.h"
+
+#include <boost/filesystem.hpp>
+
+static CSerializeData Data(const std::string& s)
+{
+    return CSerializeData(s.begin(), s.end());
+}
+
+static std::string Str(const CSerializeData& d)
+{
+    return std::string(d.begin(), d.end());
+}
+
+TEST(logdb_tests, WriteReadErasePersist) {
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(pathTemp);
+    boost::filesystem::path path = pathTemp / "wallet.dat";
+
+    {
+        CLogDB db(path);
+        EXPECT_FALSE(db.Open(false));
+        ASSERT_TRUE(db.Open(true));
+        EXPECT_TRUE(CLogDB::IsLogFile(path));
+
+        EXPECT_TRUE(db.Write(Data("a"), Data("1")));
+        EXPECT_TRUE(db.Write(Data("b"), Data("2")));
+        EXPECT_FALSE(db.Write(Data("a"), Data("3"), false));
+        EXPECT_TRUE(db.Write(Data("a"), Data("4")));
+        EXPECT_TRUE(db.Erase(Data("b")));
+
+        CSerializeData value;
+        ASSERT_TRUE(db.Read(Data("a"), value));
+        EXPECT_EQ("4", Str(value));
+        EXPECT_FALSE(db.Exists(Data("b")));
+        EXPECT_GT(db.GetDeadBytes(), 0u);
+    }
+
+    {
+        CLogDB db(path);
+        ASSERT_TRUE(db.Open(false));
+        CSerializeData value;
+        ASSERT_TRUE(db.Read(Data("a"), value));
+        EXPECT_EQ("4", Str(value));
+        EXPECT_FALSE(db.Exists(Data("b")));
+    }
+
+    boost::filesystem::remove_all(pathTemp);
+}
+
+TEST(logdb_tests, UncommittedTailIsDiscarded) {
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(pathTemp);
+    boost::filesystem::path path = pathTemp / "wallet.dat";
+
+    size_t nSize;
+    {
+        CLogDB db(path);
+        ASSERT_TRUE(db.Open(true));
+        EXPECT_TRUE(db.Write(Data("a"), Data("1")));
+        nSize = boost::filesystem::file_size(path);
+
+        CLogDB::Batch batch;
+        batch.Write(Data("b"), Data("2"));
+        batch.Write(Data("c"), Data("3"));
+        EXPECT_TRUE(db.WriteBatch(batch));
+    }
+
+    // Cut the file inside the second batch, as if the process died while writing it
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 3);
+
+    {
+        CLogDB db(path);
+        ASSERT_TRUE(db.Open(false));
+        EXPECT_TRUE(db.Exists(Data("a")));
+        EXPECT_FALSE(db.Exists(Data("b")));
+        EXPECT_FALSE(db.Exists(Data("c")));
+        EXPECT_EQ(nSize, boost::filesystem::file_size(path));
+
+        // The store is still writable after the tail was dropped
+        EXPECT_TRUE(db.Write(Data("d"), Data("4")));
+    }
+
+    {
+        CLogDB db(path);
+        ASSERT_TRUE(db.Open(false));
+        EXPECT_TRUE(db.Exists(Data("a")));
+        EXPECT_TRUE(db.Exists(Data("d")));
+    }
+
+    boost::filesystem::remove_all(pathTemp);
+}
+
+TEST(logdb_tests, SeekAndCompact) {
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(pathTemp);
+    boost::filesystem::path path = pathTemp / "wallet.dat";
+
+    CLogDB db(path);
+    ASSERT_TRUE(db.Open(true));
+
+    CLogDB::Batch batch;
+    batch.Write(Data("key\x01"), Data("1"));
+    batch.Write(Data("key\xff"), Data("2"));
+    batch.Write(Data("pool"), Data("3"));
+    batch.Write(Data("key\x80"), Data("4"));
+    batch.Erase(Data("key\x80"));
+    ASSERT_TRUE(db.WriteBatch(batch));
+
+    // Keys are ordered as unsigned bytes
+    CSerializeData key, value;
+    ASSERT_TRUE(db.Seek(Data("key"), false, key, value));
+    EXPECT_EQ("key\x01", Str(key));
+    ASSERT_TRUE(db.Seek(key, true, key, value));
+    EXPECT_EQ("key\xff", Str(key));
+    EXPECT_EQ("2", Str(value));
+    ASSERT_TRUE(db.Seek(key, true, key, value));
+    EXPECT_EQ("pool", Str(key));
+    EXPECT_FALSE(db.Seek(key, true, key, value));
+
+    for (int i = 0; i < 10; i++)
+        EXPECT_TRUE(db.Write(Data("key\x01"), Data(strprintf("%d", i))));
+    size_t nSizeBefore = boost::filesystem::file_size(path);
+    size_t nDeadBefore = db.GetDeadBytes();
+
+    ASSERT_TRUE(db.Compact("pool"));
+    EXPECT_LT(db.GetDeadBytes(), nDeadBefore);
+    EXPECT_LT(boost::filesystem::file_size(path), nSizeBefore);
+    EXPECT_FALSE(db.Exists(Data("pool")));
+    ASSERT_TRUE(db.Read(Data("key\x01"), value));
+    EXPECT_EQ("9", Str(value));
+    EXPECT_TRUE(db.Exists(Data("key\xff")));
+
+    db.Close();
+    boost::filesystem::remove_all(pathTemp);
+}
+
+TEST(logdb_tests, FailedCompactKeepsSkippedRecords) {
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(pathTemp);
+    boost::filesystem::path path = pathTemp / "wallet.dat";
+
+    CLogDB db(path);
+    ASSERT_TRUE(db.Open(true));
+    EXPECT_TRUE(db.Write(Data("key"), Data("1")));
+    EXPECT_TRUE(db.Write(Data("pool"), Data("2")));
+
+    // A directory in the way of the new file makes the compaction fail
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".compact";
+    boost::filesystem::create_directories(pathTmp);
+    EXPECT_FALSE(db.Compact("pool"));
+    EXPECT_TRUE(db.Exists(Data("pool")));
+
+    // The database is still usable, and agrees with what is on disk
+    boost::filesystem::remove(pathTmp);
+    EXPECT_TRUE(db.Write(Data("key"), Data("3")));
+    db.Close();
+    ASSERT_TRUE(db.Open(false));
+    CSerializeData value;
+    ASSERT_TRUE(db.Read(Data("pool"), value));
+    EXPECT_EQ("2", Str(value));
+    ASSERT_TRUE(db.Read(Data("key"), value));
+    EXPECT_EQ("3", Str(value));
+
+    db.Close();
+    boost::filesystem::remove_all(pathTemp);
+}
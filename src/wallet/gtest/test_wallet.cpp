@@ -31,7 +31,7 @@ public:
     MOCK_METHOD0(TxnCommit, bool());
     MOCK_METHOD0(TxnAbort, bool());
 
-    MOCK_METHOD2(WriteTx, bool(uint256 hash, const CWalletTx& wtx));
+    MOCK_METHOD2(WriteTxNoteData, bool(uint256 hash, const CWalletTx& wtx));
     MOCK_METHOD1(WriteWitnessCacheSize, bool(int64_t nWitnessCacheSize));
     MOCK_METHOD1(WriteBestBlock, bool(const CBlockLocator& loc));
 };
@@ -69,6 +69,9 @@ public:
     void MarkAffectedTransactionsDirty(const CTransaction& tx) {
         CWallet::MarkAffectedTransactionsDirty(tx);
     }
+    const std::set<COutPoint>& GetUTXOIndex() const {
+        return setWalletUTXO;
+    }
 };
 
 CWalletTx GetValidSproutReceive(const libzprime::SproutSpendingKey& sk, CAmount value, bool randomInputs, int32_t version = 2) {
@@ -1527,20 +1530,20 @@ TEST(WalletTests, WriteWitnessCache) {
     EXPECT_CALL(walletdb, TxnBegin())
         .WillRepeatedly(Return(true));
 
-    // WriteTx fails
-    EXPECT_CALL(walletdb, WriteTx(wtx.GetHash(), wtx))
+    // WriteTxNoteData fails
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtx.GetHash(), wtx))
         .WillOnce(Return(false));
     EXPECT_CALL(walletdb, TxnAbort())
         .Times(1);
     wallet.SetBestChain(walletdb, loc);
 
-    // WriteTx throws
-    EXPECT_CALL(walletdb, WriteTx(wtx.GetHash(), wtx))
+    // WriteTxNoteData throws
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtx.GetHash(), wtx))
         .WillOnce(ThrowLogicError());
     EXPECT_CALL(walletdb, TxnAbort())
         .Times(1);
     wallet.SetBestChain(walletdb, loc);
-    EXPECT_CALL(walletdb, WriteTx(wtx.GetHash(), wtx))
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtx.GetHash(), wtx))
         .WillRepeatedly(Return(true));
 
     // WriteWitnessCacheSize fails
@@ -1648,15 +1651,15 @@ TEST(WalletTests, SetBestChainIgnoresTxsWithoutShieldedData) {
 
     EXPECT_CALL(walletdb, TxnBegin())
         .WillOnce(Return(true));
-    EXPECT_CALL(walletdb, WriteTx(wtxTransparent.GetHash(), wtxTransparent))
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtxTransparent.GetHash(), wtxTransparent))
         .Times(0);
-    EXPECT_CALL(walletdb, WriteTx(wtxSprout.GetHash(), wtxSprout))
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtxSprout.GetHash(), wtxSprout))
         .Times(1).WillOnce(Return(true));
-    EXPECT_CALL(walletdb, WriteTx(wtxSproutTransparent.GetHash(), wtxSproutTransparent))
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtxSproutTransparent.GetHash(), wtxSproutTransparent))
         .Times(0);
-    EXPECT_CALL(walletdb, WriteTx(wtxSapling.GetHash(), wtxSapling))
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtxSapling.GetHash(), wtxSapling))
         .Times(1).WillOnce(Return(true));
-    EXPECT_CALL(walletdb, WriteTx(wtxSaplingTransparent.GetHash(), wtxSaplingTransparent))
+    EXPECT_CALL(walletdb, WriteTxNoteData(wtxSaplingTransparent.GetHash(), wtxSaplingTransparent))
         .Times(0);
     EXPECT_CALL(walletdb, WriteWitnessCacheSize(0))
         .WillOnce(Return(true));
@@ -2065,3 +2068,65 @@ TEST(WalletTests, SaplingNoteLocking) {
     EXPECT_FALSE(wallet.IsLockedNote(sop1));
     EXPECT_FALSE(wallet.IsLockedNote(sop2));
 }
+
+TEST(WalletTests, UTXOIndexTracksOwnedOutputs) {
+    SelectParams(CBaseChainParams::REGTEST);
+
+    TestWallet wallet;
+
+    CKey tsk = AddTestCKeyToKeyStore(wallet);
+    auto scriptPubKey = GetScriptForDestination(tsk.GetPubKey().GetID());
+    CKey other;
+    other.MakeNewKey(true);
+
+    // Transaction with one output to us and one to someone else
+    CMutableTransaction t;
+    t.vout.resize(2);
+    t.vout[0].nValue = 90*CENT;
+    t.vout[0].scriptPubKey = scriptPubKey;
+    t.vout[1].nValue = 10*CENT;
+    t.vout[1].scriptPubKey = GetScriptForDestination(other.GetPubKey().GetID());
+    CWalletTx wtx {nullptr, t};
+    wallet.AddToWallet(wtx, true, nullptr);
+    uint256 hash = wtx.GetHash();
+
+    EXPECT_EQ(1, wallet.GetUTXOIndex().size());
+    EXPECT_EQ(1, wallet.GetUTXOIndex().count(COutPoint(hash, 0)));
+
+    // An unconfirmed spend leaves the output indexed
+    CMutableTransaction t2;
+    t2.vin.resize(1);
+    t2.vin[0].prevout = COutPoint(hash, 0);
+    t2.vout.resize(1);
+    t2.vout[0].nValue = 80*CENT;
+    t2.vout[0].scriptPubKey = GetScriptForDestination(other.GetPubKey().GetID());
+    CWalletTx wtx2 {nullptr, t2};
+    wallet.AddToWallet(wtx2, true, nullptr);
+
+    wallet.RebuildUTXOIndex();
+    EXPECT_EQ(1, wallet.GetUTXOIndex().size());
+    EXPECT_EQ(1, wallet.GetUTXOIndex().count(COutPoint(hash, 0)));
+
+    // Confirming the spend drops the output from the index, without a rebuild
+    CBlock block;
+    block.vtx.push_back(wtx2);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    auto blockHash = block.GetHash();
+    CBlockIndex fakeIndex {block};
+    mapBlockIndex.insert(std::make_pair(blockHash, &fakeIndex));
+    chainActive.SetTip(&fakeIndex);
+    EXPECT_TRUE(chainActive.Contains(&fakeIndex));
+
+    wtx2.SetMerkleBranch(block);
+    wallet.AddToWallet(wtx2, true, nullptr);
+    EXPECT_EQ(0, wallet.GetUTXOIndex().size());
+
+    // A wallet without the key doesn't index the output in the first place
+    TestWallet emptyWallet;
+    emptyWallet.AddToWallet(wtx, true, nullptr);
+    EXPECT_EQ(0, emptyWallet.GetUTXOIndex().size());
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(blockHash);
+}
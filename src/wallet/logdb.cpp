@@ -0,0 +1,471 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logdb.h"
+
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+// File header: magic bytes followed by the format version
+static const unsigned char LOGDB_MAGIC[8] = {'z', 'w', 'l', 'o', 'g', 'd', 'b', 0};
+static const uint32_t LOGDB_FORMAT_VERSION = 1;
+static const size_t LOGDB_HEADER_SIZE = sizeof(LOGDB_MAGIC) + sizeof(uint32_t);
+static const size_t LOGDB_CHECKSUM_SIZE = 4;
+
+static void WriteHeader(CSerializeData& buf)
+{
+    buf.insert(buf.end(), LOGDB_MAGIC, LOGDB_MAGIC + sizeof(LOGDB_MAGIC));
+    unsigned char version[4];
+    WriteLE32(version, LOGDB_FORMAT_VERSION);
+    buf.insert(buf.end(), version, version + sizeof(version));
+}
+
+// Read a CompactSize length prefix, as written by the vector serializer
+static bool ReadLength(const unsigned char*& p, const unsigned char* pend, uint64_t& n)
+{
+    if (p >= pend)
+        return false;
+    unsigned char chSize = *p++;
+    size_t nBytes = chSize < 253 ? 0 : chSize == 253 ? 2 : chSize == 254 ? 4 : 8;
+    if ((size_t)(pend - p) < nBytes)
+        return false;
+    if (nBytes == 0)
+        n = chSize;
+    else if (nBytes == 2)
+        n = ReadLE16(p);
+    else if (nBytes == 4)
+        n = ReadLE32(p);
+    else
+        n = ReadLE64(p);
+    p += nBytes;
+    return n <= (uint64_t)(pend - p);
+}
+
+bool CLogDB::KeyCompare::operator()(const CSerializeData& a, const CSerializeData& b) const
+{
+    // Berkeley DB btrees compare keys with memcmp, so compare bytes as unsigned
+    size_t n = std::min(a.size(), b.size());
+    int c = n ? memcmp(&a[0], &b[0], n) : 0;
+    return c < 0 || (c == 0 && a.size() < b.size());
+}
+
+void CLogDB::Batch::Write(const CSerializeData& key, const CSerializeData& value)
+{
+    vRecords.push_back(std::make_pair(RECORD_PUT, std::make_pair(key, value)));
+}
+
+void CLogDB::Batch::Erase(const CSerializeData& key)
+{
+    vRecords.push_back(std::make_pair(RECORD_ERASE, std::make_pair(key, CSerializeData())));
+}
+
+bool CLogDB::Batch::Find(const CSerializeData& key, CSerializeData& value, bool& fErased) const
+{
+    for (auto it = vRecords.rbegin(); it != vRecords.rend(); ++it) {
+        if (it->second.first == key) {
+            fErased = (it->first == RECORD_ERASE);
+            value = it->second.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+CLogDB::CLogDB(const boost::filesystem::path& pathIn) :
+    path(pathIn), file(NULL), nFileSize(0), nLiveBytes(0), nDeadBytes(0)
+{
+}
+
+CLogDB::~CLogDB()
+{
+    Close();
+}
+
+bool CLogDB::IsLogFile(const boost::filesystem::path& path)
+{
+    FILE* f = fopen(path.string().c_str(), "rb");
+    if (!f)
+        return false;
+    unsigned char magic[sizeof(LOGDB_MAGIC)];
+    bool fMatch = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                  memcmp(magic, LOGDB_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return fMatch;
+}
+
+size_t CLogDB::RecordSize(const CSerializeData& key, const CSerializeData& value)
+{
+    return 1 + GetSizeOfCompactSize(key.size()) + key.size() +
+           GetSizeOfCompactSize(value.size()) + value.size() + LOGDB_CHECKSUM_SIZE;
+}
+
+void CLogDB::AppendRecord(CSerializeData& buf, RecordType type, const CSerializeData& key, const CSerializeData& value)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss.reserve(RecordSize(key, value));
+    ss << (unsigned char)type;
+    ss << key;
+    ss << value;
+    uint256 hash = Hash(ss.begin(), ss.end());
+    ss.write((const char*)hash.begin(), LOGDB_CHECKSUM_SIZE);
+    buf.insert(buf.end(), ss.begin(), ss.end());
+}
+
+bool CLogDB::Open(bool fCreate)
+{
+    LOCK(cs);
+    if (file)
+        return true;
+
+    mapRecords.clear();
+    nLiveBytes = nDeadBytes = 0;
+
+    if (!boost::filesystem::exists(path)) {
+        if (!fCreate)
+            return error("CLogDB::Open: %s does not exist", path.string());
+        FILE* f = fopen(path.string().c_str(), "wb");
+        if (!f)
+            return error("CLogDB::Open: can't create %s", path.string());
+        CSerializeData header;
+        WriteHeader(header);
+        bool fOk = fwrite(&header[0], 1, header.size(), f) == header.size();
+        if (fOk) {
+            fflush(f);
+            FileCommit(f);
+        }
+        fclose(f);
+        if (!fOk)
+            return error("CLogDB::Open: can't write header to %s", path.string());
+    }
+
+    // Map the file and replay its records
+    size_t nSize = boost::filesystem::file_size(path);
+    size_t nCommitted = 0;
+    bool fOk = false;
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return error("CLogDB::Open: can't open %s", path.string());
+    void* pmap = nSize ? mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (nSize && pmap == MAP_FAILED)
+        return error("CLogDB::Open: can't map %s", path.string());
+    if (pmap)
+        posix_madvise(pmap, nSize, POSIX_MADV_SEQUENTIAL);
+    const unsigned char* pbegin = (const unsigned char*)pmap;
+    fOk = Replay(pbegin, pbegin + nSize, nCommitted);
+    if (pmap)
+        munmap(pmap, nSize);
+#else
+    std::vector<unsigned char> vData(nSize);
+    FILE* f = fopen(path.string().c_str(), "rb");
+    if (!f || (nSize && fread(&vData[0], 1, nSize, f) != nSize)) {
+        if (f)
+            fclose(f);
+        return error("CLogDB::Open: can't read %s", path.string());
+    }
+    fclose(f);
+    fOk = Replay(vData.data(), vData.data() + nSize, nCommitted);
+#endif
+    if (!fOk) {
+        mapRecords.clear();
+        return error("CLogDB::Open: %s is not a wallet log store", path.string());
+    }
+
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file)
+        return error("CLogDB::Open: can't open %s for writing", path.string());
+
+    if (nCommitted < nSize) {
+        LogPrintf("CLogDB::Open: discarding %u bytes of damaged or uncommitted records at the end of %s\n",
+            nSize - nCommitted, path.string());
+        if (!TruncateFile(file, nCommitted)) {
+            Close();
+            return error("CLogDB::Open: can't truncate %s", path.string());
+        }
+    }
+    nFileSize = nCommitted;
+    fseek(file, nFileSize, SEEK_SET);
+
+    LogPrint("db", "CLogDB::Open: %s has %u records, %u live bytes, %u dead bytes\n",
+        path.string(), mapRecords.size(), nLiveBytes, nDeadBytes);
+    return true;
+}
+
+/**
+ * Apply the committed records in [pbegin, pend) to mapRecords. nCommitted is
+ * set to the offset just past the last commit record. Returns false only if
+ * the header is missing or unsupported.
+ */
+bool CLogDB::Replay(const unsigned char* pbegin, const unsigned char* pend, size_t& nCommitted)
+{
+    if ((size_t)(pend - pbegin) < LOGDB_HEADER_SIZE ||
+        memcmp(pbegin, LOGDB_MAGIC, sizeof(LOGDB_MAGIC)) != 0 ||
+        ReadLE32(pbegin + sizeof(LOGDB_MAGIC)) != LOGDB_FORMAT_VERSION)
+        return false;
+
+    const unsigned char* p = pbegin + LOGDB_HEADER_SIZE;
+    nCommitted = p - pbegin;
+
+    std::vector<std::pair<RecordType, std::pair<CSerializeData, CSerializeData> > > vPending;
+    while (p < pend) {
+        const unsigned char* pstart = p;
+        unsigned char type = *p++;
+        uint64_t nKeySize, nValueSize;
+        if (!ReadLength(p, pend, nKeySize))
+            break;
+        const unsigned char* pkey = p;
+        p += nKeySize;
+        if (!ReadLength(p, pend, nValueSize))
+            break;
+        const unsigned char* pvalue = p;
+        p += nValueSize;
+        if ((size_t)(pend - p) < LOGDB_CHECKSUM_SIZE)
+            break;
+        uint256 hash = Hash(pstart, p);
+        if (memcmp(hash.begin(), p, LOGDB_CHECKSUM_SIZE) != 0)
+            break;
+        p += LOGDB_CHECKSUM_SIZE;
+
+        if (type == RECORD_COMMIT) {
+            for (const auto& record : vPending)
+                Apply(record.first, record.second.first, record.second.second);
+            vPending.clear();
+            nDeadBytes += p - pstart;
+            nCommitted = p - pbegin;
+        } else if (type == RECORD_PUT || type == RECORD_ERASE) {
+            vPending.push_back(std::make_pair((RecordType)type, std::make_pair(
+                CSerializeData((const char*)pkey, (const char*)pkey + nKeySize),
+                CSerializeData((const char*)pvalue, (const char*)pvalue + nValueSize))));
+        } else {
+            break;
+        }
+    }
+    return true;
+}
+
+void CLogDB::Apply(RecordType type, const CSerializeData& key, const CSerializeData& value)
+{
+    RecordMap::iterator it = mapRecords.find(key);
+    if (it != mapRecords.end()) {
+        size_t nOldSize = RecordSize(it->first, it->second);
+        nLiveBytes -= nOldSize;
+        nDeadBytes += nOldSize;
+    }
+    if (type == RECORD_PUT) {
+        if (it != mapRecords.end())
+            it->second = value;
+        else
+            mapRecords.insert(std::make_pair(key, value));
+        nLiveBytes += RecordSize(key, value);
+    } else {
+        if (it != mapRecords.end())
+            mapRecords.erase(it);
+        nDeadBytes += RecordSize(key, value);
+    }
+}
+
+void CLogDB::Close()
+{
+    LOCK(cs);
+    if (!file)
+        return;
+    fflush(file);
+    FileCommit(file);
+    fclose(file);
+    file = NULL;
+    mapRecords.clear();
+    nLiveBytes = nDeadBytes = 0;
+}
+
+bool CLogDB::Read(const CSerializeData& key, CSerializeData& value) const
+{
+    LOCK(cs);
+    RecordMap::const_iterator it = mapRecords.find(key);
+    if (it == mapRecords.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+bool CLogDB::Exists(const CSerializeData& key) const
+{
+    LOCK(cs);
+    return mapRecords.count(key) > 0;
+}
+
+bool CLogDB::Write(const CSerializeData& key, const CSerializeData& value, bool fOverwrite)
+{
+    LOCK(cs);
+    if (!fOverwrite && mapRecords.count(key))
+        return false;
+    Batch batch;
+    batch.Write(key, value);
+    return WriteBatch(batch);
+}
+
+bool CLogDB::Erase(const CSerializeData& key)
+{
+    LOCK(cs);
+    if (!mapRecords.count(key))
+        return true;
+    Batch batch;
+    batch.Erase(key);
+    return WriteBatch(batch);
+}
+
+bool CLogDB::WriteBatch(const Batch& batch)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (batch.empty())
+        return true;
+
+    CSerializeData buf;
+    for (const auto& record : batch.vRecords)
+        AppendRecord(buf, record.first, record.second.first, record.second.second);
+    AppendRecord(buf, RECORD_COMMIT, CSerializeData(), CSerializeData());
+    if (!Append(buf))
+        return false;
+
+    for (const auto& record : batch.vRecords)
+        Apply(record.first, record.second.first, record.second.second);
+    nDeadBytes += RecordSize(CSerializeData(), CSerializeData());
+
+    if (nDeadBytes > LOGDB_COMPACT_MIN_DEAD_BYTES && nDeadBytes > nLiveBytes) {
+        // The batch is already committed, so a failed compaction only costs space
+        if (!CompactInternal(NULL))
+            LogPrintf("CLogDB::WriteBatch: compacting %s failed\n", path.string());
+    }
+    return true;
+}
+
+bool CLogDB::Append(const CSerializeData& buf)
+{
+    AssertLockHeld(cs);
+    if (!file)
+        return error("CLogDB::Append: %s is not open", path.string());
+    if (fwrite(&buf[0], 1, buf.size(), file) != buf.size() || fflush(file) != 0) {
+        // Cut off the partial batch, so that later batches are not lost behind it on replay
+        TruncateFile(file, nFileSize);
+        fseek(file, nFileSize, SEEK_SET);
+        return error("CLogDB::Append: write to %s failed", path.string());
+    }
+    nFileSize += buf.size();
+    return true;
+}
+
+bool CLogDB::Seek(const CSerializeData& key, bool fAfter, CSerializeData& keyOut, CSerializeData& valueOut) const
+{
+    LOCK(cs);
+    RecordMap::const_iterator it = fAfter ? mapRecords.upper_bound(key) : mapRecords.lower_bound(key);
+    if (it == mapRecords.end())
+        return false;
+    keyOut = it->first;
+    valueOut = it->second;
+    return true;
+}
+
+bool CLogDB::Flush()
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (fflush(file) != 0)
+        return false;
+    FileCommit(file);
+    return true;
+}
+
+bool CLogDB::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    return CompactInternal(pszSkip);
+}
+
+bool CLogDB::CompactInternal(const char* pszSkip)
+{
+    AssertLockHeld(cs);
+    int64_t nStart = GetTimeMillis();
+    size_t nSkip = pszSkip ? strlen(pszSkip) : 0;
+
+    // The skipped records stay in memory until the new file has replaced the old one
+    CSerializeData buf;
+    std::vector<RecordMap::iterator> vSkipped;
+    WriteHeader(buf);
+    for (RecordMap::iterator it = mapRecords.begin(); it != mapRecords.end(); ++it) {
+        if (nSkip && it->first.size() >= nSkip && memcmp(&it->first[0], pszSkip, nSkip) == 0) {
+            vSkipped.push_back(it);
+            continue;
+        }
+        AppendRecord(buf, RECORD_PUT, it->first, it->second);
+    }
+    AppendRecord(buf, RECORD_COMMIT, CSerializeData(), CSerializeData());
+
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".compact";
+    FILE* f = fopen(pathTmp.string().c_str(), "wb");
+    if (!f)
+        return error("CLogDB::Compact: can't create %s", pathTmp.string());
+    bool fOk = fwrite(&buf[0], 1, buf.size(), f) == buf.size() && fflush(f) == 0;
+    if (fOk)
+        FileCommit(f);
+    fclose(f);
+    if (!fOk) {
+        boost::filesystem::remove(pathTmp);
+        return error("CLogDB::Compact: can't write %s", pathTmp.string());
+    }
+
+    fclose(file);
+    file = NULL;
+    if (!RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        Reopen();
+        return error("CLogDB::Compact: can't rename %s to %s", pathTmp.string(), path.string());
+    }
+    for (const auto& it : vSkipped)
+        mapRecords.erase(it);
+    nFileSize = buf.size();
+    nLiveBytes = buf.size() - LOGDB_HEADER_SIZE - RecordSize(CSerializeData(), CSerializeData());
+    size_t nReclaimed = nDeadBytes;
+    nDeadBytes = RecordSize(CSerializeData(), CSerializeData());
+    if (!Reopen())
+        return false;
+
+    LogPrint("db", "CLogDB::Compact: rewrote %s, %u bytes reclaimed, %dms\n",
+        path.string(), nReclaimed, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CLogDB::Reopen()
+{
+    AssertLockHeld(cs);
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file) {
+        // Writes are refused from here on, as if the database were closed;
+        // what is in memory still matches the file, and can be read
+        return error("CLogDB::Compact: can't reopen %s, no further writes are possible", path.string());
+    }
+    fseek(file, nFileSize, SEEK_SET);
+    return true;
+}
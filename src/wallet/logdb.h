@@ -0,0 +1,117 @@
+// Copyright (c) 2019 The zPrime developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_LOGDB_H
+#define BITCOIN_WALLET_LOGDB_H
+
+#include "serialize.h"
+#include "support/allocators/zeroafterfree.h"
+#include "sync.h"
+
+#include <map>
+#include <stdio.h>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Rewrite a log store once overwritten records take up more than this and more than the live records */
+static const size_t LOGDB_COMPACT_MIN_DEAD_BYTES = 1 << 20;
+
+/**
+ * Append-only key/value store, used by CDB in place of a Berkeley database
+ * for wallet files created with -walletstore=log.
+ *
+ * Every change is appended to the file as a checksummed record, and a batch
+ * of records takes effect once the commit record that follows it is on disk.
+ * On open the file is memory-mapped and replayed into memory; a damaged or
+ * uncommitted tail is discarded. When records that have since been
+ * overwritten or erased outweigh the live ones, the file is compacted by
+ * writing the live records to a new file and renaming it over the old one.
+ */
+class CLogDB
+{
+public:
+    enum RecordType : unsigned char {
+        RECORD_PUT = 1,
+        RECORD_ERASE = 2,
+        RECORD_COMMIT = 3,
+    };
+
+    /** Changes that are appended and committed together */
+    class Batch
+    {
+    public:
+        void Write(const CSerializeData& key, const CSerializeData& value);
+        void Erase(const CSerializeData& key);
+
+        /** Look up the latest change to key in this batch; fErased is set if it was erased */
+        bool Find(const CSerializeData& key, CSerializeData& value, bool& fErased) const;
+
+        bool empty() const { return vRecords.empty(); }
+
+    private:
+        friend class CLogDB;
+        std::vector<std::pair<RecordType, std::pair<CSerializeData, CSerializeData> > > vRecords;
+    };
+
+    explicit CLogDB(const boost::filesystem::path& pathIn);
+    ~CLogDB();
+
+    /** Whether the file at path starts with the log store header */
+    static bool IsLogFile(const boost::filesystem::path& path);
+
+    bool Open(bool fCreate);
+    void Close();
+    bool IsOpen() const { return file != NULL; }
+
+    bool Read(const CSerializeData& key, CSerializeData& value) const;
+    bool Exists(const CSerializeData& key) const;
+    bool Write(const CSerializeData& key, const CSerializeData& value, bool fOverwrite = true);
+    bool Erase(const CSerializeData& key);
+    bool WriteBatch(const Batch& batch);
+
+    /**
+     * Find the first record with a key not less than key (or greater than key,
+     * if fAfter is set), in the byte order used by Berkeley DB btrees.
+     */
+    bool Seek(const CSerializeData& key, bool fAfter, CSerializeData& keyOut, CSerializeData& valueOut) const;
+
+    /** Write buffered records to disk and sync the file */
+    bool Flush();
+
+    /** Rewrite the file with only the live records, dropping keys that start with pszSkip */
+    bool Compact(const char* pszSkip = NULL);
+
+    size_t GetLiveBytes() const { LOCK(cs); return nLiveBytes; }
+    size_t GetDeadBytes() const { LOCK(cs); return nDeadBytes; }
+
+private:
+    struct KeyCompare {
+        bool operator()(const CSerializeData& a, const CSerializeData& b) const;
+    };
+    typedef std::map<CSerializeData, CSerializeData, KeyCompare> RecordMap;
+
+    mutable CCriticalSection cs;
+    boost::filesystem::path path;
+    FILE* file;
+    size_t nFileSize;
+    RecordMap mapRecords;
+    size_t nLiveBytes;
+    size_t nDeadBytes;
+
+    CLogDB(const CLogDB&);
+    void operator=(const CLogDB&);
+
+    static size_t RecordSize(const CSerializeData& key, const CSerializeData& value);
+    static void AppendRecord(CSerializeData& buf, RecordType type, const CSerializeData& key, const CSerializeData& value);
+
+    bool Replay(const unsigned char* pbegin, const unsigned char* pend, size_t& nCommitted);
+    void Apply(RecordType type, const CSerializeData& key, const CSerializeData& value);
+    bool Append(const CSerializeData& buf);
+    bool CompactInternal(const char* pszSkip);
+    bool Reopen();
+};
+
+#endif // BITCOIN_WALLET_LOGDB_H
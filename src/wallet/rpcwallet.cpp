@@ -29,6 +29,7 @@
 #include "wallet/asyncrpcoperation_mergetoaddress.h"
 #include "wallet/asyncrpcoperation_saplingmigration.h"
 #include "wallet/asyncrpcoperation_sendmany.h"
+#include "wallet/asyncrpcoperation_sendmanybulk.h"
 #include "wallet/asyncrpcoperation_shieldcoinbase.h"
 
 #include "sodium.h"
@@ -39,6 +40,8 @@
 
 #include <univalue.h>
 
+#include <fstream>
+#include <iterator>
 #include <numeric>
 
 using namespace std;
@@ -2723,8 +2726,6 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             );
     }
 
-    LOCK(cs_main);
-
     std::string benchmarktype = params[0].get_str();
     int samplecount = params[1].get_int();
 
@@ -2732,6 +2733,59 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_TYPE_ERROR, "Invalid samplecount");
     }
 
+    // Replayed messages are processed like any peer's, taking the locks they
+    // need, so this runs without cs_main
+    if (benchmarktype == "netreplay") {
+        if (Params().NetworkIDString() != "regtest") {
+            throw JSONRPCError(RPC_TYPE_ERROR, "Benchmark must be run in regtest mode");
+        }
+        // Replay a recording of what a peer sent, or made up rounds of
+        // inv, tx, headers, block, getdata and ping
+        std::vector<unsigned char> vStream;
+        if (params.size() >= 4) {
+            std::ifstream file(params[3].get_str().c_str(), std::ios::in | std::ios::binary);
+            if (!file.is_open()) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open recording");
+            }
+            vStream.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        } else {
+            int nRounds = 1000;
+            if (params.size() >= 3) {
+                nRounds = params[2].get_int();
+            }
+            if (nRounds < 0) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of rounds");
+            }
+            vStream = MakeSyntheticNetStream(nRounds);
+        }
+
+        UniValue results(UniValue::VARR);
+        for (const NetReplaySample& sample : benchmark_netreplay(samplecount, vStream)) {
+            UniValue result(UniValue::VOBJ);
+            result.push_back(Pair("runningtime", sample.dRunningTime));
+            uint64_t nMsgs = 0;
+            UniValue commands(UniValue::VOBJ);
+            for (const std::pair<std::string, CNetReplayCmdStats>& item : sample.stats) {
+                const CNetReplayCmdStats& stats = item.second;
+                UniValue command(UniValue::VOBJ);
+                command.push_back(Pair("messages", stats.nMsgs));
+                command.push_back(Pair("bytes", stats.nBytes));
+                command.push_back(Pair("parsetime", stats.nParseTime * 0.000001));
+                command.push_back(Pair("processtime", stats.nProcessTime * 0.000001));
+                command.push_back(Pair("maxprocesstime", stats.nMaxProcessTime * 0.000001));
+                commands.push_back(Pair(item.first, command));
+                nMsgs += stats.nMsgs;
+            }
+            result.push_back(Pair("messages", nMsgs));
+            result.push_back(Pair("messagespersecond", sample.dRunningTime > 0 ? nMsgs / sample.dRunningTime : 0.0));
+            result.push_back(Pair("commands", commands));
+            results.push_back(result);
+        }
+        return results;
+    }
+
+    LOCK(cs_main);
+
     std::vector<double> sample_times;
 
     JSDescription samplejoinsplit;
@@ -2741,6 +2795,39 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
         ss >> samplejoinsplit;
     }
 
+    if (benchmarktype == "createnewblock") {
+        if (Params().NetworkIDString() != "regtest") {
+            throw JSONRPCError(RPC_TYPE_ERROR, "Benchmark must be run in regtest mode");
+        }
+        // Transactions added to the mempool before each sample
+        int nTxs = 1000;
+        if (params.size() >= 3) {
+            nTxs = params[2].get_int();
+        }
+        // Shielded ones need Sapling to be active
+        int nShielded = 0;
+        if (params.size() >= 4) {
+            nShielded = params[3].get_int();
+        }
+        if (nTxs < 0 || nShielded < 0) {
+            throw JSONRPCError(RPC_TYPE_ERROR, "Invalid transaction count");
+        }
+
+        UniValue results(UniValue::VARR);
+        for (const CreateNewBlockSample& sample : benchmark_createnewblock(samplecount, nTxs, nShielded)) {
+            UniValue result(UniValue::VOBJ);
+            result.push_back(Pair("runningtime", sample.dRunningTime));
+            result.push_back(Pair("mempoolsize", (uint64_t)sample.nMempoolSize));
+            result.push_back(Pair("blocktxs", (uint64_t)sample.nBlockTxs));
+            result.push_back(Pair("prioritytime", sample.times.nPriority * 0.000001));
+            result.push_back(Pair("packagetime", sample.times.nPackages * 0.000001));
+            result.push_back(Pair("assembletime", sample.times.nAssemble * 0.000001));
+            result.push_back(Pair("validitytime", sample.times.nValidity * 0.000001));
+            results.push_back(result);
+        }
+        return results;
+    }
+
     for (int i = 0; i < samplecount; i++) {
         if (benchmarktype == "sleep") {
             sample_times.push_back(benchmark_sleep());
@@ -2794,6 +2881,29 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
                 throw JSONRPCError(RPC_TYPE_ERROR, "Benchmark must be run in regtest mode");
             }
             sample_times.push_back(benchmark_connectblock_slow());
+        } else if (benchmarktype == "estimatefee") {
+            // Number of blocks at the tip to replay through the fee estimator
+            int nBlocks = 1000;
+            if (params.size() >= 3) {
+                nBlocks = params[2].get_int();
+            }
+            sample_times.push_back(benchmark_estimatefee(nBlocks));
+        } else if (benchmarktype == "addrmanadd" || benchmarktype == "addrmanselect" || benchmarktype == "addrmanserialize") {
+            // Number of made-up addresses to fill a fresh address manager with
+            int nAddrs = 10000;
+            if (params.size() >= 3) {
+                nAddrs = params[2].get_int();
+            }
+            if (nAddrs < 0) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of addresses");
+            }
+            if (benchmarktype == "addrmanadd") {
+                sample_times.push_back(benchmark_addrman_add(nAddrs));
+            } else if (benchmarktype == "addrmanselect") {
+                sample_times.push_back(benchmark_addrman_select(nAddrs));
+            } else {
+                sample_times.push_back(benchmark_addrman_serialize(nAddrs));
+            }
         } else if (benchmarktype == "sendtoaddress") {
             if (Params().NetworkIDString() != "regtest") {
                 throw JSONRPCError(RPC_TYPE_ERROR, "Benchmark must be run in regtest mode");
@@ -3552,7 +3662,8 @@ UniValue z_getoperationstatus(const UniValue& params, bool fHelp)
             "\nArguments:\n"
             "1. \"operationid\"         (array, optional) A list of operation ids we are interested in.  If not provided, examine all operations known to the node.\n"
             "\nResult:\n"
-            "\"    [object, ...]\"      (array) A list of JSON objects\n"
+            "\"    [object, ...]\"      (array) A list of JSON objects. Each includes the operation's \"priority\", the \"queued_secs\" it waited\n"
+            "                            before executing and, while still queued, its \"queue_position\".\n"
             "\nExamples:\n"
             + HelpExampleCli("z_getoperationstatus", "'[\"operationid\", ... ]'")
             + HelpExampleRpc("z_getoperationstatus", "'[\"operationid\", ... ]'")
@@ -3592,6 +3703,12 @@ UniValue z_getoperationstatus_IMPL(const UniValue& params, bool fRemoveFinishedO
 
         UniValue obj = operation->getStatus();
         std::string s = obj["status"].get_str();
+        if ("queued"==s) {
+            int position = q->getQueuePosition(id);
+            if (position >= 0) {
+                obj.push_back(Pair("queue_position", position));
+            }
+        }
         if (fRemoveFinishedOperations) {
             // Caller is only interested in retrieving finished results
             if ("success"==s || "failed"==s || "cancelled"==s) {
@@ -3907,6 +4024,171 @@ UniValue z_sendmany(const UniValue& params, bool fHelp)
     return operationId;
 }
 
+UniValue z_sendmanybulk(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() < 2 || params.size() > 5)
+        throw runtime_error(
+            "z_sendmanybulk \"fromaddress\" [{\"address\":... ,\"amount\":...},...] ( minconf ) ( fee ) ( outputs_per_tx )\n"
+            "\nSend to a large number of recipients from a Sapling zaddr. Amounts are decimal numbers with at most 8 digits of precision."
+            "\nThe recipients are split into transactions of at most outputs_per_tx outputs. Notes are reserved for every"
+            "\ntransaction before this call returns, and the transactions are then built in parallel."
+            "\nChange from each transaction returns to the from address.\n"
+            + HelpRequiringPassphrase() + "\n"
+            "\nArguments:\n"
+            "1. \"fromaddress\"         (string, required) The Sapling zaddr to send the funds from.\n"
+            "2. \"amounts\"             (array, required) An array of json objects representing the amounts to send.\n"
+            "    [{\n"
+            "      \"address\":address  (string, required) The address is a taddr or Sapling zaddr\n"
+            "      \"amount\":amount    (numeric, required) The numeric amount in " + CURRENCY_UNIT + " is the value\n"
+            "      \"memo\":memo        (string, optional) If the address is a zaddr, raw data represented in hexadecimal string format\n"
+            "    }, ... ]\n"
+            "3. minconf               (numeric, optional, default=1) Only use funds confirmed at least this many times.\n"
+            "4. fee                   (numeric, optional, default="
+            + strprintf("%s", FormatMoney(ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE)) + ") The fee amount to attach to each transaction.\n"
+            "5. outputs_per_tx        (numeric, optional, default="
+            + strprintf("%d", Z_SENDMANYBULK_DEFAULT_OUTPUTS_PER_TX) + ") The maximum number of recipients paid by each transaction.\n"
+            "\nResult:\n"
+            "\"operationid\"          (string) An operationid to pass to z_getoperationstatus to get the result of the operation.\n"
+            "                                    The result lists the txid, or error, of each transaction in request order.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("z_sendmanybulk", "\"ztestsapling19rnyu293v44f0kvtmszhx35lpdug574twc0lwyf4s7w0umtkrdq5nfcauxrxcyfmh3m7slemqsj\" '[{\"address\": \"t1M72Sfpbz1BPpXFHz9m3CdqATR44Jvaydd\" ,\"amount\": 5.0}]'")
+            + HelpExampleRpc("z_sendmanybulk", "\"ztestsapling19rnyu293v44f0kvtmszhx35lpdug574twc0lwyf4s7w0umtkrdq5nfcauxrxcyfmh3m7slemqsj\", [{\"address\": \"t1M72Sfpbz1BPpXFHz9m3CdqATR44Jvaydd\" ,\"amount\": 5.0}], 1, 0.0001, 100")
+        );
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    int nextBlockHeight = chainActive.Height() + 1;
+    if (!NetworkUpgradeActive(nextBlockHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, Sapling has not activated");
+    }
+
+    // Check that the from address is valid.
+    auto fromaddress = params[0].get_str();
+    auto res = DecodePaymentAddress(fromaddress);
+    if (!IsValidPaymentAddress(res) || boost::get<libzprime::SaplingPaymentAddress>(&res) == nullptr) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid from address, should be a Sapling zaddr.");
+    }
+    if (!boost::apply_visitor(HaveSpendingKeyForPaymentAddress(pwalletMain), res)) {
+         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "From address does not belong to this node, zaddr spending key not found.");
+    }
+
+    UniValue outputs = params[1].get_array();
+
+    if (outputs.size()==0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, amounts array is empty.");
+
+    // Recipients, in request order
+    std::vector<SendManyRecipient> recipients;
+    CAmount nTotalOut = 0;
+
+    for (const UniValue& o : outputs.getValues()) {
+        if (!o.isObject())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected object");
+
+        // sanity check, report error if unknown key-value pairs
+        for (const string& name_ : o.getKeys()) {
+            std::string s = name_;
+            if (s != "address" && s != "amount" && s!="memo")
+                throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, unknown key: ")+s);
+        }
+
+        string address = find_value(o, "address").get_str();
+        bool isZaddr = false;
+        CTxDestination taddr = DecodeDestination(address);
+        if (!IsValidDestination(taddr)) {
+            auto res = DecodePaymentAddress(address);
+            if (!IsValidPaymentAddress(res)) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, unknown address format: ")+address );
+            }
+            if (boost::get<libzprime::SaplingPaymentAddress>(&res) == nullptr) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot send between Sprout and Sapling addresses using z_sendmanybulk");
+            }
+            isZaddr = true;
+        }
+
+        UniValue memoValue = find_value(o, "memo");
+        string memo;
+        if (!memoValue.isNull()) {
+            memo = memoValue.get_str();
+            if (!isZaddr) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Memo cannot be used with a taddr.  It can only be used with a zaddr.");
+            } else if (!IsHex(memo)) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected memo data in hexadecimal format.");
+            }
+            if (memo.length() > ZC_MEMO_SIZE*2) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER,  strprintf("Invalid parameter, size of memo is larger than maximum allowed %d", ZC_MEMO_SIZE ));
+            }
+        }
+
+        UniValue av = find_value(o, "amount");
+        CAmount nAmount = AmountFromValue( av );
+        if (nAmount < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, amount must be positive");
+
+        recipients.push_back( SendManyRecipient(address, nAmount, memo) );
+        nTotalOut += nAmount;
+    }
+
+    // Minimum confirmations
+    int nMinDepth = 1;
+    if (params.size() > 2) {
+        nMinDepth = params[2].get_int();
+    }
+    if (nMinDepth < 1) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Minimum number of confirmations cannot be less than 1 when sending from zaddr");
+    }
+
+    // Fee in Zatoshis, not currency format), paid by each transaction
+    CAmount nFee = ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE;
+    if (params.size() > 3) {
+        if (params[3].get_real() == 0.0) {
+            nFee = 0;
+        } else {
+            nFee = AmountFromValue( params[3] );
+        }
+    }
+
+    size_t nOutputsPerTx = Z_SENDMANYBULK_DEFAULT_OUTPUTS_PER_TX;
+    if (params.size() > 4) {
+        int nOutputs = params[4].get_int();
+        if (nOutputs < 1) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, outputs_per_tx must be at least 1");
+        }
+        nOutputsPerTx = nOutputs;
+    }
+
+    size_t nTxs = (recipients.size() + nOutputsPerTx - 1) / nOutputsPerTx;
+    if (nFee * (CAmount)nTxs > nTotalOut && nFee > ASYNC_RPC_OPERATION_DEFAULT_MINERS_FEE) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Fees %s are greater than the sum of outputs %s and also greater than the default fee", FormatMoney(nFee * nTxs), FormatMoney(nTotalOut)));
+    }
+
+    // Reserve notes for every transaction while we hold the wallet lock
+    std::vector<CSproutNotePlaintextEntry> sproutEntries;
+    std::vector<SaplingNoteEntry> saplingEntries;
+    pwalletMain->GetFilteredNotes(sproutEntries, saplingEntries, fromaddress, nMinDepth);
+    std::vector<SendManyBulkBatch> batches = AsyncRPCOperation_sendmanybulk::partition(
+        saplingEntries, recipients, nFee, nOutputsPerTx, MAX_TX_SIZE_AFTER_SAPLING);
+
+    // Use input parameters as the optional context info to be returned by z_getoperationstatus and z_getoperationresult.
+    UniValue o(UniValue::VOBJ);
+    o.push_back(Pair("fromaddress", params[0]));
+    o.push_back(Pair("recipients", (uint64_t)recipients.size()));
+    o.push_back(Pair("minconf", nMinDepth));
+    o.push_back(Pair("fee", std::stod(FormatMoney(nFee))));
+    o.push_back(Pair("outputs_per_tx", (uint64_t)nOutputsPerTx));
+    UniValue contextInfo = o;
+
+    // Create operation and add to global queue
+    std::shared_ptr<AsyncRPCQueue> q = getAsyncRPCQueue();
+    std::shared_ptr<AsyncRPCOperation> operation( new AsyncRPCOperation_sendmanybulk(nextBlockHeight, fromaddress, batches, nFee, contextInfo) );
+    q->addOperation(operation);
+    AsyncRPCOperationId operationId = operation->getId();
+    return operationId;
+}
+
 UniValue z_setmigration(const UniValue& params, bool fHelp) {
     if (!EnsureWalletIsAvailable(fHelp))
         return NullUniValue;
@@ -4787,6 +5069,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "z_gettotalbalance",        &z_gettotalbalance,        false },
     { "wallet",             "z_mergetoaddress",         &z_mergetoaddress,         false },
     { "wallet",             "z_sendmany",               &z_sendmany,               false },
+    { "wallet",             "z_sendmanybulk",           &z_sendmanybulk,           false },
     { "wallet",             "z_setmigration",           &z_setmigration,           false },
     { "wallet",             "z_getmigrationstatus",     &z_getmigrationstatus,     false },
     { "wallet",             "z_shieldcoinbase",         &z_shieldcoinbase,         false },
@@ -846,7 +846,12 @@ bool CWallet::Verify(const string& walletFile, string& warningString, string& er
         }
     }
 
-    if (GetBoolArg("-salvagewallet", false))
+    if (GetBoolArg("-salvagewallet", false) && bitdb.IsLogStore(walletFile))
+    {
+        // Damaged records at the end of a log store are discarded when it is opened
+        LogPrintf("%s is a log store, -salvagewallet ignored\n", walletFile);
+    }
+    else if (GetBoolArg("-salvagewallet", false))
     {
         // Recover readable keypairs:
         if (!CWalletDB::Recover(bitdb, walletFile, true))
@@ -1008,6 +1013,79 @@ void CWallet::AddToSpends(const uint256& wtxid)
     }
 }
 
+/**
+ * Outpoint is spent in the main chain if a wallet transaction
+ * with at least one confirmation spends it:
+ */
+bool CWallet::IsSpentInMainChain(const COutPoint& outpoint) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        const uint256& wtxid = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Re-evaluate the setWalletUTXO entries for the outputs of wtxid.
+ * fCheckSpent may only be false when cs_main is not available (wallet
+ * load); RebuildUTXOIndex prunes the extra entries afterwards.
+ */
+void CWallet::UpdateUTXOIndex(const uint256& wtxid, bool fCheckSpent)
+{
+    LOCK(cs_wallet);
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+    if (mi == mapWallet.end()) {
+        setWalletUTXO.erase(setWalletUTXO.lower_bound(COutPoint(wtxid, 0)),
+                            setWalletUTXO.upper_bound(COutPoint(wtxid, std::numeric_limits<uint32_t>::max())));
+        return;
+    }
+
+    const CWalletTx& wtx = mi->second;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        COutPoint outpoint(wtxid, i);
+        if (IsMine(wtx.vout[i]) != ISMINE_NO && !(fCheckSpent && IsSpentInMainChain(outpoint)))
+            setWalletUTXO.insert(outpoint);
+        else
+            setWalletUTXO.erase(outpoint);
+    }
+}
+
+void CWallet::RebuildUTXOIndex()
+{
+    LOCK2(cs_main, cs_wallet);
+    setWalletUTXO.clear();
+    for (const std::pair<const uint256, CWalletTx>& item : mapWallet) {
+        UpdateUTXOIndex(item.first);
+    }
+}
+
+/**
+ * Return the wallet transactions that own at least one entry in
+ * setWalletUTXO, each exactly once.
+ */
+std::vector<const CWalletTx*> CWallet::GetUTXOIndexTxs() const
+{
+    AssertLockHeld(cs_wallet);
+    std::vector<const CWalletTx*> vTxs;
+    uint256 hashPrev;
+    for (const COutPoint& outpoint : setWalletUTXO) {
+        if (outpoint.hash == hashPrev)
+            continue;
+        hashPrev = outpoint.hash;
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi != mapWallet.end())
+            vTxs.push_back(&mi->second);
+    }
+    return vTxs;
+}
+
 void CWallet::ClearNoteWitnessCache()
 {
     LOCK(cs_wallet);
@@ -1374,6 +1452,9 @@ void CWallet::MarkDirty()
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
+    // Keys or watch-only scripts may have been added, which changes which
+    // outputs are ours:
+    RebuildUTXOIndex();
 }
 
 /**
@@ -1506,6 +1587,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         mapWallet[hash].BindWallet(this);
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
         AddToSpends(hash);
+        UpdateUTXOIndex(hash, false);
     }
     else
     {
@@ -1605,6 +1687,15 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         // Break debit/credit balance caches:
         wtx.MarkDirty();
 
+        // Refresh the spendable-output index for this transaction and for
+        // the outputs it spends, whose confirmed-spent state may have changed:
+        UpdateUTXOIndex(hash);
+        if (!wtx.IsCoinBase()) {
+            for (const CTxIn& txin : wtx.vin) {
+                UpdateUTXOIndex(txin.prevout.hash);
+            }
+        }
+
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -1747,8 +1838,10 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        if (mapWallet.erase(hash)) {
+            UpdateUTXOIndex(hash);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -2859,9 +2952,8 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (const CWalletTx* pcoin : GetUTXOIndexTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -2875,9 +2967,8 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (const CWalletTx* pcoin : GetUTXOIndexTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -2890,9 +2981,8 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (const CWalletTx* pcoin : GetUTXOIndexTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -2904,9 +2994,8 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (const CWalletTx* pcoin : GetUTXOIndexTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -2920,9 +3009,8 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (const CWalletTx* pcoin : GetUTXOIndexTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -2935,9 +3023,8 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (const CWalletTx* pcoin : GetUTXOIndexTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
@@ -2953,10 +3040,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (const CWalletTx* pcoin : GetUTXOIndexTxs())
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -2977,8 +3063,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
@@ -3692,6 +3778,10 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    // Transactions were indexed without spent checks while loading, as the
+    // order of records is arbitrary; prune outputs spent in the main chain.
+    RebuildUTXOIndex();
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -803,7 +803,7 @@ protected:
                 // (i.e. are purely transparent), as well as shielding and unshielding
                 // transactions in which we only have transparent addresses involved.
                 if (!(wtx.mapSproutNoteData.empty() && wtx.mapSaplingNoteData.empty())) {
-                    if (!walletdb.WriteTx(wtxItem.first, wtx)) {
+                    if (!walletdb.WriteTxNoteData(wtxItem.first, wtx)) {
                         LogPrintf("SetBestChain(): Failed to write CWalletTx, aborting atomic write\n");
                         walletdb.TxnAbort();
                         return;
@@ -843,6 +843,23 @@ protected:
     bool UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx);
     void MarkAffectedTransactionsDirty(const CTransaction& tx);
 
+    /**
+     * Index of transparent outputs in mapWallet that are ours (spendable or
+     * watch-only) and not spent by a transaction in the main chain.
+     *
+     * Balance and coin-listing queries walk this set instead of the whole
+     * wallet history. Spends by unconfirmed transactions stay in the index
+     * and are filtered at query time by IsSpent, because their state can
+     * change (mempool expiry, conflicts) without the wallet being notified.
+     * Entries are refreshed by AddToWallet for a transaction and the outputs
+     * it spends, which covers both SyncTransaction and the re-sync performed
+     * by DisconnectTip.
+     */
+    std::set<COutPoint> setWalletUTXO;
+    void UpdateUTXOIndex(const uint256& wtxid, bool fCheckSpent = true);
+    bool IsSpentInMainChain(const COutPoint& outpoint) const;
+    std::vector<const CWalletTx*> GetUTXOIndexTxs() const;
+
     /* the hd chain data model (chain counters) */
     CHDChain hdChain;
 
@@ -1112,6 +1129,7 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    void RebuildUTXOIndex();
     bool UpdateNullifierNoteMap();
     void UpdateNullifierNoteMapWithTx(const CWalletTx& wtx);
     void UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx);
@@ -58,15 +58,46 @@ bool CWalletDB::ErasePurpose(const string& strPurpose)
 bool CWalletDB::WriteTx(uint256 hash, const CWalletTx& wtx)
 {
     nWalletDBUpdated++;
-    return Write(std::make_pair(std::string("tx"), hash), wtx);
+    if (!IsLogStore())
+        return Write(std::make_pair(std::string("tx"), hash), wtx);
+
+    // The full record supersedes any note data written since the last one
+    bool fTxn = TxnBegin();
+    bool fSuccess = Erase(std::make_pair(std::string("notedata"), hash)) &&
+                    Write(std::make_pair(std::string("tx"), hash), wtx);
+    if (fTxn) {
+        if (fSuccess)
+            fSuccess = TxnCommit();
+        else
+            TxnAbort();
+    }
+    return fSuccess;
 }
 
 bool CWalletDB::EraseTx(uint256 hash)
 {
     nWalletDBUpdated++;
+    if (IsLogStore() && !Erase(std::make_pair(std::string("notedata"), hash)))
+        return false;
     return Erase(std::make_pair(std::string("tx"), hash));
 }
 
+/**
+ * Witnesses and nullifiers change on every block, while the rest of a
+ * transaction does not. A log store keeps them in a separate record that is
+ * applied over the "tx" record on load, so that connecting a block appends
+ * only the note data. A Berkeley database rewrites the whole transaction.
+ */
+bool CWalletDB::WriteTxNoteData(uint256 hash, const CWalletTx& wtx)
+{
+    if (!IsLogStore())
+        return WriteTx(hash, wtx);
+
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("notedata"), hash),
+                 std::make_pair(wtx.mapSproutNoteData, wtx.mapSaplingNoteData));
+}
+
 bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata& keyMeta)
 {
     nWalletDBUpdated++;
@@ -302,7 +333,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit(): cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -430,6 +461,7 @@ public:
     bool fAnyUnordered;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    map<uint256, pair<mapSproutNoteData_t, mapSaplingNoteData_t> > mapNoteData;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = nZKeys = nCZKeys = nZKeyMeta = nSapZAddrs = 0;
@@ -496,6 +528,13 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
 
             pwallet->AddToWallet(wtx, true, NULL);
         }
+        else if (strType == "notedata")
+        {
+            // Applied once all transactions are loaded
+            uint256 hash;
+            ssKey >> hash;
+            ssValue >> wss.mapNoteData[hash];
+        }
         else if (strType == "acentry")
         {
             string strAccount;
@@ -885,7 +924,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -927,6 +966,22 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+
+        // Apply note data written since each transaction's full record
+        for (auto& item : wss.mapNoteData) {
+            auto mi = pwallet->mapWallet.find(item.first);
+            if (mi == pwallet->mapWallet.end())
+                continue;
+            try {
+                mi->second.SetSproutNoteData(item.second.first);
+                mi->second.SetSaplingNoteData(item.second.second);
+                pwallet->UpdateNullifierNoteMapWithTx(mi->second);
+            } catch (const std::logic_error& e) {
+                LogPrintf("Error applying note data for tx %s: %s\n", item.first.ToString(), e.what());
+                fNoncriticalErrors = true;
+                SoftSetBoolArg("-rescan", true);
+            }
+        }
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -988,7 +1043,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
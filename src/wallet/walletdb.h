@@ -133,6 +133,8 @@ public:
 
     bool WriteTx(uint256 hash, const CWalletTx& wtx);
     bool EraseTx(uint256 hash);
+    /** Write the note data (witnesses and nullifiers) of a transaction already in the database */
+    bool WriteTxNoteData(uint256 hash, const CWalletTx& wtx);
 
     bool WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata &keyMeta);
     bool WriteCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret, const CKeyMetadata &keyMeta);
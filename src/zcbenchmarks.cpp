@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <boost/filesystem.hpp>
 
+#include "addrman.h"
 #include "coins.h"
 #include "util.h"
 #include "init.h"
@@ -17,12 +18,17 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "miner.h"
+#include "netreplay.h"
+#include "policy/fees.h"
 #include "pow.h"
 #include "rpc/server.h"
 #include "script/sign.h"
 #include "sodium.h"
 #include "streams.h"
+#include "transaction_builder.h"
 #include "txdb.h"
+#include "txmempool.h"
+#include "undo.h"
 #include "utiltest.h"
 #include "wallet/wallet.h"
 
@@ -565,6 +571,299 @@ double benchmark_connectblock_slow()
     return duration;
 }
 
+double benchmark_estimatefee(int nBlocks)
+{
+    // We don't know when the transactions in old blocks were first seen, so
+    // in the replay each enters the mempool 1 to 3 blocks before it is mined
+    static const int MAX_DELAY = 3;
+    int nTip = chainActive.Height();
+    int nStart = std::max(1, nTip - nBlocks + 1);
+    if (nTip - nStart < MAX_DELAY) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Not enough blocks to replay");
+    }
+
+    // Read the blocks, and the undo data for their fees, before timing
+    std::vector<std::vector<CTxMemPoolEntry>> vMined(nTip + 1 - nStart);
+    for (int nHeight = nStart; nHeight <= nTip; nHeight++) {
+        CBlockIndex* pindex = chainActive[nHeight];
+        CBlock block;
+        CBlockUndo blockUndo;
+        if (!ReadBlockFromDisk(block, pindex) ||
+            !UndoReadFromDisk(blockUndo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash())) {
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Could not read block data to replay");
+        }
+        uint32_t nBranchId = CurrentEpochBranchId(nHeight, Params().GetConsensus());
+        for (size_t i = 1; i < block.vtx.size(); i++) {
+            const CTransaction& tx = block.vtx[i];
+            unsigned int nEntryHeight = nHeight - 1 - tx.GetHash().GetCheapHash() % MAX_DELAY;
+            CAmount nValueIn = tx.GetShieldedValueIn();
+            double dPriorityInputs = 0;
+            for (const CTxInUndo& undo : blockUndo.vtxundo[i - 1].vprevout) {
+                nValueIn += undo.txout.nValue;
+                // The undo data only has the height of an output that was
+                // the last unspent one of its transaction
+                if (undo.nHeight != 0 && undo.nHeight < nEntryHeight)
+                    dPriorityInputs += (double)undo.txout.nValue * (nEntryHeight - undo.nHeight);
+            }
+            vMined[nHeight - nStart].push_back(CTxMemPoolEntry(
+                tx, nValueIn - tx.GetValueOut(), pindex->GetBlockTime(),
+                tx.ComputePriority(dPriorityInputs), nEntryHeight, true, false, nBranchId));
+        }
+    }
+    std::vector<std::vector<const CTxMemPoolEntry*>> vEntered(nTip + 1 - nStart);
+    for (const auto& vEntries : vMined) {
+        for (const CTxMemPoolEntry& entry : vEntries) {
+            if ((int)entry.GetHeight() >= nStart)
+                vEntered[entry.GetHeight() - nStart].push_back(&entry);
+        }
+    }
+
+    CBlockPolicyEstimator estimator(::minRelayTxFee);
+    struct timeval tv_start;
+    timer_start(tv_start);
+    for (int nHeight = nStart; nHeight <= nTip; nHeight++) {
+        std::vector<CTxMemPoolEntry>& vEntries = vMined[nHeight - nStart];
+        for (const CTxMemPoolEntry& entry : vEntries) {
+            if ((int)entry.GetHeight() >= nStart)
+                estimator.removeTx(entry.GetTx().GetHash());
+        }
+        estimator.processBlock(nHeight, vEntries, true);
+        for (const CTxMemPoolEntry* pentry : vEntered[nHeight - nStart])
+            estimator.processTransaction(*pentry, true);
+        // As the wallet would, creating a transaction
+        for (unsigned int nTarget = 1; nTarget <= MAX_BLOCK_CONFIRMS; nTarget++) {
+            estimator.estimateFee(nTarget);
+            estimator.estimatePriority(nTarget);
+        }
+    }
+    return timer_stop(tv_start);
+}
+
+/**
+ * Transactions made up for benchmark_createnewblock, spending coins made up
+ * in pcoinsTip. When this goes out of scope they are taken out of the mempool
+ * and the coins out of the cache again. Requires cs_main throughout.
+ */
+class FakeMempoolTxs
+{
+public:
+    FakeMempoolTxs();
+    ~FakeMempoolTxs();
+
+    /** Add chains of 1 to MAX_CHAIN transparent transactions, nTxs in all */
+    void AddChains(size_t nTxs);
+    /** Add nTxs transactions from a transparent input to a Sapling output */
+    void AddShielded(size_t nTxs);
+
+private:
+    static const int MAX_CHAIN = 10;
+
+    const Consensus::Params& consensus;
+    const int nHeight;
+    const uint32_t nBranchId;
+    CBasicKeyStore keystore;
+    CScript scriptKey;
+    std::vector<uint256> vCoins;
+    std::vector<CTransaction> vRoots;
+
+    COutPoint AddCoin(const CScript& scriptPubKey, CAmount nValue, int nCoinHeight);
+    void AddToMempool(const CTransaction& tx, CAmount nFee, double dPriorityInputs, bool fRoot);
+};
+
+FakeMempoolTxs::FakeMempoolTxs() :
+    consensus(Params().GetConsensus()), nHeight(chainActive.Height() + 1),
+    nBranchId(CurrentEpochBranchId(nHeight, consensus))
+{
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    scriptKey = GetScriptForDestination(key.GetPubKey().GetID());
+}
+
+FakeMempoolTxs::~FakeMempoolTxs()
+{
+    for (const CTransaction& tx : vRoots) {
+        std::list<CTransaction> removed;
+        mempool.remove(tx, removed, true);
+    }
+    // Fresh coins that are spent are dropped from the cache
+    for (const uint256& hash : vCoins)
+        pcoinsTip->ModifyCoins(hash)->Clear();
+}
+
+COutPoint FakeMempoolTxs::AddCoin(const CScript& scriptPubKey, CAmount nValue, int nCoinHeight)
+{
+    uint256 hash = GetRandHash();
+    CCoinsModifier coins = pcoinsTip->ModifyNewCoins(hash);
+    coins->nVersion = 1;
+    coins->nHeight = nCoinHeight;
+    coins->vout.push_back(CTxOut(nValue, scriptPubKey));
+    vCoins.push_back(hash);
+    return COutPoint(hash, 0);
+}
+
+void FakeMempoolTxs::AddToMempool(const CTransaction& tx, CAmount nFee, double dPriorityInputs, bool fRoot)
+{
+    // Leave the fee estimator out of it
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(
+        tx, nFee, GetTime(), tx.ComputePriority(dPriorityInputs), nHeight - 1, fRoot, false, nBranchId), false);
+    if (fRoot)
+        vRoots.push_back(tx);
+}
+
+void FakeMempoolTxs::AddChains(size_t nTxs)
+{
+    CScript scriptTrue = CScript() << OP_TRUE;
+    size_t nAdded = 0;
+    while (nAdded < nTxs) {
+        size_t nLength = std::min<size_t>(1 + GetRand(MAX_CHAIN), nTxs - nAdded);
+        CAmount nValue = COIN + GetRand(100 * COIN);
+        int nCoinHeight = std::max(0, nHeight - 1 - (int)GetRand(1000));
+        COutPoint prevout = AddCoin(scriptTrue, nValue, nCoinHeight);
+        double dPriorityInputs = (double)nValue * (nHeight - 1 - nCoinHeight);
+        for (size_t i = 0; i < nLength; i++) {
+            CMutableTransaction mtx = CreateNewContextualCMutableTransaction(consensus, nHeight);
+            mtx.vin.push_back(CTxIn(prevout));
+            // A few pay nothing, and only get in by priority or a child's fee
+            CAmount nFee = GetRand(10) == 0 ? 0 : 1000 + GetRand(100000);
+            nValue -= nFee;
+            mtx.vout.push_back(CTxOut(nValue, scriptTrue));
+            CTransaction tx(mtx);
+            AddToMempool(tx, nFee, i == 0 ? dPriorityInputs : 0, i == 0);
+            prevout = COutPoint(tx.GetHash(), 0);
+        }
+        nAdded += nLength;
+    }
+}
+
+void FakeMempoolTxs::AddShielded(size_t nTxs)
+{
+    if (nTxs == 0)
+        return;
+    if (!NetworkUpgradeActive(nHeight, consensus, Consensus::UPGRADE_SAPLING))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Sapling must be active for shielded transactions");
+
+    auto sk = libzprime::SaplingSpendingKey::random();
+    auto ovk = sk.full_viewing_key().ovk;
+    auto address = sk.default_address();
+    const CAmount nFee = 10000;
+    for (size_t i = 0; i < nTxs; i++) {
+        CAmount nValue = COIN + GetRand(100 * COIN);
+        int nCoinHeight = std::max(0, nHeight - 1 - (int)GetRand(1000));
+        COutPoint prevout = AddCoin(scriptKey, nValue, nCoinHeight);
+
+        TransactionBuilder builder(consensus, nHeight, &keystore);
+        builder.SetFee(nFee);
+        builder.AddTransparentInput(prevout, scriptKey, nValue);
+        builder.AddSaplingOutput(ovk, address, nValue - nFee);
+        CTransaction tx = builder.Build().GetTxOrThrow();
+        AddToMempool(tx, nFee, (double)nValue * (nHeight - 1 - nCoinHeight), true);
+    }
+}
+
+std::vector<CreateNewBlockSample> benchmark_createnewblock(int nSamples, size_t nTxs, size_t nShielded)
+{
+    // Each sample adds to what is in the mempool already, which may have
+    // been loaded from a saved mempool.dat, so the samples show how block
+    // assembly scales with the size of the mempool
+    FakeMempoolTxs fakeTxs;
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    std::vector<CreateNewBlockSample> vSamples;
+    for (int i = 0; i < nSamples; i++) {
+        fakeTxs.AddChains(nTxs);
+        fakeTxs.AddShielded(nShielded);
+
+        CreateNewBlockSample sample;
+        sample.nMempoolSize = mempool.size();
+        struct timeval tv_start;
+        timer_start(tv_start);
+        std::unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockTimed(scriptPubKey, sample.times));
+        sample.dRunningTime = timer_stop(tv_start);
+        sample.nBlockTxs = pblocktemplate->block.vtx.size() - 1;
+        vSamples.push_back(sample);
+    }
+    return vSamples;
+}
+
+/**
+ * Add nAddrs made-up IPv4 addresses to addrman, heard of from a spread of
+ * sources in the last week. Every fourth one is marked good, so that it goes
+ * to the tried table. Some addresses aren't routable, and some collide, so
+ * addrman ends up with fewer.
+ */
+static void FillAddrMan(CAddrMan& addrman, size_t nAddrs)
+{
+    int64_t nNow = GetAdjustedTime();
+    for (size_t i = 0; i < nAddrs; i++) {
+        struct in_addr ip, ipSource;
+        ip.s_addr = htonl(0x01000000 + GetRand(0xdf000000));
+        ipSource.s_addr = htonl(0x01000000 + GetRand(0xdf000000));
+        CAddress addr(CService(ip, Params().GetDefaultPort()));
+        addr.nTime = nNow - GetRand(7 * 24 * 60 * 60);
+        addrman.Add(addr, CNetAddr(ipSource));
+        if (i % 4 == 0)
+            addrman.Good(addr);
+    }
+}
+
+double benchmark_addrman_add(size_t nAddrs)
+{
+    CAddrMan addrman;
+    struct timeval tv_start;
+    timer_start(tv_start);
+    FillAddrMan(addrman, nAddrs);
+    return timer_stop(tv_start);
+}
+
+double benchmark_addrman_select(size_t nAddrs)
+{
+    // As many as opening outbound connections would over a long while
+    static const int SELECT_COUNT = 10000;
+    CAddrMan addrman;
+    FillAddrMan(addrman, nAddrs);
+    if (addrman.size() == 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No addresses to select from");
+    }
+    struct timeval tv_start;
+    timer_start(tv_start);
+    for (int i = 0; i < SELECT_COUNT; i++) {
+        CAddrInfo addr = addrman.Select();
+        addrman.Attempt(addr);
+    }
+    return timer_stop(tv_start);
+}
+
+double benchmark_addrman_serialize(size_t nAddrs)
+{
+    CAddrMan addrman;
+    FillAddrMan(addrman, nAddrs);
+    struct timeval tv_start;
+    timer_start(tv_start);
+    // What flushing peers.dat and loading it at startup take, less the disk
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+    CAddrMan addrman2;
+    ssPeers >> addrman2;
+    return timer_stop(tv_start);
+}
+
+std::vector<NetReplaySample> benchmark_netreplay(int nSamples, const std::vector<unsigned char>& vStream)
+{
+    // A fresh peer each time, so each sample starts from the handshake
+    std::vector<NetReplaySample> vSamples;
+    for (int i = 0; i < nSamples; i++) {
+        CNetReplay replay;
+        struct timeval tv_start;
+        timer_start(tv_start);
+        replay.Replay(vStream);
+        NetReplaySample sample;
+        sample.dRunningTime = timer_stop(tv_start);
+        sample.stats = replay.GetStats();
+        vSamples.push_back(sample);
+    }
+    return vSamples;
+}
+
 extern UniValue getnewaddress(const UniValue& params, bool fHelp); // in rpcwallet.cpp
 extern UniValue sendtoaddress(const UniValue& params, bool fHelp);
 
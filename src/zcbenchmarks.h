@@ -4,6 +4,23 @@
 #include <sys/time.h>
 #include <stdlib.h>
 
+#include "miner.h"
+#include "netreplay.h"
+
+struct CreateNewBlockSample
+{
+    size_t nMempoolSize;
+    size_t nBlockTxs;
+    double dRunningTime;
+    CBlockAssemblyTimes times;
+};
+
+struct NetReplaySample
+{
+    double dRunningTime;
+    mapNetReplayStats stats;
+};
+
 extern double benchmark_sleep();
 extern double benchmark_parameter_loading();
 extern double benchmark_create_joinsplit();
@@ -18,6 +35,12 @@ extern double benchmark_try_decrypt_sapling_notes(size_t nAddrs);
 extern double benchmark_increment_sprout_note_witnesses(size_t nTxs);
 extern double benchmark_increment_sapling_note_witnesses(size_t nTxs);
 extern double benchmark_connectblock_slow();
+extern double benchmark_estimatefee(int nBlocks);
+extern std::vector<CreateNewBlockSample> benchmark_createnewblock(int nSamples, size_t nTxs, size_t nShielded);
+extern double benchmark_addrman_add(size_t nAddrs);
+extern double benchmark_addrman_select(size_t nAddrs);
+extern double benchmark_addrman_serialize(size_t nAddrs);
+extern std::vector<NetReplaySample> benchmark_netreplay(int nSamples, const std::vector<unsigned char>& vStream);
 extern double benchmark_sendtoaddress(CAmount amount);
 extern double benchmark_loadwallet();
 extern double benchmark_listunspent();
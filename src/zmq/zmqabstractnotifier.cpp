@@ -25,3 +25,8 @@ bool CZMQAbstractNotifier::NotifyTransaction(const CTransaction &/*transaction*/
 {
     return true;
 }
+
+bool CZMQAbstractNotifier::NotifyBlockTemplate(const CBlock &)
+{
+    return true;
+}
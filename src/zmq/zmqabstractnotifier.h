@@ -35,6 +35,7 @@ public:
     virtual bool NotifyBlock(const CBlockIndex *pindex);
     virtual bool NotifyBlock(const CBlock& pblock);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    virtual bool NotifyBlockTemplate(const CBlock &block);
 
 protected:
     void *psocket;
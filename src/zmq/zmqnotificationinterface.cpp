@@ -40,6 +40,7 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
     factories["pubcheckedblock"] = CZMQAbstractNotifier::Create<CZMQPublishCheckedBlockNotifier>;
+    factories["pubblocktemplate"] = CZMQAbstractNotifier::Create<CZMQPublishBlockTemplateNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -179,3 +180,20 @@ void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CB
         }
     }
 }
+
+void CZMQNotificationInterface::UpdatedBlockTemplate(const CBlock& block)
+{
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyBlockTemplate(block))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
@@ -28,6 +28,7 @@ protected:
     void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
     void UpdatedBlockTip(const CBlockIndex *pindex);
     void BlockChecked(const CBlock& block, const CValidationState& state);
+    void UpdatedBlockTemplate(const CBlock& block);
 
 private:
     CZMQNotificationInterface();
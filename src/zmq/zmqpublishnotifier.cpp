@@ -13,6 +13,7 @@ static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
 static const char *MSG_CHECKEDBLOCK = "checkedblock";
+static const char *MSG_BLOCKTEMPLATE = "blocktemplate";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -201,3 +202,11 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishBlockTemplateNotifier::NotifyBlockTemplate(const CBlock &block)
+{
+    LogPrint("zmq", "zmq: Publish blocktemplate on %s\n", block.hashPrevBlock.GetHex());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    return SendMessage(MSG_BLOCKTEMPLATE, &(*ss.begin()), ss.size());
+}